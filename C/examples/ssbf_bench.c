@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#include "ssbf.h"
+#include "ssbf_cipher.h"
+
+#define BENCH_BUFFER_SIZE (16 * 1024 * 1024)
+#define BENCH_ROUNDS 8
+
+static double time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// XChaCha20 throughput of one backend, data is encrypted in chunks
+// of chunk_size bytes (one chunk is one ssbf block)
+static double bench_backend(const struct ssbf_cipher_backend *backend,
+			    uint8_t *data, size_t chunk_size)
+{
+	uint8_t key[32];
+	uint8_t nonce[24];
+	memset(key, 0x42, sizeof(key));
+	memset(nonce, 0x24, sizeof(nonce));
+
+	ssbf_cipher_select(backend);
+
+	double start = time_now();
+	for (uint32_t r = 0; r < BENCH_ROUNDS; r++)
+	{
+		for (size_t i = 0; i < BENCH_BUFFER_SIZE; i += chunk_size)
+		{
+			ssbf_chacha20_x(&data[i], &data[i], chunk_size,
+					key, nonce, 0);
+		}
+	}
+	double elapsed = time_now() - start;
+
+	return (double) BENCH_BUFFER_SIZE * BENCH_ROUNDS
+		/ elapsed / (1024 * 1024);
+}
+
+// Encode and decode throughput of a whole file, with and without the
+// crypto extension. The data is partly compressible, like firmware.
+static void bench_file(uint8_t *data, bool no_encryption)
+{
+	uint8_t key_main[32];
+	uint8_t nonce[24];
+	uint8_t key_data[32];
+	uint8_t meta_payload_data[4] = {1, 2, 3, 4};
+	memset(key_main, 0x11, sizeof(key_main));
+	memset(nonce, 0x22, sizeof(nonce));
+	memset(key_data, 0x33, sizeof(key_data));
+
+	struct ssbf_encode_options encode_options;
+	memset(&encode_options, 0, sizeof(encode_options));
+	encode_options.no_encryption = no_encryption;
+
+	size_t encoded_max_size = 2 * BENCH_BUFFER_SIZE;
+	uint8_t *encoded = malloc(encoded_max_size);
+	uint8_t *encoded_work = malloc(encoded_max_size);
+	uint8_t *decoded = malloc(BENCH_BUFFER_SIZE);
+	if (NULL == encoded || NULL == encoded_work || NULL == decoded)
+	{
+		free(encoded);
+		free(encoded_work);
+		free(decoded);
+		return;
+	}
+
+	size_t encoded_size = 0;
+	double start = time_now();
+	ssbf_encode_data(key_main, nonce, key_data, 0x1234,
+			 meta_payload_data, sizeof(meta_payload_data), 4096,
+			 data, BENCH_BUFFER_SIZE,
+			 encoded, encoded_max_size, &encoded_size,
+			 &encode_options);
+	double encode_time = time_now() - start;
+
+	// the decoder works in place, so every round gets a fresh copy
+	double decode_time = 0;
+	enum ssbf_errors e = SSBF_NO_ERROR;
+	for (uint32_t r = 0; r < BENCH_ROUNDS && SSBF_NO_ERROR == e; r++)
+	{
+		size_t decoded_size = 0;
+		memcpy(encoded_work, encoded, encoded_size);
+
+		start = time_now();
+		e = ssbf_decode_data(no_encryption ? NULL : key_main,
+				     encoded_work, encoded_size,
+				     decoded, BENCH_BUFFER_SIZE,
+				     &decoded_size, NULL);
+		decode_time += time_now() - start;
+	}
+
+	printf("%-12s %13.1f %13.1f   %s\n",
+	       no_encryption ? "plain" : "encrypted",
+	       BENCH_BUFFER_SIZE / encode_time / (1024 * 1024),
+	       (double) BENCH_BUFFER_SIZE * BENCH_ROUNDS 
+	       / decode_time / (1024 * 1024),
+	       (SSBF_NO_ERROR == e
+		&& 0 == memcmp(data, decoded, BENCH_BUFFER_SIZE))
+	       ? "ok" : "DECODE FAILED");
+
+	free(encoded);
+	free(encoded_work);
+	free(decoded);
+}
+
+int main(void)
+{
+	static const size_t chunk_sizes[] = { 1024, 4096, 65536 };
+	size_t backends_sum = 0;
+	const struct ssbf_cipher_backend *backends =
+		ssbf_cipher_backends(&backends_sum);
+
+	uint8_t *data = malloc(BENCH_BUFFER_SIZE);
+	if (NULL == data)
+	{
+		return 1;
+	}
+	memset(data, 0, BENCH_BUFFER_SIZE);
+
+	printf("%-12s %-10s %-8s", "backend", "supported", "selftest");
+	for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++)
+	{
+		printf(" %8zuB MB/s", chunk_sizes[c]);
+	}
+	printf("\n");
+
+	int r = 0;
+	for (size_t i = 0; i < backends_sum; i++)
+	{
+		const struct ssbf_cipher_backend *b = &backends[i];
+		bool supported = b->is_supported();
+		bool selftest = supported && ssbf_cipher_selftest(b);
+
+		printf("%-12s %-10s %-8s", b->name,
+		       supported ? "yes" : "no",
+		       supported ? (selftest ? "pass" : "FAIL") : "-");
+
+		if (supported && !selftest)
+		{
+			r = 1;
+		}
+
+		if (selftest)
+		{
+			for (size_t c = 0;
+			     c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+			     c++)
+			{
+				printf(" %13.1f",
+				       bench_backend(b, data, chunk_sizes[c]));
+			}
+		}
+		printf("\n");
+	}
+
+	ssbf_cipher_select(NULL);
+	printf("Selected backend: %s\n", ssbf_cipher_selected()->name);
+
+	// every 16th byte random, the rest repeats
+	uint32_t seed = 1;
+	for (size_t i = 0; i < BENCH_BUFFER_SIZE; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (i % 16) ? (uint8_t) (i / 64) : (uint8_t) (seed >> 16);
+	}
+
+	printf("\n%-12s %13s %13s\n", "file", "encode MB/s", "decode MB/s");
+	bench_file(data, false);
+	bench_file(data, true);
+
+	free(data);
+	return r;
+}
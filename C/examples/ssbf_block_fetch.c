@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ssbf.h"
+#include "ssbf_server.h"
+
+// blocks per file (uint16 block numbers)
+#define FETCH_MAX_BLOCKS 65536
+
+static int connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (sizeof(addr.sun_path) <= strlen(path))
+	{
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (0 <= fd && connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int connect_tcp(const char *address, int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (1 != inet_pton(AF_INET, address, &addr.sin_addr))
+	{
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (0 <= fd && connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static double time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// end of the block in the file
+static uint32_t block_end(const struct ssbf_server_block *b)
+{
+	return b->file_offset + sizeof(struct ssbf_payload_block_header)
+		+ b->payload_size;
+}
+
+// Fetches a file from ssbf_block_server like a device would: the block
+// table, then the header and the blocks in ranges. With -r only the
+// given blocks are fetched and written to an existing copy, e.g. to
+// replace blocks which failed to decode.
+int main(int argc, char **argv)
+{
+	char *name = NULL;
+	char *output_filename = NULL;
+	char *unix_path = NULL;
+	char *address = "127.0.0.1";
+	int port = 0;
+	uint32_t blocks_per_request = 64;
+	uint32_t range_first = 0;
+	uint32_t range_count = 0;
+	bool range = false;
+	bool verbose = false;
+        int c;
+
+        while ((c = getopt(argc, argv, "n:o:u:p:a:b:r:vh")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'n':
+        		name = optarg;
+        		break;
+        	case 'o':
+        		output_filename = optarg;
+        		break;
+        	case 'u':
+        		unix_path = optarg;
+        		break;
+        	case 'p':
+        		port = atoi(optarg);
+        		break;
+        	case 'a':
+        		address = optarg;
+        		break;
+        	case 'b':
+        		blocks_per_request = atoi(optarg);
+        		break;
+        	case 'r':
+        		if (2 != sscanf(optarg, "%u,%u",
+        				&range_first, &range_count))
+        		{
+        			printf("E: -r needs first,count\n");
+        			return 1;
+        		}
+        		range = true;
+        		break;
+        	case 'v':
+        		verbose = true;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-n <name> - file on the server\n");
+        		printf("-o <filename> - where it is written\n");
+        		printf("-u <path> - server unix socket\n");
+        		printf("-p <port> - server TCP port\n");
+        		printf("-a <address> - server TCP address, default 127.0.0.1\n");
+        		printf("-b <blocks> - blocks per request, default 64\n");
+        		printf("-r <first,count> - only fetch these blocks to an existing file\n");
+        		printf("-v - print the block table\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (NULL == name || NULL == output_filename
+	    || (NULL == unix_path) == (0 == port) || 0 == blocks_per_request)
+	{
+		printf("Give -n, -o and either -u or -p\n");
+		return 1;
+	}
+
+	int fd = unix_path ? connect_unix(unix_path)
+		: connect_tcp(address, port);
+	if (0 > fd)
+	{
+		printf("E: can not connect\n");
+		return 1;
+	}
+
+	double start = time_now();
+	struct ssbf_server_response response;
+	struct ssbf_server_block *blocks =
+		malloc(FETCH_MAX_BLOCKS * sizeof(struct ssbf_server_block));
+
+	enum ssbf_errors r = ssbf_server_request(
+		fd, SSBF_SERVER_REQUEST_VERIFY, name, 0, 0, &response,
+		(uint8_t *) blocks,
+		FETCH_MAX_BLOCKS * sizeof(struct ssbf_server_block));
+	if (SSBF_NO_ERROR != r || 0 == response.block_count)
+	{
+		printf("E: block table of %s: %i %i\n", name, r, response.status);
+		return 1;
+	}
+
+	uint32_t block_count = response.block_count;
+	uint32_t file_id = response.file_id;
+	uint32_t bad_blocks = 0;
+
+	if (SSBF_NO_ERROR != response.status)
+	{
+		printf("W: %s is not complete on the server (%i)\n",
+		       name, response.status);
+	}
+
+	for (uint32_t i = 0; block_count > i; i++)
+	{
+		bad_blocks += (SSBF_NO_ERROR != blocks[i].status);
+
+		if (verbose)
+		{
+			printf("  block %u: offset %u, %u bytes, flags 0x%x%s\n",
+			       i, blocks[i].file_offset,
+			       blocks[i].payload_size, blocks[i].flags,
+			       SSBF_NO_ERROR != blocks[i].status
+			       ? ", BAD" : "");
+		}
+	}
+
+	if (!range)
+	{
+		range_count = block_count;
+	}
+	if (range_first >= block_count
+	    || range_count > block_count - range_first)
+	{
+		printf("E: %s has %u blocks\n", name, block_count);
+		return 1;
+	}
+
+	int out = open(output_filename,
+		       O_WRONLY | O_CREAT | (range ? 0 : O_TRUNC), 0644);
+	if (0 > out)
+	{
+		printf("E: can not open %s\n", output_filename);
+		return 1;
+	}
+
+	// the largest request is the header or blocks_per_request blocks
+	size_t buffer_size = blocks[0].file_offset;
+	for (uint32_t i = range_first; range_first + range_count > i;
+	     i += blocks_per_request)
+	{
+		uint32_t count = range_first + range_count - i;
+		count = count > blocks_per_request ? blocks_per_request : count;
+
+		size_t size = block_end(&blocks[i + count - 1])
+			- blocks[i].file_offset;
+		buffer_size = size > buffer_size ? size : buffer_size;
+	}
+
+	uint8_t *buffer = malloc(buffer_size);
+	size_t fetched = 0;
+	uint32_t requests = 1;
+
+	if (!range)
+	{
+		r = ssbf_server_request(fd, SSBF_SERVER_REQUEST_HEADER, name,
+					0, 0, &response, buffer, buffer_size);
+		if (SSBF_NO_ERROR != r || SSBF_NO_ERROR != response.status
+		    || file_id != response.file_id
+		    || (ssize_t) response.data_size != pwrite(out, buffer,
+						    response.data_size, 0))
+		{
+			printf("E: header of %s: %i %i\n", name, r,
+			       response.status);
+			return 1;
+		}
+		fetched += response.data_size;
+		requests += 1;
+	}
+
+	for (uint32_t i = range_first; range_first + range_count > i;
+	     i += blocks_per_request)
+	{
+		uint32_t count = range_first + range_count - i;
+		count = count > blocks_per_request ? blocks_per_request : count;
+
+		r = ssbf_server_request(fd, SSBF_SERVER_REQUEST_BLOCKS, name,
+					(uint16_t) i, count,
+					&response, buffer, buffer_size);
+		// a bad block is written, the device finds it when it
+		// decodes the file
+		if (SSBF_NO_ERROR != r || file_id != response.file_id
+		    || i != response.first_block
+		    || count != response.block_count
+		    || (ssize_t) response.data_size != pwrite(out, buffer,
+						    response.data_size,
+						    response.file_offset))
+		{
+			printf("E: blocks %u..%u of %s: %i %i%s\n",
+			       i, i + count - 1, name, r, response.status,
+			       file_id != response.file_id
+			       ? ", the file was replaced" : "");
+			return 1;
+		}
+
+		fetched += response.data_size;
+		requests += 1;
+	}
+
+	// the last block ends the file, the padding between the ranges
+	// is already zero
+	if (!range && ftruncate(out, block_end(&blocks[block_count - 1])))
+	{
+		printf("E: can not write %s\n", output_filename);
+		return 1;
+	}
+
+	close(out);
+	close(fd);
+
+	double t = time_now() - start;
+	printf("%s: %u of %u blocks, %zu bytes in %u requests, %.1f MB/s",
+	       name, range_count, block_count, fetched, requests,
+	       fetched / t / (1024 * 1024));
+	if (bad_blocks)
+	{
+		printf(", %u bad blocks on the server", bad_blocks);
+	}
+	printf("\n");
+
+	free(buffer);
+	free(blocks);
+
+	return bad_blocks ? 2 : 0;
+}
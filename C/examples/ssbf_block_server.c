@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "ssbf.h"
+#include "ssbf_server.h"
+
+struct connection {
+	struct ssbf_server *server;
+	int fd;
+};
+
+static void *serve_connection(void *arg)
+{
+	struct connection *c = arg;
+
+	ssbf_server_serve(c->server, c->fd);
+
+	close(c->fd);
+	free(c);
+	return NULL;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (sizeof(addr.sun_path) <= strlen(path))
+	{
+		printf("E: socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+
+	if (0 > fd
+	    || bind(fd, (struct sockaddr *) &addr, sizeof(addr))
+	    || listen(fd, 64))
+	{
+		perror("E: unix socket");
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listen_tcp(const char *address, int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (1 != inet_pton(AF_INET, address, &addr.sin_addr))
+	{
+		printf("E: wrong address %s\n", address);
+		return -1;
+	}
+
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (0 > fd
+	    || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+	    || bind(fd, (struct sockaddr *) &addr, sizeof(addr))
+	    || listen(fd, 64))
+	{
+		perror("E: tcp socket");
+		return -1;
+	}
+
+	return fd;
+}
+
+// Serves the ssbf files of a directory to devices, see ssbf_server.h
+// for the requests. Runs in the foreground, one thread per connection.
+int main(int argc, char **argv)
+{
+	char *directory = ".";
+	char *unix_path = NULL;
+	char *address = "127.0.0.1";
+	int port = 0;
+        int c;
+
+        while ((c = getopt(argc, argv, "d:u:p:a:h")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'd':
+        		directory = optarg;
+        		break;
+        	case 'u':
+        		unix_path = optarg;
+        		break;
+        	case 'p':
+        		port = atoi(optarg);
+        		break;
+        	case 'a':
+        		address = optarg;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-d <directory> - ssbf files to serve, default .\n");
+        		printf("-u <path> - listen on a unix socket\n");
+        		printf("-p <port> - listen on a TCP port\n");
+        		printf("-a <address> - TCP address, default 127.0.0.1\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if ((NULL == unix_path) == (0 == port))
+	{
+		printf("Give either -u or -p\n");
+		return 1;
+	}
+
+	struct ssbf_server server;
+	if (ssbf_server_init(&server, directory))
+	{
+		printf("E: can not open directory %s\n", directory);
+		return 1;
+	}
+
+	int listen_fd = unix_path ? listen_unix(unix_path)
+		: listen_tcp(address, port);
+	if (0 > listen_fd)
+	{
+		return 1;
+	}
+
+	// a device which goes away while a block is sent is not an error
+	signal(SIGPIPE, SIG_IGN);
+
+	if (unix_path)
+	{
+		printf("serving %s on %s\n", directory, unix_path);
+	}
+	else
+	{
+		printf("serving %s on %s:%i\n", directory, address, port);
+	}
+	fflush(stdout);
+
+	while (1)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (0 > fd)
+		{
+			continue;
+		}
+
+		// responses are small, don't wait to fill a segment
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		struct connection *conn = malloc(sizeof(*conn));
+		pthread_t thread;
+
+		if (NULL == conn)
+		{
+			close(fd);
+			continue;
+		}
+
+		conn->server = &server;
+		conn->fd = fd;
+
+		if (pthread_create(&thread, NULL, serve_connection, conn))
+		{
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ssbf.h"
+
+#define KEY_SIZE 32
+
+// hashed_data_size is 16 bit, followed by the 16 byte MAC
+#define HEADER_MAX_SIZE (UINT16_MAX + 16)
+
+#define MAX_THREADS 64
+
+// one scanned file, filled by the worker threads
+struct catalog_item {
+	char *path;
+	enum ssbf_errors e;
+	bool is_ssbf;
+	struct ssbf_catalog_entry entry;
+};
+
+struct catalog {
+	struct catalog_item *items;
+	size_t count;
+	size_t max_count;
+	atomic_size_t next;         // next item a worker takes
+	uint8_t *key_main;
+	struct ssbf_decode_options options;
+};
+
+// nftw has no user pointer
+static struct catalog catalog;
+
+static int read_file_in_a_buffer(char *file_name,
+				 uint8_t **buffer, size_t *buff_size)
+{
+	FILE * fp;
+        fp = fopen (file_name,"rb");
+        if (NULL == fp)
+        {
+                printf("File not found\n");
+                return 1;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        *buff_size = ftell(fp);
+
+        *buffer = malloc(*buff_size);
+	if (NULL == *buffer)
+	{
+		return 1;
+	}
+
+        rewind(fp);
+        fread(*buffer, 1, *buff_size, fp);
+	fclose(fp);
+	return 0;
+}
+
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	(void) ftw;
+
+	if (FTW_F != type || (size_t) st->st_size
+	    < sizeof(struct ssbf_main_header))
+	{
+		return 0;
+	}
+
+	if (catalog.count == catalog.max_count)
+	{
+		size_t max_count = catalog.max_count ? 2 * catalog.max_count : 1024;
+		struct catalog_item *items = realloc(
+			catalog.items, max_count * sizeof(struct catalog_item));
+		if (NULL == items)
+		{
+			return 1;
+		}
+		catalog.items = items;
+		catalog.max_count = max_count;
+	}
+
+	struct catalog_item *item = &catalog.items[catalog.count];
+	memset(item, 0, sizeof(struct catalog_item));
+	item->path = strdup(path);
+	if (NULL == item->path)
+	{
+		return 1;
+	}
+	catalog.count += 1;
+
+	return 0;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+	return strcmp(((const struct catalog_item *) a)->path,
+		      ((const struct catalog_item *) b)->path);
+}
+
+// Only the header is read: the main header tells how big it is
+static void scan_file(struct catalog_item *item, uint8_t *header)
+{
+	item->e = SSBF_NOT_ENOUGHT_DATA;
+
+	int fd = open(item->path, O_RDONLY);
+	if (0 > fd)
+	{
+		return;
+	}
+
+	size_t header_size = 0;
+	ssize_t n = pread(fd, header, sizeof(struct ssbf_main_header), 0);
+
+	if ((ssize_t) sizeof(struct ssbf_main_header) == n)
+	{
+		item->e = ssbf_catalog_header_size(header, (size_t) n,
+						   &header_size);
+		// anything else in the directory is not listed
+		item->is_ssbf = (SSBF_GENERIC_ERROR != item->e);
+	}
+
+	if (item->is_ssbf && SSBF_NO_ERROR == item->e)
+	{
+		n = pread(fd, header, header_size, 0);
+
+		item->e = ((ssize_t) header_size == n)
+			? ssbf_read_catalog_entry(catalog.key_main,
+						  header, header_size,
+						  &item->entry,
+						  &catalog.options)
+			: SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	close(fd);
+}
+
+static void *scan_worker(void *arg)
+{
+	uint8_t *header = malloc(HEADER_MAX_SIZE);
+
+	(void) arg;
+
+	if (NULL == header)
+	{
+		return NULL;
+	}
+
+	while (1)
+	{
+		size_t i = atomic_fetch_add(&catalog.next, 1);
+		if (i >= catalog.count)
+		{
+			break;
+		}
+
+		scan_file(&catalog.items[i], header);
+	}
+
+	free(header);
+	return NULL;
+}
+
+static void print_hex(FILE *fp, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; size > i; i++)
+	{
+		fprintf(fp, "%02x", data[i]);
+	}
+
+	if (0 == size)
+	{
+		fprintf(fp, "-");
+	}
+}
+
+// One line per file, tab separated:
+// path status file_id meta_data_id meta_payload data_size block_size
+// data_flags data_checksum blocks_size
+static void print_item(FILE *fp, const struct catalog_item *item)
+{
+	const struct ssbf_catalog_entry *entry = &item->entry;
+
+	fprintf(fp, "%s\t%i\t%08x\t%u\t", item->path, item->e,
+		entry->file_id, entry->meta_h.meta_data_id);
+	print_hex(fp, entry->meta_payload, entry->meta_h.payload_size);
+	fprintf(fp, "\t%u\t%u\t0x%02x\t%08x\t%u\n",
+		entry->data_h.full_data_size_uncompressed,
+		entry->data_h.max_uncompressed_block_size,
+		entry->data_h.flags,
+		entry->data_h.full_data_checksum,
+		entry->blocks_sum_size);
+}
+
+int main(int argc, char **argv)
+{
+        char *dir_name = NULL;
+	char *output_filename = NULL;
+        char *key_filename = NULL;
+	long meta_data_id = -1;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool no_encryption = false;
+        int c;
+
+        while ((c = getopt(argc, argv, "d:k:o:i:j:nh")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'd':
+        		dir_name = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'o':
+        		output_filename = optarg;
+        		break;
+        	case 'i':
+        		meta_data_id = atol(optarg);
+        		break;
+        	case 'j':
+        		threads = atol(optarg);
+        		break;
+        	case 'n':
+        		no_encryption = true;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-d <directory> - directory with ssbf files, scanned recursively\n");
+        		printf("-k <key_filename> - main key, without it only files without encryption are read\n");
+        		printf("-o <filename> - index file name, default is stdout\n");
+        		printf("-i <meta_data_id> - list only files with this meta data id\n");
+        		printf("-j <threads> - files read in parallel, default is the number of cpus\n");
+        		printf("-n - also read files without encryption when a key is given\n");
+        		printf("Index: path status file_id meta_data_id meta_payload(hex) data_size block_size data_flags data_checksum blocks_size\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (NULL == dir_name)
+	{
+		printf("Missing directory\n");
+		return 1;
+	}
+
+	if (key_filename && NULL == (catalog.key_main = read_key(key_filename)))
+	{
+		return 1;
+	}
+	catalog.options.allow_unencrypted = no_encryption;
+
+	if (1 > threads)
+	{
+		threads = 1;
+	}
+	if (MAX_THREADS < threads)
+	{
+		threads = MAX_THREADS;
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	if (nftw(dir_name, add_file, 16, FTW_PHYS))
+	{
+		printf("Error reading directory %s\n", dir_name);
+		return 1;
+	}
+
+	pthread_t workers[MAX_THREADS];
+	long started = 0;
+
+	for (; threads > started; started++)
+	{
+		if (pthread_create(&workers[started], NULL, scan_worker, NULL))
+		{
+			break;
+		}
+	}
+
+	// the main thread helps, so a failed pthread_create only slows down
+	scan_worker(NULL);
+
+	for (long i = 0; started > i; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+
+	gettimeofday(&end, NULL);
+
+	qsort(catalog.items, catalog.count, sizeof(struct catalog_item),
+	      compare_items);
+
+	FILE *fp = output_filename ? fopen(output_filename, "w") : stdout;
+	if (NULL == fp)
+	{
+		printf("Error opening %s\n", output_filename);
+		return 1;
+	}
+
+	size_t listed = 0;
+	size_t failed = 0;
+
+	for (size_t i = 0; catalog.count > i; i++)
+	{
+		struct catalog_item *item = &catalog.items[i];
+
+		if (!item->is_ssbf
+		    || (0 <= meta_data_id && (SSBF_NO_ERROR != item->e
+			|| meta_data_id != item->entry.meta_h.meta_data_id)))
+		{
+			continue;
+		}
+
+		print_item(fp, item);
+		listed += 1;
+		failed += (SSBF_NO_ERROR != item->e);
+	}
+
+	if (stdout != fp)
+	{
+		fclose(fp);
+	}
+
+	fprintf(stderr, "%zu files scanned, %zu listed, %zu failed, %.3f s\n",
+		catalog.count, listed, failed,
+		(double) (end.tv_sec - start.tv_sec)
+		+ (double) (end.tv_usec - start.tv_usec) / 1e6);
+
+	return 0;
+}
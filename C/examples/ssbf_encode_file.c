@@ -5,15 +5,30 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <time.h>
 #include <sys/time.h>
 
 #include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_cipher.h"
 
 #define KEY_SIZE 32
 #define NONCE_SIZE 24
 
+// Block size autotuning (-T): the samples are spread over the input, so
+// a big input is tuned on TUNE_SAMPLE_COUNT pieces of TUNE_SAMPLE_SIZE
+#define TUNE_SAMPLE_SIZE (64 * 1024)
+#define TUNE_SAMPLE_COUNT 16
+#define TUNE_MIN_BLOCK_SIZE 256
+#define TUNE_MAX_BLOCK_SIZE 32768
+#define TUNE_MAX_CONFIGS 64
+#define TUNE_MAX_THREADS 64
+// every candidate is decoded at least this long, to time it
+#define TUNE_DECODE_NS (20 * 1000 * 1000)
+
 // caller needs to assure that time_array is 8 or more bytes long
 void get_current_time(uint8_t *time_array)
 {
@@ -44,6 +59,34 @@ void get_current_time(uint8_t *time_array)
 //    printf("\n");
 }
 
+// comma separated codec names to enum SSBF_ENCODE_CODECS, -1 if unknown
+static int codec_mask(char *list)
+{
+	int codecs = 0;
+
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+	{
+		if (0 == strcmp(name, "rle"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_RLE;
+		}
+		else if (0 == strcmp(name, "lz4"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_LZ4;
+		}
+		else if (0 == strcmp(name, "lz4hc"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_LZ4HC;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	return codecs;
+}
+
 static int read_file_in_a_buffer(char *file_name, 
 				 uint8_t **buffer, size_t *buff_size)
 {
@@ -110,17 +153,416 @@ int save_to_file(char *file_name, char *backup_file_name,
 	return 0;
 }
 
+// One trial encode of the samples
+struct tune_config {
+	uint32_t block_size;
+	uint8_t compression_level;
+	uint8_t *encoded;
+	size_t encoded_size;
+	size_t blocks;
+	size_t decoder_ram;
+	double host_mbps;           // measured ssbf_decode_data speed
+	double model_mbps;          // speed on the device model, -M
+	bool decoded;               // the samples decoded back
+	bool fits;                  // meets all constraints
+};
+
+struct tune {
+	uint8_t *key_main;
+	uint8_t *nonce;
+	uint8_t *data_key;
+	const struct ssbf_encode_options *options;
+	uint8_t *sample;
+	size_t sample_size;
+	struct tune_config configs[TUNE_MAX_CONFIGS];
+	size_t count;
+	atomic_size_t next;         // next config a worker encodes
+};
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Blocks which don't compress are stored as is with their header,
+// size and tag (a dedup reference of a tiny block is a bit bigger than
+// the block), and every block can be followed by up to alignment bytes
+// of padding. The file header and its padding come in front.
+static size_t encode_buffer_size(size_t input_size, uint32_t block_size,
+				 const struct ssbf_encode_options *options)
+{
+	size_t min_block_size = block_size;
+	if (options->cdc_min_block_size
+	    && options->cdc_min_block_size < block_size)
+	{
+		min_block_size = options->cdc_min_block_size;
+	}
+
+	return 256 + options->block_alignment + input_size
+		+ (input_size / (min_block_size ? min_block_size : 1) + 2)
+		* (sizeof(struct ssbf_payload_block_header) + sizeof(uint16_t)
+		   + SSBF_BLOCK_TAG_SIZE + sizeof(struct ssbf_block_reference)
+		   + options->block_alignment);
+}
+
+// Pieces from all over the input, whole blocks of every candidate size
+// apart, so that each piece starts a new block. Small inputs and delta
+// files (the blocks match the base at their own offset) are used whole.
+static uint8_t *tune_sample(uint8_t *input, size_t input_size,
+			    bool whole, size_t *sample_size)
+{
+	if (whole || TUNE_SAMPLE_SIZE * TUNE_SAMPLE_COUNT >= input_size)
+	{
+		*sample_size = input_size;
+		return input;
+	}
+
+	uint8_t *sample = malloc(TUNE_SAMPLE_SIZE * TUNE_SAMPLE_COUNT);
+	if (NULL == sample)
+	{
+		return NULL;
+	}
+
+	size_t pieces = input_size / TUNE_SAMPLE_SIZE;
+
+	for (size_t i = 0; TUNE_SAMPLE_COUNT > i; i++)
+	{
+		size_t piece = i * pieces / TUNE_SAMPLE_COUNT;
+		memcpy(&sample[i * TUNE_SAMPLE_SIZE],
+		       &input[piece * TUNE_SAMPLE_SIZE], TUNE_SAMPLE_SIZE);
+	}
+
+	*sample_size = TUNE_SAMPLE_SIZE * TUNE_SAMPLE_COUNT;
+	return sample;
+}
+
+static void *tune_worker(void *arg)
+{
+	struct tune *t = arg;
+	uint8_t meta_payload_data[4] = {1,2,3,4};
+
+	while (1)
+	{
+		size_t i = atomic_fetch_add(&t->next, 1);
+		if (i >= t->count)
+		{
+			break;
+		}
+
+		struct tune_config *config = &t->configs[i];
+		struct ssbf_encode_options options = *t->options;
+		size_t encoded_max_size = encode_buffer_size(
+			t->sample_size, config->block_size, &options);
+
+		options.compression_level = config->compression_level;
+
+		config->encoded = malloc(encoded_max_size);
+		if (NULL == config->encoded)
+		{
+			continue;
+		}
+
+		ssbf_encode_data(t->key_main, t->nonce, t->data_key,
+				 0x1234, meta_payload_data,
+				 sizeof(meta_payload_data),
+				 config->block_size,
+				 t->sample, t->sample_size,
+				 config->encoded, encoded_max_size,
+				 &config->encoded_size,
+				 &options);
+	}
+
+	return NULL;
+}
+
+// Decodes the candidate until TUNE_DECODE_NS have passed and counts its
+// blocks. Done one candidate after the other, so the encoders running
+// in parallel don't slow down the measured decode.
+static void tune_decode(struct tune *t, struct tune_config *config,
+			uint8_t *output, uint8_t *scratch)
+{
+	struct ssbf_decode_options options;
+	memset(&options, 0, sizeof(options));
+	options.base_data_start = t->options->base_data_start;
+	options.base_data_size = t->options->base_data_size;
+	options.allow_unencrypted = t->options->no_encryption;
+	options.scratch = scratch;
+	options.scratch_size = TUNE_MAX_BLOCK_SIZE + sizeof(uint16_t)
+		+ SSBF_BLOCK_TAG_SIZE;
+
+	uint64_t elapsed = 0;
+	uint32_t rounds = 0;
+
+	config->decoded = (0 != config->encoded_size);
+
+	while (config->decoded && (TUNE_DECODE_NS > elapsed || 2 > rounds))
+	{
+		size_t output_size = 0;
+		uint64_t start = time_ns();
+
+		enum ssbf_errors e = ssbf_decode_data(
+			t->key_main, config->encoded, config->encoded_size,
+			output, t->sample_size, &output_size, &options);
+
+		elapsed += time_ns() - start;
+		rounds += 1;
+
+		config->decoded = (SSBF_NO_ERROR == e
+				   && t->sample_size == output_size
+				   && 0 == memcmp(output, t->sample,
+						  t->sample_size));
+	}
+
+	if (!config->decoded)
+	{
+		return;
+	}
+
+	config->host_mbps = (double) t->sample_size * rounds * 1e9
+		/ (double) elapsed / (1024 * 1024);
+
+	struct ssbf_file file;
+	struct ssbf_payload_block_header h;
+	size_t offset = 0;
+
+	if (SSBF_NO_ERROR != ssbf_open(&file, t->key_main, config->encoded,
+				       config->encoded_size, &options))
+	{
+		config->decoded = false;
+		return;
+	}
+
+	while (SSBF_NO_ERROR == ssbf_file_block_header(
+		       &file, offset, (uint16_t) config->blocks, &h))
+	{
+		config->blocks += 1;
+		if ((h.flags & BHF_LAST_BLOCK)
+		    || SSBF_NO_ERROR != ssbf_file_skip_block(&file, &h, &offset))
+		{
+			break;
+		}
+	}
+
+	ssbf_close(&file);
+}
+
+// Trial encodes the samples with every block size and compression level
+// in parallel and picks the smallest file which fits in max_ram and
+// decodes at min_mbps or faster, measured on the host or, with
+// block_us, on the device model: block_us per block plus the data at
+// device_mbps. The whole trade-off curve is printed.
+static int tune_block_size(uint8_t *key_main, uint8_t *nonce,
+			   uint8_t *data_key,
+			   uint8_t *input, size_t input_size,
+			   struct ssbf_encode_options *options,
+			   size_t max_ram, double min_mbps,
+			   double block_us, double device_mbps,
+			   long threads,
+			   uint32_t *block_size)
+{
+	static struct tune t;
+	int r = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.key_main = key_main;
+	t.nonce = nonce;
+	t.data_key = data_key;
+	t.options = options;
+	t.sample = tune_sample(input, input_size,
+			       NULL != options->base_data_start,
+			       &t.sample_size);
+	if (NULL == t.sample || 0 == t.sample_size)
+	{
+		printf("No data to tune on\n");
+		return 1;
+	}
+
+	// the level is only used by LZ4 HC
+	static const uint8_t hc_levels[] = {1, 4, 9, 12};
+	bool hc = (0 == options->codecs)
+		|| (options->codecs & SSBF_ENCODE_CODEC_LZ4HC);
+	size_t levels = hc ? sizeof(hc_levels) : 1;
+
+	for (uint32_t size = TUNE_MIN_BLOCK_SIZE;
+	     TUNE_MAX_BLOCK_SIZE >= size; size *= 2)
+	{
+		if (options->cdc_min_block_size >= size)
+		{
+			continue;
+		}
+
+		for (size_t l = 0; levels > l; l++)
+		{
+			struct tune_config *config = &t.configs[t.count++];
+			config->block_size = size;
+			config->compression_level = hc 
+				? hc_levels[l] : options->compression_level;
+		}
+	}
+
+	printf("Tuning on %zu of %zu bytes, %zu configurations\n",
+	       t.sample_size, input_size, t.count);
+
+	// the cipher backend is picked once, before the threads use it
+	ssbf_cipher_selected();
+
+	pthread_t workers[TUNE_MAX_THREADS];
+	long started = 0;
+
+	for (; threads > started && TUNE_MAX_THREADS > started; started++)
+	{
+		if (pthread_create(&workers[started], NULL, tune_worker, &t))
+		{
+			break;
+		}
+	}
+
+	tune_worker(&t);
+
+	for (long i = 0; started > i; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+
+	uint8_t *output = malloc(t.sample_size);
+	uint8_t *scratch = malloc(TUNE_MAX_BLOCK_SIZE + sizeof(uint16_t)
+				  + SSBF_BLOCK_TAG_SIZE);
+	struct tune_config *best = NULL;
+
+	for (size_t i = 0; t.count > i && output && scratch; i++)
+	{
+		struct tune_config *config = &t.configs[i];
+
+		tune_decode(&t, config, output, scratch);
+
+		// a streaming decoder (ssbf_file_read_block, ssbf_decode_step)
+		// holds one decoded block, and the decrypted payload of one
+		// block if the blocks are encrypted
+		config->decoder_ram = sizeof(struct ssbf_file)
+			+ config->block_size;
+		if (!options->no_encryption)
+		{
+			config->decoder_ram += config->block_size
+				+ sizeof(uint16_t) + SSBF_BLOCK_TAG_SIZE;
+		}
+
+		if (0 < block_us || 0 < device_mbps)
+		{
+			double us = config->blocks * block_us 
+				+ (0 < device_mbps 
+				   ? t.sample_size / device_mbps 
+				   / (1024 * 1024) * 1e6 
+				   : 0);
+			config->model_mbps = t.sample_size / us 
+				/ (1024 * 1024) * 1e6;
+		}
+
+		double mbps = (0 < block_us || 0 < device_mbps)
+			? config->model_mbps : config->host_mbps;
+
+		config->fits = config->decoded
+			&& (0 == max_ram || max_ram >= config->decoder_ram)
+			&& mbps >= min_mbps;
+
+		if (config->fits
+		    && (NULL == best
+			|| config->encoded_size < best->encoded_size
+			|| (config->encoded_size == best->encoded_size
+			    && config->host_mbps > best->host_mbps)))
+		{
+			best = config;
+		}
+	}
+
+	printf("%10s %6s %10s %7s %8s %11s %12s\n",
+	       "block_size", "level", "size", "ratio", "ram",
+	       "host MB/s", "model MB/s");
+
+	for (size_t i = 0; t.count > i; i++)
+	{
+		struct tune_config *config = &t.configs[i];
+
+		if (!config->decoded)
+		{
+			printf("%10" PRIu32 " %6u encode or decode failed\n",
+			       config->block_size, config->compression_level);
+			continue;
+		}
+
+		printf("%10" PRIu32 " %6u %10zu %7.3f %8zu %11.1f ",
+		       config->block_size, config->compression_level,
+		       config->encoded_size,
+		       (double) config->encoded_size / t.sample_size,
+		       config->decoder_ram, config->host_mbps);
+		if (0 < block_us || 0 < device_mbps)
+		{
+			printf("%12.1f", config->model_mbps);
+		}
+		else
+		{
+			printf("%12s", "-");
+		}
+		printf(" %s\n", best == config ? "<- best" 
+		       : (config->fits ? "" : "x"));
+	}
+
+	if (NULL == best)
+	{
+		printf("No configuration meets the constraints\n");
+		r = 1;
+	}
+	else
+	{
+		printf("using block size: %" PRIu32 ", compression level %u\n",
+		       best->block_size, best->compression_level);
+		*block_size = best->block_size;
+		options->compression_level = best->compression_level;
+	}
+
+	for (size_t i = 0; t.count > i; i++)
+	{
+		free(t.configs[i].encoded);
+	}
+	free(output);
+	free(scratch);
+	if (input != t.sample)
+	{
+		free(t.sample);
+	}
+
+	return output && scratch ? r : 1;
+}
+
 int main(int argc, char **argv)
 {
         char *data_filename = NULL;
 	char *output_filename = NULL;
         char *key_filename = NULL;
+        char *base_filename = NULL;
+        char *append_filename = NULL;
 //        char *meta_data_filename = NULL;
 
 	bool verbose = false;
+	bool dedup = false;
+	bool no_encryption = false;
+	bool block_tags = false;
+	bool fill_blocks = false;
+	uint32_t block_alignment = 0;
+	uint32_t compression_level = 0;
+	bool crc_checksums = false;
+	int codecs = 0;
+	uint32_t cdc_min_block_size = 0;
         uint32_t block_size = 1024;
+	bool tune = false;
+	size_t max_ram = 0;
+	double min_mbps = 0;
+	double block_us = 0;
+	double device_mbps = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
         int c;
-        while ((c = getopt(argc, argv, "k:f:b:m:o:v:h")) != -1)
+        while ((c = getopt(argc, argv, "k:f:b:c:d:m:o:v:a:p:l:s:x:r:S:M:j:hDntTz")) != -1)
         {
         	switch (c)
         	{
@@ -137,10 +579,92 @@ int main(int argc, char **argv)
                         printf("using block size: %i\n", block_size);
         		break;
 
+        	case 'c':
+        		cdc_min_block_size = atoi(optarg);
+        		break;
+
+        	case 'd':
+        		base_filename = optarg;
+        		break;
+
+        	case 'D':
+        		dedup = true;
+        		break;
+
+        	case 'n':
+        		no_encryption = true;
+        		break;
+
+        	case 't':
+        		block_tags = true;
+        		break;
+
+        	case 'z':
+        		fill_blocks = true;
+        		break;
+
+        	case 'a':
+        		block_alignment = atoi(optarg);
+        		break;
+
+        	case 'p':
+        		append_filename = optarg;
+        		break;
+
+        	case 'l':
+        		compression_level = atoi(optarg);
+        		break;
+
+        	case 's':
+        		if (0 == strcmp(optarg, "crc"))
+        		{
+        			crc_checksums = true;
+        		}
+        		else if (strcmp(optarg, "bsd"))
+        		{
+        			printf("Unknown checksum %s\n", optarg);
+        			return 1;
+        		}
+        		break;
+
+        	case 'x':
+        		codecs = codec_mask(optarg);
+        		if (0 > codecs)
+        		{
+        			printf("Unknown codec in %s\n", optarg);
+        			return 1;
+        		}
+        		break;
+
 //        	case 'm':
 //        		meta_data_file = optarg;
 //        		break;
 
+        	case 'T':
+        		tune = true;
+        		break;
+
+        	case 'r':
+        		max_ram = strtoul(optarg, NULL, 0);
+        		break;
+
+        	case 'S':
+        		min_mbps = atof(optarg);
+        		break;
+
+        	case 'M':
+        		if (2 != sscanf(optarg, "%lf,%lf", 
+        				&block_us, &device_mbps))
+        		{
+        			printf("Device model is <us_per_block>,<MB/s>\n");
+        			return 1;
+        		}
+        		break;
+
+        	case 'j':
+        		threads = atol(optarg);
+        		break;
+
         	case 'o':
         		output_filename = optarg;
         		break;
@@ -152,8 +676,24 @@ int main(int argc, char **argv)
         		printf("Usage flags:\n");
         		printf("-f <filename> - input file to encode to ssbf\n");
                         printf("-b <block_size - size of the block\n");
+                        printf("-c <min_block_size> - content defined block boundaries, block_size is the maximum\n");
         		printf("-k <key_filename> - filename where encryption key is stored\n");
         		printf("-o <filename> - output file name\n");
+        		printf("-d <base_filename> - delta encode against a previous image\n");
+        		printf("-D - store repeated blocks as references\n");
+        		printf("-n - no encryption, only compression and integrity\n");
+        		printf("-t - authenticate every block with its own tag\n");
+        		printf("-z - store blocks of one repeated byte (erased flash) as fill blocks\n");
+        		printf("-a <alignment> - start every block at a multiple of alignment bytes\n");
+        		printf("-p <ssbf_filename> - append the input file to an ssbf file, -c must match it\n");
+        		printf("-l <level> - LZ4 HC compression level 1 - 12\n");
+        		printf("-s <bsd|crc> - checksums, crc is CRC16 for blocks and CRC32 for the data\n");
+        		printf("-x <codecs> - codecs to try on every block, comma separated: rle, lz4, lz4hc (default)\n");
+        		printf("-T - pick the block size and compression level from trial encodes of samples of the input\n");
+        		printf("-r <bytes> - with -T, decoder RAM limit for one block and its decrypted payload\n");
+        		printf("-S <MB/s> - with -T, minimum decode speed, measured on the host or on the -M model\n");
+        		printf("-M <us_per_block>,<MB/s> - with -T, device decode model: cost per block plus data rate\n");
+        		printf("-j <threads> - with -T, trial encodes in parallel, default is the number of cpus\n");
 
         		return 1;
 
@@ -164,7 +704,8 @@ int main(int argc, char **argv)
         	}
         }
 
-        if ((NULL == data_filename) || (NULL == key_filename))
+        if ((NULL == data_filename) 
+	    || (NULL == key_filename && !no_encryption))
         {
                 printf("Missing data file name or encryption key file");
                 return 1;
@@ -185,30 +726,36 @@ int main(int argc, char **argv)
 
         uint8_t *main_key = NULL; //[32];
 	size_t main_key_size = 0;
-	r = read_file_in_a_buffer(key_filename,
-				  &main_key,
-				  &main_key_size);
 
-        if (r)
-        {
-                printf("Error reading key from file\n");
-                return 1;
-        }
-
-	if (32 != main_key_size)
+	if (!no_encryption)
 	{
-		if (33 == main_key_size && (10 == main_key[main_key_size-1]))
+		r = read_file_in_a_buffer(key_filename,
+					  &main_key,
+					  &main_key_size);
+
+		if (r)
 		{
-			// remove the newline from the end of the key
-			printf("removing new line from the main key\n");
-			main_key[main_key_size] = 0;
-			main_key_size -= 1;
+			printf("Error reading key from file\n");
+			return 1;
 		}
-		else
+
+		if (32 != main_key_size)
 		{
-			printf("E: wrong main key size  %i (%i)\n", 
-			       (int) main_key_size, main_key[main_key_size-1]);
-			return 1;
+			if (33 == main_key_size 
+			    && (10 == main_key[main_key_size-1]))
+			{
+				// remove the newline from the end of the key
+				printf("removing new line from the main key\n");
+				main_key[main_key_size] = 0;
+				main_key_size -= 1;
+			}
+			else
+			{
+				printf("E: wrong main key size  %i (%i)\n", 
+				       (int) main_key_size, 
+				       main_key[main_key_size-1]);
+				return 1;
+			}
 		}
 	}
 
@@ -255,7 +802,99 @@ int main(int argc, char **argv)
 		printf("\n");
 	}
 
-	uint8_t *output_data_start = malloc(2*input_file_buffer_size + 1);
+	struct ssbf_encode_options options;
+	memset(&options, 0, sizeof(options));
+	options.dedup = dedup;
+	options.cdc_min_block_size = cdc_min_block_size;
+	options.no_encryption = no_encryption;
+	options.block_alignment = block_alignment;
+	options.block_tags = block_tags;
+	options.fill_blocks = fill_blocks;
+	options.compression_level = compression_level;
+	options.codecs = (uint8_t) codecs;
+	if (crc_checksums)
+	{
+		options.block_checksum = SSBF_CHECKSUM_CRC16;
+		options.data_checksum = SSBF_CHECKSUM_CRC32;
+	}
+
+	if (base_filename)
+	{
+		r = read_file_in_a_buffer(base_filename,
+					  &options.base_data_start,
+					  &options.base_data_size);
+		if (r)
+		{
+			printf("Error reading base file\n");
+			return 1;
+		}
+	}
+
+	if (tune)
+	{
+		if (append_filename)
+		{
+			printf("Appended blocks keep the block size of the file\n");
+			return 1;
+		}
+
+		r = tune_block_size(main_key, nonce, data_key,
+				    input_file_buffer_start,
+				    input_file_buffer_size,
+				    &options, max_ram, min_mbps,
+				    block_us, device_mbps, threads,
+				    &block_size);
+		if (r)
+		{
+			return r;
+		}
+	}
+
+	if (append_filename)
+	{
+		uint8_t *file_data = NULL;
+		size_t file_size = 0;
+
+		r = read_file_in_a_buffer(append_filename,
+					  &file_data, &file_size);
+		if (r)
+		{
+			printf("Error reading ssbf file\n");
+			return 1;
+		}
+
+		// room for the new blocks, their padding and tags
+		size_t file_max_size = file_size + 2*input_file_buffer_size
+			+ (input_file_buffer_size / 16 + 2) * (16 + 32768);
+		file_data = realloc(file_data, file_max_size);
+		if (NULL == file_data)
+		{
+			return 1;
+		}
+
+		size_t appended_file_size = 0;
+		enum ssbf_errors e = ssbf_append_data(
+			main_key, nonce,
+			file_data, file_size, file_max_size,
+			input_file_buffer_start, input_file_buffer_size,
+			&appended_file_size, &options);
+
+		if (SSBF_NO_ERROR != e)
+		{
+			printf("ssbf append failed %i\n", e);
+			return 1;
+		}
+
+		printf("%zu -> %zu\n", file_size, appended_file_size);
+
+		return save_to_file(output_filename ? output_filename
+				    : append_filename, data_filename,
+				    file_data, appended_file_size);
+	}
+
+	size_t output_data_max_size = encode_buffer_size(
+		input_file_buffer_size, block_size, &options);
+	uint8_t *output_data_start = malloc(output_data_max_size);
 	size_t encoded_file_size = 0;
 
 	// TODO: Implement getting meta data and meta id from file
@@ -271,8 +910,15 @@ int main(int argc, char **argv)
 			 (uint8_t *)input_file_buffer_start,
 			 input_file_buffer_size,
 			 output_data_start,
-			 sizeof(output_data_start),
-			 &encoded_file_size);
+			 output_data_max_size,
+			 &encoded_file_size,
+			 &options);
+
+	if (0 == encoded_file_size)
+	{
+		printf("ssbf encode failed\n");
+		return 1;
+	}
 
 	printf("%zu -> %zu\n", input_file_buffer_size, encoded_file_size);
 
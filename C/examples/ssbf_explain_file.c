@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -40,19 +41,88 @@ static int read_file_in_a_buffer(char *file_name,
 	return 0;
 }
 
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
 int main(int argc, char **argv)
 {
-	(void) argc;
-	(void) argv;
-//        if (argc != 2)
-//        {
-//                printf("Wrong args\n");
-//                return 1;
-//        }
-//
-//        char *data_filename = argv[1];
         char *data_filename = "tmp.ssbf";
-	printf("Opening file: %s\n", data_filename);
+        char *key_filename = NULL;
+        char *base_filename = NULL;
+	bool analyze = false;
+	bool json = false;
+	bool no_encryption = false;
+        int c;
+
+        while ((c = getopt(argc, argv, "f:k:d:ajnh")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'f':
+        		data_filename = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'd':
+        		base_filename = optarg;
+        		break;
+        	case 'a':
+        		analyze = true;
+        		break;
+        	case 'j':
+        		json = true;
+        		analyze = true;
+        		break;
+        	case 'n':
+        		no_encryption = true;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-f <filename> - ssbf file to explain, default is tmp.ssbf\n");
+        		printf("-k <key_filename> - main key, needed by -a for encrypted files\n");
+        		printf("-a - decode every block and print the decrypted header, ratio and decode time per block\n");
+        		printf("-j - same as -a, printed as JSON\n");
+        		printf("-d <base_filename> - base image of a delta encoded file, for -a\n");
+        		printf("-n - allow files without encryption when a key is given\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (!json)
+	{
+		printf("Opening file: %s\n", data_filename);
+	}
 
 	size_t input_file_buffer_size = 0;
 	uint8_t *input_file_buffer_start = NULL;
@@ -64,15 +134,47 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	enum ssbf_errors r = ssbf_explain(
-		input_file_buffer_start, input_file_buffer_size);
+	enum ssbf_errors r = SSBF_NO_ERROR;
+
+	if (analyze)
+	{
+		uint8_t *key_main = NULL;
+		struct ssbf_decode_options options;
+		memset(&options, 0, sizeof(options));
+		options.allow_unencrypted = no_encryption;
+
+		if (key_filename && NULL == (key_main = read_key(key_filename)))
+		{
+			return 1;
+		}
+
+		if (base_filename
+		    && read_file_in_a_buffer(base_filename,
+					     &options.base_data_start,
+					     &options.base_data_size))
+		{
+			return 1;
+		}
+
+		r = ssbf_explain_analyze(key_main,
+					 input_file_buffer_start,
+					 input_file_buffer_size,
+					 &options, json);
+	}
+	else
+	{
+		r = ssbf_explain(input_file_buffer_start,
+				 input_file_buffer_size);
+	}
 
 	if (r)
 	{
-		printf("ssbf explain failed\n");
+		if (!json)
+		{
+			printf("ssbf explain failed\n");
+		}
 		return 1;
 	}
 
 	return 0;
 }
-
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "ssbf.h"
+#include "ssbf_io.h"
+
+#define KEY_SIZE 32
+#define BENCH_MAX_PATH 4096
+
+static int read_file_in_a_buffer(char *file_name,
+				 uint8_t **buffer, size_t *buff_size)
+{
+	FILE * fp;
+        fp = fopen (file_name,"rb");
+        if (NULL == fp)
+        {
+                printf("File not found\n");
+                return 1;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        *buff_size = ftell(fp);
+
+        *buffer = malloc(*buff_size ? *buff_size : 1);
+	if (NULL == *buffer)
+	{
+		return 1;
+	}
+
+        rewind(fp);
+        fread(*buffer, 1, *buff_size, fp);
+	fclose(fp);
+	return 0;
+}
+
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+static double time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// One file encoded and decoded with every backend
+struct bench {
+	uint8_t *key_main;
+	uint8_t nonce[24];
+	uint8_t key_data[32];
+	uint32_t block_size;
+	uint32_t rounds;
+	struct ssbf_encode_options options;
+	struct ssbf_decode_options decode_options;
+	struct ssbf_io_options io_options;
+	char encoded_path[BENCH_MAX_PATH];
+	char decoded_path[BENCH_MAX_PATH];
+};
+
+// Encodes the file and decodes it again with every backend, rounds
+// times, and checks the decoded file against data
+static int bench_file(struct bench *b, char *data_filename,
+		      uint8_t *data, size_t data_size)
+{
+	uint8_t meta_payload_data[4] = {1,2,3,4};
+	int r = 0;
+
+	printf("%-10s %10s %14s %14s   %s\n", "backend", "size",
+	       "encode MB/s", "decode MB/s", "check");
+
+	for (uint8_t backend = SSBF_IO_STDIO; SSBF_IO_URING >= backend;
+	     backend++)
+	{
+		double encode_time = 0;
+		double decode_time = 0;
+		size_t encoded_size = 0;
+		size_t decoded_size = 0;
+		enum ssbf_errors e = SSBF_NO_ERROR;
+
+		b->io_options.backend = backend;
+
+		for (uint32_t i = 0; b->rounds > i && SSBF_NO_ERROR == e; i++)
+		{
+			double start = time_now();
+			e = ssbf_io_encode_file(b->key_main, b->nonce,
+						b->key_data,
+						0x1234, meta_payload_data,
+						sizeof(meta_payload_data),
+						b->block_size,
+						data_filename, b->encoded_path,
+						&encoded_size,
+						&b->options, &b->io_options);
+			double t = time_now() - start;
+			encode_time = (0 == i || t < encode_time)
+				? t : encode_time;
+
+			if (SSBF_NO_ERROR != e)
+			{
+				break;
+			}
+
+			start = time_now();
+			e = ssbf_io_decode_file(b->key_main, b->encoded_path,
+						b->decoded_path, &decoded_size,
+						&b->decode_options,
+						&b->io_options);
+			t = time_now() - start;
+			decode_time = (0 == i || t < decode_time)
+				? t : decode_time;
+		}
+
+		// the decoded file, as it is on the disk
+		uint8_t *decoded = NULL;
+		size_t decoded_file_size = 0;
+		bool ok = SSBF_NO_ERROR == e
+			&& 0 == read_file_in_a_buffer(b->decoded_path,
+						      &decoded,
+						      &decoded_file_size)
+			&& data_size == decoded_file_size
+			&& data_size == decoded_size
+			&& 0 == memcmp(data, decoded, data_size);
+		free(decoded);
+
+		printf("%-10s %10zu %14.1f %14.1f   %s (%i)\n",
+		       ssbf_io_backend_name(backend), encoded_size,
+		       data_size / encode_time / (1024 * 1024),
+		       data_size / decode_time / (1024 * 1024),
+		       ok ? "ok" : "FAILED", e);
+
+		r |= !ok;
+	}
+
+	unlink(b->encoded_path);
+	unlink(b->decoded_path);
+
+	return r;
+}
+
+// Benchmarks the input file, then random data of the same size, which
+// does not compress and is stored as is (the largest output)
+int main(int argc, char **argv)
+{
+        char *data_filename = NULL;
+        char *key_filename = NULL;
+	char *work_dir = "/tmp";
+	struct bench b;
+        int c;
+
+	memset(&b, 0, sizeof(b));
+	b.block_size = 4096;
+	b.rounds = 3;
+
+        while ((c = getopt(argc, argv, "f:k:b:d:r:c:q:h")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'f':
+        		data_filename = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'b':
+        		b.block_size = atoi(optarg);
+        		break;
+        	case 'd':
+        		work_dir = optarg;
+        		break;
+        	case 'r':
+        		b.rounds = atoi(optarg);
+        		break;
+        	case 'c':
+        		b.io_options.chunk_size = atoi(optarg);
+        		break;
+        	case 'q':
+        		b.io_options.queue_depth = atoi(optarg);
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-f <filename> - file to encode and decode, random data of the same size is checked too\n");
+        		printf("-k <key_filename> - main key, without it the files are not encrypted\n");
+        		printf("-b <block_size> - block size, default 4096\n");
+        		printf("-d <directory> - where the encoded and decoded files are written, default /tmp\n");
+        		printf("-r <rounds> - encodes and decodes per backend, the fastest counts, default 3\n");
+        		printf("-c <chunk_size> - bytes per read or write, default 128 KiB\n");
+        		printf("-q <queue_depth> - reads and writes in flight, default 32 (8 threads)\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (NULL == data_filename)
+	{
+		printf("Missing input file\n");
+		return 1;
+	}
+
+	if (key_filename && NULL == (b.key_main = read_key(key_filename)))
+	{
+		return 1;
+	}
+
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	if (read_file_in_a_buffer(data_filename, &data, &data_size))
+	{
+		return 1;
+	}
+
+	memset(b.nonce, 0x22, sizeof(b.nonce));
+	memset(b.key_data, 0x33, sizeof(b.key_data));
+
+	b.options.no_encryption = (NULL == b.key_main);
+	b.options.codecs = SSBF_ENCODE_CODEC_LZ4;
+
+	snprintf(b.encoded_path, sizeof(b.encoded_path),
+		 "%s/ssbf_io_bench_%i.ssbf", work_dir, (int) getpid());
+	snprintf(b.decoded_path, sizeof(b.decoded_path),
+		 "%s/ssbf_io_bench_%i.out", work_dir, (int) getpid());
+
+	printf("%zu bytes, io_uring %s\n", data_size,
+	       ssbf_io_uring_supported() ? "supported"
+	       : "not supported (threads are used)");
+
+	int r = bench_file(&b, data_filename, data, data_size);
+
+	char random_path[BENCH_MAX_PATH];
+	snprintf(random_path, sizeof(random_path),
+		 "%s/ssbf_io_bench_%i.rnd", work_dir, (int) getpid());
+
+	uint32_t seed = 1;
+	for (size_t i = 0; data_size > i; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t) (seed >> 16);
+	}
+
+	FILE *fp = fopen(random_path, "wb");
+	if (NULL == fp || data_size != fwrite(data, 1, data_size, fp))
+	{
+		printf("E: can not write %s\n", random_path);
+		r = 1;
+	}
+	else
+	{
+		fclose(fp);
+		fp = NULL;
+
+		printf("\nrandom data\n");
+		r |= bench_file(&b, random_path, data, data_size);
+	}
+
+	if (fp)
+	{
+		fclose(fp);
+	}
+	unlink(random_path);
+
+	free(data);
+	free(b.key_main);
+
+	return r;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <time.h>
+
+#include "ssbf.h"
+
+#define KEY_SIZE 32
+#define PROFILE_STACK_SIZE (256 * 1024)
+#define PROFILE_STACK_PATTERN 0xa5
+
+struct decode_job {
+	uint8_t *key_main;
+	uint8_t *input;
+	size_t input_size;
+	uint8_t *output;
+	size_t output_max_size;
+	size_t output_size;
+	uint8_t *scratch;
+	size_t scratch_size;
+	uint32_t rounds;
+	double time;
+	enum ssbf_errors r;
+};
+
+static int read_file_in_a_buffer(char *file_name,
+				 uint8_t **buffer, size_t *buff_size)
+{
+	FILE * fp;
+        fp = fopen (file_name,"rb");
+        if (NULL == fp)
+        {
+                printf("File not found\n");
+                return 1;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        *buff_size = ftell(fp);
+
+        *buffer = malloc(*buff_size ? *buff_size : 1);
+	if (NULL == *buffer)
+	{
+		return 1;
+	}
+
+        rewind(fp);
+        fread(*buffer, 1, *buff_size, fp);
+	fclose(fp);
+	return 0;
+}
+
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+static double time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// same data as ssbf_bench: every 16th byte random, the rest repeats,
+// with a stretch of erased flash, like firmware
+static void generate_data(uint8_t *data, size_t size)
+{
+	uint32_t seed = 1;
+	for (size_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (i % 16) ? (uint8_t) (i / 64) : (uint8_t) (seed >> 16);
+	}
+	memset(&data[size / 2], 0xff, size / 8);
+}
+
+static void *decode_nothing(void *arg)
+{
+	return arg;
+}
+
+static void *decode(void *arg)
+{
+	struct decode_job *job = arg;
+	double start = time_now();
+
+#ifdef SSBF_PROFILE_BASELINE
+	// the same program without the library, for the code size
+	job->r = SSBF_GENERIC_ERROR;
+#else
+	struct ssbf_decode_options options;
+	memset(&options, 0, sizeof(options));
+	options.scratch = job->scratch;
+	options.scratch_size = job->scratch_size;
+
+	for (uint32_t i = 0; job->rounds > i; i++)
+	{
+		job->r = ssbf_decode_data(job->key_main,
+					  job->input, job->input_size,
+					  job->output, job->output_max_size,
+					  &job->output_size, &options);
+		if (SSBF_NO_ERROR != job->r)
+		{
+			break;
+		}
+	}
+#endif
+	job->time = time_now() - start;
+
+	return NULL;
+}
+
+// Runs f on a thread with a stack filled with a pattern, returns how
+// much of the stack was written
+static size_t stack_used(void *(*f)(void *), void *arg)
+{
+	uint8_t *stack = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (posix_memalign((void **) &stack, 4096, PROFILE_STACK_SIZE))
+	{
+		return 0;
+	}
+	memset(stack, PROFILE_STACK_PATTERN, PROFILE_STACK_SIZE);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, PROFILE_STACK_SIZE);
+
+	if (pthread_create(&thread, &attr, f, arg))
+	{
+		free(stack);
+		return 0;
+	}
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	size_t unused = 0;
+	while (PROFILE_STACK_SIZE > unused
+	       && PROFILE_STACK_PATTERN == stack[unused])
+	{
+		unused += 1;
+	}
+
+	free(stack);
+	return PROFILE_STACK_SIZE - unused;
+}
+
+// Decode benchmark of one build profile (make profiles): decodes a file
+// from RAM with a scratch buffer, like a bootloader from flash, and
+// prints the stack the decoder uses and its speed. The stack of a
+// thread which does nothing is not counted.
+int main(int argc, char **argv)
+{
+	char *data_filename = NULL;
+	char *key_filename = NULL;
+	char *generate_filename = NULL;
+	char *compare_filename = NULL;
+	size_t generate_size = 1024 * 1024;
+	uint32_t rounds = 20;
+        int c;
+
+        while ((c = getopt(argc, argv, "f:k:g:s:c:r:h")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'f':
+        		data_filename = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'g':
+        		generate_filename = optarg;
+        		break;
+        	case 's':
+        		generate_size = atoi(optarg);
+        		break;
+        	case 'c':
+        		compare_filename = optarg;
+        		break;
+        	case 'r':
+        		rounds = atoi(optarg);
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-g <filename> - write test data to encode\n");
+        		printf("-s <size> - size of the test data, default 1 MiB\n");
+        		printf("-f <filename> - ssbf file to decode\n");
+        		printf("-k <key_filename> - main key, without it only unencrypted files are decoded\n");
+        		printf("-c <filename> - the data the file must decode to\n");
+        		printf("-r <rounds> - decodes, default 20\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (generate_filename)
+	{
+		uint8_t *data = malloc(generate_size ? generate_size : 1);
+		FILE *fp = fopen(generate_filename, "wb");
+		if (NULL == data || NULL == fp)
+		{
+			printf("E: can not write %s\n", generate_filename);
+			return 1;
+		}
+
+		generate_data(data, generate_size);
+		fwrite(data, 1, generate_size, fp);
+		fclose(fp);
+		free(data);
+		return 0;
+	}
+
+	if (NULL == data_filename || 0 == rounds)
+	{
+		printf("Missing input file\n");
+		return 1;
+	}
+
+	struct decode_job job;
+	memset(&job, 0, sizeof(job));
+	job.rounds = rounds;
+
+	if (key_filename && NULL == (job.key_main = read_key(key_filename)))
+	{
+		return 1;
+	}
+
+	if (read_file_in_a_buffer(data_filename, &job.input, &job.input_size))
+	{
+		return 1;
+	}
+
+	uint8_t *expected = NULL;
+	size_t expected_size = 0;
+	if (compare_filename
+	    && read_file_in_a_buffer(compare_filename, &expected,
+				     &expected_size))
+	{
+		return 1;
+	}
+
+	// the largest block payload, blocks are at most 64 KiB
+	job.scratch_size = UINT16_MAX + 2;
+	job.scratch = malloc(job.scratch_size);
+	job.output_max_size = expected ? expected_size : 64 * job.input_size;
+	job.output = malloc(job.output_max_size ? job.output_max_size : 1);
+
+	size_t reference = stack_used(decode_nothing, NULL);
+	size_t used = stack_used(decode, &job);
+
+	bool ok = SSBF_NO_ERROR == job.r
+		&& (NULL == expected || (expected_size == job.output_size
+		    && 0 == memcmp(expected, job.output, expected_size)));
+
+	printf("%8zu %10.1f   %s (%i)\n",
+	       used > reference ? used - reference : 0,
+	       SSBF_NO_ERROR == job.r
+	       ? (double) job.output_size * rounds / job.time / (1024 * 1024)
+	       : 0.0,
+	       ok ? "ok" : "FAILED", job.r);
+
+	free(job.input);
+	free(job.output);
+	free(job.scratch);
+	free(job.key_main);
+	free(expected);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ssbf.h"
+
+#define KEY_SIZE 32
+#define NONCE_SIZE 24
+
+// main header, crypto header, data key, meta and data header, hash and
+// the padding of aligned blocks
+#define HEADER_MAX_SIZE (12 + 30 + 32 + 4 + UINT16_MAX + 12 + 16 + 32768)
+
+static int read_file_in_a_buffer(char *file_name,
+				 uint8_t **buffer, size_t *buff_size)
+{
+	FILE * fp;
+        fp = fopen (file_name,"rb");
+        if (NULL == fp)
+        {
+                printf("File not found\n");
+                return 1;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        *buff_size = ftell(fp);
+
+        *buffer = malloc(*buff_size);
+	if (NULL == *buffer)
+	{
+		return 1;
+	}
+
+        rewind(fp);
+        fread(*buffer, 1, *buff_size, fp);
+	fclose(fp);
+	return 0;
+}
+
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+// same as in ssbf_encode_file: date and time followed by random bytes
+static int new_nonce(uint8_t *nonce)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	struct tm* ptm = localtime(&tv.tv_sec);
+
+	nonce[0] = ptm->tm_year - 100;
+	nonce[1] = ptm->tm_mon + 1;
+	nonce[2] = ptm->tm_mday;
+	nonce[3] = ptm->tm_hour;
+	nonce[4] = ptm->tm_min;
+	nonce[5] = ptm->tm_sec;
+	nonce[6] = ((tv.tv_usec / 1000) >> 8) & 0xff;
+	nonce[7] = (tv.tv_usec / 1000) & 0xff;
+
+	FILE *fp = fopen("/dev/urandom", "rb");
+	if (NULL == fp)
+	{
+		return 1;
+	}
+
+	size_t n = fread(&nonce[8], 1, NONCE_SIZE-8, fp);
+	fclose(fp);
+
+	return (NONCE_SIZE-8 != n);
+}
+
+int main(int argc, char **argv)
+{
+        char *data_filename = NULL;
+	char *output_filename = NULL;
+        char *key_filename = NULL;
+        char *new_key_filename = NULL;
+        char *meta_filename = NULL;
+	long meta_data_id = -1;
+        int c;
+
+        while ((c = getopt(argc, argv, "f:k:K:i:m:o:h")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'f':
+        		data_filename = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'K':
+        		new_key_filename = optarg;
+        		break;
+        	case 'i':
+        		meta_data_id = strtol(optarg, NULL, 0);
+        		break;
+        	case 'm':
+        		meta_filename = optarg;
+        		break;
+        	case 'o':
+        		output_filename = optarg;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-f <filename> - ssbf file to rewrap\n");
+        		printf("-k <key_filename> - current main key\n");
+        		printf("-K <key_filename> - new main key\n");
+        		printf("-i <meta_data_id> - new meta data id\n");
+        		printf("-m <filename> - new meta data payload\n");
+        		printf("-o <filename> - output file name, without it the file is changed in place\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (NULL == data_filename)
+	{
+		printf("Missing ssbf file name\n");
+		return 1;
+	}
+
+	uint8_t *key_main = NULL;
+	struct ssbf_rewrap_options options;
+	memset(&options, 0, sizeof(options));
+
+	if (key_filename && NULL == (key_main = read_key(key_filename)))
+	{
+		return 1;
+	}
+
+	if (new_key_filename
+	    && NULL == (options.key_main = read_key(new_key_filename)))
+	{
+		return 1;
+	}
+
+	if (meta_filename || 0 <= meta_data_id)
+	{
+		size_t meta_size = 0;
+		options.replace_meta = true;
+
+		if (meta_filename)
+		{
+			if (read_file_in_a_buffer(meta_filename,
+						  &options.meta_payload_data,
+						  &meta_size))
+			{
+				return 1;
+			}
+
+			if (UINT16_MAX < meta_size)
+			{
+				printf("E: meta data too big\n");
+				return 1;
+			}
+		}
+
+		options.meta_data_id = (uint16_t) meta_data_id;
+		options.meta_data_payload_size = (uint16_t) meta_size;
+	}
+
+	// only the header pages of the mapping are read, unless the
+	// blocks are copied to a new file
+	int fd = open(data_filename, output_filename ? O_RDONLY : O_RDWR);
+	struct stat st;
+	if (0 > fd || fstat(fd, &st))
+	{
+		printf("File not found %s\n", data_filename);
+		return 1;
+	}
+
+	size_t file_size = st.st_size;
+	uint8_t *file_data = mmap(NULL, file_size,
+				  PROT_READ | (output_filename ? 0 : PROT_WRITE),
+				  MAP_SHARED, fd, 0);
+	if (MAP_FAILED == file_data)
+	{
+		printf("mmap failed\n");
+		return 1;
+	}
+
+	uint8_t nonce[NONCE_SIZE];
+	uint8_t *header = malloc(HEADER_MAX_SIZE);
+	size_t header_size = 0;
+	size_t blocks_offset = 0;
+
+	if (NULL == header || new_nonce(nonce))
+	{
+		return 1;
+	}
+
+	enum ssbf_errors r = ssbf_rewrap_header(key_main, nonce,
+						file_data, file_size,
+						header, HEADER_MAX_SIZE,
+						&header_size, &blocks_offset,
+						&options);
+	if (SSBF_NO_ERROR != r)
+	{
+		printf("ssbf rewrap failed %i\n", r);
+		return 1;
+	}
+
+	int result = 0;
+
+	if (output_filename)
+	{
+		FILE *fpo = fopen(output_filename, "wb");
+		if (NULL == fpo
+		    || header_size != fwrite(header, 1, header_size, fpo)
+		    || file_size - blocks_offset
+		    != fwrite(file_data + blocks_offset, 1,
+			      file_size - blocks_offset, fpo))
+		{
+			printf("Error writing %s\n", output_filename);
+			result = 1;
+		}
+
+		if (fpo)
+		{
+			fclose(fpo);
+		}
+	}
+	else if (header_size == blocks_offset)
+	{
+		memcpy(file_data, header, header_size);
+		msync(file_data, header_size, MS_SYNC);
+	}
+	else
+	{
+		printf("Header size changes (%zu -> %zu), use -o\n",
+		       blocks_offset, header_size);
+		result = 1;
+	}
+
+	if (0 == result)
+	{
+		printf("%s: header %zu -> %zu bytes, blocks not changed\n",
+		       output_filename ? output_filename : data_filename,
+		       blocks_offset, header_size);
+	}
+
+	munmap(file_data, file_size);
+	close(fd);
+
+	return result;
+}
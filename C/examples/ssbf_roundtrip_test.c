@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssbf.h"
+
+// Round trips of the format features through the library: encode,
+// verify, decode and compare with the input. make test runs it, the
+// exit code is the number of failed checks.
+
+#define KEY_SIZE 32
+#define NONCE_SIZE 24
+
+#define TEST_DATA_SIZE (2 * 1024 * 1024)
+#define TEST_BLOCK_SIZE 4096
+
+static int fails;
+
+#define CHECK(c, name)							\
+	do								\
+	{								\
+		if (!(c))						\
+		{							\
+			printf("FAIL %s:%i %s\n", __func__, __LINE__, name); \
+			fails++;					\
+		}							\
+	} while (0)
+
+static uint8_t key_main[KEY_SIZE];
+static uint8_t key_new[KEY_SIZE];
+static uint8_t key_data[KEY_SIZE];
+static uint8_t nonce[NONCE_SIZE];
+
+static uint8_t *data;        // TEST_DATA_SIZE bytes of test input
+static uint8_t *file;        // encoded file
+static uint8_t *copy;        // file before a change which must fail
+static uint8_t *output;      // decoded data
+static size_t file_max_size;
+
+// Same data on every run: 64 KiB of erased flash (fill blocks), then
+// compressible up to the half, random in the second half. Every 64 KiB
+// of random data is repeated once, for dedup.
+static void make_data(void)
+{
+	uint32_t x = 0x12345678;
+
+	memset(data, 0xff, 0x10000);
+	for (size_t i = 0x10000; i < TEST_DATA_SIZE / 2; i++)
+	{
+		data[i] = (uint8_t) ("ssbf round trip "[i % 16] + i / 4096);
+	}
+
+	for (size_t i = TEST_DATA_SIZE / 2; i < TEST_DATA_SIZE; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (uint8_t) x;
+	}
+
+	for (size_t i = TEST_DATA_SIZE / 2; i + 0x20000 <= TEST_DATA_SIZE;
+	     i += 0x20000)
+	{
+		memcpy(data + i + 0x10000, data + i, 0x10000);
+	}
+}
+
+// every nonce sealing a header is new
+static uint8_t *next_nonce(void)
+{
+	nonce[0] += 1;
+	return nonce;
+}
+
+static size_t encode(size_t data_size, size_t block_size,
+		     const struct ssbf_encode_options *options)
+{
+	size_t file_size = 0;
+
+	ssbf_encode_data(key_main, next_nonce(), key_data,
+			 1, (uint8_t *) "test", 4,
+			 block_size, data, data_size,
+			 file, file_max_size, &file_size, options);
+	return file_size;
+}
+
+// verifies the file and decodes it to output, without changing it
+static enum ssbf_errors decode(uint8_t *key, size_t file_size,
+			       size_t data_size)
+{
+	struct ssbf_file f;
+
+	enum ssbf_errors e = ssbf_open(&f, key, file, file_size, NULL);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	e = ssbf_file_verify(&f);
+	ssbf_close(&f);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	// decrypted in place, the file stays in file
+	memcpy(copy, file, file_size);
+
+	size_t output_size = 0;
+	e = ssbf_decode_data(key, copy, file_size,
+			     output, TEST_DATA_SIZE, &output_size, NULL);
+	if (SSBF_NO_ERROR == e
+	    && (output_size != data_size || memcmp(output, data, data_size)))
+	{
+		e = SSBF_CHECKSUM_FAILED;
+	}
+	return e;
+}
+
+static void test_options(void)
+{
+	static const struct
+	{
+		const char *name;
+		struct ssbf_encode_options options;
+	} cases[] = {
+		{ "defaults", { 0 } },
+		{ "block tags", { .block_tags = true } },
+		{ "crc16", { .block_checksum = SSBF_CHECKSUM_CRC16,
+			     .data_checksum = SSBF_CHECKSUM_CRC16 } },
+		{ "crc32", { .data_checksum = SSBF_CHECKSUM_CRC32 } },
+		{ "codecs", { .codecs = SSBF_ENCODE_CODEC_RLE
+			      | SSBF_ENCODE_CODEC_LZ4
+			      | SSBF_ENCODE_CODEC_LZ4HC } },
+		{ "cdc", { .cdc_min_block_size = 1024 } },
+		{ "aligned", { .block_alignment = 512 } },
+		{ "fill blocks", { .fill_blocks = true } },
+		{ "no encryption", { .no_encryption = true } },
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		size_t file_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE,
+					  &cases[i].options);
+		CHECK(file_size, cases[i].name);
+		CHECK(SSBF_NO_ERROR == decode(cases[i].options.no_encryption
+					      ? NULL : key_main,
+					      file_size, TEST_DATA_SIZE),
+		      cases[i].name);
+	}
+}
+
+// a changed block is rejected by its tag or the checksums
+static void test_modified_block(void)
+{
+	struct ssbf_encode_options options = { .block_tags = true };
+
+	size_t file_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE, &options);
+	CHECK(file_size, "encode");
+
+	file[file_size - 20] ^= 1;
+	CHECK(SSBF_NO_ERROR != decode(key_main, file_size, TEST_DATA_SIZE),
+	      "modified block decoded");
+}
+
+// repeated blocks are stored as references and read back
+static void test_dedup(void)
+{
+	struct ssbf_encode_options options = { .block_tags = true };
+
+	size_t plain_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE, &options);
+
+	options.dedup = true;
+	size_t file_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE, &options);
+	CHECK(file_size && file_size < plain_size, "no references");
+	CHECK(SSBF_NO_ERROR == decode(key_main, file_size, TEST_DATA_SIZE),
+	      "decode");
+
+	// the last block is a repeat of the block 64 KiB before it
+	struct ssbf_file f;
+	size_t output_size = 0;
+	uint16_t last_block = TEST_DATA_SIZE / TEST_BLOCK_SIZE - 1;
+
+	memcpy(copy, file, file_size);
+	CHECK(SSBF_NO_ERROR == ssbf_open(&f, key_main, copy, file_size, NULL),
+	      "open");
+	CHECK(SSBF_NO_ERROR == ssbf_file_read_block(&f, last_block,
+						    output, TEST_BLOCK_SIZE,
+						    &output_size)
+	      && TEST_BLOCK_SIZE == output_size
+	      && 0 == memcmp(output, data + TEST_DATA_SIZE - TEST_BLOCK_SIZE,
+			     TEST_BLOCK_SIZE),
+	      "read reference block");
+	ssbf_close(&f);
+}
+
+static void test_append(void)
+{
+	struct ssbf_encode_options options = {
+		.block_tags = true,
+		.cdc_min_block_size = 1024,
+	};
+	size_t size = TEST_DATA_SIZE / 2;
+
+	size_t file_size = encode(size, TEST_BLOCK_SIZE, &options);
+	CHECK(file_size, "encode");
+
+	for (size_t part = 3; part <= 4; part++)
+	{
+		size_t added = part * TEST_DATA_SIZE / 4 - size;
+		size_t new_size = 0;
+
+		CHECK(SSBF_NO_ERROR == ssbf_append_data(
+			      key_main, next_nonce(), file, file_size,
+			      file_max_size, data + size, added,
+			      &new_size, &options),
+		      "append");
+		file_size = new_size;
+		size += added;
+		CHECK(SSBF_NO_ERROR == decode(key_main, file_size, size),
+		      "decode");
+	}
+}
+
+// append which would need more than 65536 block numbers (the nonce of
+// the block) fails and leaves the file as it is
+static void test_append_block_limit(void)
+{
+	struct ssbf_encode_options options = { .block_tags = true };
+	size_t block_size = 16;
+	size_t size = 65500 * block_size;
+	size_t file_size = encode(size, block_size, &options);
+	CHECK(file_size, "encode");
+
+	size_t new_size = 0;
+	memcpy(copy, file, file_size);
+	CHECK(SSBF_NOT_ENOUGHT_DATA == ssbf_append_data(
+		      key_main, next_nonce(), file, file_size,
+		      file_max_size, data + size, 100 * block_size,
+		      &new_size, &options),
+	      "append over the limit");
+	CHECK(0 == memcmp(copy, file, file_size), "file changed");
+	CHECK(SSBF_NO_ERROR == decode(key_main, file_size, size),
+	      "decode after the failed append");
+
+	// the rest fits
+	CHECK(SSBF_NO_ERROR == ssbf_append_data(
+		      key_main, next_nonce(), file, file_size,
+		      file_max_size, data + size, 36 * block_size,
+		      &new_size, &options),
+	      "append up to the limit");
+	CHECK(SSBF_NO_ERROR == decode(key_main, new_size,
+				      size + 36 * block_size),
+	      "decode at the limit");
+
+	// with variable size blocks the count is only known while encoding
+	options.cdc_min_block_size = 12;
+	size = 60000 * 12;
+	file_size = encode(size, block_size, &options);
+	CHECK(file_size, "encode cdc");
+
+	enum ssbf_errors e = SSBF_NO_ERROR;
+	while (SSBF_NO_ERROR == e)
+	{
+		memcpy(copy, file, file_size);
+		e = ssbf_append_data(key_main, next_nonce(), file, file_size,
+				     file_max_size, data + size, 32000,
+				     &new_size, &options);
+		if (SSBF_NO_ERROR == e)
+		{
+			file_size = new_size;
+			size += 32000;
+		}
+	}
+	CHECK(SSBF_NOT_ENOUGHT_DATA == e, "append cdc over the limit");
+	CHECK(0 == memcmp(copy, file, file_size), "cdc file changed");
+	CHECK(SSBF_NO_ERROR == decode(key_main, file_size, size),
+	      "decode cdc after the failed append");
+
+	// and a file can't be encoded with too many blocks
+	options.cdc_min_block_size = 0;
+	CHECK(0 == encode(65537 * block_size, block_size, &options),
+	      "encode over the limit");
+}
+
+static void test_rewrap(void)
+{
+	struct ssbf_encode_options options = { .block_tags = true };
+	struct ssbf_rewrap_options rewrap = { .key_main = key_new };
+	uint8_t header[1024];
+	size_t header_size = 0;
+	size_t blocks_offset = 0;
+
+	size_t file_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE, &options);
+	CHECK(file_size, "encode");
+
+	CHECK(SSBF_NO_ERROR == ssbf_rewrap_header(
+		      key_main, next_nonce(), file, file_size,
+		      header, sizeof(header), &header_size, &blocks_offset,
+		      &rewrap),
+	      "rewrap");
+	CHECK(header_size == blocks_offset, "header size changed");
+	memcpy(file, header, header_size);
+
+	CHECK(SSBF_NO_ERROR == decode(key_new, file_size, TEST_DATA_SIZE),
+	      "decode with the new key");
+	CHECK(SSBF_NO_ERROR != decode(key_main, file_size, TEST_DATA_SIZE),
+	      "decode with the old key");
+}
+
+// the image at the end of the buffer is decoded to its start
+static void test_inplace(void)
+{
+	struct ssbf_encode_options options = { .block_tags = true };
+	size_t buffer_size = 0;
+	size_t output_size = 0;
+
+	size_t file_size = encode(TEST_DATA_SIZE, TEST_BLOCK_SIZE, &options);
+	CHECK(file_size, "encode");
+
+	CHECK(SSBF_NO_ERROR == ssbf_inplace_buffer_size(key_main, file,
+							file_size, NULL,
+							&buffer_size),
+	      "buffer size");
+	CHECK(buffer_size >= TEST_DATA_SIZE && buffer_size <= file_max_size,
+	      "margin");
+	CHECK(buffer_size < TEST_DATA_SIZE + file_size, "no margin recorded");
+
+	memcpy(copy + buffer_size - file_size, file, file_size);
+	CHECK(SSBF_NO_ERROR == ssbf_decode_inplace(key_main, copy,
+						   buffer_size, file_size,
+						   &output_size, NULL)
+	      && TEST_DATA_SIZE == output_size
+	      && 0 == memcmp(copy, data, TEST_DATA_SIZE),
+	      "decode in place");
+}
+
+int main(void)
+{
+	file_max_size = 2 * TEST_DATA_SIZE + 65536;
+	data = malloc(TEST_DATA_SIZE);
+	file = malloc(file_max_size);
+	copy = malloc(file_max_size);
+	output = malloc(TEST_DATA_SIZE);
+	if (NULL == data || NULL == file || NULL == copy || NULL == output)
+	{
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	memset(key_main, 0x11, sizeof(key_main));
+	memset(key_new, 0x22, sizeof(key_new));
+	memset(key_data, 0x33, sizeof(key_data));
+	memset(nonce, 0x44, sizeof(nonce));
+	make_data();
+
+	test_options();
+	test_modified_block();
+	test_dedup();
+	test_append();
+	test_append_block_limit();
+	test_rewrap();
+	test_inplace();
+
+	printf("%s, %i failed checks\n", fails ? "FAILED" : "ok", fails);
+
+	free(data);
+	free(file);
+	free(copy);
+	free(output);
+	return fails;
+}
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ssbf.h"
+
+#define KEY_SIZE 32
+#define NONCE_SIZE 24
+
+// output blocks are at most this much bigger than the data, for small
+// blocks which don't compress (block header, size, tag)
+#define BLOCK_OVERHEAD (8 + 2 + 8)
+
+static int read_file_in_a_buffer(char *file_name,
+				 uint8_t **buffer, size_t *buff_size)
+{
+	FILE * fp;
+        fp = fopen (file_name,"rb");
+        if (NULL == fp)
+        {
+                printf("File not found\n");
+                return 1;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        *buff_size = ftell(fp);
+
+        *buffer = malloc(*buff_size);
+	if (NULL == *buffer)
+	{
+		return 1;
+	}
+
+        rewind(fp);
+        fread(*buffer, 1, *buff_size, fp);
+	fclose(fp);
+	return 0;
+}
+
+// reads a 32 byte key, a newline at the end is ignored
+static uint8_t *read_key(char *file_name)
+{
+	uint8_t *key = NULL;
+	size_t key_size = 0;
+
+	if (read_file_in_a_buffer(file_name, &key, &key_size))
+	{
+		printf("Error reading key from file %s\n", file_name);
+		return NULL;
+	}
+
+	if (KEY_SIZE + 1 == key_size && 10 == key[KEY_SIZE])
+	{
+		key_size -= 1;
+	}
+
+	if (KEY_SIZE != key_size)
+	{
+		printf("E: wrong key size %i in %s\n", (int) key_size, file_name);
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+// same as in ssbf_encode_file: date and time followed by random bytes
+static int new_nonce(uint8_t *nonce)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	struct tm* ptm = localtime(&tv.tv_sec);
+
+	nonce[0] = ptm->tm_year - 100;
+	nonce[1] = ptm->tm_mon + 1;
+	nonce[2] = ptm->tm_mday;
+	nonce[3] = ptm->tm_hour;
+	nonce[4] = ptm->tm_min;
+	nonce[5] = ptm->tm_sec;
+	nonce[6] = ((tv.tv_usec / 1000) >> 8) & 0xff;
+	nonce[7] = (tv.tv_usec / 1000) & 0xff;
+
+	FILE *fp = fopen("/dev/urandom", "rb");
+	if (NULL == fp)
+	{
+		return 1;
+	}
+
+	size_t n = fread(&nonce[8], 1, NONCE_SIZE-8, fp);
+	fclose(fp);
+
+	return (NONCE_SIZE-8 != n);
+}
+
+// 0 for bsd, 1 for crc (CRC16 blocks, CRC32 data), -1 if unknown
+static int checksum_type(const char *name)
+{
+	if (0 == strcmp(name, "bsd"))
+	{
+		return 0;
+	}
+
+	if (0 == strcmp(name, "crc"))
+	{
+		return 1;
+	}
+
+	return -1;
+}
+
+// comma separated codec names to enum SSBF_ENCODE_CODECS, -1 if unknown
+static int codec_mask(char *list)
+{
+	int codecs = 0;
+
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+	{
+		if (0 == strcmp(name, "rle"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_RLE;
+		}
+		else if (0 == strcmp(name, "lz4"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_LZ4;
+		}
+		else if (0 == strcmp(name, "lz4hc"))
+		{
+			codecs |= SSBF_ENCODE_CODEC_LZ4HC;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	return codecs;
+}
+
+int main(int argc, char **argv)
+{
+        char *data_filename = NULL;
+	char *output_filename = NULL;
+        char *key_filename = NULL;
+        char *base_filename = NULL;
+	uint32_t block_size = 1024;
+	uint32_t block_alignment = 0;
+	uint32_t cdc_min_block_size = 0;
+	uint32_t compression_level = 0;
+	int checksums = 0;
+	int codecs = 0;
+	bool no_encryption = false;
+	bool block_tags = false;
+	bool fill_blocks = false;
+        int c;
+
+        while ((c = getopt(argc, argv, "f:k:o:b:c:l:s:x:a:d:ntzh")) != -1)
+        {
+        	switch (c)
+        	{
+        	case 'f':
+        		data_filename = optarg;
+        		break;
+        	case 'k':
+        		key_filename = optarg;
+        		break;
+        	case 'o':
+        		output_filename = optarg;
+        		break;
+        	case 'b':
+        		block_size = atoi(optarg);
+        		break;
+        	case 'c':
+        		cdc_min_block_size = atoi(optarg);
+        		break;
+        	case 'l':
+        		compression_level = atoi(optarg);
+        		break;
+        	case 's':
+        		checksums = checksum_type(optarg);
+        		break;
+        	case 'x':
+        		codecs = codec_mask(optarg);
+        		break;
+        	case 'a':
+        		block_alignment = atoi(optarg);
+        		break;
+        	case 'd':
+        		base_filename = optarg;
+        		break;
+        	case 'n':
+        		no_encryption = true;
+        		break;
+        	case 't':
+        		block_tags = true;
+        		break;
+        	case 'z':
+        		fill_blocks = true;
+        		break;
+
+        	case 'h':
+        		printf("Usage flags:\n");
+        		printf("-f <filename> - ssbf file to transcode\n");
+        		printf("-k <key_filename> - main key, used for the input and the output\n");
+        		printf("-o <filename> - output file name\n");
+        		printf("-b <block_size> - new block size\n");
+        		printf("-c <min_block_size> - content defined block boundaries, block_size is the maximum\n");
+        		printf("-l <level> - LZ4 HC compression level 1 - 12\n");
+        		printf("-s <bsd|crc> - checksums, crc is CRC16 for blocks and CRC32 for the data\n");
+        		printf("-x <codecs> - codecs to try on every block, comma separated: rle, lz4, lz4hc (default)\n");
+        		printf("-a <alignment> - start every block at a multiple of alignment bytes\n");
+        		printf("-d <base_filename> - base image of a delta encoded input\n");
+        		printf("-n - no encryption, only compression and integrity\n");
+        		printf("-t - authenticate every block with its own tag\n");
+        		printf("-z - store blocks of one repeated byte (erased flash) as fill blocks\n");
+        		return 1;
+
+        	case '?':
+    			return 1;
+        	default:
+        		abort();
+        	}
+        }
+
+	if (NULL == data_filename || NULL == output_filename 
+	    || 0 > checksums || 0 > codecs)
+	{
+		printf("Missing input or output file name, or unknown checksum or codec\n");
+		return 1;
+	}
+
+	uint8_t *key_main = NULL;
+
+	if (key_filename && NULL == (key_main = read_key(key_filename)))
+	{
+		return 1;
+	}
+
+	struct ssbf_decode_options decode_options;
+	memset(&decode_options, 0, sizeof(decode_options));
+	decode_options.allow_unencrypted = no_encryption;
+
+	if (base_filename
+	    && read_file_in_a_buffer(base_filename,
+				     &decode_options.base_data_start,
+				     &decode_options.base_data_size))
+	{
+		return 1;
+	}
+
+	struct ssbf_encode_options options;
+	memset(&options, 0, sizeof(options));
+	options.cdc_min_block_size = cdc_min_block_size;
+	options.no_encryption = no_encryption;
+	options.block_alignment = block_alignment;
+	options.block_tags = block_tags;
+	options.fill_blocks = fill_blocks;
+	options.compression_level = compression_level;
+	options.codecs = (uint8_t) codecs;
+	if (checksums)
+	{
+		options.block_checksum = SSBF_CHECKSUM_CRC16;
+		options.data_checksum = SSBF_CHECKSUM_CRC32;
+	}
+
+	// only the blocks in use are read from the mapping
+	int fd = open(data_filename, O_RDONLY);
+	struct stat st;
+	if (0 > fd || fstat(fd, &st))
+	{
+		printf("File not found %s\n", data_filename);
+		return 1;
+	}
+
+	size_t file_size = st.st_size;
+	uint8_t *file_data = mmap(NULL, file_size, PROT_READ, MAP_SHARED, 
+				  fd, 0);
+	if (MAP_FAILED == file_data)
+	{
+		printf("mmap failed\n");
+		return 1;
+	}
+
+	// the size of the data is in the (authenticated) header
+	struct ssbf_file file;
+	enum ssbf_errors r = ssbf_open(&file, key_main, file_data, file_size,
+				       &decode_options);
+	if (SSBF_NO_ERROR != r)
+	{
+		printf("ssbf open failed %i\n", r);
+		return 1;
+	}
+
+	size_t data_size = file.hi.data_h.full_data_size_uncompressed;
+	// headers, meta data and the padding in front of aligned blocks
+	size_t header_max_size = 128 + file.hi.meta_h.payload_size + 32768;
+	ssbf_close(&file);
+
+	size_t min_block_size = cdc_min_block_size 
+		? cdc_min_block_size : block_size;
+	if (0 == min_block_size || min_block_size > block_size)
+	{
+		min_block_size = block_size ? block_size : 1;
+	}
+
+	size_t output_max_size = header_max_size + data_size
+		+ (data_size / min_block_size + 2) 
+		* (BLOCK_OVERHEAD + block_alignment);
+
+	uint8_t nonce[NONCE_SIZE];
+	uint8_t key_data[KEY_SIZE];
+	uint8_t *output = malloc(output_max_size);
+	size_t output_size = 0;
+
+	FILE *fp = fopen("/dev/urandom", "rb");
+	if (NULL == output || new_nonce(nonce) || NULL == fp
+	    || KEY_SIZE != fread(key_data, 1, KEY_SIZE, fp))
+	{
+		return 1;
+	}
+	fclose(fp);
+
+	r = ssbf_transcode_data(key_main, nonce, key_data,
+				block_size,
+				file_data, file_size,
+				output, output_max_size,
+				&output_size,
+				&options, &decode_options);
+	munmap(file_data, file_size);
+	close(fd);
+
+	if (SSBF_NO_ERROR != r)
+	{
+		printf("ssbf transcode failed %i\n", r);
+		return 1;
+	}
+
+	FILE *fpo = fopen(output_filename, "wb");
+	if (NULL == fpo 
+	    || output_size != fwrite(output, 1, output_size, fpo))
+	{
+		printf("Error writing %s\n", output_filename);
+		return 1;
+	}
+	fclose(fpo);
+
+	printf("%s: %zu -> %zu bytes\n", output_filename, file_size, output_size);
+
+	return 0;
+}
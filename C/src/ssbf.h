@@ -2,6 +2,10 @@
 #define SSBF_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ssbf_config.h"
 
 #define SSBFv1_MAGIC_NUMBER 0x19345601
 #define SSBFv1_VERSION 1
@@ -13,18 +17,273 @@ enum ssbf_errors {
         SSBF_CHECKSUM_FAILED = 2,
         SSBF_COMPRESSION_FAILED = 3,
         SSBF_DECRYPTION_FAILED = 4,
+        SSBF_BASE_DATA_MISMATCH = 5,
+        SSBF_DECODE_IN_PROGRESS = 6,
+        SSBF_IO_ERROR = 7,           // a file could not be read or written
 };
 
 enum SSBF_MAIN_HEADER_FLAGS {
         SSBF_MAIN_HEADE_FLAG_USE_META_EXTENSION = 1,
         SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION = 2,
+        // every block payload starts with the uncompressed block size
+        SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE = 4,
+        // bits 4-7: log2 of the block alignment, 0 = blocks are packed
+        SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT = 4,
+        SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK = 0xf0,
 };
 
 enum SSBF_CRYPTO_FLAGS {
         SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305 = (1 << 0),
         SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20 = (1 << 3),
+        // every block ends with a truncated Poly1305 tag
+        SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS = (1 << 6),
+};
+
+enum SSBF_DATA_HEADER_FLAGS {
+        // blocks may reference a base image (delta / patch file)
+        SSBF_DATA_HEADER_FLAG_DELTA = (1 << 0),
+        // compressed blocks can use other codecs than LZ4, their codec
+        // is in the block flags
+        SSBF_DATA_HEADER_FLAG_BLOCK_CODECS = (1 << 1),
+        // bits 2-3: type of full_data_checksum (enum ssbf_checksum_types)
+        SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_SHIFT = 2,
+        SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_MASK = 0x0c,
+        // bits 4-5: type of the block payload checksums, BSD16 or CRC16
+        SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT = 4,
+        SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK = 0x30,
+};
+
+enum ssbf_checksum_types {
+        SSBF_CHECKSUM_BSD16 = 0,
+        SSBF_CHECKSUM_CRC16 = 1, // CRC-16/XMODEM
+        SSBF_CHECKSUM_CRC32 = 2, // CRC-32 as in zlib and Ethernet
+};
+
+// Codecs the encoder tries on every block (ssbf_encode_options.codecs),
+// the smallest output is stored. LZ4 and LZ4 HC make the same format,
+// LZ4 only compresses faster. RLE stores runs of equal bytes (erased
+// flash, zero fill) and decodes with memset and memcpy.
+enum SSBF_ENCODE_CODECS {
+        SSBF_ENCODE_CODEC_RLE = (1 << 0),
+        SSBF_ENCODE_CODEC_LZ4 = (1 << 1),
+        SSBF_ENCODE_CODEC_LZ4HC = (1 << 2),
+};
+
+enum SSBF_CHECKPOINT_FLAGS {
+        SSBF_CHECKPOINT_FLAG_STARTED = (1 << 0),
+        SSBF_CHECKPOINT_FLAG_DONE = (1 << 1),
+};
+
+// data header inplace_margin n means (n - 1) * unit < margin <= n * unit
+#define SSBF_INPLACE_MARGIN_UNIT 64
+
+// File headers, stored as is (little-endian)
+struct ssbf_main_header {
+	uint32_t ssbf_magic_number;
+	uint32_t blocks_sum_size;
+        uint16_t hashed_data_size;
+        uint8_t flags;
+        uint8_t header_checksum;
+};
+
+struct ssbf_encryption_header {
+        uint8_t nonce[24];
+        uint16_t encryption_payload_size;
+	uint16_t encrypted_header_size;
+        uint8_t flags;
+        uint8_t header_checksum;
+};
+
+struct ssbf_meta_header {
+     uint16_t meta_data_id;
+     uint16_t payload_size;
+};
+
+struct ssbf_data_header {
+        uint32_t full_data_size_uncompressed;
+        uint16_t max_uncompressed_block_size;
+        uint8_t flags;
+        uint8_t inplace_margin; // in SSBF_INPLACE_MARGIN_UNIT, 0 = unknown
+        uint32_t full_data_checksum;
+};
+
+struct ssbf_payload_block_header {
+        uint16_t block_number;
+        uint16_t compressed_size; //TODO: rename to data_size
+        uint16_t data_checksum;
+        uint8_t flags;
+        uint8_t header_checksum;
+};
+
+// Header fields the decoder needs, filled by ssbf_decode_plain_headers
+// and ssbf_unlock_header
+struct ssbf_header_info {
+        struct ssbf_main_header mh;
+        struct ssbf_encryption_header ch;
+        struct ssbf_meta_header meta_h;
+        struct ssbf_data_header data_h;
+        uint8_t key_data[32];
+        uint8_t header_mac[16];
+        uint8_t *meta_payload_data; // points into the decrypted header
+        size_t blocks_offset;       // offset of the first block
+};
+
+// Progress of a resumable decode (ssbf_decode_data_resume). It holds
+// no secrets and can be stored as is (e.g. to flash) after every call,
+// so the decode can continue from there after a reset.
+struct ssbf_decode_checkpoint {
+        uint32_t file_id;            // first 4 bytes of the header MAC
+        uint32_t input_offset;       // next block, from the first block
+        uint32_t output_offset;      // decoded bytes written so far
+        uint32_t full_data_checksum; // running checksum of decoded data
+        uint16_t next_block_number;  // last verified block + 1
+        uint8_t flags;
+        uint8_t checkpoint_checksum; // bsd8 of the fields above
+};
+
+// Checksum of data which is processed in parts (full_data_checksum),
+// continued with ssbf_checksum_update.
+struct ssbf_checksum_state {
+        uint64_t size;     // bytes covered by checksum
+        uint32_t checksum;
+        uint8_t type;      // enum ssbf_checksum_types
+};
+
+// Optional encoder features, pass NULL to ssbf_encode_data for defaults
+struct ssbf_encode_options {
+        // delta mode: previous image which is already on the device,
+        // blocks found in it are stored as a reference to the base
+        uint8_t *base_data_start;
+        size_t base_data_size;
+
+        // store repeated blocks as a reference to their first copy
+        bool dedup;
+
+        // content defined chunking: block boundaries are picked by a
+        // rolling hash of the data, between this minimum and
+        // max_block_size, instead of every max_block_size bytes.
+        // Inserted data then only changes the blocks around it, which
+        // keeps dedup and delta working. 0 = fixed size blocks.
+        uint16_t cdc_min_block_size;
+
+        // leave out the crypto extension, for data which only needs
+        // compression and integrity. The blocks are not encrypted and
+        // the header is protected with an unkeyed BLAKE2b hash, so
+        // key_main, key_main_nonce and key_data are not used.
+        bool no_encryption;
+
+        // every block header starts at a multiple of block_alignment
+        // bytes from the start of the file (e.g. cache line or flash
+        // page size), the gaps are filled with zeros. Rounded up to a
+        // power of 2, at most 32768. 0 or 1 = blocks are packed.
+        uint16_t block_alignment;
+
+        // end every block with an 8 byte Poly1305 tag keyed from
+        // key_data, so a streaming decoder can reject a modified
+        // block before decompressing and writing it, instead of
+        // learning about it from the checksum of the whole data.
+        // Needs the crypto extension, ignored with no_encryption.
+        bool block_tags;
+
+        // LZ4 HC compression level 1 - 12, 0 = 12 (smallest blocks)
+        uint8_t compression_level;
+
+        // enum SSBF_ENCODE_CODECS to try, 0 = LZ4 HC only. With RLE
+        // the file needs a decoder which knows the block codecs.
+        uint8_t codecs;
+
+        // enum ssbf_checksum_types of the block payloads (BSD16 or
+        // CRC16) and of the whole data, 0 = BSD16
+        uint8_t block_checksum;
+        uint8_t data_checksum;
+
+        // store blocks of one repeated byte (erased flash, zero fill)
+        // as a fill block, which holds only that byte. The decoder
+        // writes them with memset, or not at all if the output is
+        // already erased to that value (ssbf_decode_options).
+        bool fill_blocks;
 };
 
+// Optional decoder features, pass NULL to ssbf_decode_data for defaults
+struct ssbf_decode_options {
+        // base image, needed to decode files encoded in delta mode
+        uint8_t *base_data_start;
+        size_t base_data_size;
+
+        // buffer for decrypting blocks, at least the largest block
+        // payload (max_uncompressed_block_size + 2 bytes). Without it
+        // encrypted blocks are decrypted in the input buffer.
+        uint8_t *scratch;
+        size_t scratch_size;
+
+        // accept files without the crypto extension even when key_main
+        // is given. Such files have no authenticity, so by default
+        // they are only decoded if key_main is NULL.
+        bool allow_unencrypted;
+
+        // the output already holds erased_value in every byte (e.g.
+        // erased flash), fill blocks of that value are not written.
+        // Only used when a whole file is decoded, not for single
+        // blocks or in place.
+        bool output_erased;
+        uint8_t erased_value;
+};
+
+#ifndef SSBF_META_PAYLOAD_MAX_SIZE
+#define SSBF_META_PAYLOAD_MAX_SIZE 128
+#endif
+
+// Opened ssbf file (ssbf_open). Holds the authenticated header, so
+// reads don't unlock it again. It contains the data key, wipe it with
+// ssbf_close.
+struct ssbf_file {
+        struct ssbf_header_info hi; // hi.meta_payload_data = meta_payload
+        uint8_t meta_payload[SSBF_META_PAYLOAD_MAX_SIZE];
+        uint8_t *input_data_start;  // must stay valid until ssbf_close
+        size_t input_data_size;
+        struct ssbf_decode_options options;
+        uint32_t file_id;           // first 4 bytes of the header MAC
+};
+
+// Header of a file without the data key, for listing many files
+// (ssbf_read_catalog_entry)
+struct ssbf_catalog_entry {
+        struct ssbf_meta_header meta_h;
+        uint8_t meta_payload[SSBF_META_PAYLOAD_MAX_SIZE];
+        struct ssbf_data_header data_h;
+        uint32_t blocks_sum_size;
+        uint32_t file_id;           // first 4 bytes of the header MAC
+        uint8_t main_header_flags;
+};
+
+// Work done by one ssbf_decode_step unit on checksums and decryption,
+// in bytes. Must be a multiple of the 64 byte ChaCha20 block.
+#ifndef SSBF_DECODE_STEP_CHUNK_SIZE
+#define SSBF_DECODE_STEP_CHUNK_SIZE 1024
+#endif
+
+// Time sliced decode of an opened file (ssbf_decode_step). Everything
+// except checkpoint is the state of the block in progress.
+struct ssbf_step_decoder {
+        struct ssbf_file *file;
+        uint8_t *output_data_start;
+        size_t output_data_max_size;
+        // progress after the last decoded block, can be stored to
+        // continue with ssbf_decode_step_init after a reset
+        struct ssbf_decode_checkpoint checkpoint;
+        struct ssbf_payload_block_header h;
+        uint8_t *payload;           // block data, in the input or scratch
+        size_t payload_size;
+        size_t block_output_size;
+        size_t offset;              // progress within the current state
+        uint32_t checksum;          // running checksum of the state
+        uint8_t state;
+        enum ssbf_errors error;     // sticky, returned by later steps
+};
+
+// max_block_size is limited to what a block stored as is can hold
+// (a bit less than 64 KiB). actual_output_data_size is 0 if the data
+// could not be encoded, e.g. it needs more than 65536 blocks.
 void ssbf_encode_data(uint8_t *key_main, //[32],
 		      uint8_t *key_main_nonce, //[24]
 		      uint8_t *key_data, //[32]
@@ -36,10 +295,215 @@ void ssbf_encode_data(uint8_t *key_main, //[32],
 		      size_t input_data_size,
 		      uint8_t *output_data_start,				
 		      size_t output_data_max_size,
-		      size_t *actual_output_data_size);
+		      size_t *actual_output_data_size,
+		      const struct ssbf_encode_options *options);
+
+enum ssbf_errors ssbf_decode_data(uint8_t *key_main, //[32],
+				  uint8_t *input_data_start,
+				  size_t input_data_size,
+				  uint8_t *output_data_start,
+				  size_t output_data_max_size,
+				  size_t *actual_output_data_size,
+				  const struct ssbf_decode_options *options);
+
+void ssbf_decode_checkpoint_init(struct ssbf_decode_checkpoint *checkpoint);
+
+// Decodes up to max_blocks blocks (0 = no limit) starting from the
+// checkpoint and updates it. Only the header is authenticated again
+// on every call. Returns SSBF_DECODE_IN_PROGRESS while there are
+// blocks left, SSBF_NO_ERROR once all data is decoded and verified.
+enum ssbf_errors ssbf_decode_data_resume(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	struct ssbf_decode_checkpoint *checkpoint,
+	uint32_t max_blocks,
+	const struct ssbf_decode_options *options);
+
+// Authenticates the header and keeps the data key, meta data, data
+// header and block offsets in file. options (may be NULL) are used by
+// all reads of the file.
+enum ssbf_errors ssbf_open(struct ssbf_file *file,
+			   uint8_t *key_main, //[32],
+			   uint8_t *input_data_start,
+			   size_t input_data_size,
+			   const struct ssbf_decode_options *options);
 
+void ssbf_close(struct ssbf_file *file);
+
+// Same as ssbf_decode_data_resume, without authenticating the header
+enum ssbf_errors ssbf_file_decode(struct ssbf_file *file,
+				  uint8_t *output_data_start,
+				  size_t output_data_max_size,
+				  struct ssbf_decode_checkpoint *checkpoint,
+				  uint32_t max_blocks);
+
+// Checks the block headers, order, sizes and payload checksums without
+// decrypting or decompressing anything
+enum ssbf_errors ssbf_file_verify(struct ssbf_file *file);
+
+// Decodes a single block. A block which repeats an earlier block
+// (dedup) is decoded from that block.
+enum ssbf_errors ssbf_file_read_block(struct ssbf_file *file,
+				      uint16_t block_number,
+				      uint8_t *output_data,
+				      size_t output_data_max_size,
+				      size_t *output_data_actual_size);
+
+// Starts a time sliced decode of file to output_data_start, from
+// checkpoint (NULL = from the start), which is checked like in
+// ssbf_file_decode
+enum ssbf_errors ssbf_decode_step_init(
+	struct ssbf_step_decoder *step,
+	struct ssbf_file *file,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	const struct ssbf_decode_checkpoint *checkpoint);
+
+// Does units of work until budget bytes are processed, at least one.
+// A unit is a checksum or decryption chunk of up to
+// SSBF_DECODE_STEP_CHUNK_SIZE bytes, or one whole block for the tag,
+// the LZ4 decompression and copies, so the time of one call is bounded
+// by budget plus one block. Returns SSBF_DECODE_IN_PROGRESS until all
+// data is decoded and verified, then SSBF_NO_ERROR.
+enum ssbf_errors ssbf_decode_step(struct ssbf_step_decoder *step,
+				  size_t budget);
+
+// In place decode, for devices without RAM for both the ssbf image and
+// the decoded data. The image is placed at the end of a buffer of
+// ssbf_inplace_buffer_size bytes and decoded to the start of the same
+// buffer, the margin between them is recorded by the encoder.
+// ssbf_inplace_buffer_size needs only the header of the file.
+enum ssbf_errors ssbf_inplace_buffer_size(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	const struct ssbf_decode_options *options,
+	size_t *buffer_size);
+
+// The image (input_data_size bytes) must be at the end of buffer
+enum ssbf_errors ssbf_decode_inplace(uint8_t *key_main, //[32],
+				     uint8_t *buffer,
+				     size_t buffer_size,
+				     size_t input_data_size,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_decode_options *options);
+
+// What ssbf_rewrap_header changes, besides the nonce
+struct ssbf_rewrap_options {
+        // seal the header with this main key instead of the current
+        // one, NULL keeps the current key
+        uint8_t *key_main;
+
+        // replace the meta data with meta_data_id and meta_payload_data
+        bool replace_meta;
+        uint16_t meta_data_id;
+        uint8_t *meta_payload_data;
+        uint16_t meta_data_payload_size;
+};
+
+// Key rotation and relabeling without encoding the data again. Writes
+// a new header for the file in input_data_start (only its header is
+// read), sealed with key_main_nonce, which must not have been used
+// with the key before. The blocks keep their data key and are not
+// touched: the new file is output_header followed by the blocks of
+// the input, from *blocks_offset on. If *output_header_size equals
+// *blocks_offset the new header can be written over the old one in
+// place. Files without the crypto extension have no key, only their
+// meta data can be replaced.
+enum ssbf_errors ssbf_rewrap_header(uint8_t *key_main, //[32],
+				    uint8_t *key_main_nonce, //[24]
+				    uint8_t *input_data_start,
+				    size_t input_data_size,
+				    uint8_t *output_header,
+				    size_t output_header_max_size,
+				    size_t *output_header_size,
+				    size_t *blocks_offset,
+				    const struct ssbf_rewrap_options *options);
+
+// Appends input_data to the file in file_data (file_size bytes, the
+// buffer has room for file_max_size bytes) and returns the new file
+// size. The new blocks continue the block numbers and only the block
+// headers of the file are read, so the cost depends on the new data.
+// The header is sealed again with key_main_nonce, which must be new.
+// Fixed size blocks are found by their number, so a file whose last
+// block is shorter than max_block_size can not be appended to; files
+// which grow should be encoded with cdc_min_block_size. Only
+// options->cdc_min_block_size (it must be set exactly when the file
+// has variable size blocks), compression_level, codecs and
+// fill_blocks are used, the rest follows the file. RLE is only used
+// if the file already allows block codecs. Appended data is not
+// deduplicated or delta encoded. SSBF_NOT_ENOUGHT_DATA if the new
+// blocks would not fit in file_max_size or in the 16 bit block numbers.
+enum ssbf_errors ssbf_append_data(uint8_t *key_main, //[32],
+				  uint8_t *key_main_nonce, //[24]
+				  uint8_t *file_data,
+				  size_t file_size,
+				  size_t file_max_size,
+				  uint8_t *input_data_start,
+				  size_t input_data_size,
+				  size_t *actual_file_size,
+				  const struct ssbf_encode_options *options);
+
+// Encodes the data of an ssbf file again with other options and
+// max_block_size (e.g. smaller blocks for a device with less RAM, a
+// compression level or checksum type), without the original data.
+// The input is decoded block by block into a window of one input and
+// one output block, so the memory used does not depend on the file
+// size. key_main opens the input and seals the output, the meta data
+// stays. The blocks get the new key_data: block numbers are the
+// nonces, so the old data key must not encrypt other block contents.
+// Dedup and delta are not used for the output. decode_options are
+// used for the input (e.g. its base image).
+enum ssbf_errors ssbf_transcode_data(
+	uint8_t *key_main, //[32],
+	uint8_t *key_main_nonce, //[24]
+	uint8_t *key_data, //[32]
+	size_t max_block_size,
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	size_t *actual_output_data_size,
+	const struct ssbf_encode_options *options,
+	const struct ssbf_decode_options *decode_options);
+
+void ssbf_checksum_init(struct ssbf_checksum_state *state, uint8_t type);
+
+void ssbf_checksum_update(struct ssbf_checksum_state *state,
+			  uint8_t *data, size_t data_size);
+
+// Size of the header (hashed_data_size + the hash), which is all
+// ssbf_read_catalog_entry needs. input_data_start must hold at least
+// the main header.
+enum ssbf_errors ssbf_catalog_header_size(uint8_t *input_data_start,
+					  size_t input_data_size,
+					  size_t *header_size);
+
+// Authenticates the header and copies the meta data and data header to
+// entry, the blocks don't have to be in the input. Delta files need no
+// base image. options (may be NULL) only use allow_unencrypted.
+enum ssbf_errors ssbf_read_catalog_entry(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	struct ssbf_catalog_entry *entry,
+	const struct ssbf_decode_options *options);
 
 enum ssbf_errors ssbf_explain( uint8_t *input_data_start,
 			       size_t input_data_size);
 
+// Decodes every block with the key and prints the decrypted header, the
+// compression ratio, codec and decode time of each stage per block, a
+// ratio histogram, the blocks stored raw and the slowest blocks. json
+// prints the same as one JSON object. Delta files need
+// options->base_data_start.
+enum ssbf_errors ssbf_explain_analyze(uint8_t *key_main, //[32],
+				      uint8_t *input_data_start,
+				      size_t input_data_size,
+				      const struct ssbf_decode_options *options,
+				      bool json);
+
 #endif
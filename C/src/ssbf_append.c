@@ -0,0 +1,260 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+
+#include "monocypher.h"
+
+// Finds the last block of the file by its headers, the payloads are
+// not read
+static enum ssbf_errors ssbf_find_last_block(uint8_t *blocks_start,
+					     size_t blocks_size,
+					     uint8_t main_header_flags,
+					     size_t *last_block_offset,
+					     struct ssbf_payload_block_header *h)
+{
+	size_t offset = 0;
+
+	for (uint32_t block_number = 0; offset < blocks_size; block_number++)
+	{
+		enum ssbf_errors r = ssbf_decode_block_header(
+			blocks_start + offset, blocks_size - offset, h);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		if (h->block_number != block_number
+		    || h->compressed_size > (blocks_size - offset
+			    - sizeof(struct ssbf_payload_block_header)))
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		if (h->flags & BHF_LAST_BLOCK)
+		{
+			*last_block_offset = offset;
+			return SSBF_NO_ERROR;
+		}
+
+		offset += sizeof(struct ssbf_payload_block_header)
+			+ h->compressed_size;
+		offset += ssbf_block_padding(offset, main_header_flags);
+	}
+
+	return SSBF_NOT_ENOUGHT_DATA;
+}
+
+// Upper bound of the encoded size of the appended data: blocks are
+// stored as is if they don't compress
+static size_t ssbf_append_max_size(size_t input_data_size,
+				   size_t min_block_size,
+				   uint8_t main_header_flags,
+				   bool block_tags)
+{
+	size_t blocks = input_data_size / min_block_size + 1;
+	size_t alignment = ssbf_block_alignment(main_header_flags);
+
+	return input_data_size
+		+ blocks * (sizeof(struct ssbf_payload_block_header)
+			    + sizeof(uint16_t)
+			    + (block_tags ? SSBF_BLOCK_TAG_SIZE : 0)
+			    + alignment);
+}
+
+enum ssbf_errors ssbf_append_data(uint8_t *key_main, //[32],
+				  uint8_t *key_main_nonce, //[24]
+				  uint8_t *file_data,
+				  size_t file_size,
+				  size_t file_max_size,
+				  uint8_t *input_data_start,
+				  size_t input_data_size,
+				  size_t *actual_file_size,
+				  const struct ssbf_encode_options *options)
+{
+	struct ssbf_header_info hi;
+
+	*actual_file_size = file_size;
+
+	if (0 == input_data_size)
+	{
+		return SSBF_NO_ERROR;
+	}
+
+	enum ssbf_errors e = ssbf_decode_plain_headers(file_data, file_size,
+						       &hi);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	if (hi.blocks_offset + hi.mh.blocks_sum_size != file_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	uint8_t header_plain[SSBF_HEADER_PLAIN_MAX_SIZE];
+
+	e = ssbf_unlock_header(key_main, file_data, &hi, header_plain);
+
+	const bool encrypted =
+		hi.mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION;
+	const bool variable_block_size =
+		hi.mh.flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE;
+	const bool block_tags =
+		hi.ch.flags & SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS;
+	size_t max_block_size = hi.data_h.max_uncompressed_block_size;
+
+	// the new blocks are encoded like the old ones, without dedup and
+	// delta, their offsets would be relative to the new data
+	struct ssbf_encode_options append_options;
+	memset(&append_options, 0, sizeof(append_options));
+	if (options)
+	{
+		append_options.cdc_min_block_size = options->cdc_min_block_size;
+		append_options.compression_level = options->compression_level;
+		append_options.codecs = options->codecs;
+		append_options.fill_blocks = options->fill_blocks;
+	}
+
+	// codecs other than LZ4 only if the file can have them, the data
+	// header does not change
+	if (!(hi.data_h.flags & SSBF_DATA_HEADER_FLAG_BLOCK_CODECS))
+	{
+		append_options.codecs &= ~SSBF_ENCODE_CODEC_RLE;
+	}
+	append_options.no_encryption = !encrypted;
+	append_options.block_tags = block_tags;
+	append_options.block_alignment = (uint16_t)
+		ssbf_block_alignment(hi.mh.flags);
+	append_options.block_checksum = (hi.data_h.flags 
+		& SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK)
+		>> SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT;
+	append_options.data_checksum = ssbf_data_checksum_type(
+		hi.data_h.flags);
+
+	// the new data must use the same block layout, with blocks the
+	// encoder can store
+	if (SSBF_NO_ERROR == e
+	    && (variable_block_size != (0 != append_options.cdc_min_block_size)
+		|| 0 == max_block_size
+		|| max_block_size != ssbf_encode_max_block_size(
+			max_block_size, &append_options)))
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+
+	struct ssbf_payload_block_header last_h;
+	size_t last_block_offset = 0;
+	uint8_t *blocks_start = file_data + hi.blocks_offset;
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_find_last_block(blocks_start, hi.mh.blocks_sum_size,
+					 hi.mh.flags,
+					 &last_block_offset, &last_h);
+	}
+
+	// fixed size blocks are found by their number, so the last block
+	// must be full to be followed by more blocks
+	if (SSBF_NO_ERROR == e && !variable_block_size
+	    && hi.data_h.full_data_size_uncompressed 
+	    != ((size_t) last_h.block_number + 1) * max_block_size)
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+
+	size_t old_blocks_size = hi.mh.blocks_sum_size;
+	size_t padding = ssbf_block_padding(old_blocks_size, hi.mh.flags);
+	size_t min_block_size = variable_block_size
+		? append_options.cdc_min_block_size : max_block_size;
+
+	// the block number is the nonce of the block, it must not wrap.
+	// The new blocks of a fixed size layout are counted here, variable
+	// size blocks can be more and are stopped by the encoder.
+	if (SSBF_NO_ERROR == e
+	    && ((size_t) last_h.block_number
+		+ (input_data_size + max_block_size - 1) / max_block_size
+		> UINT16_MAX
+		|| file_max_size - file_size < padding
+		+ ssbf_append_max_size(input_data_size, min_block_size,
+				       hi.mh.flags, block_tags)))
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	size_t appended_size = 0;
+
+	// the checksum continues over the new data
+	struct ssbf_checksum_state checksum = {
+		.size = hi.data_h.full_data_size_uncompressed,
+		.checksum = hi.data_h.full_data_checksum,
+		.type = append_options.data_checksum,
+	};
+
+	// the new blocks go behind the file, it is not changed until they
+	// are all made
+	if (SSBF_NO_ERROR == e)
+	{
+		memset(file_data + file_size, 0, padding);
+
+		ssbf_encode_data_to_blocks(encrypted ? hi.key_data : NULL,
+					   max_block_size,
+					   last_h.block_number + 1,
+					   input_data_start,
+					   input_data_size,
+					   file_data + file_size + padding,
+					   file_max_size - file_size - padding,
+					   &appended_size,
+					   &checksum,
+					   &append_options);
+
+		// out of block numbers (variable size blocks) or space
+		if (0 == appended_size)
+		{
+			e = SSBF_NOT_ENOUGHT_DATA;
+		}
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		// the old last block continues, its tag does not cover
+		// the last block flag
+		last_h.flags &= ~BHF_LAST_BLOCK;
+		last_h.header_checksum = bsd_checksum8(
+			(uint8_t *) &last_h,
+			sizeof(struct ssbf_payload_block_header)-1);
+		memcpy(blocks_start + last_block_offset, &last_h,
+		       sizeof(struct ssbf_payload_block_header));
+
+		size_t blocks_sum_size = old_blocks_size + padding
+			+ appended_size;
+
+		struct ssbf_data_header data_h = hi.data_h;
+		data_h.full_data_size_uncompressed = checksum.size;
+		data_h.full_data_checksum = checksum.checksum;
+
+		// same meta data (in header_plain), so the header keeps
+		// its size
+		*actual_file_size = ssbf_encode_finish(
+			key_main, key_main_nonce,
+			encrypted ? hi.key_data : NULL,
+			hi.mh.flags
+			& ~(SSBF_MAIN_HEADE_FLAG_USE_META_EXTENSION
+			    | SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION),
+			hi.ch.flags,
+			hi.meta_h.meta_data_id, hi.meta_payload_data,
+			hi.meta_h.payload_size,
+			&data_h, hi.blocks_offset, blocks_sum_size,
+			file_data);
+	}
+
+	crypto_wipe(header_plain, sizeof(header_plain));
+	crypto_wipe(hi.key_data, sizeof(hi.key_data));
+
+	return e;
+}
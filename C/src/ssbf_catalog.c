@@ -0,0 +1,94 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+
+#include "monocypher.h"
+
+enum ssbf_errors ssbf_catalog_header_size(uint8_t *input_data_start,
+					  size_t input_data_size,
+					  size_t *header_size)
+{
+	struct ssbf_main_header mh;
+
+	*header_size = 0;
+
+	if (sizeof(struct ssbf_main_header) > input_data_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	memcpy(&mh, input_data_start, sizeof(struct ssbf_main_header));
+
+	if (SSBFv1_MAGIC_NUMBER != mh.ssbf_magic_number)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (bsd_checksum8((uint8_t *) &mh, sizeof(struct ssbf_main_header)-1)
+	    != mh.header_checksum)
+	{
+		return SSBF_CHECKSUM_FAILED;
+	}
+
+	*header_size = (size_t) mh.hashed_data_size + SSBF_HEADER_HASH_SIZE;
+
+	return SSBF_NO_ERROR;
+}
+
+enum ssbf_errors ssbf_read_catalog_entry(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	struct ssbf_catalog_entry *entry,
+	const struct ssbf_decode_options *options)
+{
+	struct ssbf_header_info hi;
+
+	memset(entry, 0, sizeof(struct ssbf_catalog_entry));
+
+	enum ssbf_errors e = ssbf_decode_plain_headers(input_data_start,
+						       input_data_size,
+						       &hi);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	// same as ssbf_open, a caller with a key expects authenticated data
+	if (!(hi.mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION)
+	    && key_main && !(options && options->allow_unencrypted))
+	{
+		return SSBF_DECRYPTION_FAILED;
+	}
+
+	uint8_t header_plain[SSBF_HEADER_PLAIN_MAX_SIZE];
+
+	e = ssbf_unlock_header(key_main, input_data_start, &hi, header_plain);
+
+	if (SSBF_NO_ERROR == e
+	    && hi.meta_h.payload_size > sizeof(entry->meta_payload))
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		entry->meta_h = hi.meta_h;
+		memcpy(entry->meta_payload, hi.meta_payload_data,
+		       hi.meta_h.payload_size);
+		entry->data_h = hi.data_h;
+		entry->blocks_sum_size = hi.mh.blocks_sum_size;
+		entry->main_header_flags = hi.mh.flags;
+		memcpy(&entry->file_id, hi.header_mac, sizeof(entry->file_id));
+	}
+
+	crypto_wipe(header_plain, sizeof(header_plain));
+	crypto_wipe(hi.key_data, sizeof(hi.key_data));
+
+	return e;
+}
@@ -0,0 +1,682 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "monocypher.h"
+
+#include "ssbf_config.h"
+#include "ssbf_cipher.h"
+
+// SIMD kernels compute several ChaCha20 blocks in parallel, one block
+// per vector lane, and leave the tail (less than one batch) to
+// Monocypher. Counter is 64 bit (words 12 and 13) like in
+// crypto_chacha20_djb, so the output is identical. Define
+// SSBF_CIPHER_NO_SIMD to build only the portable backend.
+#if !defined(SSBF_CIPHER_NO_SIMD) && defined(__GNUC__)
+#if defined(__x86_64__) || defined(__i386__)
+#define SSBF_CIPHER_X86
+#define SSBF_CIPHER_SIMD
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) \
+	&& defined(__BYTE_ORDER__) \
+	&& (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SSBF_CIPHER_NEON
+#define SSBF_CIPHER_SIMD
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(SSBF_CIPHER_SIMD)
+
+static uint32_t ssbf_load32_le(const uint8_t *p)
+{
+	return ((uint32_t) p[0])
+		| ((uint32_t) p[1] << 8)
+		| ((uint32_t) p[2] << 16)
+		| ((uint32_t) p[3] << 24);
+}
+
+// state without the counter (words 12 and 13)
+static void ssbf_chacha20_init(uint32_t state[16],
+			       const uint8_t key[32],
+			       const uint8_t nonce[8])
+{
+	state[0] = 0x61707865; // "expand 32-byte k"
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		state[4 + i] = ssbf_load32_le(key + i * 4);
+	}
+	state[12] = 0;
+	state[13] = 0;
+	state[14] = ssbf_load32_le(nonce);
+	state[15] = ssbf_load32_le(nonce + 4);
+}
+
+#endif // SSBF_CIPHER_SIMD
+
+static bool ssbf_cipher_always_supported(void)
+{
+	return true;
+}
+
+static uint64_t ssbf_chacha20_djb_portable(uint8_t *cipher_text,
+					   const uint8_t *plain_text,
+					   size_t text_size,
+					   const uint8_t key[32],
+					   const uint8_t nonce[8],
+					   uint64_t ctr)
+{
+	return crypto_chacha20_djb(cipher_text, plain_text, text_size,
+				   key, nonce, ctr);
+}
+
+// Generic quarter round and double round over vectors, VADD, VXOR and
+// VROTL are defined per instruction set.
+#define SSBF_QR(a, b, c, d)				\
+	do {						\
+		a = VADD(a, b); d = VROTL(VXOR(d, a), 16);	\
+		c = VADD(c, d); b = VROTL(VXOR(b, c), 12);	\
+		a = VADD(a, b); d = VROTL(VXOR(d, a), 8);	\
+		c = VADD(c, d); b = VROTL(VXOR(b, c), 7);	\
+	} while (0)
+
+#define SSBF_CHACHA20_ROUNDS(x)					\
+	do {							\
+		for (uint32_t r = 0; r < 10; r++)		\
+		{						\
+			SSBF_QR(x[0], x[4], x[8],  x[12]);	\
+			SSBF_QR(x[1], x[5], x[9],  x[13]);	\
+			SSBF_QR(x[2], x[6], x[10], x[14]);	\
+			SSBF_QR(x[3], x[7], x[11], x[15]);	\
+			SSBF_QR(x[0], x[5], x[10], x[15]);	\
+			SSBF_QR(x[1], x[6], x[11], x[12]);	\
+			SSBF_QR(x[2], x[7], x[8],  x[13]);	\
+			SSBF_QR(x[3], x[4], x[9],  x[14]);	\
+		}						\
+	} while (0)
+
+#if defined(SSBF_CIPHER_X86)
+
+static bool ssbf_cipher_sse2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool ssbf_cipher_avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool ssbf_cipher_avx512_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+// 4 blocks, one per 32 bit lane
+__attribute__((target("sse2")))
+static void ssbf_chacha20_blocks_sse2(uint8_t *out, const uint8_t *in,
+				      const uint32_t state[16],
+				      uint64_t ctr)
+{
+#define VADD(a, b) _mm_add_epi32(a, b)
+#define VXOR(a, b) _mm_xor_si128(a, b)
+#define VROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n),		\
+				 _mm_srli_epi32(v, 32 - (n)))
+	__m128i s[16];
+	__m128i x[16];
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		s[i] = _mm_set1_epi32((int32_t) state[i]);
+	}
+	s[12] = _mm_set_epi32((int32_t) (uint32_t) (ctr + 3),
+			      (int32_t) (uint32_t) (ctr + 2),
+			      (int32_t) (uint32_t) (ctr + 1),
+			      (int32_t) (uint32_t) ctr);
+	s[13] = _mm_set_epi32((int32_t) (uint32_t) ((ctr + 3) >> 32),
+			      (int32_t) (uint32_t) ((ctr + 2) >> 32),
+			      (int32_t) (uint32_t) ((ctr + 1) >> 32),
+			      (int32_t) (uint32_t) (ctr >> 32));
+	memcpy(x, s, sizeof(x));
+
+	SSBF_CHACHA20_ROUNDS(x);
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		x[i] = VADD(x[i], s[i]);
+	}
+
+	// transpose 4x4 words, so each vector holds 16 bytes of one block
+	for (uint32_t w = 0; w < 16; w += 4)
+	{
+		__m128i t0 = _mm_unpacklo_epi32(x[w], x[w + 1]);
+		__m128i t1 = _mm_unpacklo_epi32(x[w + 2], x[w + 3]);
+		__m128i t2 = _mm_unpackhi_epi32(x[w], x[w + 1]);
+		__m128i t3 = _mm_unpackhi_epi32(x[w + 2], x[w + 3]);
+		__m128i b[4] = {
+			_mm_unpacklo_epi64(t0, t1),
+			_mm_unpackhi_epi64(t0, t1),
+			_mm_unpacklo_epi64(t2, t3),
+			_mm_unpackhi_epi64(t2, t3),
+		};
+
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			size_t offset = i * 64 + w * 4;
+			if (in)
+			{
+				b[i] = VXOR(b[i], _mm_loadu_si128(
+						    (const __m128i *) (in + offset)));
+			}
+			_mm_storeu_si128((__m128i *) (out + offset), b[i]);
+		}
+	}
+#undef VADD
+#undef VXOR
+#undef VROTL
+}
+
+// 8 blocks, block i in lane i. 128 bit lanes hold blocks 0-3 and 4-7.
+__attribute__((target("avx2")))
+static void ssbf_chacha20_blocks_avx2(uint8_t *out, const uint8_t *in,
+				      const uint32_t state[16],
+				      uint64_t ctr)
+{
+	const __m256i rot16 = _mm256_set_epi8(
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+#define VADD(a, b) _mm256_add_epi32(a, b)
+#define VXOR(a, b) _mm256_xor_si256(a, b)
+#define VROTL(v, n) ((n) == 16 ? _mm256_shuffle_epi8(v, rot16)	\
+		     : (n) == 8 ? _mm256_shuffle_epi8(v, rot8)	\
+		     : _mm256_or_si256(_mm256_slli_epi32(v, n),	\
+				       _mm256_srli_epi32(v, 32 - (n))))
+	__m256i s[16];
+	__m256i x[16];
+	uint32_t ctr_low[8];
+	uint32_t ctr_high[8];
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		s[i] = _mm256_set1_epi32((int32_t) state[i]);
+	}
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		ctr_low[i] = (uint32_t) (ctr + i);
+		ctr_high[i] = (uint32_t) ((ctr + i) >> 32);
+	}
+	s[12] = _mm256_loadu_si256((const __m256i *) ctr_low);
+	s[13] = _mm256_loadu_si256((const __m256i *) ctr_high);
+	memcpy(x, s, sizeof(x));
+
+	SSBF_CHACHA20_ROUNDS(x);
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		x[i] = VADD(x[i], s[i]);
+	}
+
+	// b[w / 4][i] holds words w..w+3 of block i (low) and i+4 (high)
+	__m256i b[4][4];
+	for (uint32_t w = 0; w < 16; w += 4)
+	{
+		__m256i t0 = _mm256_unpacklo_epi32(x[w], x[w + 1]);
+		__m256i t1 = _mm256_unpacklo_epi32(x[w + 2], x[w + 3]);
+		__m256i t2 = _mm256_unpackhi_epi32(x[w], x[w + 1]);
+		__m256i t3 = _mm256_unpackhi_epi32(x[w + 2], x[w + 3]);
+		b[w / 4][0] = _mm256_unpacklo_epi64(t0, t1);
+		b[w / 4][1] = _mm256_unpackhi_epi64(t0, t1);
+		b[w / 4][2] = _mm256_unpacklo_epi64(t2, t3);
+		b[w / 4][3] = _mm256_unpackhi_epi64(t2, t3);
+	}
+
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		// 32 byte halves of blocks i and i+4
+		__m256i v[4] = {
+			_mm256_permute2x128_si256(b[0][i], b[1][i], 0x20),
+			_mm256_permute2x128_si256(b[2][i], b[3][i], 0x20),
+			_mm256_permute2x128_si256(b[0][i], b[1][i], 0x31),
+			_mm256_permute2x128_si256(b[2][i], b[3][i], 0x31),
+		};
+		size_t offset[4] = {
+			i * 64, i * 64 + 32, (i + 4) * 64, (i + 4) * 64 + 32,
+		};
+
+		for (uint32_t j = 0; j < 4; j++)
+		{
+			if (in)
+			{
+				v[j] = VXOR(v[j], _mm256_loadu_si256(
+						    (const __m256i *) (in + offset[j])));
+			}
+			_mm256_storeu_si256((__m256i *) (out + offset[j]), v[j]);
+		}
+	}
+#undef VADD
+#undef VXOR
+#undef VROTL
+}
+
+// 16 blocks, block i in lane i. 128 bit lane l holds blocks 4l..4l+3.
+__attribute__((target("avx512f")))
+static void ssbf_chacha20_blocks_avx512(uint8_t *out, const uint8_t *in,
+					const uint32_t state[16],
+					uint64_t ctr)
+{
+#define VADD(a, b) _mm512_add_epi32(a, b)
+#define VXOR(a, b) _mm512_xor_si512(a, b)
+#define VROTL(v, n) _mm512_rol_epi32(v, n)
+	__m512i s[16];
+	__m512i x[16];
+	uint32_t ctr_low[16];
+	uint32_t ctr_high[16];
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		s[i] = _mm512_set1_epi32((int32_t) state[i]);
+		ctr_low[i] = (uint32_t) (ctr + i);
+		ctr_high[i] = (uint32_t) ((ctr + i) >> 32);
+	}
+	s[12] = _mm512_loadu_si512(ctr_low);
+	s[13] = _mm512_loadu_si512(ctr_high);
+	memcpy(x, s, sizeof(x));
+
+	SSBF_CHACHA20_ROUNDS(x);
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		x[i] = VADD(x[i], s[i]);
+	}
+
+	// b[w / 4][i] holds words w..w+3 of blocks i, i+4, i+8, i+12
+	__m512i b[4][4];
+	for (uint32_t w = 0; w < 16; w += 4)
+	{
+		__m512i t0 = _mm512_unpacklo_epi32(x[w], x[w + 1]);
+		__m512i t1 = _mm512_unpacklo_epi32(x[w + 2], x[w + 3]);
+		__m512i t2 = _mm512_unpackhi_epi32(x[w], x[w + 1]);
+		__m512i t3 = _mm512_unpackhi_epi32(x[w + 2], x[w + 3]);
+		b[w / 4][0] = _mm512_unpacklo_epi64(t0, t1);
+		b[w / 4][1] = _mm512_unpackhi_epi64(t0, t1);
+		b[w / 4][2] = _mm512_unpacklo_epi64(t2, t3);
+		b[w / 4][3] = _mm512_unpackhi_epi64(t2, t3);
+	}
+
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		// transpose 4x4 128 bit lanes, v[l] is the whole block i+4l
+		__m512i a0 = _mm512_shuffle_i32x4(b[0][i], b[1][i], 0x44);
+		__m512i a1 = _mm512_shuffle_i32x4(b[0][i], b[1][i], 0xee);
+		__m512i a2 = _mm512_shuffle_i32x4(b[2][i], b[3][i], 0x44);
+		__m512i a3 = _mm512_shuffle_i32x4(b[2][i], b[3][i], 0xee);
+		__m512i v[4] = {
+			_mm512_shuffle_i32x4(a0, a2, 0x88),
+			_mm512_shuffle_i32x4(a0, a2, 0xdd),
+			_mm512_shuffle_i32x4(a1, a3, 0x88),
+			_mm512_shuffle_i32x4(a1, a3, 0xdd),
+		};
+
+		for (uint32_t l = 0; l < 4; l++)
+		{
+			size_t offset = (i + 4 * l) * 64;
+			if (in)
+			{
+				v[l] = VXOR(v[l], _mm512_loadu_si512(in + offset));
+			}
+			_mm512_storeu_si512(out + offset, v[l]);
+		}
+	}
+#undef VADD
+#undef VXOR
+#undef VROTL
+}
+
+#endif // SSBF_CIPHER_X86
+
+#if defined(SSBF_CIPHER_NEON)
+
+// NEON is mandatory on ARMv8-A
+#define ssbf_cipher_neon_supported ssbf_cipher_always_supported
+
+// 4 blocks, one per 32 bit lane
+static void ssbf_chacha20_blocks_neon(uint8_t *out, const uint8_t *in,
+				      const uint32_t state[16],
+				      uint64_t ctr)
+{
+#define VADD(a, b) vaddq_u32(a, b)
+#define VXOR(a, b) veorq_u32(a, b)
+#define VROTL(v, n) ((n) == 16 ? vreinterpretq_u32_u16(		\
+			     vrev32q_u16(vreinterpretq_u16_u32(v)))	\
+		     : vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n)))
+	uint32x4_t s[16];
+	uint32x4_t x[16];
+	uint32_t ctr_low[4];
+	uint32_t ctr_high[4];
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		s[i] = vdupq_n_u32(state[i]);
+	}
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		ctr_low[i] = (uint32_t) (ctr + i);
+		ctr_high[i] = (uint32_t) ((ctr + i) >> 32);
+	}
+	s[12] = vld1q_u32(ctr_low);
+	s[13] = vld1q_u32(ctr_high);
+	memcpy(x, s, sizeof(x));
+
+	SSBF_CHACHA20_ROUNDS(x);
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		x[i] = VADD(x[i], s[i]);
+	}
+
+	// transpose 4x4 words, so each vector holds 16 bytes of one block
+	for (uint32_t w = 0; w < 16; w += 4)
+	{
+		uint32x4x2_t t0 = vtrnq_u32(x[w], x[w + 1]);
+		uint32x4x2_t t1 = vtrnq_u32(x[w + 2], x[w + 3]);
+		uint32x4_t b[4] = {
+			vcombine_u32(vget_low_u32(t0.val[0]),
+				     vget_low_u32(t1.val[0])),
+			vcombine_u32(vget_low_u32(t0.val[1]),
+				     vget_low_u32(t1.val[1])),
+			vcombine_u32(vget_high_u32(t0.val[0]),
+				     vget_high_u32(t1.val[0])),
+			vcombine_u32(vget_high_u32(t0.val[1]),
+				     vget_high_u32(t1.val[1])),
+		};
+
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			size_t offset = i * 64 + w * 4;
+			uint8x16_t k = vreinterpretq_u8_u32(b[i]);
+			if (in)
+			{
+				k = veorq_u8(k, vld1q_u8(in + offset));
+			}
+			vst1q_u8(out + offset, k);
+		}
+	}
+#undef VADD
+#undef VXOR
+#undef VROTL
+}
+
+#endif // SSBF_CIPHER_NEON
+
+// Full batches with the SIMD kernel, the rest with Monocypher
+#define SSBF_CHACHA20_DJB_SIMD(name, blocks_function, batch_blocks)	\
+	static uint64_t name(uint8_t *cipher_text,			\
+			     const uint8_t *plain_text,			\
+			     size_t text_size,				\
+			     const uint8_t key[32],			\
+			     const uint8_t nonce[8],			\
+			     uint64_t ctr)				\
+	{								\
+		uint32_t state[16];					\
+		ssbf_chacha20_init(state, key, nonce);			\
+		while (text_size >= (batch_blocks) * 64)		\
+		{							\
+			blocks_function(cipher_text, plain_text,	\
+					state, ctr);			\
+			cipher_text += (batch_blocks) * 64;		\
+			if (plain_text)					\
+			{						\
+				plain_text += (batch_blocks) * 64;	\
+			}						\
+			text_size -= (batch_blocks) * 64;		\
+			ctr += (batch_blocks);				\
+		}							\
+		crypto_wipe(state, sizeof(state));			\
+		return crypto_chacha20_djb(cipher_text, plain_text,	\
+					   text_size, key, nonce, ctr); \
+	}
+
+#if defined(SSBF_CIPHER_X86)
+SSBF_CHACHA20_DJB_SIMD(ssbf_chacha20_djb_sse2,
+		       ssbf_chacha20_blocks_sse2, 4)
+SSBF_CHACHA20_DJB_SIMD(ssbf_chacha20_djb_avx2,
+		       ssbf_chacha20_blocks_avx2, 8)
+SSBF_CHACHA20_DJB_SIMD(ssbf_chacha20_djb_avx512,
+		       ssbf_chacha20_blocks_avx512, 16)
+#endif
+#if defined(SSBF_CIPHER_NEON)
+SSBF_CHACHA20_DJB_SIMD(ssbf_chacha20_djb_neon,
+		       ssbf_chacha20_blocks_neon, 4)
+#endif
+
+// ordered from the slowest to the fastest
+static const struct ssbf_cipher_backend ssbf_cipher_backend_table[] = {
+	{
+		.name = "monocypher",
+		.is_supported = ssbf_cipher_always_supported,
+		.chacha20_djb = ssbf_chacha20_djb_portable,
+	},
+#if defined(SSBF_CIPHER_X86)
+	{
+		.name = "sse2",
+		.is_supported = ssbf_cipher_sse2_supported,
+		.chacha20_djb = ssbf_chacha20_djb_sse2,
+	},
+	{
+		.name = "avx2",
+		.is_supported = ssbf_cipher_avx2_supported,
+		.chacha20_djb = ssbf_chacha20_djb_avx2,
+	},
+	{
+		.name = "avx512",
+		.is_supported = ssbf_cipher_avx512_supported,
+		.chacha20_djb = ssbf_chacha20_djb_avx512,
+	},
+#endif
+#if defined(SSBF_CIPHER_NEON)
+	{
+		.name = "neon",
+		.is_supported = ssbf_cipher_neon_supported,
+		.chacha20_djb = ssbf_chacha20_djb_neon,
+	},
+#endif
+};
+
+#define SSBF_CIPHER_BACKENDS_SUM					\
+	(sizeof(ssbf_cipher_backend_table) / sizeof(ssbf_cipher_backend_table[0]))
+
+// read for every block, from any thread (io workers, the block server)
+static _Atomic(const struct ssbf_cipher_backend *)
+	ssbf_cipher_backend_selected = NULL;
+
+const struct ssbf_cipher_backend *ssbf_cipher_backends(size_t *count)
+{
+	*count = SSBF_CIPHER_BACKENDS_SUM;
+	return ssbf_cipher_backend_table;
+}
+
+static uint64_t ssbf_chacha20_x_backend(
+	const struct ssbf_cipher_backend *backend,
+	uint8_t *cipher_text,
+	const uint8_t *plain_text,
+	size_t text_size,
+	const uint8_t key[32],
+	const uint8_t nonce[24],
+	uint64_t ctr)
+{
+	uint8_t sub_key[32];
+	crypto_chacha20_h(sub_key, key, nonce);
+	ctr = backend->chacha20_djb(cipher_text, plain_text, text_size,
+				    sub_key, nonce + 16, ctr);
+	crypto_wipe(sub_key, sizeof(sub_key));
+	return ctr;
+}
+
+bool ssbf_cipher_selftest(const struct ssbf_cipher_backend *backend)
+{
+	// RFC 8439 2.3.2, nonce 000000090000004a00000000 and block
+	// counter 1 map to djb nonce 000000004a000000 and counter
+	// 0x0900000000000001. The block is placed in the middle of a
+	// batch, so it goes through the SIMD kernels.
+	static const uint8_t rfc_block[64] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+		0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+		0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+		0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+		0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+	};
+	static const uint8_t rfc_nonce[8] = {
+		0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00,
+	};
+	static const size_t sizes[] = {
+		0, 1, 63, 64, 65, 255, 256, 257, 511, 512, 513,
+		1023, 1024, 1025, 64 * 17 + 7, 64 * 33 + 3, 64 * 40,
+	};
+	static const uint64_t counters[] = {
+		0, 1, 0xfffffffe, 0xfffffffffffffff9,
+	};
+	uint8_t key[32];
+	uint8_t nonce[24];
+	uint8_t plain[64 * 40];
+	uint8_t expected[64 * 40];
+	uint8_t actual[64 * 40];
+	bool r = true;
+
+	for (uint32_t i = 0; i < sizeof(key); i++)
+	{
+		key[i] = (uint8_t) i;
+	}
+	memset(plain, 0, 64 * 24);
+	uint64_t ctr = backend->chacha20_djb(actual, plain, 64 * 24,
+					     key, rfc_nonce,
+					     0x0900000000000001 - 5);
+	if (ctr != 0x0900000000000001 - 5 + 24
+	    || 0 != memcmp(actual + 5 * 64, rfc_block, sizeof(rfc_block)))
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < sizeof(nonce); i++)
+	{
+		nonce[i] = (uint8_t) (0xa5 ^ (i * 7));
+	}
+	for (uint32_t i = 0; i < sizeof(plain); i++)
+	{
+		plain[i] = (uint8_t) (i * 131 + (i >> 8));
+	}
+
+	for (uint32_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++)
+	{
+		for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			size_t size = sizes[s];
+			uint64_t ctr_expected = crypto_chacha20_djb(
+				expected, plain, size, key, nonce,
+				counters[c]);
+			uint64_t ctr_actual = backend->chacha20_djb(
+				actual, plain, size, key, nonce,
+				counters[c]);
+			r &= ctr_expected == ctr_actual;
+			r &= 0 == memcmp(expected, actual, size);
+
+			// in place and without plain text (key stream)
+			memcpy(actual, plain, size);
+			backend->chacha20_djb(actual, actual, size, key, nonce,
+					      counters[c]);
+			r &= 0 == memcmp(expected, actual, size);
+
+			crypto_chacha20_djb(expected, NULL, size, key, nonce,
+					    counters[c]);
+			backend->chacha20_djb(actual, NULL, size, key, nonce,
+					      counters[c]);
+			r &= 0 == memcmp(expected, actual, size);
+		}
+	}
+
+	crypto_chacha20_x(expected, plain, sizeof(plain), key, nonce, 3);
+	ssbf_chacha20_x_backend(backend, actual, plain, sizeof(plain),
+				key, nonce, 3);
+	r &= 0 == memcmp(expected, actual, sizeof(plain));
+
+	return r;
+}
+
+// The fastest supported backend which passes the self test
+static const struct ssbf_cipher_backend *ssbf_cipher_fastest(void)
+{
+	// the portable backend is the reference, it is not tested
+	for (size_t i = SSBF_CIPHER_BACKENDS_SUM; i > 1; i--)
+	{
+		const struct ssbf_cipher_backend *backend =
+			&ssbf_cipher_backend_table[i - 1];
+		if (backend->is_supported() && ssbf_cipher_selftest(backend))
+		{
+			return backend;
+		}
+	}
+	return &ssbf_cipher_backend_table[0];
+}
+
+bool ssbf_cipher_select(const struct ssbf_cipher_backend *backend)
+{
+	if (NULL == backend)
+	{
+		backend = ssbf_cipher_fastest();
+	}
+	else if (!backend->is_supported() || !ssbf_cipher_selftest(backend))
+	{
+		return false;
+	}
+
+	atomic_store_explicit(&ssbf_cipher_backend_selected, backend,
+			      memory_order_release);
+	return true;
+}
+
+// Threads using the cipher for the first time at once may all look for
+// the fastest backend, only the first result (or an explicit selection)
+// is kept
+const struct ssbf_cipher_backend *ssbf_cipher_selected(void)
+{
+	const struct ssbf_cipher_backend *backend = atomic_load_explicit(
+		&ssbf_cipher_backend_selected, memory_order_acquire);
+
+	if (NULL == backend)
+	{
+		const struct ssbf_cipher_backend *fastest =
+			ssbf_cipher_fastest();
+		if (atomic_compare_exchange_strong_explicit(
+			    &ssbf_cipher_backend_selected, &backend, fastest,
+			    memory_order_acq_rel, memory_order_acquire))
+		{
+			backend = fastest;
+		}
+	}
+	return backend;
+}
+
+uint64_t ssbf_chacha20_x(uint8_t *cipher_text,
+			 const uint8_t *plain_text,
+			 size_t text_size,
+			 const uint8_t key[32],
+			 const uint8_t nonce[24],
+			 uint64_t ctr)
+{
+	return ssbf_chacha20_x_backend(ssbf_cipher_selected(),
+				       cipher_text, plain_text, text_size,
+				       key, nonce, ctr);
+}
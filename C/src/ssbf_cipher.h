@@ -0,0 +1,48 @@
+#ifndef SSBF_CIPHER_H
+#define SSBF_CIPHER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// ChaCha20 implementation used for the block encryption. The portable
+// one is Monocypher, the others process several 64 byte ChaCha20
+// blocks at once with SIMD instructions and give the same output.
+struct ssbf_cipher_backend {
+	const char *name;
+	bool (*is_supported)(void);
+	// same interface as Monocypher crypto_chacha20_djb
+	uint64_t (*chacha20_djb)(uint8_t *cipher_text,
+				 const uint8_t *plain_text,
+				 size_t text_size,
+				 const uint8_t key[32],
+				 const uint8_t nonce[8],
+				 uint64_t ctr);
+};
+
+// All backends compiled in, the portable one first
+const struct ssbf_cipher_backend *ssbf_cipher_backends(size_t *count);
+
+// Known answer test (RFC 8439 block) and comparison with Monocypher
+// over lengths and counters which exercise all code paths
+bool ssbf_cipher_selftest(const struct ssbf_cipher_backend *backend);
+
+// Selects the backend for ssbf_chacha20_x. NULL picks the fastest one
+// the CPU supports which passes the self test. Returns false if the
+// backend is not supported or fails the self test. Without a call the
+// first use of the cipher selects with NULL. The selection is atomic,
+// threads can use the cipher at any time; select a backend before
+// starting them to use it for all of their blocks.
+bool ssbf_cipher_select(const struct ssbf_cipher_backend *backend);
+
+const struct ssbf_cipher_backend *ssbf_cipher_selected(void);
+
+// XChaCha20, same output as Monocypher crypto_chacha20_x
+uint64_t ssbf_chacha20_x(uint8_t *cipher_text,
+	                 const uint8_t *plain_text,
+	                 size_t text_size,
+	                 const uint8_t key[32],
+	                 const uint8_t nonce[24],
+	                 uint64_t ctr);
+
+#endif
@@ -0,0 +1,276 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ssbf_config.h"
+
+#include "lz4.h"
+#if SSBF_CONFIG_ENCODER && SSBF_CONFIG_LZ4HC
+#include "lz4hc.h"
+#endif
+
+#include "ssbf_codec.h"
+
+// same as LZ4_DECOMPRESS_INPLACE_MARGIN
+#define SSBF_LZ4_INPLACE_MARGIN(compressed_size) (((compressed_size) >> 8) + 32)
+
+// RLE tokens: 0lllllll is followed by l + 1 literal bytes, 1lllllll v
+// is l + 3 times byte v. 11111111 is followed by a 16 bit length and
+// the byte, for runs longer than 129 bytes.
+#define SSBF_RLE_MAX_LITERALS 128
+#define SSBF_RLE_MIN_RUN 3
+#define SSBF_RLE_MAX_SHORT_RUN (0x7e + SSBF_RLE_MIN_RUN)
+#define SSBF_RLE_LONG_RUN 0xff
+
+// a decode only build has no compressors, so the codec table does not
+// pull them in
+#if SSBF_CONFIG_ENCODER
+#define SSBF_CODEC_COMPRESS(compress) compress
+#else
+#define SSBF_CODEC_COMPRESS(compress) NULL
+#endif
+
+#if SSBF_CONFIG_ENCODER && SSBF_CONFIG_LZ4HC
+static size_t ssbf_lz4hc_compress(const uint8_t *input, size_t input_size,
+				  uint8_t *output, size_t output_max_size,
+				  int level)
+{
+	int r = LZ4_compress_HC((const char *) input, (char *) output,
+				(int) input_size, (int) output_max_size,
+				level ? level : LZ4HC_CLEVEL_MAX);
+
+	return (0 < r) ? (size_t) r : 0;
+}
+#endif
+
+#if SSBF_CONFIG_CODEC_LZ4
+#if SSBF_CONFIG_ENCODER
+static size_t ssbf_lz4_compress(const uint8_t *input, size_t input_size,
+				uint8_t *output, size_t output_max_size,
+				int level)
+{
+	(void) level;
+
+	int r = LZ4_compress_default((const char *) input, (char *) output,
+				     (int) input_size, (int) output_max_size);
+
+	return (0 < r) ? (size_t) r : 0;
+}
+#endif
+
+static int32_t ssbf_lz4_decompress(const uint8_t *input, size_t input_size,
+				   uint8_t *output, size_t output_max_size)
+{
+	return LZ4_decompress_safe((const char *) input, (char *) output,
+				   (int) input_size, (int) output_max_size);
+}
+
+static size_t ssbf_lz4_inplace_margin(size_t compressed_size)
+{
+	return SSBF_LZ4_INPLACE_MARGIN(compressed_size);
+}
+#endif
+
+#if SSBF_CONFIG_CODEC_RLE
+#if SSBF_CONFIG_ENCODER
+static size_t ssbf_rle_run(const uint8_t *data, size_t data_size)
+{
+	size_t n = 1;
+
+	if (UINT16_MAX < data_size)
+	{
+		data_size = UINT16_MAX;
+	}
+
+	while (n < data_size && data[n] == data[0])
+	{
+		n++;
+	}
+
+	return n;
+}
+
+static size_t ssbf_rle_compress(const uint8_t *input, size_t input_size,
+				uint8_t *output, size_t output_max_size,
+				int level)
+{
+	size_t literals_start = 0;
+	size_t in = 0;
+	size_t out = 0;
+
+	(void) level;
+
+	while (1)
+	{
+		size_t run = (in < input_size)
+			? ssbf_rle_run(input + in, input_size - in) : 0;
+
+		if (in < input_size && SSBF_RLE_MIN_RUN > run)
+		{
+			in += 1;
+			continue;
+		}
+
+		// literals in front of the run, or at the end
+		while (literals_start < in)
+		{
+			size_t n = in - literals_start;
+			if (SSBF_RLE_MAX_LITERALS < n)
+			{
+				n = SSBF_RLE_MAX_LITERALS;
+			}
+
+			if (output_max_size - out < 1 + n)
+			{
+				return 0;
+			}
+
+			output[out++] = (uint8_t) (n - 1);
+			memcpy(output + out, input + literals_start, n);
+			out += n;
+			literals_start += n;
+		}
+
+		if (in == input_size)
+		{
+			break;
+		}
+
+		if (output_max_size - out < 4)
+		{
+			return 0;
+		}
+
+		if (SSBF_RLE_MAX_SHORT_RUN >= run)
+		{
+			output[out++] = (uint8_t) (0x80 | (run - SSBF_RLE_MIN_RUN));
+		}
+		else
+		{
+			output[out++] = SSBF_RLE_LONG_RUN;
+			output[out++] = (uint8_t) run;
+			output[out++] = (uint8_t) (run >> 8);
+		}
+		output[out++] = input[in];
+
+		in += run;
+		literals_start = in;
+	}
+
+	return out;
+}
+#endif
+
+// The input is read before the output of a token is written and
+// literals are moved, so the input and output can overlap
+static int32_t ssbf_rle_decompress(const uint8_t *input, size_t input_size,
+				   uint8_t *output, size_t output_max_size)
+{
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < input_size)
+	{
+		uint8_t token = input[in++];
+		size_t n;
+
+		if (!(token & 0x80))
+		{
+			n = (size_t) token + 1;
+			if (input_size - in < n || output_max_size - out < n)
+			{
+				return -1;
+			}
+
+			memmove(output + out, input + in, n);
+			in += n;
+			out += n;
+			continue;
+		}
+
+		n = (size_t) (token & 0x7f) + SSBF_RLE_MIN_RUN;
+		if (SSBF_RLE_LONG_RUN == token)
+		{
+			if (input_size - in < 2)
+			{
+				return -1;
+			}
+
+			n = input[in] | ((size_t) input[in + 1] << 8);
+			in += 2;
+		}
+
+		if (input_size == in || output_max_size - out < n)
+		{
+			return -1;
+		}
+
+		memset(output + out, input[in++], n);
+		out += n;
+	}
+
+	return (int32_t) out;
+}
+
+// Runs write more than they read. Literals read one byte more than
+// they write, but the encoder only ends literals before the full 128
+// bytes if a run follows, so at most one literal token per 129 bytes
+// is not made up for by a run after it.
+static size_t ssbf_rle_inplace_margin(size_t compressed_size)
+{
+	return compressed_size / (SSBF_RLE_MAX_LITERALS + 1) + 1;
+}
+#endif
+
+static const struct ssbf_codec ssbf_codec_list[] = {
+#if SSBF_CONFIG_CODEC_RLE
+	{
+		.name = "rle",
+		.id = SSBF_CODEC_RLE,
+		.compress = SSBF_CODEC_COMPRESS(ssbf_rle_compress),
+		.decompress = ssbf_rle_decompress,
+		.inplace_margin = ssbf_rle_inplace_margin,
+	},
+#endif
+#if SSBF_CONFIG_CODEC_LZ4
+	{
+		.name = "lz4",
+		.id = SSBF_CODEC_LZ4,
+		.compress = SSBF_CODEC_COMPRESS(ssbf_lz4_compress),
+		.decompress = ssbf_lz4_decompress,
+		.inplace_margin = ssbf_lz4_inplace_margin,
+	},
+#endif
+#if SSBF_CONFIG_ENCODER && SSBF_CONFIG_LZ4HC
+	{
+		.name = "lz4hc",
+		.id = SSBF_CODEC_LZ4,
+		.compress = ssbf_lz4hc_compress,
+		.decompress = ssbf_lz4_decompress,
+		.inplace_margin = ssbf_lz4_inplace_margin,
+	},
+#endif
+};
+
+const struct ssbf_codec *ssbf_codecs(size_t *count)
+{
+	*count = sizeof(ssbf_codec_list) / sizeof(ssbf_codec_list[0]);
+	return ssbf_codec_list;
+}
+
+const struct ssbf_codec *ssbf_codec_by_id(uint8_t id)
+{
+	size_t count = 0;
+	const struct ssbf_codec *codecs = ssbf_codecs(&count);
+
+	for (size_t i = 0; count > i; i++)
+	{
+		if (codecs[i].id == id)
+		{
+			return &codecs[i];
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef SSBF_CODEC_H
+#define SSBF_CODEC_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Format of a compressed block payload, stored in the block flags.
+// LZ4 and LZ4 HC make the same format.
+enum ssbf_codec_ids {
+	SSBF_CODEC_LZ4 = 0,
+	SSBF_CODEC_RLE = 1,
+};
+
+// Block compression. Blocks which don't get smaller are stored as is,
+// so compress only has to fill output_max_size (less than the input),
+// and decompress needs no memory besides the output.
+struct ssbf_codec {
+	const char *name;
+	uint8_t id; // enum ssbf_codec_ids
+	// returns the compressed size, 0 if it does not fit in
+	// output_max_size. level is ssbf_encode_options.compression_level.
+	size_t (*compress)(const uint8_t *input, size_t input_size,
+			   uint8_t *output, size_t output_max_size,
+			   int level);
+	// returns the decompressed size, < 0 if the input is corrupted
+	int32_t (*decompress)(const uint8_t *input, size_t input_size,
+			      uint8_t *output, size_t output_max_size);
+	// how far the compressed data must end after the end of its
+	// output, so decompressing in place does not overwrite input
+	// which is not read yet
+	size_t (*inplace_margin)(size_t compressed_size);
+};
+
+// Codecs the encoder can use, codec n is enabled with bit n of
+// ssbf_encode_options.codecs (enum SSBF_ENCODE_CODECS). On equal
+// size the first one is used, so they are ordered by decode speed.
+// Without SSBF_CONFIG_ENCODER compress is NULL and only the codecs
+// compiled in are listed.
+const struct ssbf_codec *ssbf_codecs(size_t *count);
+
+// Codec which decompresses blocks of format id, NULL if unknown
+const struct ssbf_codec *ssbf_codec_by_id(uint8_t id);
+
+#endif
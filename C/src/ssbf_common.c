@@ -5,13 +5,14 @@
 
 //#include "debug_io.h"
 
-#include "lz4.h"
-#include "lz4hc.h"
-
 #include "monocypher.h"
 
+#include "ssbf_cipher.h"
+
 #include "ssbf.h"
 #include "ssbf_internal.h"
+#include "ssbf_common.h"
+#include "ssbf_codec.h"
 
 uint8_t bsd_checksum8_from(uint8_t start_checksum, uint8_t *data, size_t data_size)
 {
@@ -30,9 +31,10 @@ uint8_t bsd_checksum8(uint8_t *data, size_t data_size)
         return bsd_checksum8_from(0, data, data_size);
 }
 
-uint16_t bsd_checksum16(uint8_t *data, size_t data_size)
+uint16_t bsd_checksum16_from(uint16_t start_checksum, 
+			     uint8_t *data, size_t data_size)
 {
-        uint16_t checksum = 0;
+        uint16_t checksum = start_checksum;
         uint32_t i;
         for (i = 0; data_size > i; i++)
         {
@@ -42,58 +44,296 @@ uint16_t bsd_checksum16(uint8_t *data, size_t data_size)
         return checksum;
 }
 
-uint32_t ssbf_compress_lz4(uint8_t *data_in, uint8_t *data_out, 
-			  uint32_t data_size_to_compress, 
-			  uint8_t *flags)
+uint16_t bsd_checksum16(uint8_t *data, size_t data_size)
 {
+        return bsd_checksum16_from(0, data, data_size);
+}
 
-	uint32_t r = LZ4_compress_HC ((char *) data_in, (char *) data_out,
-				 (int) data_size_to_compress, 
-				 (int) data_size_to_compress, 
-				 LZ4HC_CLEVEL_MAX);
+#if SSBF_CONFIG_CHECKSUM_CRC16
+// CRC-16/XMODEM (polynomial 0x1021, MSB first, no final xor), a 16
+// entry table per 4 bits keeps it small for MCUs
+uint16_t crc16_from(uint16_t start_checksum, uint8_t *data, size_t data_size)
+{
+	static const uint16_t table[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+		0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	};
+	uint16_t crc = start_checksum;
 
-        //int r = LZ4_compress_default((char *) data_in,
-        //                             (char *) data_out,
-        //                             data_size_to_compress, max_block_size);
+	for (size_t i = 0; data_size > i; i++)
+	{
+		crc = (uint16_t) ((crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)]);
+		crc = (uint16_t) ((crc << 4) ^ table[(crc >> 12) ^ (data[i] & 15)]);
+	}
 
+	return crc;
+}
+#endif
 
-        // compression failed or bigger than original
-        if (0 == r || data_size_to_compress <= r) 
-        {
-                // just copy original data
-                memcpy(data_out, data_in, data_size_to_compress);
-                r = data_size_to_compress;
-        }
-	else
+#if SSBF_CONFIG_CHECKSUM_CRC32
+// CRC-32 (reflected polynomial 0xedb88320), continues like zlib crc32:
+// start_checksum is the CRC of the data before, 0 for none
+uint32_t crc32_from(uint32_t start_checksum, uint8_t *data, size_t data_size)
+{
+	static const uint32_t table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+	};
+	uint32_t crc = ~start_checksum;
+
+	for (size_t i = 0; data_size > i; i++)
+	{
+		crc ^= data[i];
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+
+	return ~crc;
+}
+#endif
+
+// Types which are not compiled in are rejected by ssbf_open
+static uint32_t ssbf_checksum_from(uint8_t type, uint32_t start_checksum,
+				   uint8_t *data, size_t data_size)
+{
+#if SSBF_CONFIG_CHECKSUM_CRC32
+	if (SSBF_CHECKSUM_CRC32 == type)
 	{
-		*flags |= BHF_BLOCK_COMPRESSED;
+		return crc32_from(start_checksum, data, data_size);
 	}
-        
-        return r;
+#endif
+
+#if SSBF_CONFIG_CHECKSUM_CRC16
+	if (SSBF_CHECKSUM_CRC16 == type)
+	{
+		return crc16_from((uint16_t) start_checksum, data, data_size);
+	}
+#endif
+
+	(void) type;
+	return bsd_checksum16_from((uint16_t) start_checksum, data, data_size);
+}
+
+#if SSBF_CONFIG_ENCODER
+
+void ssbf_checksum_init(struct ssbf_checksum_state *state, uint8_t type)
+{
+	state->size = 0;
+	state->checksum = 0;
+	state->type = type;
+}
+
+void ssbf_checksum_update(struct ssbf_checksum_state *state,
+			  uint8_t *data, size_t data_size)
+{
+	state->checksum = ssbf_checksum_from(state->type, state->checksum,
+					     data, data_size);
+	state->size += data_size;
+}
+#endif
+
+// Block payload checksum of the type set in the data header flags.
+// All checksum types are 0 for no data and continue from start.
+uint16_t ssbf_block_checksum_from(uint8_t data_header_flags,
+				  uint16_t start_checksum,
+				  uint8_t *data, size_t data_size)
+{
+#if SSBF_CONFIG_CHECKSUM_CRC16
+	uint8_t type = (data_header_flags 
+			& SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK)
+		>> SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT;
+
+	if (SSBF_CHECKSUM_CRC16 == type)
+	{
+		return crc16_from(start_checksum, data, data_size);
+	}
+#else
+	(void) data_header_flags;
+#endif
+
+	return bsd_checksum16_from(start_checksum, data, data_size);
+}
+
+uint8_t ssbf_data_checksum_type(uint8_t data_header_flags)
+{
+	return (data_header_flags & SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_MASK)
+		>> SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_SHIFT;
+}
+
+// Checksum of the whole data (full_data_checksum) of the type set in
+// the data header flags
+uint32_t ssbf_data_checksum_from(uint8_t data_header_flags,
+				 uint32_t start_checksum,
+				 uint8_t *data, size_t data_size)
+{
+	return ssbf_checksum_from(ssbf_data_checksum_type(data_header_flags),
+				  start_checksum, data, data_size);
 }
 
-int32_t sdf_decompress_lz4(uint8_t *data_in, uint8_t *data_out, 
-			    size_t compressed_data_size, size_t max_block_size)
+#if SSBF_CONFIG_BLOCK_TAGS
+// Tag of a block (SSBF_BLOCK_TAG_SIZE bytes): Poly1305 over the block
+// number, size and flags and the block data in front of the tag,
+// truncated. The last block flag is left out, so appending to a file
+// does not need a second tag with the same key. The one time Poly1305
+// key is the start of the key_data XChaCha20 stream with the block
+// number and a domain byte as nonce, so it never overlaps the key
+// stream which encrypts the block.
+void ssbf_block_tag(uint8_t *tag,
+		    const uint8_t key_data[32],
+		    const struct ssbf_payload_block_header *block_header,
+		    const uint8_t *block_data,
+		    size_t block_data_size)
 {
-        int32_t r = LZ4_decompress_safe((char *) data_in,
-                                        (char *) data_out,
-                                        compressed_data_size, max_block_size);
-        return r;
+	uint8_t nonce[24];
+	uint8_t key[32];
+	uint8_t mac[16];
+	crypto_poly1305_ctx ctx;
+
+	memset(nonce, 0, sizeof(nonce));
+	nonce[0] = block_header->block_number & 0xff;
+	nonce[1] = (block_header->block_number >> 8) & 0xff;
+	nonce[23] = 't';
+
+	memset(key, 0, sizeof(key));
+	ssbf_chacha20_x(key, key, sizeof(key), key_data, nonce, 0);
+
+	// the checksums depend on the tag, so they are not covered
+	uint8_t fields[5] = {
+		block_header->block_number & 0xff,
+		(block_header->block_number >> 8) & 0xff,
+		block_header->compressed_size & 0xff,
+		(block_header->compressed_size >> 8) & 0xff,
+		(uint8_t) (block_header->flags & ~BHF_LAST_BLOCK),
+	};
+
+	crypto_poly1305_init(&ctx, key);
+	crypto_poly1305_update(&ctx, fields, sizeof(fields));
+	crypto_poly1305_update(&ctx, block_data, block_data_size);
+	crypto_poly1305_final(&ctx, mac);
+
+	memcpy(tag, mac, SSBF_BLOCK_TAG_SIZE);
+
+	crypto_wipe(key, sizeof(key));
+	crypto_wipe(mac, sizeof(mac));
+}
+#endif
+
+// Block alignment in bytes as set in the main header, 1 = packed
+size_t ssbf_block_alignment(uint8_t main_header_flags)
+{
+	uint8_t alignment_log2 = 
+		(main_header_flags & SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK)
+		>> SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT;
+
+	return (size_t) 1 << alignment_log2;
+}
+
+// Zero bytes after a block ending at offset (from the start of the
+// first block), so the next block is aligned as set in the main header
+size_t ssbf_block_padding(size_t offset, uint8_t main_header_flags)
+{
+	size_t alignment = ssbf_block_alignment(main_header_flags);
+
+	return (alignment - (offset & (alignment - 1))) & (alignment - 1);
 }
 
+// Margin needed to decode the blocks in place: the ssbf image is at the
+// end of a buffer of full_data_size + margin bytes and the data is
+// decoded to its start. The output of a block must not reach the rest
+// of the image, compressed blocks also need the LZ4 in place margin.
+size_t ssbf_blocks_inplace_margin(uint8_t *blocks_start,
+				  size_t blocks_size,
+				  size_t header_size,
+				  size_t full_data_size,
+				  size_t max_block_size,
+				  uint8_t main_header_flags)
+{
+	struct ssbf_payload_block_header h;
+	bool variable_block_size = 
+		main_header_flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE;
+	size_t image_size = header_size + blocks_size;
+	size_t prefix_size = variable_block_size ? sizeof(uint16_t) : 0;
+	size_t offset = 0;
+	size_t output_offset = 0;
+
+	// the whole image must fit in the buffer
+	size_t margin = image_size > full_data_size 
+		? image_size - full_data_size : 0;
+
+	while (offset + sizeof(struct ssbf_payload_block_header) <= blocks_size)
+	{
+		memcpy(&h, blocks_start + offset, 
+		       sizeof(struct ssbf_payload_block_header));
+		offset += sizeof(struct ssbf_payload_block_header);
+
+		if (h.compressed_size < prefix_size
+		    || offset + h.compressed_size > blocks_size)
+		{
+			break;
+		}
+
+		size_t block_size = max_block_size;
+		if (variable_block_size)
+		{
+			uint16_t s;
+			memcpy(&s, blocks_start + offset, sizeof(s));
+			block_size = s;
+		}
+		else if (full_data_size - output_offset < max_block_size)
+		{
+			block_size = full_data_size - output_offset;
+		}
+
+		offset += h.compressed_size;
+		output_offset += block_size;
+
+		// The block input ends at full_data_size + margin
+		// - image_size + header_size + offset, its output must
+		// end before that. Both sides are shifted by image_size.
+		size_t input_end = full_data_size + header_size + offset;
+		size_t output_end = output_offset + image_size;
+
+		const struct ssbf_codec *codec = ssbf_codec_by_id(
+			(h.flags & BHF_BLOCK_CODEC_MASK) 
+			>> BHF_BLOCK_CODEC_SHIFT);
+
+		if ((h.flags & BHF_BLOCK_COMPRESSED)
+		    && !(h.flags & (BHF_BLOCK_BASE_COPY | BHF_BLOCK_REFERENCE))
+		    && codec)
+		{
+			output_end += codec->inplace_margin(
+				h.compressed_size - prefix_size);
+		}
 
+		if (output_end > input_end && output_end - input_end > margin)
+		{
+			margin = output_end - input_end;
+		}
+
+		if (h.flags & BHF_LAST_BLOCK)
+		{
+			break;
+		}
+
+		offset += ssbf_block_padding(offset, main_header_flags);
+	}
+
+	return margin;
+}
+
+#if SSBF_CONFIG_ENCODER
 void ssbf_crypto_inplace_chacha20(uint8_t key [ 32],
 				  uint8_t nonce [ 24],
 				  uint8_t *data,
 				  uint32_t data_size,
 				  uint8_t *flags)
 {
-	crypto_chacha20_x(data, data, data_size, key, nonce, 0);
+	ssbf_chacha20_x(data, data, data_size, key, nonce, 0);
 
 	//crypto_wipe(key,        32);
 
 	*flags |= BHF_BLOCK_ENCRYPTED;
 }
-
-
-
+#endif
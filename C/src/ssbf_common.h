@@ -2,17 +2,43 @@
 #define SSBF_COMMON_H
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 
+uint8_t bsd_checksum8_from(uint8_t start_checksum, 
+			   uint8_t *data, size_t data_size);
 uint8_t bsd_checksum8(uint8_t *data, size_t data_size);
+uint16_t bsd_checksum16_from(uint16_t start_checksum, 
+			     uint8_t *data, size_t data_size);
 uint16_t bsd_checksum16(uint8_t *data, size_t data_size);
+uint16_t crc16_from(uint16_t start_checksum, uint8_t *data, size_t data_size);
+uint32_t crc32_from(uint32_t start_checksum, uint8_t *data, size_t data_size);
 
-uint32_t ssbf_compress_lz4(uint8_t *data_in, uint8_t *data_out, 
-			   int32_t data_size_to_compress, 
-			   uint8_t *flags);
+uint16_t ssbf_block_checksum_from(uint8_t data_header_flags,
+				  uint16_t start_checksum,
+				  uint8_t *data, size_t data_size);
+uint8_t ssbf_data_checksum_type(uint8_t data_header_flags);
+uint32_t ssbf_data_checksum_from(uint8_t data_header_flags,
+				 uint32_t start_checksum,
+				 uint8_t *data, size_t data_size);
 
-int32_t sdf_decompress_lz4(uint8_t *data_in, uint8_t *data_out, 
-			   size_t compressed_data_size, 
-			   size_t max_block_size);
+struct ssbf_payload_block_header;
+
+void ssbf_block_tag(uint8_t *tag,
+		    const uint8_t key_data[32],
+		    const struct ssbf_payload_block_header *block_header,
+		    const uint8_t *block_data,
+		    size_t block_data_size);
+
+size_t ssbf_block_alignment(uint8_t main_header_flags);
+size_t ssbf_block_padding(size_t offset, uint8_t main_header_flags);
+
+size_t ssbf_blocks_inplace_margin(uint8_t *blocks_start,
+				  size_t blocks_size,
+				  size_t header_size,
+				  size_t full_data_size,
+				  size_t max_block_size,
+				  uint8_t main_header_flags);
 
 void ssbf_crypto_inplace_chacha20(uint8_t key [ 32],
 				  uint8_t nonce [ 24],
@@ -0,0 +1,111 @@
+#ifndef SSBF_CONFIG_H
+#define SSBF_CONFIG_H
+
+// Features compiled into the library. SSBF_PROFILE picks the defaults,
+// every SSBF_CONFIG_ option can still be set on its own with -D or in
+// a header of the project given as -D SSBF_CONFIG_FILE=\"file.h\".
+// Files which need a feature that is not compiled in are rejected by
+// ssbf_open with SSBF_GENERIC_ERROR (SSBF_DECRYPTION_FAILED if they
+// are encrypted and SSBF_BASE_DATA_MISMATCH if they are delta files).
+
+#ifdef SSBF_CONFIG_FILE
+#include SSBF_CONFIG_FILE
+#endif
+
+// encoder and decoder with everything, for host tools
+#define SSBF_PROFILE_FULL 0
+// decoder with everything, no compressors (ssbf_encoder.c and lz4hc.c
+// are not linked)
+#define SSBF_PROFILE_DECODE 1
+// bootloader decoder: encrypted LZ4 files with BSD16 checksums, no
+// block tags, no delta, portable ChaCha20
+#define SSBF_PROFILE_BOOT 2
+// bootloader decoder of files without encryption, only the header
+// hash of Monocypher is linked
+#define SSBF_PROFILE_BOOT_PLAIN 3
+
+#ifndef SSBF_PROFILE
+#define SSBF_PROFILE SSBF_PROFILE_FULL
+#endif
+
+#if SSBF_PROFILE == SSBF_PROFILE_FULL
+#define SSBF_PROFILE_ENCODER 1
+#else
+#define SSBF_PROFILE_ENCODER 0
+#endif
+
+#if SSBF_PROFILE == SSBF_PROFILE_FULL || SSBF_PROFILE == SSBF_PROFILE_DECODE
+#define SSBF_PROFILE_ALL_FEATURES 1
+#else
+#define SSBF_PROFILE_ALL_FEATURES 0
+#endif
+
+// compressors, ssbf_encoder.c and the host tools need it
+#ifndef SSBF_CONFIG_ENCODER
+#define SSBF_CONFIG_ENCODER SSBF_PROFILE_ENCODER
+#endif
+
+// LZ4 HC compressor (lz4hc.c)
+#ifndef SSBF_CONFIG_LZ4HC
+#define SSBF_CONFIG_LZ4HC SSBF_CONFIG_ENCODER
+#endif
+
+#ifndef SSBF_CONFIG_CODEC_LZ4
+#define SSBF_CONFIG_CODEC_LZ4 1
+#endif
+
+#ifndef SSBF_CONFIG_CODEC_RLE
+#define SSBF_CONFIG_CODEC_RLE SSBF_PROFILE_ALL_FEATURES
+#endif
+
+// files with the crypto extension (XChaCha20, Poly1305)
+#ifndef SSBF_CONFIG_ENCRYPTION
+#define SSBF_CONFIG_ENCRYPTION (SSBF_PROFILE != SSBF_PROFILE_BOOT_PLAIN)
+#endif
+
+// SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS
+#ifndef SSBF_CONFIG_BLOCK_TAGS
+#define SSBF_CONFIG_BLOCK_TAGS \
+	(SSBF_PROFILE_ALL_FEATURES && SSBF_CONFIG_ENCRYPTION)
+#endif
+
+// SIMD ChaCha20 backends and their self test (ssbf_cipher.c)
+#ifndef SSBF_CONFIG_CIPHER_SIMD
+#define SSBF_CONFIG_CIPHER_SIMD SSBF_PROFILE_ALL_FEATURES
+#endif
+
+// SSBF_CHECKSUM_CRC16 block checksums, BSD16 is always there
+#ifndef SSBF_CONFIG_CHECKSUM_CRC16
+#define SSBF_CONFIG_CHECKSUM_CRC16 SSBF_PROFILE_ALL_FEATURES
+#endif
+
+// SSBF_CHECKSUM_CRC32 full data checksum
+#ifndef SSBF_CONFIG_CHECKSUM_CRC32
+#define SSBF_CONFIG_CHECKSUM_CRC32 SSBF_PROFILE_ALL_FEATURES
+#endif
+
+// base copy blocks of delta files (SSBF_DATA_HEADER_FLAG_DELTA)
+#ifndef SSBF_CONFIG_DELTA
+#define SSBF_CONFIG_DELTA SSBF_PROFILE_ALL_FEATURES
+#endif
+
+#if SSBF_CONFIG_ENCODER && !(SSBF_CONFIG_LZ4HC && SSBF_CONFIG_CODEC_LZ4 \
+	&& SSBF_CONFIG_CODEC_RLE && SSBF_CONFIG_ENCRYPTION		\
+	&& SSBF_CONFIG_BLOCK_TAGS && SSBF_CONFIG_CHECKSUM_CRC16		\
+	&& SSBF_CONFIG_CHECKSUM_CRC32 && SSBF_CONFIG_DELTA)
+#error "the encoder needs all features"
+#endif
+
+#if !SSBF_CONFIG_CODEC_LZ4 && !SSBF_CONFIG_CODEC_RLE
+#error "at least one codec is needed"
+#endif
+
+#if SSBF_CONFIG_BLOCK_TAGS && !SSBF_CONFIG_ENCRYPTION
+#error "block tags need SSBF_CONFIG_ENCRYPTION"
+#endif
+
+#if !SSBF_CONFIG_CIPHER_SIMD && !defined(SSBF_CIPHER_NO_SIMD)
+#define SSBF_CIPHER_NO_SIMD
+#endif
+
+#endif
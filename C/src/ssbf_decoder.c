@@ -6,6 +6,8 @@
 #include "ssbf.h"
 #include "ssbf_internal.h"
 #include "ssbf_common.h"
+#include "ssbf_cipher.h"
+#include "ssbf_codec.h"
 
 #include "monocypher.h"
 
@@ -15,78 +17,563 @@
 #define STATIC static
 #endif
 
-STATIC enum ssbf_errors ssbf_decode_block(uint8_t *key_block,
-				struct ssbf_payload_block_header *block_header,
-				uint8_t *input_data,
-				uint8_t *output_data,
-				size_t output_data_max_mem_size,
-				size_t *output_data_actual_size)
+#if SSBF_CONFIG_DELTA
+static enum ssbf_errors ssbf_decode_base_copy_block(
+	uint8_t *payload,
+	size_t payload_size,
+	uint8_t *output_data,
+	size_t output_data_max_mem_size,
+	size_t *output_data_actual_size,
+	const struct ssbf_decode_options *options)
+{
+	struct ssbf_base_copy base_copy;
+
+	if (sizeof(struct ssbf_base_copy) != payload_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	memcpy(&base_copy, payload, sizeof(struct ssbf_base_copy));
+
+	if (NULL == options || NULL == options->base_data_start
+	    || base_copy.base_offset > options->base_data_size
+	    || base_copy.size > 
+	    (options->base_data_size - base_copy.base_offset))
+	{
+		return SSBF_BASE_DATA_MISMATCH;
+	}
+
+	if (base_copy.size > output_data_max_mem_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	uint8_t *base_data = options->base_data_start + base_copy.base_offset;
+
+	// make sure the device has the base image the delta was made for
+	if (bsd_checksum16(base_data, base_copy.size) 
+	    != base_copy.base_checksum)
+	{
+		return SSBF_BASE_DATA_MISMATCH;
+	}
+
+	memmove(output_data, base_data, base_copy.size);
+	*output_data_actual_size = base_copy.size;
+
+	return SSBF_NO_ERROR;
+}
+#endif
+
+// copies the data of an earlier block, which is already in the output
+static enum ssbf_errors ssbf_decode_reference_block(
+	struct ssbf_payload_block_header *block_header,
+	uint8_t *payload,
+	size_t payload_size,
+	uint8_t *output_data_start,
+	uint8_t *output_data,
+	size_t output_data_max_mem_size,
+	size_t *output_data_actual_size)
+{
+	struct ssbf_block_reference reference;
+
+	if (sizeof(struct ssbf_block_reference) != payload_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	memcpy(&reference, payload, sizeof(struct ssbf_block_reference));
+
+	size_t output_offset = output_data - output_data_start;
+
+	if (reference.block_number >= block_header->block_number
+	    || reference.output_offset > output_offset
+	    || reference.size > (output_offset - reference.output_offset))
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (reference.size > output_data_max_mem_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	memcpy(output_data, output_data_start + reference.output_offset,
+	       reference.size);
+	*output_data_actual_size = reference.size;
+
+	return SSBF_NO_ERROR;
+}
+
+// Sets the block to the byte in its payload. On an erased output
+// (options->output_erased) a block of the erased value is already
+// there and is not written, so flash is not programmed for it.
+static enum ssbf_errors ssbf_decode_fill_block(
+	uint8_t *payload,
+	size_t payload_size,
+	uint8_t *output_data,
+	size_t block_output_size,
+	size_t *output_data_actual_size,
+	const struct ssbf_decode_options *options)
+{
+	if (sizeof(uint8_t) != payload_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (!(options && options->output_erased
+	      && options->erased_value == payload[0]))
+	{
+		memset(output_data, payload[0], block_output_size);
+	}
+	*output_data_actual_size = block_output_size;
+
+	return SSBF_NO_ERROR;
+}
+
+// Size of the data the block decodes to, known without decoding it.
+// Variable size blocks store it in front of the payload, fixed size
+// blocks are all max_uncompressed_block_size long except the last one.
+enum ssbf_errors ssbf_block_output_size(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *input_data,
+	size_t *block_output_size)
+{
+	if (hi->mh.flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE)
+	{
+		uint16_t block_size;
+
+		if (sizeof(block_size) > block_header->compressed_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		memcpy(&block_size, input_data, sizeof(block_size));
+		*block_output_size = block_size;
+
+		return SSBF_NO_ERROR;
+	}
+
+	size_t max_block_size = hi->data_h.max_uncompressed_block_size;
+	size_t block_offset = block_header->block_number * max_block_size;
+
+	if (block_offset > hi->data_h.full_data_size_uncompressed)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	*block_output_size = hi->data_h.full_data_size_uncompressed 
+		- block_offset;
+
+	if (*block_output_size > max_block_size)
+	{
+		*block_output_size = max_block_size;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+// Checks the tag at the end of the block data, if the file has block
+// tags, and returns the size of the block data in front of it
+enum ssbf_errors ssbf_check_block_tag(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *input_data,
+	size_t *block_data_size)
+{
+	uint8_t tag[SSBF_BLOCK_TAG_SIZE];
+	uint8_t diff = 0;
+
+	*block_data_size = block_header->compressed_size;
+
+	if (!(hi->ch.flags & SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS))
+	{
+		return SSBF_NO_ERROR;
+	}
+
+#if !SSBF_CONFIG_BLOCK_TAGS
+	(void) input_data;
+	(void) tag;
+	(void) diff;
+	return SSBF_DECRYPTION_FAILED;
+#else
+	if (SSBF_BLOCK_TAG_SIZE > *block_data_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	*block_data_size -= SSBF_BLOCK_TAG_SIZE;
+
+	ssbf_block_tag(tag, hi->key_data, block_header, 
+		       input_data, *block_data_size);
+
+	// constant time compare
+	for (size_t i = 0; i < SSBF_BLOCK_TAG_SIZE; i++)
+	{
+		diff |= tag[i] ^ input_data[*block_data_size + i];
+	}
+
+	return diff ? SSBF_DECRYPTION_FAILED : SSBF_NO_ERROR;
+#endif
+}
+
+// Checks the tag and the size the block decodes to, and finds the
+// block payload after the variable block size
+static enum ssbf_errors ssbf_block_payload(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *input_data,
+	size_t output_data_max_mem_size,
+	uint8_t **payload,
+	size_t *payload_size,
+	size_t *block_output_size)
+{
+	// a modified block is rejected before anything is decoded
+	enum ssbf_errors r = ssbf_check_block_tag(hi, block_header,
+						  input_data, payload_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	r = ssbf_block_output_size(hi, block_header, input_data,
+				   block_output_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	if (*block_output_size > output_data_max_mem_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	*payload = input_data;
+
+	if (hi->mh.flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE)
+	{
+		if (sizeof(uint16_t) > *payload_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		*payload += sizeof(uint16_t);
+		*payload_size -= sizeof(uint16_t);
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+void ssbf_block_nonce(
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *nonce)
+{
+	// use block_number as a nonce
+	memset(nonce, 0, 24);
+	nonce[0] = block_header->block_number & 0xff;
+	nonce[1] = (block_header->block_number >> 8) & 0xff;
+}
+
+// Codec of a compressed block, NULL if it is not compiled in or the
+// file does not allow codecs other than LZ4
+const struct ssbf_codec *ssbf_block_codec(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header)
+{
+	uint8_t id = (block_header->flags & BHF_BLOCK_CODEC_MASK) 
+		>> BHF_BLOCK_CODEC_SHIFT;
+
+	if (SSBF_CODEC_LZ4 != id
+	    && !(hi->data_h.flags & SSBF_DATA_HEADER_FLAG_BLOCK_CODECS))
+	{
+		return NULL;
+	}
+
+	return ssbf_codec_by_id(id);
+}
+
+// Decodes the payload of a block to block_output_size bytes. Encrypted
+// payloads are decrypted first if decrypt is set, otherwise they must
+// be decrypted already.
+static enum ssbf_errors ssbf_decode_block_payload(
+	const struct ssbf_header_info *hi,
+	struct ssbf_payload_block_header *block_header,
+	uint8_t *payload,
+	size_t payload_size,
+	size_t block_output_size,
+	bool decrypt,
+	uint8_t *output_data_start,
+	uint8_t *output_data,
+	size_t *output_data_actual_size,
+	const struct ssbf_decode_options *options)
 {
+	enum ssbf_errors r = SSBF_NO_ERROR;
+
+	*output_data_actual_size = 0;
+
+	if (block_header->flags & BHF_BLOCK_BASE_COPY)
+	{
+#if SSBF_CONFIG_DELTA
+		r = ssbf_decode_base_copy_block(payload,
+						payload_size,
+						output_data,
+						block_output_size,
+						output_data_actual_size,
+						options);
+#else
+		r = SSBF_BASE_DATA_MISMATCH;
+#endif
+	}
+	else if (block_header->flags & BHF_BLOCK_REFERENCE)
+	{
+		r = ssbf_decode_reference_block(block_header,
+						payload,
+						payload_size,
+						output_data_start,
+						output_data,
+						block_output_size,
+						output_data_actual_size);
+	}
+	else if (block_header->flags & BHF_BLOCK_FILL)
+	{
+		r = ssbf_decode_fill_block(payload,
+					   payload_size,
+					   output_data,
+					   block_output_size,
+					   output_data_actual_size,
+					   options);
+	}
+	else
+	{
+		if ((block_header->flags & BHF_BLOCK_ENCRYPTED)
+		    && !(hi->mh.flags 
+			 & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION))
+		{
+			// there is no data key without the crypto header
+			return SSBF_DECRYPTION_FAILED;
+		}
+
+#if SSBF_CONFIG_ENCRYPTION
+		if (decrypt && (block_header->flags & BHF_BLOCK_ENCRYPTED))
+		{
+			// decrypt to the scratch buffer if there is one, so
+			// the input stays encrypted and can be read again
+			uint8_t *plain_payload = payload;
+			if (options && options->scratch)
+			{
+				if (payload_size > options->scratch_size)
+				{
+					return SSBF_NOT_ENOUGHT_DATA;
+				}
+				plain_payload = options->scratch;
+			}
+
+			uint8_t tmp_nonce[24];
+			ssbf_block_nonce(block_header, tmp_nonce);
+
+			ssbf_chacha20_x(plain_payload, payload, payload_size,
+					hi->key_data,
+					tmp_nonce,
+					0);
+			payload = plain_payload;
+		}
+#else
+		(void) decrypt;
+		(void) options;
+#endif
+
+		if (block_header->flags & BHF_BLOCK_COMPRESSED)
+		{
+			const struct ssbf_codec *codec = 
+				ssbf_block_codec(hi, block_header);
+			if (NULL == codec)
+			{
+				return SSBF_COMPRESSION_FAILED;
+			}
+
+			int32_t ds = codec->decompress(payload,
+						       payload_size,
+						       output_data,
+						       block_output_size);
+
+			if (0 >= ds)
+			{
+				return SSBF_COMPRESSION_FAILED;
+			}
+
+			*output_data_actual_size = ds;
+		}
+		else if (payload_size <= block_output_size)
+		{
+			// block stored as is
+			memmove(output_data, payload, payload_size);
+			*output_data_actual_size = payload_size;
+		}
+	}
 
-	uint8_t tmp_nonce[ 24];
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
 
-	memset(tmp_nonce, 0, sizeof(tmp_nonce));
-	tmp_nonce[0] = block_header->block_number & 0xff;
-	tmp_nonce[1] = (block_header->block_number >> 8) & 0xff;
+	if (*output_data_actual_size != block_output_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
 
+	return SSBF_NO_ERROR;
+}
 
+STATIC enum ssbf_errors ssbf_decode_block(const struct ssbf_header_info *hi,
+				struct ssbf_payload_block_header *block_header,
+				uint8_t *input_data,
+				uint8_t *output_data_start,
+				uint8_t *output_data,
+				size_t output_data_max_mem_size,
+				size_t *output_data_actual_size,
+				const struct ssbf_decode_options *options)
+{
 	// check checksum
-	uint16_t bcs = bsd_checksum16(input_data, block_header->compressed_size);
+	uint16_t bcs = ssbf_block_checksum_from(hi->data_h.flags, 0,
+						input_data,
+						block_header->compressed_size);
 	if (bcs != block_header->data_checksum)
 	{
 		return SSBF_CHECKSUM_FAILED;
 	}
 
-	ssbf_crypto_inplace_chacha20(key_block,
-				     tmp_nonce, // use block_number as a nonce
-				     input_data,
-				     block_header->compressed_size,
-				     &block_header->flags);
+	uint8_t *payload = NULL;
+	size_t payload_size = 0;
+	size_t block_output_size = 0;
+	enum ssbf_errors r = ssbf_block_payload(hi, block_header, input_data,
+						output_data_max_mem_size,
+						&payload, &payload_size,
+						&block_output_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	return ssbf_decode_block_payload(hi, block_header,
+					 payload, payload_size,
+					 block_output_size, true,
+					 output_data_start, output_data,
+					 output_data_actual_size, options);
+}
+
+// Reads the header of the block at offset (from the first block) and
+// checks that it is the expected block and its payload is in the input
+static enum ssbf_errors ssbf_next_block_header(
+	uint8_t *blocks_start,
+	size_t blocks_size,
+	size_t offset,
+	uint16_t block_number,
+	struct ssbf_payload_block_header *h)
+{
+	if (offset > blocks_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
 
+	size_t input_data_left = blocks_size - offset;
+	enum ssbf_errors r = ssbf_decode_block_header(blocks_start + offset,
+						      input_data_left,
+						      h);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
 
-	if (block_header->flags & BHF_BLOCK_COMPRESSED)
+	if (h->block_number != block_number
+	    || h->compressed_size > (input_data_left 
+		    - sizeof(struct ssbf_payload_block_header)))
 	{
-		*output_data_actual_size = 
-			sdf_decompress_lz4(input_data,
-					   output_data,
-					   block_header->compressed_size,
-					   output_data_max_mem_size);
+		return SSBF_GENERIC_ERROR;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+// Moves offset from the end of a block to the next block header over
+// the alignment padding, which must be zeros
+static enum ssbf_errors ssbf_skip_block_padding(uint8_t *blocks_start,
+						size_t blocks_size,
+						size_t *offset,
+						uint8_t main_header_flags)
+{
+	size_t padding = ssbf_block_padding(*offset, main_header_flags);
 
+	if (padding > blocks_size - *offset)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
 
-		// TODO: Should we check that it is not bigger that 
-		// max_block_size aswell?
-		if (0 >= *output_data_actual_size)
+	for (size_t i = 0; i < padding; i++)
+	{
+		if (blocks_start[*offset + i])
 		{
-			return SSBF_COMPRESSION_FAILED;
+			return SSBF_GENERIC_ERROR;
 		}
 	}
 
+	*offset += padding;
+
 	return SSBF_NO_ERROR;
 }
 
-STATIC enum ssbf_errors ssbf_decode_data_from_blocks(uint8_t *key_block,
-					 size_t max_block_size,
+static void ssbf_decode_checkpoint_seal(
+	struct ssbf_decode_checkpoint *checkpoint)
+{
+	checkpoint->checkpoint_checksum = bsd_checksum8(
+		(uint8_t *) checkpoint, 
+		sizeof(struct ssbf_decode_checkpoint) - 1);
+}
+
+void ssbf_decode_checkpoint_init(struct ssbf_decode_checkpoint *checkpoint)
+{
+	memset(checkpoint, 0, sizeof(struct ssbf_decode_checkpoint));
+	ssbf_decode_checkpoint_seal(checkpoint);
+}
+
+STATIC enum ssbf_errors ssbf_decode_data_from_blocks(
+					 const struct ssbf_header_info *hi,
 					 uint8_t *input_data_start,
 					 size_t input_data_size,
 					 uint8_t *output_data_start,				
 					 size_t output_data_max_size,
-					 size_t *actual_output_data_size)
+					 struct ssbf_decode_checkpoint *checkpoint,
+					 uint32_t max_blocks,
+					 const struct ssbf_decode_options *options)
 {
-	(void) max_block_size;
-
 	enum ssbf_errors r = SSBF_NO_ERROR;
-	uint8_t *input_data_current_p = input_data_start;
-	uint8_t *output_data_current_p = output_data_start;
 	struct ssbf_payload_block_header h;
+	uint32_t decoded_blocks = 0;
 
-	while((input_data_start + input_data_size) > input_data_current_p)
+	if (checkpoint->input_offset > input_data_size
+	    || checkpoint->output_offset > output_data_max_size)
 	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	while(input_data_size > checkpoint->input_offset
+	      && !(checkpoint->flags & SSBF_CHECKPOINT_FLAG_DONE))
+	{
+		if (max_blocks && max_blocks == decoded_blocks)
+		{
+			return SSBF_DECODE_IN_PROGRESS;
+		}
 
-		int32_t input_data_left = input_data_size 
-			- (input_data_current_p - input_data_start);
-		r = ssbf_decode_block_header(input_data_current_p,
-					     input_data_left,
-					     &h);
+		uint8_t *input_data_current_p = input_data_start 
+			+ checkpoint->input_offset;
+		uint8_t *output_data_current_p = output_data_start
+			+ checkpoint->output_offset;
+
+		// blocks must come in order, a resumed decode must continue
+		// exactly where it stopped
+		r = ssbf_next_block_header(input_data_start, input_data_size,
+					   checkpoint->input_offset,
+					   checkpoint->next_block_number,
+					   &h);
 		if (SSBF_NO_ERROR != r)
 		{
 			return r;
@@ -96,28 +583,64 @@ STATIC enum ssbf_errors ssbf_decode_data_from_blocks(uint8_t *key_block,
 
 
 		int32_t output_data_left = output_data_max_size 
-			- (output_data_current_p - output_data_start);
+			- checkpoint->output_offset;
 
 		size_t block_output_data_size = 0;
 
-		r = ssbf_decode_block(key_block,
+		r = ssbf_decode_block(hi,
 				      &h,
 				      input_data_current_p,
+				      output_data_start,
 				      output_data_current_p,
 				      output_data_left,
-				      &block_output_data_size);
+				      &block_output_data_size,
+				      options);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		size_t next_input_offset = checkpoint->input_offset
+			+ sizeof(struct ssbf_payload_block_header)
+			+ h.compressed_size;
+
+		if (!(h.flags & BHF_LAST_BLOCK))
+		{
+			r = ssbf_skip_block_padding(input_data_start,
+						    input_data_size,
+						    &next_input_offset,
+						    hi->mh.flags);
+			if (SSBF_NO_ERROR != r)
+			{
+				return r;
+			}
+		}
+
+		checkpoint->full_data_checksum = ssbf_data_checksum_from(
+			hi->data_h.flags, checkpoint->full_data_checksum,
+			output_data_current_p, block_output_data_size);
 
-		input_data_current_p += h.compressed_size;
-		output_data_current_p += block_output_data_size;
+		checkpoint->input_offset = next_input_offset;
+		checkpoint->output_offset += block_output_data_size;
+		checkpoint->next_block_number += 1;
 
+		if (h.flags & BHF_LAST_BLOCK)
+		{
+			checkpoint->flags |= SSBF_CHECKPOINT_FLAG_DONE;
+		}
 
-		*actual_output_data_size += block_output_data_size;
+		ssbf_decode_checkpoint_seal(checkpoint);
+
+		decoded_blocks += 1;
 
 		//printf("%i: %i -> %zu\n", h.block_number,
 		//       h.compressed_size,
 		//       block_output_data_size);
 	}
 
+	checkpoint->flags |= SSBF_CHECKPOINT_FLAG_DONE;
+	ssbf_decode_checkpoint_seal(checkpoint);
+
 	return r;
 }
 
@@ -144,103 +667,1110 @@ enum ssbf_errors ssbf_decode_block_header(
 	return SSBF_NO_ERROR;
 }
 
-enum ssbf_errors ssbf_decode_data(uint8_t *key_main, //[32],
-				  uint8_t *input_data_start,
-				  size_t input_data_size,
-				  uint8_t *output_data_start,				
-				  size_t output_data_max_size,
-				  size_t *actual_output_data_size)
+// Parses and checks the unencrypted part of the header, input_data
+// may contain only the header
+enum ssbf_errors ssbf_decode_plain_headers(uint8_t *input_data_start,
+					   size_t input_data_size,
+					   struct ssbf_header_info *hi)
 {
-
-	(void) input_data_size;
-
 	const uint16_t full_header_hash_mac_size = 16;
 
 	uint8_t *input_data_current_p = input_data_start;
 
+	if (sizeof(struct ssbf_main_header) > input_data_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
 	// main header
-	struct ssbf_main_header mh;
-	memcpy(&mh, input_data_current_p, sizeof(struct ssbf_main_header));
+	memcpy(&hi->mh, input_data_current_p, sizeof(struct ssbf_main_header));
 	input_data_current_p += sizeof(struct ssbf_main_header);
 
-	uint16_t cs = bsd_checksum8(
-		(uint8_t *) &mh, sizeof(struct ssbf_main_header)-1);
-	if (cs != mh.header_checksum)
+	uint8_t cs = bsd_checksum8(
+		(uint8_t *) &hi->mh, sizeof(struct ssbf_main_header)-1);
+	if (cs != hi->mh.header_checksum)
 	{
 		return SSBF_CHECKSUM_FAILED;
 	}
 
+	if (hi->mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION)
+	{
+		if ((sizeof(struct ssbf_main_header) 
+		     + sizeof(struct ssbf_encryption_header)) > input_data_size)
+		{
+			return SSBF_NOT_ENOUGHT_DATA;
+		}
 
-	// crypto header
-	struct ssbf_encryption_header ch;
-	memcpy(&ch, input_data_current_p, sizeof(struct ssbf_encryption_header));
-	input_data_current_p += sizeof(struct ssbf_encryption_header);
-
-	size_t full_header_size = 
-		+ sizeof(struct ssbf_main_header)
-		+ sizeof(struct ssbf_encryption_header)
-		+ ch.encrypted_header_size
-		+ full_header_hash_mac_size; // hash size
-
-	uint8_t *mac_addr_p = input_data_start 
-		+ full_header_size - full_header_hash_mac_size;
+		// crypto header
+		memcpy(&hi->ch, input_data_current_p, 
+		       sizeof(struct ssbf_encryption_header));
 
+		cs = bsd_checksum8(
+			(uint8_t *) &hi->ch, 
+			sizeof(struct ssbf_encryption_header)-1);
+		if (cs != hi->ch.header_checksum)
+		{
+			return SSBF_CHECKSUM_FAILED;
+		}
 
-	int r = crypto_aead_unlock(input_data_current_p, 
-				   mac_addr_p, 
-				   key_main, ch.nonce,
-				   input_data_start, 
-				   sizeof(struct ssbf_main_header)
-				   + sizeof(struct ssbf_encryption_header),
-				   input_data_current_p,
-				   ch.encrypted_header_size);
-	if (r)
-	{
-		return SSBF_DECRYPTION_FAILED;
+		hi->blocks_offset = 
+			+ sizeof(struct ssbf_main_header)
+			+ sizeof(struct ssbf_encryption_header)
+			+ hi->ch.encrypted_header_size
+			+ full_header_hash_mac_size; // hash size
 	}
+	else
+	{
+		// No crypto header, the rest of the header is plain. It is
+		// described as an encrypted header without the encryption
+		// payload, so the rest of the decoder handles both cases.
+		memset(&hi->ch, 0, sizeof(struct ssbf_encryption_header));
 
-	uint8_t key_data[32];
-	memcpy(key_data, input_data_current_p, ch.encryption_payload_size);
-	input_data_current_p += ch.encryption_payload_size;
-
+		if (sizeof(struct ssbf_main_header) > hi->mh.hashed_data_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
 
-	struct ssbf_meta_header meta_h;
+		hi->ch.encrypted_header_size = hi->mh.hashed_data_size
+			- sizeof(struct ssbf_main_header);
 
-	memcpy(&meta_h, input_data_current_p, sizeof(struct ssbf_meta_header));
-	input_data_current_p += sizeof(struct ssbf_meta_header);
+		hi->blocks_offset = hi->mh.hashed_data_size
+			+ full_header_hash_mac_size; // hash size
+	}
 
-	uint8_t meta_payload_data[meta_h.payload_size];
+	// the hash is followed by zero padding if the blocks are aligned
+	size_t hash_end = hi->blocks_offset;
+	hi->blocks_offset += ssbf_block_padding(hash_end, hi->mh.flags);
 
-	memcpy(meta_payload_data, input_data_current_p, meta_h.payload_size);
-	input_data_current_p += meta_h.payload_size;
+	if ((hi->ch.encryption_payload_size 
+	     + sizeof(struct ssbf_meta_header)
+	     + sizeof(struct ssbf_data_header)) 
+	    > hi->ch.encrypted_header_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
 
-	struct ssbf_data_header data_h;
+	// the blocks are checked by ssbf_open, only the header is needed
+	if (hash_end > input_data_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	memcpy(hi->header_mac, input_data_start 
+	       + hash_end - full_header_hash_mac_size,
+	       full_header_hash_mac_size);
+
+	return SSBF_NO_ERROR;
+}
+
+// Authenticates the header and decrypts the encrypted part of it to
+// header_plain (SSBF_HEADER_PLAIN_MAX_SIZE bytes). The input is not
+// modified, so the header can be unlocked again later. Without the
+// crypto extension the header is only checked against its hash.
+enum ssbf_errors ssbf_unlock_header(uint8_t *key_main, //[32],
+				    uint8_t *input_data_start,
+				    struct ssbf_header_info *hi,
+				    uint8_t *header_plain)
+{
+	// the size is not authenticated yet, bigger headers have meta data
+	// ssbf_open can't hold
+	if (hi->ch.encrypted_header_size > SSBF_HEADER_PLAIN_MAX_SIZE)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (hi->mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION)
+	{
+		uint8_t *encrypted_header = input_data_start
+			+ sizeof(struct ssbf_main_header)
+			+ sizeof(struct ssbf_encryption_header);
+
+		if (NULL == key_main)
+		{
+			return SSBF_DECRYPTION_FAILED;
+		}
+
+#if !SSBF_CONFIG_ENCRYPTION
+		(void) encrypted_header;
+		return SSBF_DECRYPTION_FAILED;
+#else
+		int r = crypto_aead_unlock(header_plain, 
+					   hi->header_mac, 
+					   key_main, hi->ch.nonce,
+					   input_data_start, 
+					   sizeof(struct ssbf_main_header)
+					   + sizeof(struct ssbf_encryption_header),
+					   encrypted_header,
+					   hi->ch.encrypted_header_size);
+		if (r)
+		{
+			return SSBF_DECRYPTION_FAILED;
+		}
+
+		if (sizeof(hi->key_data) != hi->ch.encryption_payload_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		memcpy(hi->key_data, header_plain, 
+		       hi->ch.encryption_payload_size);
+#endif
+	}
+	else
+	{
+		// integrity only, the hash has no key
+		uint8_t hash[16];
+		crypto_blake2b(hash, sizeof(hash),
+			       input_data_start, hi->mh.hashed_data_size);
+		if (crypto_verify16(hash, hi->header_mac))
+		{
+			return SSBF_CHECKSUM_FAILED;
+		}
+
+		memcpy(header_plain, 
+		       input_data_start + sizeof(struct ssbf_main_header),
+		       hi->ch.encrypted_header_size);
+		memset(hi->key_data, 0, sizeof(hi->key_data));
+	}
+
+	uint8_t *header_current_p = header_plain 
+		+ hi->ch.encryption_payload_size;
+
+	memcpy(&hi->meta_h, header_current_p, sizeof(struct ssbf_meta_header));
+	header_current_p += sizeof(struct ssbf_meta_header);
+
+	if ((header_current_p - header_plain) + hi->meta_h.payload_size
+	    + sizeof(struct ssbf_data_header) != hi->ch.encrypted_header_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	hi->meta_payload_data = header_current_p;
+	header_current_p += hi->meta_h.payload_size;
+
+	memcpy(&hi->data_h, header_current_p, sizeof(struct ssbf_data_header));
+
+	return SSBF_NO_ERROR;
+}
+
+static bool ssbf_checksums_supported(uint8_t data_header_flags)
+{
+	uint8_t block_type = (data_header_flags 
+			      & SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK)
+		>> SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT;
+	uint8_t data_type = ssbf_data_checksum_type(data_header_flags);
+
+	return (SSBF_CHECKSUM_BSD16 == block_type
+		|| (SSBF_CONFIG_CHECKSUM_CRC16 
+		    && SSBF_CHECKSUM_CRC16 == block_type))
+		&& (SSBF_CHECKSUM_BSD16 == data_type
+		    || (SSBF_CONFIG_CHECKSUM_CRC16 
+			&& SSBF_CHECKSUM_CRC16 == data_type)
+		    || (SSBF_CONFIG_CHECKSUM_CRC32 
+			&& SSBF_CHECKSUM_CRC32 == data_type));
+}
+
+// ssbf_open without checking that the blocks are in the input
+static enum ssbf_errors ssbf_open_header(
+	struct ssbf_file *file,
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	const struct ssbf_decode_options *options)
+{
+	memset(file, 0, sizeof(struct ssbf_file));
+
+	struct ssbf_header_info *hi = &file->hi;
+
+	enum ssbf_errors e = ssbf_decode_plain_headers(input_data_start,
+						       input_data_size,
+						       hi);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	// a file without the crypto extension is not authenticated, a
+	// caller with a key expects authenticated data
+	if (!(hi->mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION)
+	    && key_main && !(options && options->allow_unencrypted))
+	{
+		return SSBF_DECRYPTION_FAILED;
+	}
+
+	uint8_t header_plain[SSBF_HEADER_PLAIN_MAX_SIZE];
+
+	e = ssbf_unlock_header(key_main, input_data_start, hi, header_plain);
+
+	if (SSBF_NO_ERROR == e)
+	{
+		if (hi->meta_h.payload_size > sizeof(file->meta_payload))
+		{
+			e = SSBF_NOT_ENOUGHT_DATA;
+		}
+		else
+		{
+			memcpy(file->meta_payload, hi->meta_payload_data,
+			       hi->meta_h.payload_size);
+			hi->meta_payload_data = file->meta_payload;
+		}
+	}
+
+	crypto_wipe(header_plain, sizeof(header_plain));
+
+	// checksum types this decoder does not know or are not compiled in
+	if (SSBF_NO_ERROR == e
+	    && !ssbf_checksums_supported(hi->data_h.flags))
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+
+#if !SSBF_CONFIG_BLOCK_TAGS
+	if (SSBF_NO_ERROR == e
+	    && (hi->ch.flags & SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS))
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+#endif
+
+#if !SSBF_CONFIG_DELTA
+	if (SSBF_NO_ERROR == e
+	    && (hi->data_h.flags & SSBF_DATA_HEADER_FLAG_DELTA))
+	{
+		e = SSBF_BASE_DATA_MISMATCH;
+	}
+#endif
+
+	if (SSBF_NO_ERROR == e
+	    && (hi->data_h.flags & SSBF_DATA_HEADER_FLAG_DELTA)
+	    && (NULL == options || NULL == options->base_data_start))
+	{
+		e = SSBF_BASE_DATA_MISMATCH;
+	}
+
+	if (SSBF_NO_ERROR != e)
+	{
+		ssbf_close(file);
+		return e;
+	}
+
+	file->input_data_start = input_data_start;
+	file->input_data_size = input_data_size;
+	if (options)
+	{
+		file->options = *options;
+	}
+	memcpy(&file->file_id, hi->header_mac, sizeof(file->file_id));
+
+	return SSBF_NO_ERROR;
+}
+
+enum ssbf_errors ssbf_open(struct ssbf_file *file,
+			   uint8_t *key_main, //[32],
+			   uint8_t *input_data_start,
+			   size_t input_data_size,
+			   const struct ssbf_decode_options *options)
+{
+	enum ssbf_errors e = ssbf_open_header(file, key_main,
+					      input_data_start, input_data_size,
+					      options);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	if (file->hi.blocks_offset + file->hi.mh.blocks_sum_size 
+	    > input_data_size)
+	{
+		ssbf_close(file);
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+void ssbf_close(struct ssbf_file *file)
+{
+	crypto_wipe(file, sizeof(struct ssbf_file));
+}
 
-	memcpy(&data_h, input_data_current_p, sizeof(struct ssbf_data_header));
-	input_data_current_p += sizeof(struct ssbf_data_header);
+// Checks a stored checkpoint and starts it if it is new
+static enum ssbf_errors ssbf_file_checkpoint_start(
+	const struct ssbf_file *file,
+	struct ssbf_decode_checkpoint *checkpoint)
+{
+	uint8_t cs = bsd_checksum8((uint8_t *) checkpoint, 
+				   sizeof(struct ssbf_decode_checkpoint) - 1);
+	if (cs != checkpoint->checkpoint_checksum)
+	{
+		return SSBF_CHECKSUM_FAILED;
+	}
+
+	if (!(checkpoint->flags & SSBF_CHECKPOINT_FLAG_STARTED))
+	{
+		ssbf_decode_checkpoint_init(checkpoint);
+		checkpoint->file_id = file->file_id;
+		checkpoint->flags = SSBF_CHECKPOINT_FLAG_STARTED;
+		ssbf_decode_checkpoint_seal(checkpoint);
+	}
+	else if (checkpoint->file_id != file->file_id)
+	{
+		// checkpoint belongs to a different file
+		return SSBF_GENERIC_ERROR;
+	}
 
-	// skip the mac
-	input_data_current_p += full_header_hash_mac_size; // mac size
+	return SSBF_NO_ERROR;
+}
 
-	// if all is ok, output_data_current_p points now to start of the first block
-	if (input_data_current_p != (input_data_start + full_header_size))
+// Checks the decoded size and checksum once all blocks are decoded
+static enum ssbf_errors ssbf_file_decode_finish(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_decode_checkpoint *checkpoint)
+{
+	if (checkpoint->output_offset != hi->data_h.full_data_size_uncompressed)
 	{
-		printf("output data error 1\n");
+		return SSBF_NOT_ENOUGHT_DATA;
 	}
 
-	if (input_data_current_p + mh.blocks_sum_size != (input_data_start + input_data_size))
+	if (checkpoint->full_data_checksum != hi->data_h.full_data_checksum)
 	{
-		printf("output data error 2\n");
+		return SSBF_CHECKSUM_FAILED;
 	}
 
-	enum ssbf_errors e = ssbf_decode_data_from_blocks(
-		key_data,
-		data_h.max_uncompressed_block_size,
-		input_data_current_p,
-		mh.blocks_sum_size,
+	return SSBF_NO_ERROR;
+}
+
+enum ssbf_errors ssbf_file_decode(struct ssbf_file *file,
+				  uint8_t *output_data_start,
+				  size_t output_data_max_size,
+				  struct ssbf_decode_checkpoint *checkpoint,
+				  uint32_t max_blocks)
+{
+	enum ssbf_errors e = ssbf_file_checkpoint_start(file, checkpoint);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	const struct ssbf_header_info *hi = &file->hi;
+
+	e = ssbf_decode_data_from_blocks(
+		hi,
+		file->input_data_start + hi->blocks_offset,
+		hi->mh.blocks_sum_size,
 		output_data_start,				
 		output_data_max_size,
-		actual_output_data_size);
+		checkpoint,
+		max_blocks,
+		&file->options);
+
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	return ssbf_file_decode_finish(hi, checkpoint);
+}
+
+enum ssbf_errors ssbf_file_verify(struct ssbf_file *file)
+{
+	const struct ssbf_header_info *hi = &file->hi;
+	uint8_t *blocks_start = file->input_data_start + hi->blocks_offset;
+	size_t offset = 0;
+	size_t output_size = 0;
+	struct ssbf_payload_block_header h;
+
+	for (uint32_t block_number = 0; 
+	     offset < hi->mh.blocks_sum_size; 
+	     block_number++)
+	{
+		enum ssbf_errors r = ssbf_next_block_header(
+			blocks_start, hi->mh.blocks_sum_size,
+			offset, block_number, &h);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		uint8_t *payload = blocks_start + offset
+			+ sizeof(struct ssbf_payload_block_header);
+
+		if (ssbf_block_checksum_from(hi->data_h.flags, 0,
+					     payload, h.compressed_size) 
+		    != h.data_checksum)
+		{
+			return SSBF_CHECKSUM_FAILED;
+		}
+
+		size_t block_data_size = 0;
+		r = ssbf_check_block_tag(hi, &h, payload, &block_data_size);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		size_t block_output_size = 0;
+		r = ssbf_block_output_size(hi, &h, payload, &block_output_size);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		output_size += block_output_size;
+		offset += sizeof(struct ssbf_payload_block_header)
+			+ h.compressed_size;
+
+		if (h.flags & BHF_LAST_BLOCK)
+		{
+			break;
+		}
+
+		r = ssbf_skip_block_padding(blocks_start, 
+					    hi->mh.blocks_sum_size,
+					    &offset, hi->mh.flags);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+	}
+
+	if (output_size != hi->data_h.full_data_size_uncompressed)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+enum ssbf_errors ssbf_file_block_header(struct ssbf_file *file,
+					size_t offset,
+					uint16_t block_number,
+					struct ssbf_payload_block_header *h)
+{
+	return ssbf_next_block_header(
+		file->input_data_start + file->hi.blocks_offset,
+		file->hi.mh.blocks_sum_size,
+		offset, block_number, h);
+}
+
+enum ssbf_errors ssbf_file_skip_block(struct ssbf_file *file,
+				      const struct ssbf_payload_block_header *h,
+				      size_t *offset)
+{
+	if (h->flags & BHF_LAST_BLOCK)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	*offset += sizeof(struct ssbf_payload_block_header)
+		+ h->compressed_size;
+
+	return ssbf_skip_block_padding(
+		file->input_data_start + file->hi.blocks_offset,
+		file->hi.mh.blocks_sum_size,
+		offset, file->hi.mh.flags);
+}
+
+// Finds a block by its number, only the headers are read. offset is
+// from the first block, output_offset is where the block decodes to.
+static enum ssbf_errors ssbf_file_find_block(
+	struct ssbf_file *file,
+	uint16_t block_number,
+	size_t *offset,
+	size_t *output_offset,
+	struct ssbf_payload_block_header *h)
+{
+	uint8_t *blocks_start = file->input_data_start + file->hi.blocks_offset;
+
+	*offset = 0;
+	*output_offset = 0;
+
+	for (uint32_t i = 0; ; i++)
+	{
+		enum ssbf_errors r = ssbf_file_block_header(file, *offset, i, h);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		if (i == block_number)
+		{
+			return SSBF_NO_ERROR;
+		}
+
+		size_t block_output_size = 0;
+		r = ssbf_block_output_size(
+			&file->hi, h,
+			blocks_start + *offset 
+			+ sizeof(struct ssbf_payload_block_header),
+			&block_output_size);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		*output_offset += block_output_size;
+
+		r = ssbf_file_skip_block(file, h, offset);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+	}
+}
+
+enum ssbf_errors ssbf_file_decode_block(struct ssbf_file *file,
+					size_t offset,
+					struct ssbf_payload_block_header *h,
+					uint8_t *output_data,
+					size_t output_data_max_size,
+					size_t *output_data_actual_size)
+{
+	const struct ssbf_header_info *hi = &file->hi;
+	uint8_t *input_data = file->input_data_start + hi->blocks_offset
+		+ offset + sizeof(struct ssbf_payload_block_header);
+
+	*output_data_actual_size = 0;
+
+	if (!(h->flags & BHF_BLOCK_REFERENCE))
+	{
+		// output_data is a buffer of its own, not the erased output
+		struct ssbf_decode_options options = file->options;
+		options.output_erased = false;
+
+		return ssbf_decode_block(hi, h, input_data,
+					 output_data,
+					 output_data,
+					 output_data_max_size,
+					 output_data_actual_size,
+					 &options);
+	}
+
+	// the reference is checked like any other block, then the
+	// block it repeats is decoded instead
+	if (ssbf_block_checksum_from(hi->data_h.flags, 0,
+				     input_data, h->compressed_size)
+	    != h->data_checksum)
+	{
+		return SSBF_CHECKSUM_FAILED;
+	}
+
+	uint8_t *payload = NULL;
+	size_t payload_size = 0;
+	size_t block_output_size = 0;
+	enum ssbf_errors r = ssbf_block_payload(hi, h, input_data,
+						output_data_max_size,
+						&payload, &payload_size,
+						&block_output_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	struct ssbf_block_reference reference;
+
+	if (sizeof(struct ssbf_block_reference) != payload_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	memcpy(&reference, payload, sizeof(struct ssbf_block_reference));
+
+	if (reference.block_number >= h->block_number
+	    || reference.size != block_output_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	struct ssbf_payload_block_header reference_h;
+	size_t reference_offset = 0;
+	size_t reference_output_offset = 0;
+
+	r = ssbf_file_find_block(file, reference.block_number,
+				 &reference_offset, &reference_output_offset,
+				 &reference_h);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	// the encoder only refers to whole blocks which are stored
+	if ((reference_h.flags & BHF_BLOCK_REFERENCE)
+	    || reference_output_offset != reference.output_offset)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	r = ssbf_file_decode_block(file, reference_offset, &reference_h,
+				   output_data, block_output_size,
+				   output_data_actual_size);
+
+	if (SSBF_NO_ERROR == r && *output_data_actual_size != reference.size)
+	{
+		r = SSBF_GENERIC_ERROR;
+	}
+
+	return r;
+}
+
+enum ssbf_errors ssbf_file_read_block(struct ssbf_file *file,
+				      uint16_t block_number,
+				      uint8_t *output_data,
+				      size_t output_data_max_size,
+				      size_t *output_data_actual_size)
+{
+	size_t offset = 0;
+	size_t output_offset = 0;
+	struct ssbf_payload_block_header h;
+
+	*output_data_actual_size = 0;
+
+	// skip to the block, only the headers are read
+	enum ssbf_errors r = ssbf_file_find_block(file, block_number,
+						  &offset, &output_offset, &h);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	return ssbf_file_decode_block(file, offset, &h,
+				      output_data,
+				      output_data_max_size,
+				      output_data_actual_size);
+}
+
+// States of ssbf_step_decoder, every block goes through them in order
+enum ssbf_step_states {
+	SSBF_STEP_BLOCK_HEADER = 0,
+	SSBF_STEP_CHECKSUM,        // payload checksum, in chunks
+	SSBF_STEP_PAYLOAD,         // block tag and sizes, whole block
+	SSBF_STEP_DECRYPT,         // in chunks
+	SSBF_STEP_DECODE,          // LZ4 or copy, whole block
+	SSBF_STEP_OUTPUT_CHECKSUM, // full data checksum, in chunks
+	SSBF_STEP_FINISH,
+	SSBF_STEP_DONE,
+};
+
+_Static_assert(0 == SSBF_DECODE_STEP_CHUNK_SIZE % 64,
+	       "decryption chunks must be whole ChaCha20 blocks");
+
+enum ssbf_errors ssbf_decode_step_init(
+	struct ssbf_step_decoder *step,
+	struct ssbf_file *file,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	const struct ssbf_decode_checkpoint *checkpoint)
+{
+	memset(step, 0, sizeof(struct ssbf_step_decoder));
+	step->file = file;
+	step->output_data_start = output_data_start;
+	step->output_data_max_size = output_data_max_size;
+
+	if (checkpoint)
+	{
+		step->checkpoint = *checkpoint;
+	}
+	else
+	{
+		ssbf_decode_checkpoint_init(&step->checkpoint);
+	}
+
+	step->error = ssbf_file_checkpoint_start(file, &step->checkpoint);
+
+	if (SSBF_NO_ERROR == step->error
+	    && (step->checkpoint.input_offset > file->hi.mh.blocks_sum_size
+		|| step->checkpoint.output_offset > output_data_max_size))
+	{
+		step->error = SSBF_GENERIC_ERROR;
+	}
+
+	return step->error;
+}
+
+static size_t ssbf_step_chunk(const struct ssbf_step_decoder *step,
+			      size_t size)
+{
+	size_t left = size - step->offset;
+
+	return (left < SSBF_DECODE_STEP_CHUNK_SIZE) 
+		? left : SSBF_DECODE_STEP_CHUNK_SIZE;
+}
+
+// Does one unit of work and moves to the next state. work is the
+// number of bytes processed.
+static enum ssbf_errors ssbf_decode_step_unit(struct ssbf_step_decoder *step,
+					      size_t *work)
+{
+	const struct ssbf_header_info *hi = &step->file->hi;
+	const struct ssbf_decode_options *options = &step->file->options;
+	struct ssbf_decode_checkpoint *checkpoint = &step->checkpoint;
+	uint8_t *blocks_start = step->file->input_data_start + hi->blocks_offset;
+	size_t blocks_size = hi->mh.blocks_sum_size;
+	uint8_t *output_data = step->output_data_start 
+		+ checkpoint->output_offset;
+	enum ssbf_errors r = SSBF_NO_ERROR;
+	size_t n = 0;
+
+	*work = 0;
+
+	switch (step->state)
+	{
+	case SSBF_STEP_BLOCK_HEADER:
+		if ((checkpoint->flags & SSBF_CHECKPOINT_FLAG_DONE)
+		    || checkpoint->input_offset >= blocks_size)
+		{
+			checkpoint->flags |= SSBF_CHECKPOINT_FLAG_DONE;
+			ssbf_decode_checkpoint_seal(checkpoint);
+			step->state = SSBF_STEP_FINISH;
+			break;
+		}
+
+		r = ssbf_next_block_header(blocks_start, blocks_size,
+					   checkpoint->input_offset,
+					   checkpoint->next_block_number,
+					   &step->h);
+
+		step->payload = blocks_start + checkpoint->input_offset
+			+ sizeof(struct ssbf_payload_block_header);
+		step->payload_size = step->h.compressed_size;
+		step->offset = 0;
+		step->checksum = 0;
+		step->state = SSBF_STEP_CHECKSUM;
+		break;
+
+	case SSBF_STEP_CHECKSUM:
+		n = ssbf_step_chunk(step, step->payload_size);
+		step->checksum = ssbf_block_checksum_from(
+			hi->data_h.flags, (uint16_t) step->checksum,
+			step->payload + step->offset, n);
+		step->offset += n;
+		*work = n;
+
+		if (step->offset == step->payload_size)
+		{
+			if (step->checksum != step->h.data_checksum)
+			{
+				r = SSBF_CHECKSUM_FAILED;
+			}
+			step->state = SSBF_STEP_PAYLOAD;
+		}
+		break;
+
+	case SSBF_STEP_PAYLOAD:
+		r = ssbf_block_payload(hi, &step->h, step->payload,
+				       step->output_data_max_size 
+				       - checkpoint->output_offset,
+				       &step->payload, &step->payload_size,
+				       &step->block_output_size);
+
+		if (hi->ch.flags & SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS)
+		{
+			*work = step->h.compressed_size;
+		}
+
+		step->offset = 0;
+		step->state = SSBF_STEP_DECODE;
+
+		if ((step->h.flags & BHF_BLOCK_ENCRYPTED)
+		    && !(step->h.flags & (BHF_BLOCK_BASE_COPY 
+					  | BHF_BLOCK_REFERENCE
+					  | BHF_BLOCK_FILL))
+		    && (hi->mh.flags 
+			& SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION))
+		{
+			if (options->scratch 
+			    && step->payload_size > options->scratch_size)
+			{
+				r = SSBF_NOT_ENOUGHT_DATA;
+			}
+			step->state = SSBF_STEP_DECRYPT;
+		}
+		break;
+
+	case SSBF_STEP_DECRYPT:
+	{
+#if !SSBF_CONFIG_ENCRYPTION
+		// encrypted files are not opened
+		r = SSBF_DECRYPTION_FAILED;
+		break;
+#else
+		// the same as decrypting the whole payload at once, the
+		// counter continues at the chunk
+		uint8_t *plain_payload = options->scratch 
+			? options->scratch : step->payload;
+		uint8_t tmp_nonce[24];
+		ssbf_block_nonce(&step->h, tmp_nonce);
+
+		n = ssbf_step_chunk(step, step->payload_size);
+		ssbf_chacha20_x(plain_payload + step->offset,
+				step->payload + step->offset, n,
+				hi->key_data, tmp_nonce, step->offset / 64);
+		step->offset += n;
+		*work = n;
+
+		if (step->offset == step->payload_size)
+		{
+			step->payload = plain_payload;
+			step->state = SSBF_STEP_DECODE;
+		}
+		break;
+#endif
+	}
+
+	case SSBF_STEP_DECODE:
+		r = ssbf_decode_block_payload(hi, &step->h,
+					      step->payload, step->payload_size,
+					      step->block_output_size, false,
+					      step->output_data_start,
+					      output_data, &n, options);
+		*work = n;
+
+		step->offset = 0;
+		step->checksum = checkpoint->full_data_checksum;
+		step->state = SSBF_STEP_OUTPUT_CHECKSUM;
+		break;
+
+	case SSBF_STEP_OUTPUT_CHECKSUM:
+	{
+		n = ssbf_step_chunk(step, step->block_output_size);
+		step->checksum = ssbf_data_checksum_from(
+			hi->data_h.flags, step->checksum,
+			output_data + step->offset, n);
+		step->offset += n;
+		*work = n;
+
+		if (step->offset < step->block_output_size)
+		{
+			break;
+		}
+
+		size_t next_input_offset = checkpoint->input_offset
+			+ sizeof(struct ssbf_payload_block_header)
+			+ step->h.compressed_size;
+
+		if (!(step->h.flags & BHF_LAST_BLOCK))
+		{
+			r = ssbf_skip_block_padding(blocks_start, blocks_size,
+						    &next_input_offset,
+						    hi->mh.flags);
+			if (SSBF_NO_ERROR != r)
+			{
+				break;
+			}
+		}
+
+		// the block is done, the checkpoint moves to the next one
+		checkpoint->full_data_checksum = step->checksum;
+		checkpoint->input_offset = next_input_offset;
+		checkpoint->output_offset += step->block_output_size;
+		checkpoint->next_block_number += 1;
+
+		if (step->h.flags & BHF_LAST_BLOCK)
+		{
+			checkpoint->flags |= SSBF_CHECKPOINT_FLAG_DONE;
+		}
+
+		ssbf_decode_checkpoint_seal(checkpoint);
+
+		step->state = SSBF_STEP_BLOCK_HEADER;
+		break;
+	}
+
+	case SSBF_STEP_FINISH:
+		r = ssbf_file_decode_finish(hi, checkpoint);
+		step->state = SSBF_STEP_DONE;
+		break;
+
+	default:
+		break;
+	}
+
+	return r;
+}
+
+enum ssbf_errors ssbf_decode_step(struct ssbf_step_decoder *step,
+				  size_t budget)
+{
+	size_t spent = 0;
+	bool worked = false;
+
+	while (SSBF_NO_ERROR == step->error
+	       && SSBF_STEP_DONE != step->state
+	       && (!worked || spent < budget))
+	{
+		size_t work = 0;
+
+		step->error = ssbf_decode_step_unit(step, &work);
+
+		spent += work;
+		worked = worked || work;
+	}
+
+	if (SSBF_NO_ERROR != step->error)
+	{
+		return step->error;
+	}
+
+	return (SSBF_STEP_DONE == step->state) 
+		? SSBF_NO_ERROR : SSBF_DECODE_IN_PROGRESS;
+}
+
+enum ssbf_errors ssbf_decode_data_resume(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	struct ssbf_decode_checkpoint *checkpoint,
+	uint32_t max_blocks,
+	const struct ssbf_decode_options *options)
+{
+	uint8_t cs = bsd_checksum8((uint8_t *) checkpoint, 
+				   sizeof(struct ssbf_decode_checkpoint) - 1);
+	if (cs != checkpoint->checkpoint_checksum)
+	{
+		return SSBF_CHECKSUM_FAILED;
+	}
+
+	struct ssbf_file file;
+
+	enum ssbf_errors e = ssbf_open(&file, key_main, 
+				       input_data_start, input_data_size,
+				       options);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	e = ssbf_file_decode(&file, output_data_start, output_data_max_size,
+			     checkpoint, max_blocks);
+
+	ssbf_close(&file);
+
+	return e;
+}
+
+enum ssbf_errors ssbf_decode_data(uint8_t *key_main, //[32],
+				  uint8_t *input_data_start,
+				  size_t input_data_size,
+				  uint8_t *output_data_start,				
+				  size_t output_data_max_size,
+				  size_t *actual_output_data_size,
+				  const struct ssbf_decode_options *options)
+{
+	struct ssbf_decode_checkpoint checkpoint;
+	ssbf_decode_checkpoint_init(&checkpoint);
+
+	enum ssbf_errors e = ssbf_decode_data_resume(key_main,
+						     input_data_start,
+						     input_data_size,
+						     output_data_start,
+						     output_data_max_size,
+						     &checkpoint,
+						     0,
+						     options);
+
+	*actual_output_data_size = checkpoint.output_offset;
+
+	return e;
+}
+
+enum ssbf_errors ssbf_inplace_buffer_size(
+	uint8_t *key_main, //[32],
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	const struct ssbf_decode_options *options,
+	size_t *buffer_size)
+{
+	struct ssbf_file file;
+
+	enum ssbf_errors e = ssbf_open_header(&file, key_main,
+					      input_data_start, input_data_size,
+					      options);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	const struct ssbf_header_info *hi = &file.hi;
+	size_t image_size = hi->blocks_offset + hi->mh.blocks_sum_size;
+
+	// with the image after the decoded data nothing is overwritten,
+	// so image_size is always enough
+	size_t margin = image_size;
+	if (hi->data_h.inplace_margin
+	    && (size_t) hi->data_h.inplace_margin * SSBF_INPLACE_MARGIN_UNIT 
+	    < margin)
+	{
+		margin = (size_t) hi->data_h.inplace_margin 
+			* SSBF_INPLACE_MARGIN_UNIT;
+	}
+
+	*buffer_size = hi->data_h.full_data_size_uncompressed + margin;
+
+	ssbf_close(&file);
+
+	return SSBF_NO_ERROR;
+}
+
+enum ssbf_errors ssbf_decode_inplace(uint8_t *key_main, //[32],
+				     uint8_t *buffer,
+				     size_t buffer_size,
+				     size_t input_data_size,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_decode_options *options)
+{
+	*actual_output_data_size = 0;
+
+	if (input_data_size > buffer_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	uint8_t *input_data_start = buffer + buffer_size - input_data_size;
+	struct ssbf_file file;
+
+	enum ssbf_errors e = ssbf_open(&file, key_main, 
+				       input_data_start, input_data_size,
+				       options);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	const struct ssbf_header_info *hi = &file.hi;
+	size_t full_data_size = hi->data_h.full_data_size_uncompressed;
+
+	// the buffer holds the image, it is not erased
+	file.options.output_erased = false;
+
+	// The recorded margin is not trusted, the block headers are
+	// checked again (before anything is written). Data after the
+	// last block moves the image to the left.
+	size_t margin = ssbf_blocks_inplace_margin(
+		input_data_start + hi->blocks_offset,
+		hi->mh.blocks_sum_size,
+		hi->blocks_offset,
+		full_data_size,
+		hi->data_h.max_uncompressed_block_size,
+		hi->mh.flags);
+	margin += input_data_size - (hi->blocks_offset + hi->mh.blocks_sum_size);
+
+	if (full_data_size + margin > buffer_size)
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+	else
+	{
+		struct ssbf_decode_checkpoint checkpoint;
+		ssbf_decode_checkpoint_init(&checkpoint);
+
+		e = ssbf_file_decode(&file, buffer, full_data_size,
+				     &checkpoint, 0);
+		*actual_output_data_size = checkpoint.output_offset;
+	}
+
+	ssbf_close(&file);
 
 	return e;
 }
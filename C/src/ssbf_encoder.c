@@ -1,14 +1,20 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ssbf.h"
 #include "ssbf_internal.h"
 #include "ssbf_common.h"
+#include "ssbf_codec.h"
 
 #include "monocypher.h"
 
+#if !SSBF_CONFIG_ENCODER
+#error "ssbf_encoder.c is not part of a decode only build (SSBF_CONFIG_ENCODER)"
+#endif
+
 
 #ifdef UNIT_TESTS
 #define STATIC
@@ -17,45 +23,138 @@
 #endif
 
 
-STATIC size_t ssbf_encode_block(uint8_t *key_data,
-				uint8_t *output_mem,
-				uint8_t *input_data_start, 
-				size_t input_data_size,
-				uint16_t block_number,
-				uint8_t input_flags)
+// Where the block payload starts. Files with variable size blocks
+// store the uncompressed size of the block in front of every payload.
+static uint8_t *ssbf_block_payload(const struct ssbf_encode_options *options,
+				   uint8_t *output_mem)
+{
+	uint8_t *payload = output_mem 
+		+ sizeof(struct ssbf_payload_block_header);
+
+	if (options && options->cdc_min_block_size)
+	{
+		payload += sizeof(uint16_t);
+	}
+
+	return payload;
+}
+
+// Checksum types and codec flag of the data header
+uint8_t ssbf_data_header_flags(const struct ssbf_encode_options *options)
+{
+	if (NULL == options)
+	{
+		return 0;
+	}
+
+	uint8_t flags = ((options->data_checksum 
+			  << SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_SHIFT)
+			 & SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_MASK)
+		| ((options->block_checksum 
+		    << SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT)
+		   & SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK);
+
+	if (options->codecs & SSBF_ENCODE_CODEC_RLE)
+	{
+		flags |= SSBF_DATA_HEADER_FLAG_BLOCK_CODECS;
+	}
+
+	return flags;
+}
+
+// Block sizes are stored in 16 bits. A block stored as is must fit
+// together with its size in front (variable size blocks) and its tag.
+size_t ssbf_encode_max_block_size(size_t max_block_size,
+				  const struct ssbf_encode_options *options)
 {
+	const bool encrypted = !(options && options->no_encryption);
+	size_t limit = UINT16_MAX;
+
+	if (encrypted && options && options->block_tags)
+	{
+		limit -= SSBF_BLOCK_TAG_SIZE;
+	}
+
+	if (options && options->cdc_min_block_size)
+	{
+		limit -= sizeof(uint16_t);
+	}
+
+	return max_block_size > limit ? limit : max_block_size;
+}
 
+// encrypts the payload placed at ssbf_block_payload() in output_mem
+// (if encrypt is set), appends the block tag (if enabled and key_data
+// is given) and fills in the block header. Returns 0 if the block is
+// too big for its 16 bit compressed_size, nothing is written then.
+static size_t ssbf_seal_block(uint8_t *key_data,
+			      bool encrypt,
+			      const struct ssbf_encode_options *options,
+			      uint8_t *output_mem,
+			      size_t payload_size,
+			      size_t uncompressed_size,
+			      uint16_t block_number,
+			      uint8_t flags)
+{
 	uint8_t *output_mem_data = output_mem
 		+ sizeof(struct ssbf_payload_block_header);
+	uint8_t *payload = ssbf_block_payload(options, output_mem);
 
 	struct ssbf_payload_block_header *block_working_mem_header = 
 		(struct ssbf_payload_block_header *) output_mem;
 
-	block_working_mem_header->flags = input_flags;
+	const bool block_tag = key_data && options && options->block_tags;
+	size_t block_data_size = (payload - output_mem_data) + payload_size;
+
+	if (block_data_size + (block_tag ? SSBF_BLOCK_TAG_SIZE : 0) 
+	    > UINT16_MAX)
+	{
+		return 0;
+	}
 
 	memset(block_working_mem_header, 0, 
 	       sizeof(struct ssbf_payload_block_header));
 
-	int32_t cs = ssbf_compress_lz4(
-		input_data_start, output_mem_data,
-		(uint32_t) input_data_size,
-		&block_working_mem_header->flags);
+	block_working_mem_header->flags = flags;
+
+	if (payload != output_mem_data)
+	{
+		uint16_t block_size = (uint16_t) uncompressed_size;
+		memcpy(output_mem_data, &block_size, sizeof(block_size));
+	}
 
-	uint8_t tmp_nonce[ 24];
-	memset(tmp_nonce, 0, sizeof(tmp_nonce));
-	tmp_nonce[0] = block_number & 0xff;
-	tmp_nonce[1] = (block_number >> 8) & 0xff;
+	if (encrypt && key_data)
+	{
+		uint8_t tmp_nonce[ 24];
+		memset(tmp_nonce, 0, sizeof(tmp_nonce));
+		tmp_nonce[0] = block_number & 0xff;
+		tmp_nonce[1] = (block_number >> 8) & 0xff;
 
-	ssbf_crypto_inplace_chacha20(key_data,
-				     tmp_nonce, // use block_number as a nonce
-				     output_mem_data,
-				     cs,
-				     &block_working_mem_header->flags);
+		ssbf_crypto_inplace_chacha20(key_data,
+					     tmp_nonce, // use block_number as a nonce
+					     payload,
+					     payload_size,
+					     &block_working_mem_header->flags);
+	}
 
 	block_working_mem_header->block_number = block_number;
-	block_working_mem_header->compressed_size = (uint16_t) cs;
-	block_working_mem_header->data_checksum = bsd_checksum16(
-		output_mem_data, cs);
+
+	if (block_tag)
+	{
+		// the tag covers the final size, including itself
+		block_working_mem_header->compressed_size = (uint16_t) 
+			(block_data_size + SSBF_BLOCK_TAG_SIZE);
+
+		ssbf_block_tag(output_mem_data + block_data_size, key_data,
+			       block_working_mem_header,
+			       output_mem_data, block_data_size);
+		block_data_size += SSBF_BLOCK_TAG_SIZE;
+	}
+
+	block_working_mem_header->compressed_size = (uint16_t) block_data_size;
+	block_working_mem_header->data_checksum = ssbf_block_checksum_from(
+		ssbf_data_header_flags(options), 0,
+		output_mem_data, block_data_size);
 
 	block_working_mem_header->header_checksum = bsd_checksum8(
 		(uint8_t *) block_working_mem_header,
@@ -65,109 +164,738 @@ STATIC size_t ssbf_encode_block(uint8_t *key_data,
 		+ sizeof(struct ssbf_payload_block_header);
 }
 
-STATIC void ssbf_encode_data_to_blocks(uint8_t *key_data,
+// Fill blocks are not encrypted either. The block flag already shows
+// that the data is one repeated byte, the byte itself is left readable
+// like the base copy and reference payloads. key_data is only used for
+// the block tag.
+STATIC size_t ssbf_encode_fill_block(uint8_t *key_data,
+				     uint8_t *output_mem,
+				     uint8_t value,
+				     size_t block_size,
+				     uint16_t block_number,
+				     uint8_t input_flags,
+				     const struct ssbf_encode_options *options)
+{
+	*ssbf_block_payload(options, output_mem) = value;
+
+	return ssbf_seal_block(key_data, false, options, output_mem,
+			       sizeof(value), block_size,
+			       block_number, input_flags | BHF_BLOCK_FILL);
+}
+
+// The block is one repeated byte and fill blocks are enabled
+static bool ssbf_fill_value(const struct ssbf_encode_options *options,
+			    uint8_t *block_data,
+			    size_t block_size,
+			    uint8_t *value)
+{
+	if (NULL == options || !options->fill_blocks || 0 == block_size)
+	{
+		return false;
+	}
+
+	for (size_t i = 1; block_size > i; i++)
+	{
+		if (block_data[i] != block_data[0])
+		{
+			return false;
+		}
+	}
+
+	*value = block_data[0];
+
+	return true;
+}
+
+// Codecs picked in the options, LZ4 HC if none
+static uint8_t ssbf_encode_codecs(const struct ssbf_encode_options *options)
+{
+	return (options && options->codecs)
+		? options->codecs : SSBF_ENCODE_CODEC_LZ4HC;
+}
+
+// Size of the scratch buffer ssbf_encode_block compares codecs in, 0 if
+// only one codec is used
+size_t ssbf_encode_scratch_size(size_t max_block_size,
+				const struct ssbf_encode_options *options)
+{
+	uint8_t codecs = ssbf_encode_codecs(options);
+
+	return (codecs & (codecs - 1)) ? max_block_size : 0;
+}
+
+// scratch holds the output of all codecs after the first
+// (ssbf_encode_scratch_size), without it only the first codec which
+// makes the block smaller is used
+STATIC size_t ssbf_encode_block(uint8_t *key_data,
+				uint8_t *output_mem,
+				uint8_t *input_data_start, 
+				size_t input_data_size,
+				uint16_t block_number,
+				uint8_t input_flags,
+				uint8_t *scratch,
+				const struct ssbf_encode_options *options)
+{
+	uint8_t fill_value = 0;
+
+	if (ssbf_fill_value(options, input_data_start, input_data_size,
+			    &fill_value))
+	{
+		return ssbf_encode_fill_block(key_data, output_mem,
+					      fill_value, input_data_size,
+					      block_number, input_flags,
+					      options);
+	}
+
+	uint8_t *output_mem_data = ssbf_block_payload(options, output_mem);
+
+	uint8_t flags = input_flags;
+	uint8_t codecs = ssbf_encode_codecs(options);
+	int level = options ? options->compression_level : 0;
+
+	// the block is stored as is unless a codec makes it smaller. The
+	// first output goes to the block, the others to scratch.
+	size_t payload_size = input_data_size;
+
+	size_t codec_count = 0;
+	const struct ssbf_codec *codec = ssbf_codecs(&codec_count);
+
+	for (size_t i = 0; codec_count > i; i++)
+	{
+		bool first = payload_size == input_data_size;
+
+		if (!(codecs & (1u << i)) || 1 >= payload_size
+		    || (!first && NULL == scratch))
+		{
+			continue;
+		}
+
+		size_t cs = codec[i].compress(input_data_start,
+					      input_data_size,
+					      first ? output_mem_data : scratch,
+					      payload_size - 1,
+					      level);
+		if (0 == cs)
+		{
+			continue;
+		}
+
+		if (!first)
+		{
+			memcpy(output_mem_data, scratch, cs);
+		}
+
+		payload_size = cs;
+		flags = (uint8_t) ((input_flags & ~BHF_BLOCK_CODEC_MASK)
+				   | BHF_BLOCK_COMPRESSED 
+				   | (codec[i].id << BHF_BLOCK_CODEC_SHIFT));
+	}
+
+	if (payload_size == input_data_size)
+	{
+		memcpy(output_mem_data, input_data_start, input_data_size);
+	}
+
+	return ssbf_seal_block(key_data, true, options, output_mem,
+			       payload_size, input_data_size, 
+			       block_number, flags);
+}
+
+// base copy blocks are not encrypted, so the delta savings can be
+// explained without the key. They only reveal where in the base
+// image (which the receiver already has) the data is. key_data is only
+// used for the block tag.
+STATIC size_t ssbf_encode_base_copy_block(uint8_t *key_data,
+					  uint8_t *output_mem,
+					  struct ssbf_base_copy *base_copy,
+					  uint16_t block_number,
+					  uint8_t input_flags,
+					  const struct ssbf_encode_options *options)
+{
+	memcpy(ssbf_block_payload(options, output_mem),
+	       base_copy, sizeof(struct ssbf_base_copy));
+
+	return ssbf_seal_block(key_data, false, options, output_mem, 
+			       sizeof(struct ssbf_base_copy), base_copy->size,
+			       block_number, input_flags | BHF_BLOCK_BASE_COPY);
+}
+
+// Like base copy blocks, reference blocks are not encrypted
+STATIC size_t ssbf_encode_reference_block(uint8_t *key_data,
+					  uint8_t *output_mem,
+					  struct ssbf_block_reference *reference,
+					  uint16_t block_number,
+					  uint8_t input_flags,
+					  const struct ssbf_encode_options *options)
+{
+	memcpy(ssbf_block_payload(options, output_mem),
+	       reference, sizeof(struct ssbf_block_reference));
+
+	return ssbf_seal_block(key_data, false, options, output_mem, 
+			       sizeof(struct ssbf_block_reference), 
+			       reference->size,
+			       block_number, input_flags | BHF_BLOCK_REFERENCE);
+}
+
+static size_t ssbf_min_block_size(const struct ssbf_encode_options *options,
+				  size_t max_block_size)
+{
+	if (options && options->cdc_min_block_size 
+	    && options->cdc_min_block_size < max_block_size)
+	{
+		return options->cdc_min_block_size;
+	}
+
+	return max_block_size;
+}
+
+// random looking value for every byte (replaces the gear hash table)
+static inline uint32_t ssbf_gear(uint8_t b)
+{
+	// murmur3 finalizer
+	uint32_t h = (b + 1u) * 0x9e3779b1u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// Size of the next block. Fixed size blocks are max_block_size long.
+// With content defined chunking the block ends where a rolling (gear)
+// hash of the data hits a pattern, anywhere between the minimum and
+// the maximum block size, so the same data gives the same blocks
+// even if it was moved within the file.
+static size_t ssbf_next_block_size(const struct ssbf_encode_options *options,
+				   size_t max_block_size,
+				   uint8_t *data,
+				   size_t data_left)
+{
+	size_t limit = data_left < max_block_size ? data_left : max_block_size;
+	size_t min_block_size = ssbf_min_block_size(options, max_block_size);
+
+	if (limit <= min_block_size)
+	{
+		return limit;
+	}
+
+	// the average block size is about min + (max - min) / 2
+	uint32_t bits = 0;
+	while (bits < 31 
+	       && (2u << bits) <= (max_block_size - min_block_size) / 2)
+	{
+		bits++;
+	}
+
+	// only the last 32 bytes affect the 32 bit gear hash
+	size_t i = min_block_size > 32 ? min_block_size - 32 : 0;
+	uint32_t h = 0;
+
+	for (; limit > i; i++)
+	{
+		h = (h << 1) + ssbf_gear(data[i]);
+
+		// use the top bits, they depend on the whole window
+		if (i + 1 >= min_block_size 
+		    && (0 == bits || 0 == (h >> (32 - bits))))
+		{
+			return i + 1;
+		}
+	}
+
+	return limit;
+}
+
+// Encodes the next block of data which is not all in memory at once
+// (transcoding). The block size is picked from the input_data_size
+// bytes at input_data_start, which are all the data left if last is
+// set, otherwise at least max_block_size bytes. Returns the size of
+// the block with its header, block_size is the data it holds. Returns
+// 0 if max_block_size is above ssbf_encode_max_block_size. scratch is
+// ssbf_encode_scratch_size bytes.
+size_t ssbf_encode_stream_block(uint8_t *key_data,
 				size_t max_block_size,
+				uint16_t block_number,
 				uint8_t *input_data_start,
 				size_t input_data_size,
-				uint8_t *output_data_start,				
-				size_t output_data_max_size,
-				size_t *actual_output_data_size)
+				bool last,
+				uint8_t *output_data,
+				size_t *block_size,
+				uint8_t *scratch,
+				const struct ssbf_encode_options *options)
+{
+	*block_size = ssbf_next_block_size(options, max_block_size,
+					   input_data_start, input_data_size);
+
+	uint8_t flags = (last && *block_size == input_data_size) 
+		? BHF_LAST_BLOCK : 0;
+
+	return ssbf_encode_block(key_data, output_data, 
+				 input_data_start, *block_size,
+				 block_number, flags, scratch, options);
+}
+
+// Open addressing hash table of blocks, used to find repeated blocks
+// in dedup mode and blocks of the base image in delta mode
+struct ssbf_dedup_entry {
+	uint32_t hash; // 0 = empty slot
+	uint32_t offset;
+	uint16_t size;
+	uint16_t block_number;
+};
+
+struct ssbf_dedup_index {
+	struct ssbf_dedup_entry *entries;
+	size_t mask;
+	uint8_t *data_start; // data the entry offsets point into
+};
+
+static uint32_t ssbf_dedup_hash(uint8_t *data, size_t data_size)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; data_size > i; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+static bool ssbf_dedup_index_init(struct ssbf_dedup_index *index,
+				  uint8_t *data_start,
+				  size_t number_of_blocks)
+{
+	size_t slots = 16;
+	while (slots < 2 * number_of_blocks)
+	{
+		slots *= 2;
+	}
+
+	index->entries = calloc(slots, sizeof(struct ssbf_dedup_entry));
+	index->mask = slots - 1;
+	index->data_start = data_start;
+
+	return NULL != index->entries;
+}
+
+// Returns the entry with the same data or the empty slot where the
+// block can be added (entry hash is 0)
+static struct ssbf_dedup_entry *ssbf_dedup_lookup(
+	struct ssbf_dedup_index *index,
+	uint8_t *block_data,
+	size_t block_size,
+	uint32_t hash)
+{
+	size_t slot = hash & index->mask;
+
+	while (index->entries[slot].hash)
+	{
+		struct ssbf_dedup_entry *e = &index->entries[slot];
+
+		if (hash == e->hash && block_size == e->size
+		    && 0 == memcmp(index->data_start + e->offset,
+				   block_data, block_size))
+		{
+			break;
+		}
+
+		slot = (slot + 1) & index->mask;
+	}
+
+	return &index->entries[slot];
+}
+
+static void ssbf_dedup_add(struct ssbf_dedup_entry *e,
+			   uint32_t hash,
+			   size_t offset,
+			   size_t size,
+			   uint16_t block_number)
 {
+	e->hash = hash;
+	e->offset = (uint32_t) offset;
+	e->size = (uint16_t) size;
+	e->block_number = block_number;
+}
 
-	// TODO: Check for output data out of bounds error
-	(void) output_data_max_size;
+// Splits the base image the same way as the input and indexes the
+// blocks, so data moved by any offset can be found in delta mode
+static void ssbf_base_index_init(struct ssbf_dedup_index *index,
+				 const struct ssbf_encode_options *options,
+				 size_t max_block_size)
+{
+	size_t min_block_size = ssbf_min_block_size(options, max_block_size);
 
+	if (!ssbf_dedup_index_init(index, options->base_data_start,
+				   options->base_data_size / min_block_size + 1))
+	{
+		return;
+	}
+
+	size_t offset = 0;
+	while (options->base_data_size > offset)
+	{
+		uint8_t *block_data = options->base_data_start + offset;
+		size_t block_size = ssbf_next_block_size(
+			options, max_block_size, block_data,
+			options->base_data_size - offset);
+
+		uint32_t hash = ssbf_dedup_hash(block_data, block_size);
+		struct ssbf_dedup_entry *e = ssbf_dedup_lookup(
+			index, block_data, block_size, hash);
+
+		if (0 == e->hash)
+		{
+			ssbf_dedup_add(e, hash, offset, block_size, 0);
+		}
+
+		offset += block_size;
+	}
+}
+
+// Look for the block data in the base image. The same offset is
+// checked first (unchanged part of the image), then the index of the
+// base image blocks.
+static bool ssbf_find_in_base(const struct ssbf_encode_options *options,
+			      struct ssbf_dedup_index *base_index,
+			      size_t block_offset,
+			      uint8_t *block_data,
+			      size_t block_size,
+			      struct ssbf_base_copy *base_copy)
+{
+	if (NULL == options || NULL == options->base_data_start
+	    || 0 == block_size || block_size > options->base_data_size)
+	{
+		return false;
+	}
+
+	size_t offset = block_offset;
+
+	if (offset > (options->base_data_size - block_size)
+	    || memcmp(options->base_data_start + offset, block_data, block_size))
+	{
+		if (NULL == base_index->entries)
+		{
+			return false;
+		}
+
+		struct ssbf_dedup_entry *e = ssbf_dedup_lookup(
+			base_index, block_data, block_size,
+			ssbf_dedup_hash(block_data, block_size));
+
+		if (0 == e->hash)
+		{
+			return false;
+		}
+
+		offset = e->offset;
+	}
+
+	base_copy->base_offset = (uint32_t) offset;
+	base_copy->size = (uint16_t) block_size;
+	base_copy->base_checksum = bsd_checksum16(block_data, block_size);
+
+	return true;
+}
+
+// Block alignment as stored in the main header flags
+static uint8_t ssbf_block_alignment_flags(
+	const struct ssbf_encode_options *options)
+{
+	uint8_t alignment_log2 = 0;
+
+	if (options)
+	{
+		while (((size_t) 1 << alignment_log2) < options->block_alignment
+		       && alignment_log2 < 15)
+		{
+			alignment_log2 += 1;
+		}
+	}
+
+	return alignment_log2 << SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT;
+}
+
+// Layout flags of the main header: alignment and variable block size
+uint8_t ssbf_main_header_flags(const struct ssbf_encode_options *options)
+{
+	uint8_t main_header_flags = ssbf_block_alignment_flags(options);
+
+	if (options && options->cdc_min_block_size)
+	{
+		main_header_flags |= SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE;
+	}
+
+	return main_header_flags;
+}
+
+// Biggest encoded block of block_size bytes of data. Codecs are only
+// used if they make the payload smaller and a fill payload is one byte,
+// so the data stored as is is the biggest payload, unless a reference or
+// base copy is bigger than a tiny block. The header, the size in front
+// (variable size blocks) and the tag come on top.
+static size_t ssbf_block_max_encoded_size(
+	uint8_t *key_data,
+	size_t block_size,
+	const struct ssbf_encode_options *options)
+{
+	size_t payload_size = block_size;
+
+	if (options && (options->dedup || options->base_data_start)
+	    && payload_size < sizeof(struct ssbf_block_reference))
+	{
+		payload_size = sizeof(struct ssbf_block_reference);
+	}
+
+	return sizeof(struct ssbf_payload_block_header)
+		+ ((options && options->cdc_min_block_size)
+		   ? sizeof(uint16_t) : 0)
+		+ payload_size
+		+ ((key_data && options && options->block_tags)
+		   ? SSBF_BLOCK_TAG_SIZE : 0);
+}
+
+// Encodes the data to blocks numbered from first_block_number on.
+// actual_output_data_size is 0 if a block does not fit (max_block_size
+// above ssbf_encode_max_block_size), the output is too small or the
+// data needs more blocks than the 16 bit block numbers have. The block
+// number is the nonce of the block, it must not wrap.
+void ssbf_encode_data_to_blocks(uint8_t *key_data,
+				size_t max_block_size,
+				uint16_t first_block_number,
+				uint8_t *input_data_start,
+				size_t input_data_size,
+				uint8_t *output_data_start,				
+				size_t output_data_max_size,
+				size_t *actual_output_data_size,
+				struct ssbf_checksum_state *checksum,
+				const struct ssbf_encode_options *options)
+{
 	*actual_output_data_size = 0;
 
 	uint8_t *input_data_current_p = input_data_start;
 	uint8_t *output_data_current_p = output_data_start;
 
-	uint16_t block_cnt = 0; 
-
-	int32_t input_data_size_minus_last_block = 
-		input_data_size - max_block_size;
+	size_t block_cnt = first_block_number;
+	uint8_t alignment_flags = ssbf_block_alignment_flags(options);
 
 	size_t encoded_block_size_with_header = 0;
 
-	int32_t i;
-	for (i = 0; input_data_size_minus_last_block > i; i += max_block_size)
+	struct ssbf_dedup_index dedup_index = {
+		.entries = NULL,
+	};
+
+	struct ssbf_dedup_index base_index = {
+		.entries = NULL,
+	};
+
+	// without memory for the indexes (or the codec scratch), just
+	// encode without them
+	size_t scratch_size = ssbf_encode_scratch_size(max_block_size, options);
+	uint8_t *scratch = scratch_size ? malloc(scratch_size) : NULL;
+
+	if (options && options->dedup)
+	{
+		ssbf_dedup_index_init(
+			&dedup_index, input_data_start,
+			input_data_size 
+			/ ssbf_min_block_size(options, max_block_size) + 1);
+	}
+
+	if (options && options->base_data_start)
 	{
-		encoded_block_size_with_header = 
-			ssbf_encode_block(
-				key_data,
-				output_data_current_p,
-				input_data_current_p,
-				max_block_size,
-				block_cnt, 0); 
+		ssbf_base_index_init(&base_index, options, max_block_size);
+	}
+
+	while (1)
+	{
+		if (block_cnt > UINT16_MAX)
+		{
+			output_data_current_p = output_data_start;
+			break;
+		}
+
+		size_t data_left = input_data_size 
+			- (input_data_current_p - input_data_start);
+		size_t block_size = ssbf_next_block_size(options,
+							 max_block_size,
+							 input_data_current_p,
+							 data_left);
+		uint8_t flags = (block_size == data_left) ? BHF_LAST_BLOCK : 0;
+
+		if (output_data_max_size
+		    - (size_t) (output_data_current_p - output_data_start)
+		    < ssbf_block_max_encoded_size(key_data, block_size,
+						  options))
+		{
+			output_data_current_p = output_data_start;
+			break;
+		}
+
+		size_t block_offset = input_data_current_p - input_data_start;
+		struct ssbf_base_copy base_copy;
+		struct ssbf_block_reference reference;
+		uint8_t fill_value = 0;
+
+		// 0 until the block is encoded
+		encoded_block_size_with_header = 0;
+
+		// a fill block is smaller than a reference or a base copy
+		// and is not written at all on erased flash, it is made by
+		// ssbf_encode_block
+		bool fill = ssbf_fill_value(options, input_data_current_p,
+					    block_size, &fill_value);
+
+		if (!fill && dedup_index.entries && block_size)
+		{
+			uint32_t hash = ssbf_dedup_hash(input_data_current_p,
+							block_size);
+			struct ssbf_dedup_entry *e = ssbf_dedup_lookup(
+				&dedup_index, input_data_current_p,
+				block_size, hash);
+
+			if (e->hash)
+			{
+				reference.output_offset = e->offset;
+				reference.size = e->size;
+				reference.block_number = e->block_number;
 
-		input_data_current_p += max_block_size;
+				encoded_block_size_with_header = 
+					ssbf_encode_reference_block(
+						key_data,
+						output_data_current_p,
+						&reference,
+						(uint16_t) block_cnt,
+						flags, options);
+			}
+			else
+			{
+				ssbf_dedup_add(e, hash, block_offset,
+					       block_size,
+					       (uint16_t) block_cnt);
+			}
+		}
+
+		if (0 == encoded_block_size_with_header && !fill
+		    && ssbf_find_in_base(options, &base_index,
+					 block_offset,
+					 input_data_current_p, block_size,
+					 &base_copy))
+		{
+			encoded_block_size_with_header = 
+				ssbf_encode_base_copy_block(
+					key_data,
+					output_data_current_p,
+					&base_copy,
+					(uint16_t) block_cnt,
+					flags, options);
+		}
+
+		if (0 == encoded_block_size_with_header)
+		{
+			encoded_block_size_with_header = 
+				ssbf_encode_block(
+					key_data,
+					output_data_current_p,
+					input_data_current_p,
+					block_size,
+					(uint16_t) block_cnt,
+					flags, scratch, options);
+		}
+
+		// the block does not fit in a block of this file
+		if (0 == encoded_block_size_with_header)
+		{
+			output_data_current_p = output_data_start;
+			break;
+		}
+
+		// while the block data is still in the cache
+		ssbf_checksum_update(checksum, input_data_current_p, block_size);
+
+		input_data_current_p += block_size;
 		output_data_current_p += encoded_block_size_with_header;
 		block_cnt += 1;
-	}
 
-	// last block
-	uint32_t data_left = input_data_size - i;
+		if (flags & BHF_LAST_BLOCK)
+		{
+			break;
+		}
+
+		size_t padding = ssbf_block_padding(
+			output_data_current_p - output_data_start,
+			alignment_flags);
+		if (output_data_max_size
+		    - (size_t) (output_data_current_p - output_data_start)
+		    < padding)
+		{
+			output_data_current_p = output_data_start;
+			break;
+		}
+		memset(output_data_current_p, 0, padding);
+		output_data_current_p += padding;
+	}
 
-	encoded_block_size_with_header = 
-		ssbf_encode_block(
-			key_data,
-			output_data_current_p,
-			input_data_current_p,
-			data_left,
-			block_cnt, BHF_LAST_BLOCK); 
+	free(dedup_index.entries);
+	free(base_index.entries);
+	free(scratch);
 
-	*actual_output_data_size = encoded_block_size_with_header 
-		+ (output_data_current_p - output_data_start);
+	*actual_output_data_size = output_data_current_p - output_data_start;
 }
 
-void ssbf_encode_data(uint8_t *key_main, //[32],
-		      uint8_t *key_main_nonce, //[24]
-		      uint8_t *key_data, //[32]
-		      uint16_t meta_data_id,
-		      uint8_t *meta_payload_data,
-		      uint16_t meta_data_payload_size,
-		      size_t max_block_size,
-		      uint8_t *input_data_start,
-		      size_t input_data_size,
-		      uint8_t *output_data_start,				
-		      size_t output_data_max_size,
-		      size_t *actual_output_data_size)
+// Size of the header up to and including the hash, without the
+// padding in front of the first block
+size_t ssbf_header_size(bool encrypted, uint16_t meta_data_payload_size)
 {
-
-	const uint16_t encryption_payload_size = 32;
-	const uint16_t full_header_hash_mac_size = 16;
-
-	// encode data to blocks
-	size_t full_header_size = 
-		+ sizeof(struct ssbf_main_header)
-		+ sizeof(struct ssbf_encryption_header)
-		+ encryption_payload_size
+	return sizeof(struct ssbf_main_header)
+		+ (encrypted ? sizeof(struct ssbf_encryption_header) : 0)
+		+ (encrypted ? SSBF_DATA_KEY_SIZE : 0)
 		+ sizeof(struct ssbf_meta_header)
 		+ meta_data_payload_size
 		+ sizeof(struct ssbf_data_header)
-		+ full_header_hash_mac_size; // hash size
-
-	ssbf_encode_data_to_blocks(key_data,
-				   max_block_size,
-				   input_data_start,
-				   input_data_size,
-				   output_data_start + full_header_size,
-				   output_data_max_size,
-				   actual_output_data_size);
+		+ SSBF_HEADER_HASH_SIZE;
+}
 
+// Writes the header for blocks_sum_size bytes of blocks and returns
+// the offset of the first block. Without key_data the header gets no
+// crypto extension and is protected with an unkeyed hash, key_main and
+// key_main_nonce are not used then.
+size_t ssbf_encode_header(uint8_t *key_main, //[32],
+			  uint8_t *key_main_nonce, //[24]
+			  uint8_t *key_data, //[32]
+			  uint8_t main_header_flags,
+			  uint8_t encryption_header_flags,
+			  uint16_t meta_data_id,
+			  uint8_t *meta_payload_data,
+			  uint16_t meta_data_payload_size,
+			  const struct ssbf_data_header *data_h,
+			  size_t blocks_sum_size,
+			  uint8_t *output_data_start)
+{
+	const bool encrypted = NULL != key_data;
+	const uint16_t encryption_payload_size = 
+		encrypted ? SSBF_DATA_KEY_SIZE : 0;
+	size_t full_header_size = ssbf_header_size(encrypted,
+						   meta_data_payload_size);
 
 	uint8_t *output_data_current_p = output_data_start;
 
 	// main header
 	struct ssbf_main_header mh = {
 		.ssbf_magic_number = SSBFv1_MAGIC_NUMBER,
-		.flags = SSBF_MAIN_HEADE_FLAG_USE_META_EXTENSION 
-		| SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION,
-		.blocks_sum_size = *actual_output_data_size,
-		.hashed_data_size = full_header_size - full_header_hash_mac_size,
+		.flags = SSBF_MAIN_HEADE_FLAG_USE_META_EXTENSION
+		| main_header_flags,
+		.blocks_sum_size = blocks_sum_size,
+		.hashed_data_size = full_header_size - SSBF_HEADER_HASH_SIZE,
 		.header_checksum = 0,
 	};
 
+	if (encrypted)
+	{
+		mh.flags |= SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION;
+	}
+
 	mh.header_checksum = bsd_checksum8(
 		(uint8_t *) &mh, sizeof(struct ssbf_main_header)-1);
 
@@ -182,21 +910,29 @@ void ssbf_encode_data(uint8_t *key_main, //[32],
 		+ meta_data_payload_size
 		+ sizeof(struct ssbf_data_header),
 		.flags = SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305
-		 | SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20,
+		 | SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20
+		 | encryption_header_flags,
 	};
 
-	memcpy(ch.nonce, key_main_nonce, 24);
+	if (encrypted)
+	{
+		memcpy(ch.nonce, key_main_nonce, 24);
 
-	ch.header_checksum = bsd_checksum8(
-		(uint8_t *) &ch, sizeof(struct ssbf_encryption_header)-1);
+		ch.header_checksum = bsd_checksum8(
+			(uint8_t *) &ch, sizeof(struct ssbf_encryption_header)-1);
 
-	memcpy(output_data_current_p, &ch, sizeof(struct ssbf_encryption_header));
-	output_data_current_p += sizeof(struct ssbf_encryption_header);
+		memcpy(output_data_current_p, &ch, 
+		       sizeof(struct ssbf_encryption_header));
+		output_data_current_p += sizeof(struct ssbf_encryption_header);
+	}
 
 	uint8_t *encrypt_data_from_here = output_data_current_p;
 
-	memcpy(output_data_current_p, key_data, ch.encryption_payload_size);
-	output_data_current_p += ch.encryption_payload_size;
+	if (encrypted)
+	{
+		memcpy(output_data_current_p, key_data, ch.encryption_payload_size);
+		output_data_current_p += ch.encryption_payload_size;
+	}
 
 
 
@@ -212,37 +948,160 @@ void ssbf_encode_data(uint8_t *key_main, //[32],
 	output_data_current_p += meta_h.payload_size;
 
 
+	memcpy(output_data_current_p, data_h, sizeof(struct ssbf_data_header));
+	output_data_current_p += sizeof(struct ssbf_data_header);
+
+
+	// Calculate header hash and encrypt part of header
+
+	if (encrypted)
+	{
+		crypto_aead_lock(encrypt_data_from_here, output_data_current_p,
+				 key_main, key_main_nonce, 
+				 output_data_start, 
+				 sizeof(struct ssbf_main_header)
+				 + sizeof(struct ssbf_encryption_header),
+				 encrypt_data_from_here, 
+				 ch.encrypted_header_size);
+	}
+	else
+	{
+		// integrity only, anyone can recompute this hash
+		crypto_blake2b(output_data_current_p, SSBF_HEADER_HASH_SIZE,
+			       output_data_start, 
+			       output_data_current_p - output_data_start);
+	}
+
+	output_data_current_p += SSBF_HEADER_HASH_SIZE; // mac size
+
+	// if all is ok, output_data_current_p points now to start of the first block
+	if (output_data_current_p != (output_data_start + full_header_size))
+	{
+		printf("output data error\n");
+	}
+
+	// with aligned blocks the first one starts after zero padding
+	size_t padding = ssbf_block_padding(full_header_size, mh.flags);
+	memset(output_data_current_p, 0, padding);
+
+	return full_header_size + padding;
+}
+
+// Writes the header in front of the blocks_sum_size bytes of blocks at
+// blocks_offset, with the in place margin of the blocks in data_h.
+// Returns the size of the whole file.
+size_t ssbf_encode_finish(uint8_t *key_main, //[32],
+			  uint8_t *key_main_nonce, //[24]
+			  uint8_t *key_data, //[32]
+			  uint8_t main_header_flags,
+			  uint8_t encryption_header_flags,
+			  uint16_t meta_data_id,
+			  uint8_t *meta_payload_data,
+			  uint16_t meta_data_payload_size,
+			  struct ssbf_data_header *data_h,
+			  size_t blocks_offset,
+			  size_t blocks_sum_size,
+			  uint8_t *output_data_start)
+{
+	// margin for in place decoding, left at 0 (unknown) if too big
+	size_t inplace_margin = ssbf_blocks_inplace_margin(
+		output_data_start + blocks_offset,
+		blocks_sum_size,
+		blocks_offset,
+		data_h->full_data_size_uncompressed,
+		data_h->max_uncompressed_block_size,
+		main_header_flags);
+	inplace_margin = inplace_margin / SSBF_INPLACE_MARGIN_UNIT + 1;
+	data_h->inplace_margin = (inplace_margin <= UINT8_MAX)
+		? (uint8_t) inplace_margin : 0;
+
+	ssbf_encode_header(key_main, key_main_nonce, key_data,
+			   main_header_flags, encryption_header_flags,
+			   meta_data_id, meta_payload_data, meta_data_payload_size,
+			   data_h, blocks_sum_size,
+			   output_data_start);
+
+	return blocks_offset + blocks_sum_size;
+}
+
+void ssbf_encode_data(uint8_t *key_main, //[32],
+		      uint8_t *key_main_nonce, //[24]
+		      uint8_t *key_data, //[32]
+		      uint16_t meta_data_id,
+		      uint8_t *meta_payload_data,
+		      uint16_t meta_data_payload_size,
+		      size_t max_block_size,
+		      uint8_t *input_data_start,
+		      size_t input_data_size,
+		      uint8_t *output_data_start,				
+		      size_t output_data_max_size,
+		      size_t *actual_output_data_size,
+		      const struct ssbf_encode_options *options)
+{
+
+	// without the crypto extension the header is followed by an
+	// unkeyed hash and the blocks are not encrypted
+	const bool encrypted = !(options && options->no_encryption);
+	const bool block_tags = encrypted && options && options->block_tags;
+
+	max_block_size = ssbf_encode_max_block_size(max_block_size, options);
+
+	uint8_t main_header_flags = ssbf_main_header_flags(options);
+
+	// with aligned blocks the first one starts after zero padding
+	size_t full_header_size = ssbf_header_size(encrypted, 
+						   meta_data_payload_size);
+	size_t blocks_offset = full_header_size 
+		+ ssbf_block_padding(full_header_size, main_header_flags);
 
 	struct ssbf_data_header data_h = {
 		.full_data_size_uncompressed = input_data_size,
 		.max_uncompressed_block_size = max_block_size, //is this with or without header?
-		.flags = 0, // we use default checksum (bsd 16)
-		.reserved = 0,
-		.full_data_checksum = bsd_checksum16(input_data_start,
-						     input_data_size),
+		.flags = ssbf_data_header_flags(options),
+		.inplace_margin = 0,
 	};
 
-	memcpy(output_data_current_p, &data_h, sizeof(struct ssbf_data_header));
-	output_data_current_p += sizeof(struct ssbf_data_header);
+	// the full data checksum is made block by block
+	struct ssbf_checksum_state checksum;
+	ssbf_checksum_init(&checksum, ssbf_data_checksum_type(data_h.flags));
 
+	// the header is written in front of the blocks at the end
+	if (blocks_offset > output_data_max_size)
+	{
+		*actual_output_data_size = 0;
+		return;
+	}
 
-	// Calculate header hash and encrypt part of header
+	// encode data to blocks
+	ssbf_encode_data_to_blocks(encrypted ? key_data : NULL,
+				   max_block_size,
+				   0,
+				   input_data_start,
+				   input_data_size,
+				   output_data_start + blocks_offset,
+				   output_data_max_size - blocks_offset,
+				   actual_output_data_size,
+				   &checksum,
+				   options);
 
-	crypto_aead_lock(encrypt_data_from_here, output_data_current_p,
-			 key_main, key_main_nonce, 
-			 output_data_start, 
-			 sizeof(struct ssbf_main_header)
-			 + sizeof(struct ssbf_encryption_header),
-			 encrypt_data_from_here, 
-			 ch.encrypted_header_size);
+	if (0 == *actual_output_data_size)
+	{
+		return;
+	}
 
-	output_data_current_p += full_header_hash_mac_size; // mac size
+	data_h.full_data_checksum = checksum.checksum;
 
-	// if all is ok, output_data_current_p points now to start of the first block
-	if (output_data_current_p != (output_data_start + full_header_size))
+	if (options && options->base_data_start)
 	{
-		printf("output data error\n");
+		data_h.flags |= SSBF_DATA_HEADER_FLAG_DELTA;
 	}
 
-	*actual_output_data_size += full_header_size;
+	*actual_output_data_size = ssbf_encode_finish(
+		key_main, key_main_nonce,
+		encrypted ? key_data : NULL,
+		main_header_flags,
+		block_tags ? SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS : 0,
+		meta_data_id, meta_payload_data, meta_data_payload_size,
+		&data_h, blocks_offset, *actual_output_data_size,
+		output_data_start);
 }
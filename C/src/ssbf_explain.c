@@ -1,11 +1,17 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "ssbf.h"
 #include "ssbf_internal.h"
 #include "ssbf_common.h"
+#include "ssbf_cipher.h"
+#include "ssbf_codec.h"
+
+#include "monocypher.h"
 
 #ifdef UNIT_TESTS
 #define STATIC
@@ -13,15 +19,74 @@
 #define STATIC static
 #endif
 
+static const char *ssbf_checksum_name(uint8_t checksum_type)
+{
+	switch (checksum_type)
+	{
+	case SSBF_CHECKSUM_BSD16:
+		return "BSD16";
+	case SSBF_CHECKSUM_CRC16:
+		return "CRC16";
+	case SSBF_CHECKSUM_CRC32:
+		return "CRC32";
+	default:
+		return "unknown";
+	}
+}
+
+static void ssbf_explain_meta_data_headers(
+	const struct ssbf_meta_header *meta_h,
+	const struct ssbf_data_header *data_h)
+{
+	printf("\nMeta header:\n");
+	printf("  meta_data_id: 0x%x\n", meta_h->meta_data_id);
+	printf("  payload_size: %i\n", meta_h->payload_size);
+
+	printf("\nData header:\n");
+	printf("  full_data_size_uncompressed: %" PRIu32 "\n",
+	       data_h->full_data_size_uncompressed);
+	printf("  max_uncompressed_block_size: %i\n",
+	       data_h->max_uncompressed_block_size);
+	printf("  flags (0x%x):\n", data_h->flags);
+	if (SSBF_DATA_HEADER_FLAG_DELTA & data_h->flags)
+	{
+		printf("    SSBF_DATA_HEADER_FLAG_DELTA\n");
+	}
+	if (SSBF_DATA_HEADER_FLAG_BLOCK_CODECS & data_h->flags)
+	{
+		printf("    SSBF_DATA_HEADER_FLAG_BLOCK_CODECS\n");
+	}
+	printf("    block checksum: %s\n", ssbf_checksum_name(
+		       (data_h->flags 
+			& SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK)
+		       >> SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT));
+	printf("    full data checksum: %s\n", ssbf_checksum_name(
+		       ssbf_data_checksum_type(data_h->flags)));
+	printf("  full_data_checksum: 0x%" PRIx32 "\n",
+	       data_h->full_data_checksum);
+	printf("  inplace_margin: %i (%i bytes)\n",
+	       data_h->inplace_margin, 
+	       data_h->inplace_margin * SSBF_INPLACE_MARGIN_UNIT);
+}
 
 STATIC enum ssbf_errors ssbf_explain_blocks( uint8_t *input_data_start,
-					     size_t input_data_size)
+					     size_t input_data_size,
+					     uint8_t main_header_flags,
+					     bool block_tags)
 {
+	bool variable_block_size = 
+		main_header_flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE;
 	enum ssbf_errors r = SSBF_NO_ERROR;
 	uint8_t *input_data_current_p = input_data_start;
 
 	struct ssbf_payload_block_header h;
 
+	uint32_t base_copy_blocks = 0;
+	size_t base_copy_bytes = 0;
+	uint32_t reference_blocks = 0;
+	size_t reference_bytes = 0;
+	uint32_t fill_blocks = 0;
+
 	while((input_data_start + input_data_size) > input_data_current_p)
 	{
 		int32_t input_data_left = input_data_size 
@@ -34,10 +99,34 @@ STATIC enum ssbf_errors ssbf_explain_blocks( uint8_t *input_data_start,
 			return r;
 		}
 
+		uint8_t *payload = input_data_current_p
+			+ sizeof(struct ssbf_payload_block_header);
+		size_t payload_size = h.compressed_size;
+		uint16_t block_size = 0;
+
+		if (block_tags && SSBF_BLOCK_TAG_SIZE <= payload_size)
+		{
+			payload_size -= SSBF_BLOCK_TAG_SIZE;
+		}
+
+		if (variable_block_size && sizeof(block_size) <= payload_size)
+		{
+			memcpy(&block_size, payload, sizeof(block_size));
+			payload += sizeof(block_size);
+			payload_size -= sizeof(block_size);
+		}
+
 		input_data_current_p += 
 			sizeof(struct ssbf_payload_block_header)
 			+ h.compressed_size;
 
+		if (!(h.flags & BHF_LAST_BLOCK))
+		{
+			input_data_current_p += ssbf_block_padding(
+				input_data_current_p - input_data_start,
+				main_header_flags);
+		}
+
 		printf("  ");
 		if (h.flags & BHF_LAST_BLOCK)
 		{
@@ -46,17 +135,74 @@ STATIC enum ssbf_errors ssbf_explain_blocks( uint8_t *input_data_start,
 		printf("block %i of size %i found, ", h.block_number,
 		       h.compressed_size);
 
+		if (variable_block_size)
+		{
+			printf("%i bytes uncompressed, ", block_size);
+		}
+
 		if (h.flags & BHF_BLOCK_COMPRESSED)
 		{
-			printf("compressed, ");
+			const struct ssbf_codec *codec = ssbf_codec_by_id(
+				(h.flags & BHF_BLOCK_CODEC_MASK)
+				>> BHF_BLOCK_CODEC_SHIFT);
+			printf("compressed (%s), ", codec ? codec->name : "?");
 		}
 		if (h.flags & BHF_BLOCK_ENCRYPTED)
 		{
 			printf(" encrypted");
 		}
+		if ((h.flags & BHF_BLOCK_BASE_COPY)
+		    && sizeof(struct ssbf_base_copy) == payload_size)
+		{
+			struct ssbf_base_copy base_copy;
+			memcpy(&base_copy, payload, sizeof(struct ssbf_base_copy));
+
+			printf(" copy of %i bytes from base offset %" PRIu32,
+			       base_copy.size, base_copy.base_offset);
+
+			base_copy_blocks += 1;
+			base_copy_bytes += base_copy.size;
+		}
+		if ((h.flags & BHF_BLOCK_REFERENCE)
+		    && sizeof(struct ssbf_block_reference) == payload_size)
+		{
+			struct ssbf_block_reference reference;
+			memcpy(&reference, payload, 
+			       sizeof(struct ssbf_block_reference));
+
+			printf(" repeat of block %i (%i bytes)",
+			       reference.block_number, reference.size);
+
+			reference_blocks += 1;
+			reference_bytes += reference.size;
+		}
+		if ((h.flags & BHF_BLOCK_FILL) && sizeof(uint8_t) == payload_size)
+		{
+			printf(" fill with 0x%02x", payload[0]);
+
+			fill_blocks += 1;
+		}
 		printf("\n");
 	}
 
+	if (base_copy_blocks)
+	{
+		printf("\nDelta: %" PRIu32 " blocks (%zu bytes) copied from "
+		       "base image\n", base_copy_blocks, base_copy_bytes);
+	}
+
+	if (reference_blocks)
+	{
+		printf("\nDedup: %" PRIu32 " blocks (%zu bytes) repeated\n",
+		       reference_blocks, reference_bytes);
+	}
+
+	if (fill_blocks)
+	{
+		printf("\nFill: %" PRIu32 " blocks of one repeated byte\n",
+		       fill_blocks);
+	}
+
 	return r;
 }
 
@@ -66,6 +212,7 @@ enum ssbf_errors ssbf_explain( uint8_t *input_data_start,
 	(void) input_data_size;
 
 	const uint16_t full_header_hash_mac_size = 16;
+	bool block_tags = false;
 
 	uint8_t *input_data_current_p = input_data_start;
 
@@ -94,40 +241,103 @@ enum ssbf_errors ssbf_explain( uint8_t *input_data_start,
 	{
 		printf("    SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION\n");
 	}
-	printf("  bsd checksum8: %i\n", mh.header_checksum);
-
-	// copy encryption header data from input data
-	struct ssbf_encryption_header ch;
-	memcpy(&ch, input_data_current_p, sizeof(struct ssbf_encryption_header));
-	input_data_current_p += sizeof(struct ssbf_encryption_header);
-
-	cs = bsd_checksum8(
-		(uint8_t *) &ch, sizeof(struct ssbf_encryption_header)-1);
-	if (cs != ch.header_checksum)
+	if (SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE & mh.flags)
 	{
-		return SSBF_CHECKSUM_FAILED;
+		printf("    SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE\n");
 	}
-
-	printf("\nEncryption header:");
-	printf("  encryption_payload_size: %i\n", ch.encryption_payload_size);
-	printf("  encrypted_header_size: %i\n", ch.encrypted_header_size);
-	printf("  flags (0x%x):\n", ch.encrypted_header_size);
-	if (SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305 & ch.flags)
+	if (SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK & mh.flags)
 	{
-		printf("    SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305\n");
+		printf("    block alignment: %u bytes\n", 
+		       1u << ((SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK 
+			       & mh.flags)
+			      >> SSBF_MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT));
 	}
-	if (SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20 & ch.flags)
+	printf("  bsd checksum8: %i\n", mh.header_checksum);
+
+	if (SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION & mh.flags)
 	{
-		printf("    SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20\n");
+		// copy encryption header data from input data
+		struct ssbf_encryption_header ch;
+		memcpy(&ch, input_data_current_p, 
+		       sizeof(struct ssbf_encryption_header));
+		input_data_current_p += sizeof(struct ssbf_encryption_header);
+
+		cs = bsd_checksum8(
+			(uint8_t *) &ch, sizeof(struct ssbf_encryption_header)-1);
+		if (cs != ch.header_checksum)
+		{
+			return SSBF_CHECKSUM_FAILED;
+		}
+
+		printf("\nEncryption header:");
+		printf("  encryption_payload_size: %i\n", 
+		       ch.encryption_payload_size);
+		printf("  encrypted_header_size: %i\n", ch.encrypted_header_size);
+		printf("  flags (0x%x):\n", ch.flags);
+		if (SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305 & ch.flags)
+		{
+			printf("    SSBF_ENCRYPTION_HEADER_FLAG_USE_POLY1305\n");
+		}
+		if (SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20 & ch.flags)
+		{
+			printf("    SSBF_ENCRYPTION_HEADER_FLAG_USE_CHACHA20\n");
+		}
+		if (SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS & ch.flags)
+		{
+			printf("    SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS\n");
+			block_tags = true;
+		}
+		printf("  bsd checksum8: %i\n", ch.header_checksum);
+
+		printf("\nrest of the header (%i bytes) is encrypted\n", 
+		       ch.encrypted_header_size);
+
+		input_data_current_p += ch.encrypted_header_size;
 	}
-	printf("  bsd checksum8: %i\n", ch.header_checksum);
+	else
+	{
+		// no crypto extension, the rest of the header is plain
+		if (mh.hashed_data_size < sizeof(struct ssbf_main_header)
+		    + sizeof(struct ssbf_meta_header)
+		    + sizeof(struct ssbf_data_header)
+		    || (size_t) mh.hashed_data_size + full_header_hash_mac_size 
+		    > input_data_size)
+		{
+			printf("parsing error\n");
+			return SSBF_GENERIC_ERROR;
+		}
+
+		struct ssbf_meta_header meta_h;
+		memcpy(&meta_h, input_data_current_p, 
+		       sizeof(struct ssbf_meta_header));
+		input_data_current_p += sizeof(struct ssbf_meta_header)
+			+ meta_h.payload_size;
 
-	printf("\nrest of the header (%i bytes) is encrypted\n", 
-	       ch.encrypted_header_size);
+		struct ssbf_data_header data_h;
+		memcpy(&data_h, input_data_current_p, 
+		       sizeof(struct ssbf_data_header));
+		input_data_current_p += sizeof(struct ssbf_data_header);
 
-	input_data_current_p += ch.encrypted_header_size;
+		ssbf_explain_meta_data_headers(&meta_h, &data_h);
 
-	printf("\nMAC (header): ");
+		if (input_data_current_p 
+		    != input_data_start + mh.hashed_data_size)
+		{
+			printf("parsing error\n");
+			return SSBF_GENERIC_ERROR;
+		}
+
+		uint8_t hash[16];
+		crypto_blake2b(hash, sizeof(hash),
+			       input_data_start, mh.hashed_data_size);
+		printf("\nheader is not encrypted, hash %s\n",
+		       crypto_verify16(hash, input_data_current_p) 
+		       ? "MISMATCH" : "ok");
+	}
+
+	printf("\n%s (header): ",
+	       (SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION & mh.flags) 
+	       ? "MAC" : "Hash");
 	for (uint32_t i = 0; i < full_header_hash_mac_size; i++)
 	{
 		printf("%02x ", input_data_current_p[i]);
@@ -137,6 +347,10 @@ enum ssbf_errors ssbf_explain( uint8_t *input_data_start,
 	// skip the mac
 	input_data_current_p += full_header_hash_mac_size; // mac size
 
+	// and the padding in front of the first aligned block
+	input_data_current_p += ssbf_block_padding(
+		input_data_current_p - input_data_start, mh.flags);
+
 	if (input_data_current_p + mh.blocks_sum_size 
 	    != (input_data_start + input_data_size))
 	{
@@ -146,5 +360,567 @@ enum ssbf_errors ssbf_explain( uint8_t *input_data_start,
 
 	printf("\nBlocks: ");
 	return ssbf_explain_blocks( input_data_current_p, 
-				    mh.blocks_sum_size);
+				    mh.blocks_sum_size,
+				    mh.flags,
+				    block_tags);
+}
+
+// Ratio histogram buckets of 10 %, the last one for blocks which are
+// bigger than their data (stored raw, with tag and size)
+#define SSBF_ANALYZE_RATIO_BUCKETS 11
+#define SSBF_ANALYZE_SLOWEST_BLOCKS 10
+#define SSBF_ANALYZE_TEXT_RAW_BLOCKS 32
+
+// Decode profile of one block. The checksum stage is the block
+// checksum, the block tag and the full data checksum over the output,
+// decompress is the codec, the copy of a raw block or the whole decode
+// of a base copy, reference or fill block.
+struct ssbf_block_profile {
+	uint32_t offset;        // from the first block
+	uint16_t block_number;
+	uint16_t stored_size;   // compressed_size of the block header
+	uint32_t output_size;
+	uint8_t flags;
+	uint64_t checksum_ns;
+	uint64_t decrypt_ns;
+	uint64_t decompress_ns;
+};
+
+static uint64_t ssbf_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static const char *ssbf_block_kind(const struct ssbf_header_info *hi,
+				   const struct ssbf_block_profile *p)
+{
+	struct ssbf_payload_block_header h = {
+		.block_number = p->block_number,
+		.flags = p->flags,
+	};
+
+	if (p->flags & BHF_BLOCK_BASE_COPY)
+	{
+		return "base copy";
+	}
+	if (p->flags & BHF_BLOCK_REFERENCE)
+	{
+		return "reference";
+	}
+	if (p->flags & BHF_BLOCK_FILL)
+	{
+		return "fill";
+	}
+	if (p->flags & BHF_BLOCK_COMPRESSED)
+	{
+		const struct ssbf_codec *codec = ssbf_block_codec(hi, &h);
+		return codec ? codec->name : "?";
+	}
+
+	return "raw";
+}
+
+static uint64_t ssbf_block_profile_ns(const struct ssbf_block_profile *p)
+{
+	return p->checksum_ns + p->decrypt_ns + p->decompress_ns;
+}
+
+// stored size in % of the data, 0 for a block of no data
+static uint32_t ssbf_block_ratio(const struct ssbf_block_profile *p)
+{
+	return p->output_size 
+		? (uint32_t) ((uint64_t) p->stored_size * 100 / p->output_size)
+		: 0;
+}
+
+// Decodes the block at offset like ssbf_file_decode_block, with a
+// time stamp between the stages. output holds the block data.
+static enum ssbf_errors ssbf_profile_block(struct ssbf_file *file,
+					   size_t offset,
+					   struct ssbf_payload_block_header *h,
+					   uint8_t *scratch,
+					   uint8_t *output,
+					   uint32_t *data_checksum,
+					   struct ssbf_block_profile *p)
+{
+	const struct ssbf_header_info *hi = &file->hi;
+	uint8_t *payload = file->input_data_start + hi->blocks_offset
+		+ offset + sizeof(struct ssbf_payload_block_header);
+	size_t payload_size = 0;
+	size_t block_output_size = 0;
+	size_t output_size = 0;
+	enum ssbf_errors r = SSBF_NO_ERROR;
+
+	memset(p, 0, sizeof(struct ssbf_block_profile));
+	p->offset = (uint32_t) offset;
+	p->block_number = h->block_number;
+	p->stored_size = h->compressed_size;
+	p->flags = h->flags;
+
+	uint64_t t = ssbf_time_ns();
+
+	if (ssbf_block_checksum_from(hi->data_h.flags, 0,
+				     payload, h->compressed_size)
+	    != h->data_checksum)
+	{
+		return SSBF_CHECKSUM_FAILED;
+	}
+
+	r = ssbf_check_block_tag(hi, h, payload, &payload_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	p->checksum_ns = ssbf_time_ns() - t;
+
+	r = ssbf_block_output_size(hi, h, payload, &block_output_size);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	if (UINT16_MAX < block_output_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+	p->output_size = (uint32_t) block_output_size;
+
+	if (hi->mh.flags & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE)
+	{
+		if (sizeof(uint16_t) > payload_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		payload += sizeof(uint16_t);
+		payload_size -= sizeof(uint16_t);
+	}
+
+	t = ssbf_time_ns();
+
+	if (h->flags & (BHF_BLOCK_BASE_COPY | BHF_BLOCK_REFERENCE
+			| BHF_BLOCK_FILL))
+	{
+		// small payloads, the decoder checks and decodes them
+		r = ssbf_file_decode_block(file, offset, h,
+					   output, block_output_size,
+					   &output_size);
+	}
+	else
+	{
+		if (h->flags & BHF_BLOCK_ENCRYPTED)
+		{
+			uint8_t nonce[24];
+
+			if (!(hi->mh.flags 
+			      & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION))
+			{
+				return SSBF_DECRYPTION_FAILED;
+			}
+
+			ssbf_block_nonce(h, nonce);
+			ssbf_chacha20_x(scratch, payload, payload_size,
+					hi->key_data, nonce, 0);
+			payload = scratch;
+
+			uint64_t now = ssbf_time_ns();
+			p->decrypt_ns = now - t;
+			t = now;
+		}
+
+		if (h->flags & BHF_BLOCK_COMPRESSED)
+		{
+			const struct ssbf_codec *codec = ssbf_block_codec(hi, h);
+			int32_t ds = codec
+				? codec->decompress(payload, payload_size,
+						    output, block_output_size)
+				: -1;
+
+			if (0 >= ds)
+			{
+				return SSBF_COMPRESSION_FAILED;
+			}
+			output_size = (size_t) ds;
+		}
+		else if (payload_size <= block_output_size)
+		{
+			memcpy(output, payload, payload_size);
+			output_size = payload_size;
+		}
+	}
+
+	p->decompress_ns = ssbf_time_ns() - t;
+
+	if (SSBF_NO_ERROR == r && output_size != block_output_size)
+	{
+		r = SSBF_GENERIC_ERROR;
+	}
+
+	if (SSBF_NO_ERROR == r)
+	{
+		t = ssbf_time_ns();
+		*data_checksum = ssbf_data_checksum_from(hi->data_h.flags,
+							 *data_checksum,
+							 output, output_size);
+		p->checksum_ns += ssbf_time_ns() - t;
+	}
+
+	return r;
+}
+
+// Indexes of the n slowest blocks, slowest first
+static size_t ssbf_slowest_blocks(const struct ssbf_block_profile *profiles,
+				  size_t blocks_count,
+				  size_t *slowest,
+				  size_t n)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; blocks_count > i; i++)
+	{
+		uint64_t ns = ssbf_block_profile_ns(&profiles[i]);
+		size_t j = count;
+
+		if (n == count 
+		    && ns <= ssbf_block_profile_ns(&profiles[slowest[n - 1]]))
+		{
+			continue;
+		}
+
+		if (n > count)
+		{
+			count += 1;
+		}
+		else
+		{
+			j = n - 1;
+		}
+
+		for (; 0 < j 
+			     && ns > ssbf_block_profile_ns(&profiles[slowest[j - 1]]);
+		     j--)
+		{
+			slowest[j] = slowest[j - 1];
+		}
+		slowest[j] = i;
+	}
+
+	return count;
+}
+
+static void ssbf_analyze_text(const struct ssbf_header_info *hi,
+			      const struct ssbf_block_profile *profiles,
+			      size_t blocks_count,
+			      const uint32_t *histogram,
+			      const size_t *slowest,
+			      size_t slowest_count,
+			      enum ssbf_errors r)
+{
+	uint64_t checksum_ns = 0;
+	uint64_t decrypt_ns = 0;
+	uint64_t decompress_ns = 0;
+	uint32_t raw_blocks = 0;
+	uint32_t histogram_max = 1;
+
+	ssbf_explain_meta_data_headers(&hi->meta_h, &hi->data_h);
+
+	printf("  meta payload:");
+	for (uint32_t i = 0; hi->meta_h.payload_size > i; i++)
+	{
+		printf(" %02x", hi->meta_payload_data[i]);
+	}
+
+	printf("\n\nBlocks:\n");
+	printf("  %6s %8s %8s %7s %-10s %12s %12s %12s\n",
+	       "block", "stored", "output", "ratio", "kind",
+	       "checksum us", "decrypt us", "decode us");
+
+	for (size_t i = 0; blocks_count > i; i++)
+	{
+		const struct ssbf_block_profile *p = &profiles[i];
+
+		printf("  %6u %8u %8" PRIu32 " %6" PRIu32 "%% %-10s "
+		       "%12.2f %12.2f %12.2f\n",
+		       p->block_number, p->stored_size, p->output_size,
+		       ssbf_block_ratio(p), ssbf_block_kind(hi, p),
+		       p->checksum_ns / 1e3, p->decrypt_ns / 1e3,
+		       p->decompress_ns / 1e3);
+
+		checksum_ns += p->checksum_ns;
+		decrypt_ns += p->decrypt_ns;
+		decompress_ns += p->decompress_ns;
+	}
+
+	for (uint32_t b = 0; SSBF_ANALYZE_RATIO_BUCKETS > b; b++)
+	{
+		if (histogram[b] > histogram_max)
+		{
+			histogram_max = histogram[b];
+		}
+	}
+
+	printf("\nRatio histogram (stored / output size):\n");
+	for (uint32_t b = 0; SSBF_ANALYZE_RATIO_BUCKETS > b; b++)
+	{
+		if (SSBF_ANALYZE_RATIO_BUCKETS - 1 == b)
+		{
+			printf("  >= 100%% ");
+		}
+		else
+		{
+			printf("  %3u-%3u%% ", b * 10, b * 10 + 9);
+		}
+
+		printf("%6" PRIu32 " ", histogram[b]);
+		for (uint32_t n = 0; histogram[b] * 50 / histogram_max > n; n++)
+		{
+			printf("#");
+		}
+		printf("\n");
+	}
+
+	printf("\nStored raw:");
+	for (size_t i = 0; blocks_count > i; i++)
+	{
+		const struct ssbf_block_profile *p = &profiles[i];
+
+		if (p->flags & (BHF_BLOCK_COMPRESSED | BHF_BLOCK_BASE_COPY 
+				| BHF_BLOCK_REFERENCE | BHF_BLOCK_FILL))
+		{
+			continue;
+		}
+
+		if (SSBF_ANALYZE_TEXT_RAW_BLOCKS > raw_blocks)
+		{
+			printf(" %u", p->block_number);
+		}
+		raw_blocks += 1;
+	}
+	if (SSBF_ANALYZE_TEXT_RAW_BLOCKS < raw_blocks)
+	{
+		printf(" ...");
+	}
+	printf(" (%" PRIu32 " blocks)\n", raw_blocks);
+
+	printf("\nSlowest blocks:\n");
+	for (size_t i = 0; slowest_count > i; i++)
+	{
+		const struct ssbf_block_profile *p = &profiles[slowest[i]];
+
+		printf("  block %u: %.2f us, %s, %" PRIu32 "%%\n",
+		       p->block_number, ssbf_block_profile_ns(p) / 1e3,
+		       ssbf_block_kind(hi, p), ssbf_block_ratio(p));
+	}
+
+	uint64_t total_ns = checksum_ns + decrypt_ns + decompress_ns;
+	printf("\nTotal: %" PRIu32 " -> %" PRIu32 " bytes in %zu blocks, "
+	       "%.3f ms (checksum %.3f, decrypt %.3f, decode %.3f), "
+	       "%.1f MB/s\n",
+	       hi->mh.blocks_sum_size, hi->data_h.full_data_size_uncompressed,
+	       blocks_count, total_ns / 1e6, checksum_ns / 1e6,
+	       decrypt_ns / 1e6, decompress_ns / 1e6,
+	       total_ns ? hi->data_h.full_data_size_uncompressed * 1e9
+	       / total_ns / (1024 * 1024) : 0.0);
+	printf("Result: %s (%i)\n", SSBF_NO_ERROR == r ? "ok" : "FAILED", r);
+}
+
+static void ssbf_analyze_json(const struct ssbf_header_info *hi,
+			      const struct ssbf_block_profile *profiles,
+			      size_t blocks_count,
+			      const uint32_t *histogram,
+			      const size_t *slowest,
+			      size_t slowest_count,
+			      enum ssbf_errors r)
+{
+	printf("{\n  \"error\": %i,\n", r);
+
+	printf("  \"header\": {\"meta_data_id\": %u, \"meta_payload\": \"",
+	       hi->meta_h.meta_data_id);
+	for (uint32_t i = 0; hi->meta_h.payload_size > i; i++)
+	{
+		printf("%02x", hi->meta_payload_data[i]);
+	}
+	printf("\", \"main_flags\": %u, \"data_flags\": %u, "
+	       "\"blocks_size\": %" PRIu32 ", \"data_size\": %" PRIu32 ", "
+	       "\"max_block_size\": %u, \"data_checksum\": %" PRIu32 "},\n",
+	       hi->mh.flags, hi->data_h.flags, hi->mh.blocks_sum_size,
+	       hi->data_h.full_data_size_uncompressed,
+	       hi->data_h.max_uncompressed_block_size,
+	       hi->data_h.full_data_checksum);
+
+	printf("  \"blocks\": [");
+	for (size_t i = 0; blocks_count > i; i++)
+	{
+		const struct ssbf_block_profile *p = &profiles[i];
+
+		printf("%s\n    {\"block\": %u, \"offset\": %" PRIu32 ", "
+		       "\"stored\": %u, \"output\": %" PRIu32 ", "
+		       "\"ratio\": %" PRIu32 ", \"kind\": \"%s\", "
+		       "\"encrypted\": %s, \"checksum_ns\": %" PRIu64 ", "
+		       "\"decrypt_ns\": %" PRIu64 ", "
+		       "\"decompress_ns\": %" PRIu64 "}",
+		       i ? "," : "", p->block_number, p->offset,
+		       p->stored_size, p->output_size, ssbf_block_ratio(p),
+		       ssbf_block_kind(hi, p),
+		       (p->flags & BHF_BLOCK_ENCRYPTED) ? "true" : "false",
+		       p->checksum_ns, p->decrypt_ns, p->decompress_ns);
+	}
+	printf("\n  ],\n");
+
+	printf("  \"ratio_histogram\": [");
+	for (uint32_t b = 0; SSBF_ANALYZE_RATIO_BUCKETS > b; b++)
+	{
+		printf("%s%" PRIu32, b ? ", " : "", histogram[b]);
+	}
+	printf("],\n");
+
+	printf("  \"raw_blocks\": [");
+	bool first = true;
+	for (size_t i = 0; blocks_count > i; i++)
+	{
+		if (profiles[i].flags & (BHF_BLOCK_COMPRESSED 
+					 | BHF_BLOCK_BASE_COPY 
+					 | BHF_BLOCK_REFERENCE
+					 | BHF_BLOCK_FILL))
+		{
+			continue;
+		}
+
+		printf("%s%u", first ? "" : ", ", profiles[i].block_number);
+		first = false;
+	}
+	printf("],\n");
+
+	printf("  \"slowest_blocks\": [");
+	for (size_t i = 0; slowest_count > i; i++)
+	{
+		printf("%s%u", i ? ", " : "",
+		       profiles[slowest[i]].block_number);
+	}
+	printf("]\n}\n");
+}
+
+enum ssbf_errors ssbf_explain_analyze(uint8_t *key_main, //[32],
+				      uint8_t *input_data_start,
+				      size_t input_data_size,
+				      const struct ssbf_decode_options *options,
+				      bool json)
+{
+	struct ssbf_file file;
+	struct ssbf_payload_block_header h;
+	size_t blocks_count = 0;
+	size_t offset = 0;
+
+	enum ssbf_errors r = ssbf_open(&file, key_main, input_data_start,
+				       input_data_size, options);
+
+	// the headers only, to know how many blocks there are
+	while (SSBF_NO_ERROR == r)
+	{
+		r = ssbf_file_block_header(&file, offset, 
+					   (uint16_t) blocks_count, &h);
+		if (SSBF_NO_ERROR == r)
+		{
+			blocks_count += 1;
+			if (h.flags & BHF_LAST_BLOCK)
+			{
+				break;
+			}
+			r = ssbf_file_skip_block(&file, &h, &offset);
+		}
+	}
+
+	if (SSBF_NO_ERROR != r)
+	{
+		printf(json ? "{\"error\": %i}\n" : "analysis failed %i\n", r);
+		ssbf_close(&file);
+		return r;
+	}
+
+	struct ssbf_block_profile *profiles = 
+		calloc(blocks_count, sizeof(struct ssbf_block_profile));
+	uint8_t *scratch = malloc(UINT16_MAX);
+	uint8_t *output = malloc(UINT16_MAX);
+	uint32_t histogram[SSBF_ANALYZE_RATIO_BUCKETS] = {0};
+	size_t slowest[SSBF_ANALYZE_SLOWEST_BLOCKS];
+	uint32_t data_checksum = 0;
+	size_t data_size = 0;
+	size_t profiled = 0;
+
+	r = (profiles && scratch && output) 
+		? SSBF_NO_ERROR : SSBF_GENERIC_ERROR;
+
+	// the backend self test is not part of the first block's time
+	ssbf_cipher_selected();
+
+	for (offset = 0; SSBF_NO_ERROR == r && blocks_count > profiled; )
+	{
+		r = ssbf_file_block_header(&file, offset, 
+					   (uint16_t) profiled, &h);
+		if (SSBF_NO_ERROR == r)
+		{
+			r = ssbf_profile_block(&file, offset, &h,
+					       scratch, output,
+					       &data_checksum,
+					       &profiles[profiled]);
+		}
+
+		if (SSBF_NO_ERROR == r)
+		{
+			const struct ssbf_block_profile *p = 
+				&profiles[profiled];
+			uint32_t b = ssbf_block_ratio(p) / 10;
+
+			histogram[b < SSBF_ANALYZE_RATIO_BUCKETS 
+				  ? b : SSBF_ANALYZE_RATIO_BUCKETS - 1] += 1;
+			data_size += p->output_size;
+			profiled += 1;
+
+			if (!(h.flags & BHF_LAST_BLOCK))
+			{
+				r = ssbf_file_skip_block(&file, &h, &offset);
+			}
+		}
+	}
+
+	if (SSBF_NO_ERROR == r
+	    && data_size != file.hi.data_h.full_data_size_uncompressed)
+	{
+		r = SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (SSBF_NO_ERROR == r
+	    && data_checksum != file.hi.data_h.full_data_checksum)
+	{
+		r = SSBF_CHECKSUM_FAILED;
+	}
+
+	// the blocks up to the failing one are reported
+	if (profiles)
+	{
+		size_t slowest_count = ssbf_slowest_blocks(
+			profiles, profiled, 
+			slowest, SSBF_ANALYZE_SLOWEST_BLOCKS);
+
+		if (json)
+		{
+			ssbf_analyze_json(&file.hi, profiles, profiled,
+					  histogram, slowest, slowest_count, r);
+		}
+		else
+		{
+			ssbf_analyze_text(&file.hi, profiles, profiled,
+					  histogram, slowest, slowest_count, r);
+		}
+	}
+
+	free(profiles);
+	free(scratch);
+	free(output);
+	ssbf_close(&file);
+
+	return r;
 }
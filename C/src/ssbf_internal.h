@@ -10,89 +10,218 @@ enum block_header_flags {
 	BHF_LAST_BLOCK = 1,
 	BHF_BLOCK_COMPRESSED = 2,
 	BHF_BLOCK_ENCRYPTED = 4,
+	BHF_BLOCK_BASE_COPY = 8,
+	BHF_BLOCK_REFERENCE = 16,
+	// the block is one byte repeated (erased flash, zero fill), the
+	// payload is only that byte
+	BHF_BLOCK_FILL = 32,
+	// enum ssbf_codec_ids of a compressed block, 0 (LZ4) unless
+	// SSBF_DATA_HEADER_FLAG_BLOCK_CODECS is set
+	BHF_BLOCK_CODEC_SHIFT = 6,
+	BHF_BLOCK_CODEC_MASK = 0xc0,
 };
 
-struct ssbf_main_header {
-	uint32_t ssbf_magic_number;
-	uint32_t blocks_sum_size;
-        uint16_t hashed_data_size;
-        uint8_t flags;
-        uint8_t header_checksum;
+// data key in the encryption payload, MAC or hash after the header
+#define SSBF_DATA_KEY_SIZE 32
+#define SSBF_HEADER_HASH_SIZE 16
+
+// biggest header ssbf_unlock_header decodes (ch.encrypted_header_size):
+// the data key, the meta data and the data header
+#define SSBF_HEADER_PLAIN_MAX_SIZE (SSBF_DATA_KEY_SIZE \
+	+ sizeof(struct ssbf_meta_header) + SSBF_META_PAYLOAD_MAX_SIZE \
+	+ sizeof(struct ssbf_data_header))
+
+// truncated Poly1305 tag at the end of every block data, if
+// SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS is set
+#define SSBF_BLOCK_TAG_SIZE 8
+
+// payload of a BHF_BLOCK_BASE_COPY block, the block data is taken
+// from the base image instead of being stored in the file
+struct ssbf_base_copy {
+        uint32_t base_offset;
+        uint16_t size;
+        uint16_t base_checksum; // bsd16 of the referenced base data
 };
 
-struct ssbf_encryption_header {
-        uint8_t nonce[24];
-        uint16_t encryption_payload_size;
-	uint16_t encrypted_header_size;
-        uint8_t flags;
-        uint8_t header_checksum;
+// payload of a BHF_BLOCK_REFERENCE block, the block data is a repeat
+// of an earlier block of the same file
+struct ssbf_block_reference {
+        uint32_t output_offset; // where the earlier block was decoded to
+        uint16_t size;
+        uint16_t block_number;  // the referenced block
 };
 
-struct ssbf_meta_header {
-     uint16_t meta_data_id;
-     uint16_t payload_size;
-};
-
-struct ssbf_data_header {
-        uint32_t full_data_size_uncompressed;
-        uint16_t max_uncompressed_block_size;
-        uint8_t flags;
-        uint8_t reserved;
-        uint32_t full_data_checksum;
-};
+enum ssbf_errors ssbf_decode_plain_headers(uint8_t *input_data_start,
+					   size_t input_data_size,
+					   struct ssbf_header_info *hi);
 
-struct ssbf_payload_block_header {
-        uint16_t block_number;
-        uint16_t compressed_size; //TODO: rename to data_size
-        uint16_t data_checksum;
-        uint8_t flags;
-        uint8_t header_checksum;
-};
+enum ssbf_errors ssbf_unlock_header(uint8_t *key_main, //[32],
+				    uint8_t *input_data_start,
+				    struct ssbf_header_info *hi,
+				    uint8_t *header_plain);
 
 enum ssbf_errors ssbf_decode_block_header(
 	uint8_t *input_data,
 	size_t input_data_size,
 	struct ssbf_payload_block_header *h);
 
-#ifdef UNIT_TESTS
-size_t ssbf_encode_block(uint8_t *key_data,
-			 uint8_t *output_mem,
-			 uint8_t *input_data_start, 
-			 size_t input_data_size,
-			 uint16_t block_number,
-			 uint8_t input_flags);
-
 void ssbf_encode_data_to_blocks(uint8_t *key_data,
 				size_t max_block_size,
+				uint16_t first_block_number,
 				uint8_t *input_data_start,
 				size_t input_data_size,
 				uint8_t *output_data_start,				
 				size_t output_data_max_size,
-				size_t *actual_output_data_size);
-
+				size_t *actual_output_data_size,
+				struct ssbf_checksum_state *checksum,
+				const struct ssbf_encode_options *options);
+
+uint8_t ssbf_main_header_flags(const struct ssbf_encode_options *options);
+size_t ssbf_encode_max_block_size(size_t max_block_size,
+				  const struct ssbf_encode_options *options);
+uint8_t ssbf_data_header_flags(const struct ssbf_encode_options *options);
+
+size_t ssbf_header_size(bool encrypted, uint16_t meta_data_payload_size);
+
+size_t ssbf_encode_header(uint8_t *key_main, //[32],
+			  uint8_t *key_main_nonce, //[24]
+			  uint8_t *key_data, //[32]
+			  uint8_t main_header_flags,
+			  uint8_t encryption_header_flags,
+			  uint16_t meta_data_id,
+			  uint8_t *meta_payload_data,
+			  uint16_t meta_data_payload_size,
+			  const struct ssbf_data_header *data_h,
+			  size_t blocks_sum_size,
+			  uint8_t *output_data_start);
+
+size_t ssbf_encode_finish(uint8_t *key_main, //[32],
+			  uint8_t *key_main_nonce, //[24]
+			  uint8_t *key_data, //[32]
+			  uint8_t main_header_flags,
+			  uint8_t encryption_header_flags,
+			  uint16_t meta_data_id,
+			  uint8_t *meta_payload_data,
+			  uint16_t meta_data_payload_size,
+			  struct ssbf_data_header *data_h,
+			  size_t blocks_offset,
+			  size_t blocks_sum_size,
+			  uint8_t *output_data_start);
+
+enum ssbf_errors ssbf_block_output_size(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *input_data,
+	size_t *block_output_size);
 
+// Checks the tag at the end of the block data, if the file has block
+// tags, and returns the size of the block data in front of it
+enum ssbf_errors ssbf_check_block_tag(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *input_data,
+	size_t *block_data_size);
+
+// XChaCha20 nonce of an encrypted block payload
+void ssbf_block_nonce(
+	const struct ssbf_payload_block_header *block_header,
+	uint8_t *nonce);
+
+struct ssbf_codec;
+
+// Codec of a compressed block, NULL if it is not compiled in or the
+// file does not allow codecs other than LZ4
+const struct ssbf_codec *ssbf_block_codec(
+	const struct ssbf_header_info *hi,
+	const struct ssbf_payload_block_header *block_header);
+
+// Blocks of an opened file, offset is from the first block. The
+// header of block_number at offset is checked to be in the file.
+enum ssbf_errors ssbf_file_block_header(struct ssbf_file *file,
+					size_t offset,
+					uint16_t block_number,
+					struct ssbf_payload_block_header *h);
+
+// Moves offset over the block and the padding after it
+enum ssbf_errors ssbf_file_skip_block(struct ssbf_file *file,
+				      const struct ssbf_payload_block_header *h,
+				      size_t *offset);
+
+// Decodes the block at offset. A reference block (dedup) is decoded
+// from the block it repeats, so no earlier output is needed.
+enum ssbf_errors ssbf_file_decode_block(struct ssbf_file *file,
+					size_t offset,
+					struct ssbf_payload_block_header *h,
+					uint8_t *output_data,
+					size_t output_data_max_size,
+					size_t *output_data_actual_size);
+
+size_t ssbf_encode_scratch_size(size_t max_block_size,
+				const struct ssbf_encode_options *options);
+
+size_t ssbf_encode_stream_block(uint8_t *key_data,
+				size_t max_block_size,
+				uint16_t block_number,
+				uint8_t *input_data_start,
+				size_t input_data_size,
+				bool last,
+				uint8_t *output_data,
+				size_t *block_size,
+				uint8_t *scratch,
+				const struct ssbf_encode_options *options);
 
-enum ssbf_errors ssbf_decode_block(uint8_t *block_key,
+#ifdef UNIT_TESTS
+size_t ssbf_encode_block(uint8_t *key_data,
+			 uint8_t *output_mem,
+			 uint8_t *input_data_start, 
+			 size_t input_data_size,
+			 uint16_t block_number,
+			 uint8_t input_flags,
+			 uint8_t *scratch,
+			 const struct ssbf_encode_options *options);
+
+size_t ssbf_encode_base_copy_block(uint8_t *key_data,
+				   uint8_t *output_mem,
+				   struct ssbf_base_copy *base_copy,
+				   uint16_t block_number,
+				   uint8_t input_flags,
+				   const struct ssbf_encode_options *options);
+
+size_t ssbf_encode_reference_block(uint8_t *key_data,
+				   uint8_t *output_mem,
+				   struct ssbf_block_reference *reference,
+				   uint16_t block_number,
+				   uint8_t input_flags,
+				   const struct ssbf_encode_options *options);
+
+size_t ssbf_encode_fill_block(uint8_t *key_data,
+			      uint8_t *output_mem,
+			      uint8_t value,
+			      size_t block_size,
+			      uint16_t block_number,
+			      uint8_t input_flags,
+			      const struct ssbf_encode_options *options);
+
+
+
+enum ssbf_errors ssbf_decode_block(const struct ssbf_header_info *hi,
 				   struct ssbf_payload_block_header *block_header,
 				   uint8_t *input_data,
+				   uint8_t *output_data_start,
 				   uint8_t *output_data,
 				   size_t output_data_max_mem_size,
-				   size_t *output_data_actual_size);
+				   size_t *output_data_actual_size,
+				   const struct ssbf_decode_options *options);
 
-enum ssbf_errors ssbf_decode_data_from_blocks(uint8_t *block_key,
-					 size_t max_block_size,
+enum ssbf_errors ssbf_decode_data_from_blocks(
+					 const struct ssbf_header_info *hi,
 					 uint8_t *input_data_start,
 					 size_t input_data_size,
 					 uint8_t *output_data_start,				
 					 size_t output_data_max_size,
-					      size_t *actual_output_data_size);
-
-enum ssbf_errors ssbf_decode_data(uint8_t *key_main, //[32],
-				  uint8_t *input_data_start,
-				  size_t input_data_size,
-				  uint8_t *output_data_start,				
-				  size_t output_data_max_size,
-				  size_t *actual_output_data_size);
+					      struct ssbf_decode_checkpoint *checkpoint,
+					      uint32_t max_blocks,
+					      const struct ssbf_decode_options *options);
 
 #endif
 
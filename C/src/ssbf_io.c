@@ -0,0 +1,1356 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+#include "ssbf_io.h"
+
+#include "monocypher.h"
+
+#define SSBF_IO_DEFAULT_CHUNK_SIZE (128 * 1024)
+#define SSBF_IO_DEFAULT_QUEUE_DEPTH 32
+#define SSBF_IO_MAX_THREADS 64
+// blocking reads need a thread each to be in flight, more than a few
+// only take turns on the same disk
+#define SSBF_IO_DEFAULT_THREADS 8
+
+// A chunk of the input to read or of the output to write. Reads are
+// made at the start for the whole input, writes are added as the
+// output is made.
+struct ssbf_io_request {
+	uint8_t *data;
+	size_t size;
+	uint64_t offset;
+	bool done;
+};
+
+struct ssbf_io_queue {
+	struct ssbf_io_request *requests;
+	size_t count;
+	size_t max_count;
+	size_t submitted;           // requests before it were submitted
+	size_t done;                // done requests, reads: done in order
+};
+
+// io_uring without liburing: the rings are mapped from the kernel and
+// filled with the syscalls
+struct ssbf_io_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned unsubmitted;       // queued in the ring, not yet entered
+	bool fixed_buffers;         // input is buffer 0, output buffer 1
+};
+
+struct ssbf_io {
+	uint8_t backend;
+	size_t chunk_size;
+	uint32_t queue_depth;
+	bool queue_depth_set;       // given in the options
+	uint32_t in_flight;
+	bool failed;
+
+	int input_fd;
+	uint8_t *input;
+	size_t input_size;
+	size_t input_ready;         // bytes from the start which are read
+
+	int output_fd;
+	const char *output_path;
+	uint8_t *output;
+	size_t output_max_size;
+	size_t output_queued;       // output before it is queued for writing
+
+	uint8_t *scratch;           // decrypted block payloads (decode),
+	                            // output of the codecs (encode)
+	size_t scratch_size;
+
+	struct ssbf_io_queue reads;
+	struct ssbf_io_queue writes;
+
+	// SSBF_IO_THREADS
+	pthread_t workers[SSBF_IO_MAX_THREADS];
+	size_t worker_count;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t progress;
+	bool stop;
+
+	// SSBF_IO_URING
+	struct ssbf_io_uring ring;
+};
+
+const char *ssbf_io_backend_name(uint8_t backend)
+{
+	switch (backend)
+	{
+	case SSBF_IO_STDIO:
+		return "stdio";
+	case SSBF_IO_MMAP:
+		return "mmap";
+	case SSBF_IO_THREADS:
+		return "threads";
+	case SSBF_IO_URING:
+		return "io_uring";
+	default:
+		return "?";
+	}
+}
+
+static bool ssbf_io_queue_add(struct ssbf_io_queue *q,
+			      uint8_t *data, size_t size, uint64_t offset)
+{
+	if (q->count == q->max_count)
+	{
+		size_t max_count = q->max_count ? 2 * q->max_count : 64;
+		struct ssbf_io_request *requests = realloc(
+			q->requests, max_count * sizeof(struct ssbf_io_request));
+		if (NULL == requests)
+		{
+			return false;
+		}
+		q->requests = requests;
+		q->max_count = max_count;
+	}
+
+	q->requests[q->count++] = (struct ssbf_io_request) {
+		.data = data,
+		.size = size,
+		.offset = offset,
+		.done = false,
+	};
+
+	return true;
+}
+
+// Marks a request done and moves the read input forward over the reads
+// which are done in order
+static void ssbf_io_request_done(struct ssbf_io *io, bool write, size_t i)
+{
+	struct ssbf_io_queue *q = write ? &io->writes : &io->reads;
+
+	q->requests[i].done = true;
+
+	if (write)
+	{
+		q->done += 1;
+		return;
+	}
+
+	while (q->done < q->count && q->requests[q->done].done)
+	{
+		q->done += 1;
+	}
+
+	io->input_ready = q->done < q->count
+		? q->requests[q->done].offset : io->input_size;
+}
+
+// Reads or writes all of the request, false if the file ends first or
+// on an error
+static bool ssbf_io_transfer(int fd, bool write, uint8_t *data,
+			     size_t size, uint64_t offset)
+{
+	while (size)
+	{
+		ssize_t n = write ? pwrite(fd, data, size, (off_t) offset)
+			: pread(fd, data, size, (off_t) offset);
+
+		if (0 > n && EINTR == errno)
+		{
+			continue;
+		}
+		if (0 >= n)
+		{
+			return false;
+		}
+
+		data += n;
+		size -= (size_t) n;
+		offset += (uint64_t) n;
+	}
+
+	return true;
+}
+
+//
+// SSBF_IO_THREADS
+//
+
+static void *ssbf_io_worker(void *arg)
+{
+	struct ssbf_io *io = arg;
+
+	pthread_mutex_lock(&io->lock);
+
+	while (1)
+	{
+		// the reads come first, the encoder or decoder waits for them
+		struct ssbf_io_queue *q =
+			io->reads.submitted < io->reads.count ? &io->reads
+			: (io->writes.submitted < io->writes.count
+			   ? &io->writes : NULL);
+
+		if (NULL == q)
+		{
+			if (io->stop)
+			{
+				break;
+			}
+			pthread_cond_wait(&io->work, &io->lock);
+			continue;
+		}
+
+		bool write = (q == &io->writes);
+		size_t i = q->submitted++;
+		struct ssbf_io_request r = q->requests[i];
+
+		pthread_mutex_unlock(&io->lock);
+
+		bool ok = ssbf_io_transfer(write ? io->output_fd : io->input_fd,
+					   write, r.data, r.size, r.offset);
+
+		pthread_mutex_lock(&io->lock);
+
+		io->failed |= !ok;
+		ssbf_io_request_done(io, write, i);
+		// only the encoder or decoder waits for progress
+		pthread_cond_signal(&io->progress);
+	}
+
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
+}
+
+static bool ssbf_io_threads_start(struct ssbf_io *io)
+{
+	uint32_t threads = io->queue_depth;
+
+	if (!io->queue_depth_set && SSBF_IO_DEFAULT_THREADS < threads)
+	{
+		threads = SSBF_IO_DEFAULT_THREADS;
+	}
+	if (SSBF_IO_MAX_THREADS < threads)
+	{
+		threads = SSBF_IO_MAX_THREADS;
+	}
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->work, NULL);
+	pthread_cond_init(&io->progress, NULL);
+
+	for (; threads > io->worker_count; io->worker_count++)
+	{
+		if (pthread_create(&io->workers[io->worker_count], NULL,
+				   ssbf_io_worker, io))
+		{
+			break;
+		}
+	}
+
+	return 0 < io->worker_count;
+}
+
+static void ssbf_io_threads_stop(struct ssbf_io *io)
+{
+	pthread_mutex_lock(&io->lock);
+	io->stop = true;
+	// nothing new is started after an error
+	if (io->failed)
+	{
+		io->reads.submitted = io->reads.count;
+		io->writes.submitted = io->writes.count;
+	}
+	pthread_cond_broadcast(&io->work);
+	pthread_mutex_unlock(&io->lock);
+
+	for (size_t i = 0; io->worker_count > i; i++)
+	{
+		pthread_join(io->workers[i], NULL);
+	}
+
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->work);
+	pthread_cond_destroy(&io->progress);
+}
+
+//
+// SSBF_IO_URING
+//
+
+static int ssbf_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ssbf_io_uring_enter(int fd, unsigned to_submit,
+			       unsigned min_complete)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			     min_complete ? IORING_ENTER_GETEVENTS : 0,
+			     NULL, 0);
+}
+
+bool ssbf_io_uring_supported(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = ssbf_io_uring_setup(1, &p);
+	if (0 > fd)
+	{
+		return false;
+	}
+
+	close(fd);
+	return true;
+}
+
+static void ssbf_io_uring_exit(struct ssbf_io_uring *ring)
+{
+	if (ring->sqes)
+	{
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+	{
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring)
+	{
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (0 <= ring->fd)
+	{
+		close(ring->fd);
+	}
+
+	memset(ring, 0, sizeof(struct ssbf_io_uring));
+	ring->fd = -1;
+}
+
+static bool ssbf_io_uring_init(struct ssbf_io *io)
+{
+	struct ssbf_io_uring *ring = &io->ring;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = ssbf_io_uring_setup(io->queue_depth, &p);
+	if (0 > ring->fd)
+	{
+		return false;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// both rings in one mapping on kernels since 5.4
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+		{
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring)
+	{
+		ring->sq_ring = NULL;
+		ssbf_io_uring_exit(ring);
+		return false;
+	}
+
+	ring->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring
+		: mmap(NULL, ring->cq_ring_size,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       ring->fd, IORING_OFF_CQ_RING);
+	if (MAP_FAILED == ring->cq_ring)
+	{
+		ring->cq_ring = NULL;
+		ssbf_io_uring_exit(ring);
+		return false;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size,
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes)
+	{
+		ring->sqes = NULL;
+		ssbf_io_uring_exit(ring);
+		return false;
+	}
+
+	uint8_t *sq = ring->sq_ring;
+	uint8_t *cq = ring->cq_ring;
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	// with the buffers registered the kernel does not map the pages
+	// for every request. Without them the plain reads and writes are
+	// used (e.g. over the locked memory limit).
+	struct iovec buffers[2] = {
+		{ .iov_base = io->input, .iov_len = io->input_size },
+		{ .iov_base = io->output, .iov_len = io->output_max_size },
+	};
+	ring->fixed_buffers = io->input_size && io->output_max_size
+		&& 0 == syscall(__NR_io_uring_register, ring->fd,
+				IORING_REGISTER_BUFFERS, buffers, 2);
+
+	return true;
+}
+
+// Puts a read or write in the submission ring, it is submitted with the
+// next ssbf_io_uring_enter
+static void ssbf_io_uring_queue(struct ssbf_io *io, bool write, size_t i)
+{
+	struct ssbf_io_uring *ring = &io->ring;
+	struct ssbf_io_request *r = write
+		? &io->writes.requests[i] : &io->reads.requests[i];
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	if (ring->fixed_buffers)
+	{
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = write ? 1 : 0;
+	}
+	else
+	{
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = write ? io->output_fd : io->input_fd;
+	sqe->addr = (uint64_t) (uintptr_t) r->data;
+	sqe->len = (uint32_t) r->size;
+	sqe->off = r->offset;
+	sqe->user_data = ((uint64_t) i << 1) | write;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->unsubmitted += 1;
+}
+
+static void ssbf_io_uring_reap(struct ssbf_io *io)
+{
+	struct ssbf_io_uring *ring = &io->ring;
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		bool write = cqe->user_data & 1;
+		size_t i = (size_t) (cqe->user_data >> 1);
+		struct ssbf_io_request *r = write
+			? &io->writes.requests[i] : &io->reads.requests[i];
+
+		if (-EINTR == cqe->res || -EAGAIN == cqe->res)
+		{
+			ssbf_io_uring_queue(io, write, i);
+			continue;
+		}
+
+		if (0 >= cqe->res)
+		{
+			io->failed = true;
+			io->in_flight -= 1;
+			continue;
+		}
+
+		// the rest of a short read or write is queued again
+		if ((size_t) cqe->res < r->size)
+		{
+			r->data += cqe->res;
+			r->size -= (size_t) cqe->res;
+			r->offset += (uint64_t) cqe->res;
+			ssbf_io_uring_queue(io, write, i);
+			continue;
+		}
+
+		io->in_flight -= 1;
+		ssbf_io_request_done(io, write, i);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Fills the ring up to the queue depth, a quarter of it stays for the
+// writes while the input is read
+static void ssbf_io_uring_fill(struct ssbf_io *io)
+{
+	uint32_t max_reads = io->queue_depth - io->queue_depth / 4;
+
+	while (!io->failed && io->queue_depth > io->in_flight)
+	{
+		if (io->reads.submitted < io->reads.count
+		    && (max_reads > io->in_flight
+			|| io->writes.submitted == io->writes.count))
+		{
+			ssbf_io_uring_queue(io, false, io->reads.submitted++);
+		}
+		else if (io->writes.submitted < io->writes.count)
+		{
+			ssbf_io_uring_queue(io, true, io->writes.submitted++);
+		}
+		else
+		{
+			break;
+		}
+
+		io->in_flight += 1;
+	}
+}
+
+// Submits what is queued and waits for at least one completion if wait
+static void ssbf_io_uring_run(struct ssbf_io *io, bool wait)
+{
+	struct ssbf_io_uring *ring = &io->ring;
+
+	ssbf_io_uring_fill(io);
+
+	wait = wait && io->in_flight;
+	if (ring->unsubmitted || wait)
+	{
+		int n = ssbf_io_uring_enter(ring->fd, ring->unsubmitted,
+					    wait ? 1 : 0);
+		if (0 <= n)
+		{
+			ring->unsubmitted -= (unsigned) n;
+		}
+		else if (EINTR != errno && EAGAIN != errno && EBUSY != errno)
+		{
+			io->failed = true;
+		}
+	}
+
+	ssbf_io_uring_reap(io);
+}
+
+//
+// Common to all backends
+//
+
+static void ssbf_io_init(struct ssbf_io *io,
+			 const struct ssbf_io_options *io_options)
+{
+	memset(io, 0, sizeof(struct ssbf_io));
+	io->input_fd = -1;
+	io->output_fd = -1;
+	io->ring.fd = -1;
+
+	if (io_options)
+	{
+		io->backend = io_options->backend;
+		io->chunk_size = io_options->chunk_size;
+		io->queue_depth = io_options->queue_depth;
+	}
+
+	if (0 == io->chunk_size)
+	{
+		io->chunk_size = SSBF_IO_DEFAULT_CHUNK_SIZE;
+	}
+	io->queue_depth_set = (0 != io->queue_depth);
+	if (0 == io->queue_depth)
+	{
+		io->queue_depth = SSBF_IO_DEFAULT_QUEUE_DEPTH;
+	}
+}
+
+// Opens the input and gets memory for it. stdio and mmap have all of
+// it right away.
+static enum ssbf_errors ssbf_io_open_input(struct ssbf_io *io,
+					   const char *path)
+{
+	struct stat st;
+
+	io->input_fd = open(path, O_RDONLY);
+	if (0 > io->input_fd || fstat(io->input_fd, &st))
+	{
+		return SSBF_IO_ERROR;
+	}
+
+	io->input_size = (size_t) st.st_size;
+	if (0 == io->input_size)
+	{
+		return SSBF_NO_ERROR;
+	}
+
+	if (SSBF_IO_MMAP == io->backend)
+	{
+		io->input = mmap(NULL, io->input_size, PROT_READ, MAP_PRIVATE,
+				 io->input_fd, 0);
+		if (MAP_FAILED == io->input)
+		{
+			io->input = NULL;
+			return SSBF_IO_ERROR;
+		}
+
+		madvise(io->input, io->input_size, MADV_SEQUENTIAL);
+		io->input_ready = io->input_size;
+		return SSBF_NO_ERROR;
+	}
+
+	io->input = malloc(io->input_size);
+	if (NULL == io->input)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (SSBF_IO_STDIO == io->backend)
+	{
+		FILE *fp = fdopen(dup(io->input_fd), "rb");
+		size_t n = fp ? fread(io->input, 1, io->input_size, fp) : 0;
+
+		if (fp)
+		{
+			fclose(fp);
+		}
+		if (n != io->input_size)
+		{
+			return SSBF_IO_ERROR;
+		}
+		io->input_ready = io->input_size;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+// Reads the start of the input before the rest is read in the
+// background, e.g. the header which tells how big the output is
+static enum ssbf_errors ssbf_io_read_start(struct ssbf_io *io, size_t size)
+{
+	if (size > io->input_size)
+	{
+		size = io->input_size;
+	}
+
+	if (size > io->input_ready)
+	{
+		if (!ssbf_io_transfer(io->input_fd, false,
+				      io->input + io->input_ready,
+				      size - io->input_ready, io->input_ready))
+		{
+			return SSBF_IO_ERROR;
+		}
+		io->input_ready = size;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+static enum ssbf_errors ssbf_io_open_output(struct ssbf_io *io,
+					    const char *path,
+					    size_t max_size)
+{
+	io->output_path = path;
+	io->output_max_size = max_size;
+
+	// stdio writes all of it at the end
+	if (SSBF_IO_STDIO != io->backend)
+	{
+		io->output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (0 > io->output_fd)
+		{
+			return SSBF_IO_ERROR;
+		}
+	}
+
+	if (0 == max_size)
+	{
+		return SSBF_NO_ERROR;
+	}
+
+	if (SSBF_IO_MMAP == io->backend)
+	{
+		if (ftruncate(io->output_fd, (off_t) max_size))
+		{
+			return SSBF_IO_ERROR;
+		}
+
+		io->output = mmap(NULL, max_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, io->output_fd, 0);
+		if (MAP_FAILED == io->output)
+		{
+			io->output = NULL;
+			return SSBF_IO_ERROR;
+		}
+		return SSBF_NO_ERROR;
+	}
+
+	io->output = malloc(max_size);
+
+	return io->output ? SSBF_NO_ERROR : SSBF_GENERIC_ERROR;
+}
+
+// Starts reading the rest of the input in chunks, both buffers must be
+// there (io_uring registers them)
+static enum ssbf_errors ssbf_io_start(struct ssbf_io *io)
+{
+	if (SSBF_IO_URING == io->backend && !ssbf_io_uring_init(io))
+	{
+		io->backend = SSBF_IO_THREADS;
+	}
+
+	if (SSBF_IO_THREADS == io->backend && !ssbf_io_threads_start(io))
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_mutex_lock(&io->lock);
+	}
+
+	for (size_t offset = io->input_ready; io->input_size > offset;
+	     offset += io->chunk_size)
+	{
+		size_t size = io->input_size - offset < io->chunk_size
+			? io->input_size - offset : io->chunk_size;
+
+		if (!ssbf_io_queue_add(&io->reads, io->input + offset,
+				       size, offset))
+		{
+			io->failed = true;
+			break;
+		}
+	}
+
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_cond_broadcast(&io->work);
+		pthread_mutex_unlock(&io->lock);
+	}
+	else if (SSBF_IO_URING == io->backend)
+	{
+		ssbf_io_uring_run(io, false);
+	}
+
+	return io->failed ? SSBF_IO_ERROR : SSBF_NO_ERROR;
+}
+
+// Waits until the first size bytes of the input are read
+static enum ssbf_errors ssbf_io_wait_input(struct ssbf_io *io, size_t size)
+{
+	if (size > io->input_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_mutex_lock(&io->lock);
+		while (size > io->input_ready && !io->failed)
+		{
+			pthread_cond_wait(&io->progress, &io->lock);
+		}
+		pthread_mutex_unlock(&io->lock);
+	}
+	else if (SSBF_IO_URING == io->backend)
+	{
+		ssbf_io_uring_run(io, false);
+		while (size > io->input_ready && !io->failed)
+		{
+			ssbf_io_uring_run(io, true);
+		}
+	}
+
+	return io->failed ? SSBF_IO_ERROR : SSBF_NO_ERROR;
+}
+
+// Queues the output from offset for writing, in chunks
+static enum ssbf_errors ssbf_io_write(struct ssbf_io *io,
+				      size_t offset, size_t size)
+{
+	if (SSBF_IO_THREADS != io->backend && SSBF_IO_URING != io->backend)
+	{
+		return SSBF_NO_ERROR;
+	}
+
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_mutex_lock(&io->lock);
+	}
+
+	while (size && !io->failed)
+	{
+		size_t chunk = size < io->chunk_size ? size : io->chunk_size;
+
+		if (!ssbf_io_queue_add(&io->writes, io->output + offset,
+				       chunk, offset))
+		{
+			io->failed = true;
+		}
+		offset += chunk;
+		size -= chunk;
+	}
+
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_cond_broadcast(&io->work);
+		pthread_mutex_unlock(&io->lock);
+	}
+	else
+	{
+		ssbf_io_uring_run(io, false);
+	}
+
+	return io->failed ? SSBF_IO_ERROR : SSBF_NO_ERROR;
+}
+
+// Queues whole chunks of the output up to end, and the rest if last
+static enum ssbf_errors ssbf_io_write_until(struct ssbf_io *io,
+					    size_t end, bool last)
+{
+	size_t size = end - io->output_queued;
+
+	if (!last)
+	{
+		size -= size % io->chunk_size;
+	}
+
+	enum ssbf_errors e = ssbf_io_write(io, io->output_queued, size);
+	io->output_queued += size;
+
+	return e;
+}
+
+// Waits for all writes and leaves output_size bytes in the output file
+static enum ssbf_errors ssbf_io_finish(struct ssbf_io *io,
+				       size_t output_size)
+{
+	if (SSBF_IO_THREADS == io->backend)
+	{
+		pthread_mutex_lock(&io->lock);
+		while (io->writes.done < io->writes.count && !io->failed)
+		{
+			pthread_cond_wait(&io->progress, &io->lock);
+		}
+		pthread_mutex_unlock(&io->lock);
+	}
+	else if (SSBF_IO_URING == io->backend)
+	{
+		while (io->writes.done < io->writes.count && !io->failed)
+		{
+			ssbf_io_uring_run(io, true);
+		}
+	}
+	else if (SSBF_IO_STDIO == io->backend)
+	{
+		FILE *fp = fopen(io->output_path, "wb");
+		if (NULL == fp)
+		{
+			return SSBF_IO_ERROR;
+		}
+
+		size_t n = output_size
+			? fwrite(io->output, 1, output_size, fp) : 0;
+		if (fclose(fp) || n != output_size)
+		{
+			return SSBF_IO_ERROR;
+		}
+		return SSBF_NO_ERROR;
+	}
+
+	if (io->failed)
+	{
+		return SSBF_IO_ERROR;
+	}
+
+	if (SSBF_IO_MMAP == io->backend && io->output)
+	{
+		munmap(io->output, io->output_max_size);
+		io->output = NULL;
+	}
+
+	return ftruncate(io->output_fd, (off_t) output_size)
+		? SSBF_IO_ERROR : SSBF_NO_ERROR;
+}
+
+static void ssbf_io_close(struct ssbf_io *io)
+{
+	// the kernel and the workers must be done with the buffers
+	if (SSBF_IO_THREADS == io->backend && io->worker_count)
+	{
+		ssbf_io_threads_stop(io);
+	}
+	else if (SSBF_IO_URING == io->backend && 0 <= io->ring.fd)
+	{
+		io->failed = true;
+		while (io->in_flight)
+		{
+			ssbf_io_uring_run(io, true);
+		}
+		ssbf_io_uring_exit(&io->ring);
+	}
+
+	if (SSBF_IO_MMAP == io->backend)
+	{
+		if (io->input)
+		{
+			munmap(io->input, io->input_size);
+		}
+		if (io->output)
+		{
+			munmap(io->output, io->output_max_size);
+		}
+	}
+	else
+	{
+		free(io->input);
+		free(io->output);
+	}
+
+	if (io->scratch)
+	{
+		crypto_wipe(io->scratch, io->scratch_size);
+		free(io->scratch);
+	}
+
+	if (0 <= io->input_fd)
+	{
+		close(io->input_fd);
+	}
+	if (0 <= io->output_fd)
+	{
+		close(io->output_fd);
+	}
+
+	free(io->reads.requests);
+	free(io->writes.requests);
+}
+
+// Same as ssbf_encode_data, with the blocks made as the input comes in
+// and written as they are made. The header is written last.
+static enum ssbf_errors ssbf_io_encode_blocks(
+	struct ssbf_io *io,
+	uint8_t *key_main, //[32],
+	uint8_t *key_main_nonce, //[24]
+	uint8_t *key_data, //[32]
+	uint16_t meta_data_id,
+	uint8_t *meta_payload_data,
+	uint16_t meta_data_payload_size,
+	size_t max_block_size,
+	size_t *actual_output_data_size,
+	const struct ssbf_encode_options *options)
+{
+	const bool encrypted = !options->no_encryption;
+	const bool block_tags = encrypted && options->block_tags;
+	uint8_t main_header_flags = ssbf_main_header_flags(options);
+	uint8_t data_header_flags = ssbf_data_header_flags(options);
+
+	size_t full_header_size = ssbf_header_size(encrypted,
+						   meta_data_payload_size);
+	size_t blocks_offset = full_header_size
+		+ ssbf_block_padding(full_header_size, main_header_flags);
+
+	// a block can hold the data as is, with its size, tag and the
+	// padding in front of the next block
+	size_t block_overhead = sizeof(struct ssbf_payload_block_header)
+		+ sizeof(uint16_t) + SSBF_BLOCK_TAG_SIZE
+		+ ssbf_block_alignment(main_header_flags);
+
+	uint8_t *blocks_start = io->output + blocks_offset;
+	size_t blocks_max_size = io->output_max_size - blocks_offset;
+	size_t blocks_sum_size = 0;
+	size_t input_offset = 0;
+	uint32_t block_number = 0;
+	bool done = false;
+	enum ssbf_errors e = SSBF_NO_ERROR;
+	struct ssbf_checksum_state checksum;
+
+	ssbf_checksum_init(&checksum, ssbf_data_checksum_type(data_header_flags));
+
+	io->output_queued = blocks_offset;
+
+	while (SSBF_NO_ERROR == e && !done)
+	{
+		// content defined blocks look at up to max_block_size bytes
+		size_t window_end = io->input_size - input_offset
+			> max_block_size
+			? input_offset + max_block_size : io->input_size;
+		bool last = (window_end == io->input_size);
+
+		if (blocks_max_size - blocks_sum_size
+		    < window_end - input_offset + block_overhead
+		    || block_number > UINT16_MAX)
+		{
+			e = SSBF_NOT_ENOUGHT_DATA;
+			break;
+		}
+
+		e = ssbf_io_wait_input(io, window_end);
+		if (SSBF_NO_ERROR != e)
+		{
+			break;
+		}
+
+		size_t block_size = 0;
+		size_t encoded_size = ssbf_encode_stream_block(
+			encrypted ? key_data : NULL,
+			max_block_size,
+			(uint16_t) block_number,
+			io->input + input_offset, window_end - input_offset,
+			last,
+			blocks_start + blocks_sum_size,
+			&block_size,
+			io->scratch,
+			options);
+		if (0 == encoded_size)
+		{
+			e = SSBF_GENERIC_ERROR;
+			break;
+		}
+		blocks_sum_size += encoded_size;
+
+		ssbf_checksum_update(&checksum, io->input + input_offset,
+				     block_size);
+		input_offset += block_size;
+		block_number += 1;
+		done = last && input_offset == io->input_size;
+
+		if (!done)
+		{
+			size_t padding = ssbf_block_padding(blocks_sum_size,
+							    main_header_flags);
+			memset(blocks_start + blocks_sum_size, 0, padding);
+			blocks_sum_size += padding;
+		}
+
+		e = ssbf_io_write_until(io, blocks_offset + blocks_sum_size,
+					false);
+	}
+
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	struct ssbf_data_header data_h = {
+		.full_data_size_uncompressed = io->input_size,
+		.max_uncompressed_block_size = max_block_size,
+		.flags = data_header_flags,
+		.inplace_margin = 0,
+		.full_data_checksum = checksum.checksum,
+	};
+
+	*actual_output_data_size = ssbf_encode_finish(
+		key_main, key_main_nonce,
+		encrypted ? key_data : NULL,
+		main_header_flags,
+		block_tags ? SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS : 0,
+		meta_data_id, meta_payload_data, meta_data_payload_size,
+		&data_h, blocks_offset, blocks_sum_size,
+		io->output);
+
+	e = ssbf_io_write_until(io, *actual_output_data_size, true);
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_write(io, 0, blocks_offset);
+	}
+
+	return e;
+}
+
+enum ssbf_errors ssbf_io_encode_file(uint8_t *key_main, //[32],
+				     uint8_t *key_main_nonce, //[24]
+				     uint8_t *key_data, //[32]
+				     uint16_t meta_data_id,
+				     uint8_t *meta_payload_data,
+				     uint16_t meta_data_payload_size,
+				     size_t max_block_size,
+				     const char *input_path,
+				     const char *output_path,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_encode_options *options,
+				     const struct ssbf_io_options *io_options)
+{
+	struct ssbf_io io;
+	struct ssbf_encode_options encode_options;
+
+	*actual_output_data_size = 0;
+
+	memset(&encode_options, 0, sizeof(encode_options));
+	if (options)
+	{
+		encode_options = *options;
+	}
+
+	const bool encrypted = !encode_options.no_encryption;
+
+	max_block_size = ssbf_encode_max_block_size(max_block_size,
+						    &encode_options);
+
+	if (0 == max_block_size
+	    || (encrypted && (NULL == key_main || NULL == key_data)))
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	ssbf_io_init(&io, io_options);
+
+	// the codecs are compared in the scratch buffer
+	io.scratch_size = ssbf_encode_scratch_size(max_block_size,
+						   &encode_options);
+	io.scratch = io.scratch_size ? malloc(io.scratch_size) : NULL;
+
+	enum ssbf_errors e = (io.scratch_size && NULL == io.scratch)
+		? SSBF_GENERIC_ERROR : ssbf_io_open_input(&io, input_path);
+
+	// every block can be stored as is with its header, size, tag and
+	// padding, content defined blocks are at least cdc_min_block_size
+	size_t min_block_size = encode_options.cdc_min_block_size
+		&& encode_options.cdc_min_block_size < max_block_size
+		? encode_options.cdc_min_block_size : max_block_size;
+	size_t output_max_size = ssbf_header_size(encrypted,
+						  meta_data_payload_size)
+		+ io.input_size
+		+ (io.input_size / min_block_size + 2)
+		* (sizeof(struct ssbf_payload_block_header) + sizeof(uint16_t)
+		   + SSBF_BLOCK_TAG_SIZE
+		   + ssbf_block_alignment(
+			   ssbf_main_header_flags(&encode_options)));
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_open_output(&io, output_path, output_max_size);
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_start(&io);
+	}
+
+	if (SSBF_NO_ERROR == e
+	    && !encode_options.dedup && !encode_options.base_data_start)
+	{
+		e = ssbf_io_encode_blocks(&io, key_main, key_main_nonce,
+					  key_data, meta_data_id,
+					  meta_payload_data,
+					  meta_data_payload_size,
+					  max_block_size,
+					  actual_output_data_size,
+					  &encode_options);
+	}
+	else if (SSBF_NO_ERROR == e)
+	{
+		// earlier blocks are looked up in all of the input
+		e = ssbf_io_wait_input(&io, io.input_size);
+		if (SSBF_NO_ERROR == e)
+		{
+			ssbf_encode_data(key_main, key_main_nonce, key_data,
+					 meta_data_id, meta_payload_data,
+					 meta_data_payload_size,
+					 max_block_size,
+					 io.input, io.input_size,
+					 io.output, io.output_max_size,
+					 actual_output_data_size,
+					 &encode_options);
+			e = (0 == *actual_output_data_size)
+				? SSBF_GENERIC_ERROR
+				: ssbf_io_write(&io, 0, *actual_output_data_size);
+		}
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_finish(&io, *actual_output_data_size);
+	}
+
+	ssbf_io_close(&io);
+
+	if (SSBF_NO_ERROR != e)
+	{
+		*actual_output_data_size = 0;
+	}
+
+	return e;
+}
+
+enum ssbf_errors ssbf_io_decode_file(uint8_t *key_main, //[32],
+				     const char *input_path,
+				     const char *output_path,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_decode_options *options,
+				     const struct ssbf_io_options *io_options)
+{
+	struct ssbf_io io;
+	struct ssbf_file file;
+	struct ssbf_decode_options decode_options;
+	size_t header_size = 0;
+	bool opened = false;
+
+	*actual_output_data_size = 0;
+
+	memset(&decode_options, 0, sizeof(decode_options));
+	if (options)
+	{
+		decode_options = *options;
+	}
+
+	ssbf_io_init(&io, io_options);
+
+	// the input is not changed (it may be mapped read only), blocks
+	// are decrypted to the scratch buffer
+	io.scratch_size = UINT16_MAX + sizeof(uint16_t);
+	io.scratch = malloc(io.scratch_size);
+	decode_options.scratch = io.scratch;
+	decode_options.scratch_size = io.scratch_size;
+
+	// the new output file reads as zeros, blocks of zeros are not
+	// written and stay holes in it
+	if (SSBF_IO_MMAP == io.backend)
+	{
+		decode_options.output_erased = true;
+		decode_options.erased_value = 0;
+	}
+
+	enum ssbf_errors e = io.scratch
+		? ssbf_io_open_input(&io, input_path) : SSBF_GENERIC_ERROR;
+
+	// the header tells how big the output is
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_read_start(&io, sizeof(struct ssbf_main_header));
+	}
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_catalog_header_size(io.input, io.input_ready,
+					     &header_size);
+	}
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_read_start(&io, header_size);
+	}
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_open(&file, key_main, io.input, io.input_size,
+			      &decode_options);
+		opened = (SSBF_NO_ERROR == e);
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_open_output(
+			&io, output_path,
+			file.hi.data_h.full_data_size_uncompressed);
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_start(&io);
+	}
+
+	const struct ssbf_header_info *hi = &file.hi;
+	struct ssbf_decode_checkpoint checkpoint;
+	ssbf_decode_checkpoint_init(&checkpoint);
+
+	// one block at a time, as soon as it and the padding after it are
+	// read
+	while (SSBF_NO_ERROR == e)
+	{
+		struct ssbf_payload_block_header h;
+		size_t block_start = hi->blocks_offset + checkpoint.input_offset;
+
+		e = ssbf_io_wait_input(&io, block_start
+				       + sizeof(struct ssbf_payload_block_header));
+		if (SSBF_NO_ERROR == e)
+		{
+			e = ssbf_file_block_header(
+				&file, checkpoint.input_offset,
+				checkpoint.next_block_number, &h);
+		}
+		if (SSBF_NO_ERROR != e)
+		{
+			break;
+		}
+
+		size_t block_end = checkpoint.input_offset
+			+ sizeof(struct ssbf_payload_block_header)
+			+ h.compressed_size;
+		if (!(h.flags & BHF_LAST_BLOCK))
+		{
+			block_end += ssbf_block_padding(block_end, hi->mh.flags);
+		}
+
+		e = ssbf_io_wait_input(&io, hi->blocks_offset + block_end);
+		if (SSBF_NO_ERROR == e)
+		{
+			e = ssbf_file_decode(&file, io.output,
+					     io.output_max_size,
+					     &checkpoint, 1);
+		}
+
+		if (SSBF_NO_ERROR == e || SSBF_DECODE_IN_PROGRESS == e)
+		{
+			enum ssbf_errors we = ssbf_io_write_until(
+				&io, checkpoint.output_offset,
+				SSBF_NO_ERROR == e);
+
+			if (SSBF_NO_ERROR == e)
+			{
+				e = we;
+				break;
+			}
+			e = (SSBF_NO_ERROR == we) ? SSBF_NO_ERROR : we;
+		}
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		e = ssbf_io_finish(&io, checkpoint.output_offset);
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		*actual_output_data_size = checkpoint.output_offset;
+	}
+
+	if (opened)
+	{
+		ssbf_close(&file);
+	}
+	ssbf_io_close(&io);
+
+	return e;
+}
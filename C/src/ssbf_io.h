@@ -0,0 +1,59 @@
+#ifndef SSBF_IO_H
+#define SSBF_IO_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ssbf.h"
+
+// How ssbf_io_encode_file and ssbf_io_decode_file read and write the
+// files (Linux host tools). With the threads and io_uring backends the
+// input is read in chunks while the blocks which are already in are
+// encoded or decoded, and the output is written as it is made.
+enum ssbf_io_backends {
+        SSBF_IO_STDIO = 0,          // fread the whole input, fwrite at the end
+        SSBF_IO_MMAP = 1,           // input and output files mapped
+        SSBF_IO_THREADS = 2,        // pread and pwrite on worker threads
+        SSBF_IO_URING = 3,          // io_uring, threads if it is not there
+};
+
+struct ssbf_io_options {
+        uint8_t backend;            // enum ssbf_io_backends
+        uint32_t chunk_size;        // bytes per read or write, 0 = 128 KiB
+        uint32_t queue_depth;       // reads and writes in flight, 0 = 32
+                                    // (8 threads)
+};
+
+const char *ssbf_io_backend_name(uint8_t backend);
+
+// io_uring can be set up (the kernel has it and it is not blocked)
+bool ssbf_io_uring_supported(void);
+
+// ssbf_encode_data from and to files. With dedup or a base image the
+// whole input is read before encoding, the rest is encoded block by
+// block as the input comes in. The output file is replaced.
+enum ssbf_errors ssbf_io_encode_file(uint8_t *key_main, //[32],
+				     uint8_t *key_main_nonce, //[24]
+				     uint8_t *key_data, //[32]
+				     uint16_t meta_data_id,
+				     uint8_t *meta_payload_data,
+				     uint16_t meta_data_payload_size,
+				     size_t max_block_size,
+				     const char *input_path,
+				     const char *output_path,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_encode_options *options,
+				     const struct ssbf_io_options *io_options);
+
+// ssbf_decode_data from and to files, every block is decoded as soon
+// as it is read. The output file is replaced, it is only complete if
+// SSBF_NO_ERROR is returned.
+enum ssbf_errors ssbf_io_decode_file(uint8_t *key_main, //[32],
+				     const char *input_path,
+				     const char *output_path,
+				     size_t *actual_output_data_size,
+				     const struct ssbf_decode_options *options,
+				     const struct ssbf_io_options *io_options);
+
+#endif
@@ -0,0 +1,118 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+
+#include "monocypher.h"
+
+// In place decoding keeps the blocks at the end of the buffer, so
+// their distance to the decoded data does not depend on the header.
+// Only a bigger image can need a bigger margin.
+static uint8_t ssbf_rewrap_inplace_margin(const struct ssbf_header_info *hi,
+					  size_t blocks_offset)
+{
+	size_t image_size = blocks_offset + hi->mh.blocks_sum_size;
+	size_t full_data_size = hi->data_h.full_data_size_uncompressed;
+	size_t margin = (size_t) hi->data_h.inplace_margin
+		* SSBF_INPLACE_MARGIN_UNIT;
+
+	if (0 == hi->data_h.inplace_margin
+	    || image_size <= full_data_size + margin)
+	{
+		return hi->data_h.inplace_margin;
+	}
+
+	margin = (image_size - full_data_size) / SSBF_INPLACE_MARGIN_UNIT + 1;
+
+	return (margin <= UINT8_MAX) ? (uint8_t) margin : 0;
+}
+
+enum ssbf_errors ssbf_rewrap_header(uint8_t *key_main, //[32],
+				    uint8_t *key_main_nonce, //[24]
+				    uint8_t *input_data_start,
+				    size_t input_data_size,
+				    uint8_t *output_header,
+				    size_t output_header_max_size,
+				    size_t *output_header_size,
+				    size_t *blocks_offset,
+				    const struct ssbf_rewrap_options *options)
+{
+	struct ssbf_header_info hi;
+
+	*output_header_size = 0;
+
+	enum ssbf_errors e = ssbf_decode_plain_headers(input_data_start,
+						       input_data_size,
+						       &hi);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	uint8_t header_plain[SSBF_HEADER_PLAIN_MAX_SIZE];
+
+	e = ssbf_unlock_header(key_main, input_data_start, &hi, header_plain);
+
+	const bool encrypted =
+		hi.mh.flags & SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION;
+
+	uint16_t meta_data_id = hi.meta_h.meta_data_id;
+	uint8_t *meta_payload_data = hi.meta_payload_data;
+	uint16_t meta_data_payload_size = hi.meta_h.payload_size;
+
+	if (options && options->replace_meta)
+	{
+		meta_data_id = options->meta_data_id;
+		meta_payload_data = options->meta_payload_data;
+		meta_data_payload_size = options->meta_data_payload_size;
+
+		if (NULL == meta_payload_data && meta_data_payload_size)
+		{
+			e = SSBF_GENERIC_ERROR;
+		}
+	}
+
+	size_t header_size = ssbf_header_size(encrypted,
+					      meta_data_payload_size);
+	size_t new_blocks_offset = header_size
+		+ ssbf_block_padding(header_size, hi.mh.flags);
+
+	if (SSBF_NO_ERROR == e && new_blocks_offset > output_header_max_size)
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		struct ssbf_data_header data_h = hi.data_h;
+		data_h.inplace_margin = ssbf_rewrap_inplace_margin(
+			&hi, new_blocks_offset);
+
+		// the layout flags and the block tags stay, they describe
+		// the blocks
+		ssbf_encode_header(
+			(options && options->key_main)
+			? options->key_main : key_main,
+			key_main_nonce,
+			encrypted ? hi.key_data : NULL,
+			hi.mh.flags
+			& ~(SSBF_MAIN_HEADE_FLAG_USE_META_EXTENSION
+			    | SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION),
+			hi.ch.flags,
+			meta_data_id, meta_payload_data, meta_data_payload_size,
+			&data_h, hi.mh.blocks_sum_size,
+			output_header);
+
+		*output_header_size = new_blocks_offset;
+		*blocks_offset = hi.blocks_offset;
+	}
+
+	crypto_wipe(header_plain, sizeof(header_plain));
+	crypto_wipe(hi.key_data, sizeof(hi.key_data));
+
+	return e;
+}
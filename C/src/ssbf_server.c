@@ -0,0 +1,597 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+#include "ssbf_server.h"
+
+// bytes per read and send if sendfile can not be used
+#define SSBF_SERVER_COPY_SIZE (64 * 1024)
+
+// An indexed file. It stays open, so a file which is replaced while
+// it is sent is still sent whole from the old one.
+struct ssbf_server_file {
+	struct ssbf_server_file *next;
+	char name[SSBF_SERVER_MAX_NAME_SIZE + 1];
+	int fd;
+	struct stat st;             // when it was indexed
+	uint32_t refs;              // requests using it, +1 while listed
+
+	size_t blocks_offset;
+	uint32_t file_id;
+	enum ssbf_errors status;    // of the header and the block chain
+	uint32_t block_count;
+	struct ssbf_server_block *blocks;
+};
+
+// Reads until size bytes are in or the other side closes, returns the
+// bytes read
+static size_t ssbf_server_read(int fd, void *data, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t n = recv(fd, (uint8_t *) data + done, size - done, 0);
+
+		if (0 > n && EINTR == errno)
+		{
+			continue;
+		}
+		if (0 >= n)
+		{
+			break;
+		}
+
+		done += (size_t) n;
+	}
+
+	return done;
+}
+
+static bool ssbf_server_write(int fd, const void *data, size_t size,
+			      bool more)
+{
+	const uint8_t *p = data;
+
+	while (size)
+	{
+		ssize_t n = send(fd, p, size,
+				 MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+
+		if (0 > n && EINTR == errno)
+		{
+			continue;
+		}
+		if (0 >= n)
+		{
+			return false;
+		}
+
+		p += n;
+		size -= (size_t) n;
+	}
+
+	return true;
+}
+
+// Sends size bytes of the file from offset, with sendfile the data
+// goes from the page cache to the socket without a copy
+static bool ssbf_server_send_file(int socket_fd, int file_fd,
+				  off_t offset, size_t size)
+{
+	while (size)
+	{
+		ssize_t n = sendfile(socket_fd, file_fd, &offset, size);
+
+		if (0 > n && EINTR == errno)
+		{
+			continue;
+		}
+		if (0 > n && (EINVAL == errno || ENOSYS == errno))
+		{
+			break;
+		}
+		if (0 >= n)
+		{
+			return false;
+		}
+
+		size -= (size_t) n;
+	}
+
+	// sendfile does not support the socket or the file
+	uint8_t buffer[SSBF_SERVER_COPY_SIZE];
+
+	while (size)
+	{
+		size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+		ssize_t n = pread(file_fd, buffer, chunk, offset);
+
+		if (0 > n && EINTR == errno)
+		{
+			continue;
+		}
+		if (0 >= n || !ssbf_server_write(socket_fd, buffer, (size_t) n,
+						 (size_t) n < size))
+		{
+			return false;
+		}
+
+		offset += n;
+		size -= (size_t) n;
+	}
+
+	return true;
+}
+
+// Finds the blocks with their headers and payload checksums. On an
+// error the blocks before it are kept, they can still be served.
+static enum ssbf_errors ssbf_server_index(struct ssbf_server_file *f,
+					  uint8_t *data, size_t size)
+{
+	struct ssbf_header_info hi;
+
+	enum ssbf_errors r = ssbf_decode_plain_headers(data, size, &hi);
+	if (SSBF_NO_ERROR != r)
+	{
+		return r;
+	}
+
+	if (hi.blocks_offset > size
+	    || hi.mh.blocks_sum_size > size - hi.blocks_offset)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	f->blocks_offset = hi.blocks_offset;
+	memcpy(&f->file_id, hi.header_mac, sizeof(f->file_id));
+
+	uint8_t *blocks_start = data + hi.blocks_offset;
+	size_t blocks_size = hi.mh.blocks_sum_size;
+	size_t offset = 0;
+	uint32_t max_count = 0;
+	struct ssbf_payload_block_header h;
+
+	do
+	{
+		r = ssbf_decode_block_header(blocks_start + offset,
+					     blocks_size - offset, &h);
+		if (SSBF_NO_ERROR != r)
+		{
+			return r;
+		}
+
+		if (UINT16_MAX < f->block_count
+		    || h.block_number != f->block_count
+		    || h.compressed_size > blocks_size - offset
+		    - sizeof(struct ssbf_payload_block_header))
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		if (f->block_count == max_count)
+		{
+			max_count = max_count ? 2 * max_count : 256;
+			struct ssbf_server_block *blocks = realloc(
+				f->blocks,
+				max_count * sizeof(struct ssbf_server_block));
+			if (NULL == blocks)
+			{
+				return SSBF_GENERIC_ERROR;
+			}
+			f->blocks = blocks;
+		}
+
+		uint8_t *payload = blocks_start + offset
+			+ sizeof(struct ssbf_payload_block_header);
+		struct ssbf_server_block *b = &f->blocks[f->block_count++];
+
+		b->file_offset = (uint32_t) (hi.blocks_offset + offset);
+		b->payload_size = h.compressed_size;
+		b->flags = h.flags;
+		b->status = ssbf_block_checksum_from(hi.data_h.flags, 0,
+						     payload,
+						     h.compressed_size)
+			== h.data_checksum
+			? SSBF_NO_ERROR : SSBF_CHECKSUM_FAILED;
+
+		offset += sizeof(struct ssbf_payload_block_header)
+			+ h.compressed_size;
+
+		if (h.flags & BHF_LAST_BLOCK)
+		{
+			break;
+		}
+
+		size_t padding = ssbf_block_padding(offset, hi.mh.flags);
+		if (padding > blocks_size - offset)
+		{
+			return SSBF_NOT_ENOUGHT_DATA;
+		}
+
+		for (size_t i = 0; padding > i; i++)
+		{
+			if (blocks_start[offset + i])
+			{
+				b->status = SSBF_GENERIC_ERROR;
+			}
+		}
+
+		offset += padding;
+	} while (offset < blocks_size);
+
+	if (!(h.flags & BHF_LAST_BLOCK))
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	return SSBF_NO_ERROR;
+}
+
+static void ssbf_server_file_free(struct ssbf_server_file *f)
+{
+	close(f->fd);
+	free(f->blocks);
+	free(f);
+}
+
+static void ssbf_server_release(struct ssbf_server *server,
+				struct ssbf_server_file *f)
+{
+	pthread_mutex_lock(&server->lock);
+	f->refs -= 1;
+	bool unused = (0 == f->refs);
+	pthread_mutex_unlock(&server->lock);
+
+	if (unused)
+	{
+		ssbf_server_file_free(f);
+	}
+}
+
+// A file name in the directory, no paths
+static bool ssbf_server_valid_name(const char *name)
+{
+	return name[0] && NULL == strchr(name, '/')
+		&& strcmp(name, ".") && strcmp(name, "..");
+}
+
+static struct ssbf_server_file *ssbf_server_index_file(
+	struct ssbf_server *server, const char *name)
+{
+	struct ssbf_server_file *f = calloc(1, sizeof(*f));
+	if (NULL == f)
+	{
+		return NULL;
+	}
+
+	f->fd = openat(server->directory_fd, name, O_RDONLY | O_CLOEXEC);
+	if (0 > f->fd || fstat(f->fd, &f->st) || !S_ISREG(f->st.st_mode))
+	{
+		if (0 <= f->fd)
+		{
+			close(f->fd);
+		}
+		free(f);
+		return NULL;
+	}
+
+	strcpy(f->name, name);
+	f->status = SSBF_NOT_ENOUGHT_DATA;
+
+	size_t size = (size_t) f->st.st_size;
+	uint8_t *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+				    f->fd, 0) : MAP_FAILED;
+
+	if (MAP_FAILED != data)
+	{
+		madvise(data, size, MADV_SEQUENTIAL);
+		f->status = ssbf_server_index(f, data, size);
+		munmap(data, size);
+	}
+
+	return f;
+}
+
+// Returns the file with a reference, indexed again if it was changed
+// since it was indexed, NULL if it can not be opened
+static struct ssbf_server_file *ssbf_server_open_file(
+	struct ssbf_server *server, const char *name)
+{
+	struct stat st;
+
+	if (!ssbf_server_valid_name(name)
+	    || fstatat(server->directory_fd, name, &st, 0))
+	{
+		return NULL;
+	}
+
+	// indexing is done with the lock held, so a file is not indexed
+	// twice when many devices ask for it at once
+	pthread_mutex_lock(&server->lock);
+
+	struct ssbf_server_file **p = &server->files;
+	for (; NULL != *p; p = &(*p)->next)
+	{
+		if (strcmp((*p)->name, name))
+		{
+			continue;
+		}
+
+		struct ssbf_server_file *f = *p;
+		if (f->st.st_dev == st.st_dev && f->st.st_ino == st.st_ino
+		    && f->st.st_size == st.st_size
+		    && f->st.st_mtim.tv_sec == st.st_mtim.tv_sec
+		    && f->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+		{
+			f->refs += 1;
+			pthread_mutex_unlock(&server->lock);
+			return f;
+		}
+
+		// changed, freed once the requests using it are done
+		*p = f->next;
+		f->refs -= 1;
+		if (0 == f->refs)
+		{
+			ssbf_server_file_free(f);
+		}
+		break;
+	}
+
+	struct ssbf_server_file *f = ssbf_server_index_file(server, name);
+	if (NULL != f)
+	{
+		f->refs = 2;
+		f->next = server->files;
+		server->files = f;
+	}
+
+	pthread_mutex_unlock(&server->lock);
+
+	return f;
+}
+
+// Checks the block range of the request and fills it in the response
+static enum ssbf_errors ssbf_server_block_range(
+	const struct ssbf_server_file *f,
+	const struct ssbf_server_request *request,
+	struct ssbf_server_response *response)
+{
+	uint32_t first = request->first_block;
+
+	if (first >= f->block_count
+	    || request->block_count > f->block_count - first)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	response->first_block = request->first_block;
+	response->block_count = request->block_count
+		? request->block_count : f->block_count - first;
+
+	return SSBF_NO_ERROR;
+}
+
+// Answers one request, false if the connection failed
+static bool ssbf_server_answer(struct ssbf_server *server, int socket_fd,
+			       const struct ssbf_server_request *request,
+			       const char *name)
+{
+	struct ssbf_server_response response;
+	memset(&response, 0, sizeof(response));
+	response.type = request->type;
+
+	struct ssbf_server_file *f = ssbf_server_open_file(server, name);
+	if (NULL == f)
+	{
+		response.status = SSBF_IO_ERROR;
+		return ssbf_server_write(socket_fd, &response,
+					 sizeof(response), false);
+	}
+
+	enum ssbf_errors r = SSBF_NO_ERROR;
+	response.file_id = f->file_id;
+
+	switch (request->type)
+	{
+	case SSBF_SERVER_REQUEST_HEADER:
+		// the blocks_offset is only known if the header is fine
+		r = (0 < f->blocks_offset) ? SSBF_NO_ERROR : f->status;
+		response.data_size = (uint32_t) f->blocks_offset;
+		break;
+
+	case SSBF_SERVER_REQUEST_BLOCKS:
+		r = ssbf_server_block_range(f, request, &response);
+		if (SSBF_NO_ERROR != r)
+		{
+			break;
+		}
+
+		const struct ssbf_server_block *first =
+			&f->blocks[response.first_block];
+		const struct ssbf_server_block *last =
+			first + response.block_count - 1;
+
+		response.file_offset = first->file_offset;
+		response.data_size = last->file_offset
+			+ sizeof(struct ssbf_payload_block_header)
+			+ last->payload_size - first->file_offset;
+
+		// the blocks are sent as they are, the device finds out
+		// which one is bad
+		for (const struct ssbf_server_block *b = first;
+		     last >= b && SSBF_NO_ERROR == r; b++)
+		{
+			r = b->status;
+		}
+		break;
+
+	case SSBF_SERVER_REQUEST_VERIFY:
+		if (0 == f->block_count)
+		{
+			r = f->status;
+			break;
+		}
+
+		r = ssbf_server_block_range(f, request, &response);
+		if (SSBF_NO_ERROR == r)
+		{
+			r = f->status;
+			response.data_size = response.block_count
+				* sizeof(struct ssbf_server_block);
+		}
+		break;
+
+	default:
+		r = SSBF_GENERIC_ERROR;
+		break;
+	}
+
+	response.status = r;
+
+	bool ok = ssbf_server_write(socket_fd, &response, sizeof(response),
+			       0 < response.data_size);
+
+	if (ok && 0 < response.data_size)
+	{
+		if (SSBF_SERVER_REQUEST_VERIFY == request->type)
+		{
+			ok = ssbf_server_write(
+				socket_fd, &f->blocks[response.first_block],
+				response.data_size, false);
+		}
+		else
+		{
+			ok = ssbf_server_send_file(socket_fd, f->fd,
+						   response.file_offset,
+						   response.data_size);
+		}
+	}
+
+	ssbf_server_release(server, f);
+
+	return ok;
+}
+
+enum ssbf_errors ssbf_server_init(struct ssbf_server *server,
+				  const char *directory)
+{
+	memset(server, 0, sizeof(*server));
+
+	server->directory_fd = open(directory,
+				    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (0 > server->directory_fd)
+	{
+		return SSBF_IO_ERROR;
+	}
+
+	pthread_mutex_init(&server->lock, NULL);
+
+	return SSBF_NO_ERROR;
+}
+
+void ssbf_server_close(struct ssbf_server *server)
+{
+	while (NULL != server->files)
+	{
+		struct ssbf_server_file *f = server->files;
+		server->files = f->next;
+		ssbf_server_file_free(f);
+	}
+
+	pthread_mutex_destroy(&server->lock);
+	close(server->directory_fd);
+}
+
+enum ssbf_errors ssbf_server_serve(struct ssbf_server *server,
+				   int socket_fd)
+{
+	while (1)
+	{
+		struct ssbf_server_request request;
+		char name[SSBF_SERVER_MAX_NAME_SIZE + 1];
+
+		size_t n = ssbf_server_read(socket_fd, &request,
+					    sizeof(request));
+		if (0 == n)
+		{
+			return SSBF_NO_ERROR;
+		}
+
+		if (sizeof(request) != n
+		    || request.name_size != ssbf_server_read(
+			    socket_fd, name, request.name_size))
+		{
+			return SSBF_IO_ERROR;
+		}
+		name[request.name_size] = 0;
+
+		if (!ssbf_server_answer(server, socket_fd, &request, name))
+		{
+			return SSBF_IO_ERROR;
+		}
+	}
+}
+
+enum ssbf_errors ssbf_server_request(int socket_fd,
+				     uint8_t type,
+				     const char *name,
+				     uint16_t first_block,
+				     uint32_t block_count,
+				     struct ssbf_server_response *response,
+				     uint8_t *data,
+				     size_t data_max_size)
+{
+	size_t name_size = strlen(name);
+	if (SSBF_SERVER_MAX_NAME_SIZE < name_size)
+	{
+		return SSBF_GENERIC_ERROR;
+	}
+
+	struct ssbf_server_request request = {
+		.type = type,
+		.name_size = (uint8_t) name_size,
+		.first_block = first_block,
+		.block_count = block_count,
+	};
+
+	uint8_t message[sizeof(request) + SSBF_SERVER_MAX_NAME_SIZE];
+	memcpy(message, &request, sizeof(request));
+	memcpy(message + sizeof(request), name, name_size);
+
+	if (!ssbf_server_write(socket_fd, message, sizeof(request) + name_size,
+			       false)
+	    || sizeof(*response) != ssbf_server_read(socket_fd, response,
+						     sizeof(*response)))
+	{
+		return SSBF_IO_ERROR;
+	}
+
+	if (response->data_size > data_max_size)
+	{
+		return SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (response->data_size != ssbf_server_read(socket_fd, data,
+						    response->data_size))
+	{
+		return SSBF_IO_ERROR;
+	}
+
+	return SSBF_NO_ERROR;
+}
@@ -0,0 +1,93 @@
+#ifndef SSBF_SERVER_H
+#define SSBF_SERVER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "ssbf.h"
+
+// Serves the header and blocks of the ssbf files in a directory over a
+// connected socket (Linux host tool, unix or TCP). The server has no
+// key, the blocks are sent as they are stored with sendfile, so
+// encrypted blocks are never decrypted on the server. Requests and
+// responses are the structs below, stored as is (little-endian).
+
+#define SSBF_SERVER_MAX_NAME_SIZE 255
+
+enum ssbf_server_request_types {
+        // the header, everything before the first block
+        SSBF_SERVER_REQUEST_HEADER = 1,
+        // blocks first_block .. first_block + block_count - 1 as they
+        // are in the file, with the padding between them
+        SSBF_SERVER_REQUEST_BLOCKS = 2,
+        // struct ssbf_server_block of every block
+        SSBF_SERVER_REQUEST_VERIFY = 3,
+};
+
+// Followed by name_size bytes of the file name (no '/')
+struct ssbf_server_request {
+        uint8_t type;               // enum ssbf_server_request_types
+        uint8_t name_size;
+        uint16_t first_block;
+        uint32_t block_count;       // 0 = to the last block
+};
+
+// Followed by data_size bytes of data, which is stored at file_offset
+// in the file. file_id changes when the file is replaced on the server,
+// the responses of one download must all have the same.
+struct ssbf_server_response {
+        uint8_t status;             // enum ssbf_errors
+        uint8_t type;
+        uint16_t first_block;
+        uint32_t block_count;
+        uint32_t file_offset;
+        uint32_t data_size;
+        uint32_t file_id;           // first 4 bytes of the header MAC
+};
+
+// One block in the SSBF_SERVER_REQUEST_VERIFY response. Only the block
+// header, the order of the blocks and the payload checksum can be
+// checked without the key.
+struct ssbf_server_block {
+        uint32_t file_offset;
+        uint16_t payload_size;      // the block header is not included
+        uint8_t status;             // enum ssbf_errors
+        uint8_t flags;              // block header flags
+};
+
+struct ssbf_server_file;
+
+struct ssbf_server {
+        int directory_fd;
+        pthread_mutex_t lock;
+        struct ssbf_server_file *files; // indexed files
+};
+
+enum ssbf_errors ssbf_server_init(struct ssbf_server *server,
+				  const char *directory);
+
+void ssbf_server_close(struct ssbf_server *server);
+
+// Answers the requests on socket_fd until the other side closes it.
+// Files are indexed on their first request and again when they change,
+// the index is shared by all connections (one thread per connection).
+enum ssbf_errors ssbf_server_serve(struct ssbf_server *server,
+				   int socket_fd);
+
+// Client side: sends a request and reads the response and its data,
+// which must fit in data_max_size. Returns SSBF_IO_ERROR if the
+// connection failed and SSBF_NOT_ENOUGHT_DATA if the data does not fit,
+// the connection is not usable after either. An error of the request
+// itself is in response->status.
+enum ssbf_errors ssbf_server_request(int socket_fd,
+				     uint8_t type,
+				     const char *name,
+				     uint16_t first_block,
+				     uint32_t block_count,
+				     struct ssbf_server_response *response,
+				     uint8_t *data,
+				     size_t data_max_size);
+
+#endif
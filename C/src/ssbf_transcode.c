@@ -0,0 +1,257 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+
+#include "monocypher.h"
+
+enum ssbf_errors ssbf_transcode_data(
+	uint8_t *key_main, //[32],
+	uint8_t *key_main_nonce, //[24]
+	uint8_t *key_data, //[32]
+	size_t max_block_size,
+	uint8_t *input_data_start,
+	size_t input_data_size,
+	uint8_t *output_data_start,
+	size_t output_data_max_size,
+	size_t *actual_output_data_size,
+	const struct ssbf_encode_options *options,
+	const struct ssbf_decode_options *decode_options)
+{
+	struct ssbf_file file;
+
+	*actual_output_data_size = 0;
+
+	enum ssbf_errors e = ssbf_open(&file, key_main, 
+				       input_data_start, input_data_size,
+				       decode_options);
+	if (SSBF_NO_ERROR != e)
+	{
+		return e;
+	}
+
+	// the output is encoded from a stream of decoded data, dedup and
+	// delta need all of it at once
+	struct ssbf_encode_options encode_options;
+	memset(&encode_options, 0, sizeof(encode_options));
+	if (options)
+	{
+		encode_options = *options;
+	}
+	encode_options.dedup = false;
+	encode_options.base_data_start = NULL;
+	encode_options.base_data_size = 0;
+
+	const bool encrypted = !encode_options.no_encryption;
+	const bool block_tags = encrypted && encode_options.block_tags;
+
+	max_block_size = ssbf_encode_max_block_size(max_block_size,
+						    &encode_options);
+
+	uint8_t main_header_flags = ssbf_main_header_flags(&encode_options);
+	uint8_t data_header_flags = ssbf_data_header_flags(&encode_options);
+	const struct ssbf_header_info *hi = &file.hi;
+
+	size_t full_header_size = ssbf_header_size(encrypted,
+						   hi->meta_h.payload_size);
+	size_t blocks_offset = full_header_size 
+		+ ssbf_block_padding(full_header_size, main_header_flags);
+
+	// the window holds less than one output block and one input block,
+	// the scratch buffer the decrypted payload of an input block, so
+	// the input is not changed. The codecs are compared after it.
+	size_t input_max_block_size = hi->data_h.max_uncompressed_block_size;
+	size_t window_max_size = input_max_block_size + max_block_size;
+	size_t scratch_size = input_max_block_size + sizeof(uint16_t);
+	size_t codec_scratch_size = ssbf_encode_scratch_size(max_block_size,
+							     &encode_options);
+	uint8_t *window = NULL;
+
+	if (0 == max_block_size 
+	    || (encrypted && (NULL == key_main || NULL == key_data)))
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+	else if (blocks_offset > output_data_max_size)
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+	else if (NULL == (window = malloc(window_max_size + scratch_size
+					  + codec_scratch_size)))
+	{
+		e = SSBF_GENERIC_ERROR;
+	}
+
+	if (window)
+	{
+		file.options.scratch = window + window_max_size;
+		file.options.scratch_size = scratch_size;
+	}
+
+	uint8_t *blocks_start = output_data_start + blocks_offset;
+	size_t blocks_max_size = output_data_max_size - blocks_offset;
+	size_t blocks_sum_size = 0;
+	size_t window_size = 0;
+	struct ssbf_checksum_state input_checksum;
+	struct ssbf_checksum_state output_checksum;
+	size_t input_offset = 0;
+	uint32_t input_block_number = 0;
+	uint32_t output_block_number = 0;
+	bool input_done = false;
+	bool output_done = false;
+
+	ssbf_checksum_init(&input_checksum,
+			   ssbf_data_checksum_type(hi->data_h.flags));
+	ssbf_checksum_init(&output_checksum,
+			   ssbf_data_checksum_type(data_header_flags));
+
+	// a new block can hold the data as is, with its size, tag and the
+	// padding in front of the next block
+	size_t max_encoded_block_size = sizeof(struct ssbf_payload_block_header)
+		+ sizeof(uint16_t) + max_block_size + SSBF_BLOCK_TAG_SIZE
+		+ ssbf_block_alignment(main_header_flags);
+
+	while (SSBF_NO_ERROR == e && !output_done)
+	{
+		// encode while there is a whole output block in the window,
+		// and the rest once the input is decoded
+		if (input_done || window_size >= max_block_size)
+		{
+			if (blocks_max_size - blocks_sum_size 
+			    < max_encoded_block_size
+			    || output_block_number > UINT16_MAX)
+			{
+				e = SSBF_NOT_ENOUGHT_DATA;
+				break;
+			}
+
+			size_t block_size = 0;
+			size_t encoded_size = ssbf_encode_stream_block(
+				encrypted ? key_data : NULL,
+				max_block_size,
+				(uint16_t) output_block_number,
+				window, window_size, input_done,
+				blocks_start + blocks_sum_size,
+				&block_size,
+				codec_scratch_size ? window + window_max_size
+				+ scratch_size : NULL,
+				&encode_options);
+			if (0 == encoded_size)
+			{
+				e = SSBF_GENERIC_ERROR;
+				break;
+			}
+			blocks_sum_size += encoded_size;
+
+			// the same data, only made again for another type
+			if (output_checksum.type != input_checksum.type)
+			{
+				ssbf_checksum_update(&output_checksum,
+						     window, block_size);
+			}
+			output_block_number += 1;
+			output_done = input_done && block_size == window_size;
+
+			window_size -= block_size;
+			memmove(window, window + block_size, window_size);
+
+			if (!output_done)
+			{
+				size_t padding = ssbf_block_padding(
+					blocks_sum_size, main_header_flags);
+				memset(blocks_start + blocks_sum_size, 0, padding);
+				blocks_sum_size += padding;
+			}
+			continue;
+		}
+
+		// decode the next input block to the end of the window
+		struct ssbf_payload_block_header h;
+		size_t block_output_size = 0;
+
+		e = ssbf_file_block_header(&file, input_offset,
+					   (uint16_t) input_block_number, &h);
+		if (SSBF_NO_ERROR == e)
+		{
+			e = ssbf_file_decode_block(&file, input_offset, &h,
+						   window + window_size,
+						   window_max_size - window_size,
+						   &block_output_size);
+		}
+
+		if (SSBF_NO_ERROR != e)
+		{
+			break;
+		}
+
+		ssbf_checksum_update(&input_checksum, window + window_size,
+				     block_output_size);
+		window_size += block_output_size;
+		input_block_number += 1;
+
+		if (h.flags & BHF_LAST_BLOCK)
+		{
+			input_done = true;
+		}
+		else
+		{
+			e = ssbf_file_skip_block(&file, &h, &input_offset);
+		}
+	}
+
+	// the output is only as good as the input
+	if (SSBF_NO_ERROR == e && input_checksum.size 
+	    != hi->data_h.full_data_size_uncompressed)
+	{
+		e = SSBF_NOT_ENOUGHT_DATA;
+	}
+
+	if (SSBF_NO_ERROR == e 
+	    && input_checksum.checksum != hi->data_h.full_data_checksum)
+	{
+		e = SSBF_CHECKSUM_FAILED;
+	}
+
+	if (SSBF_NO_ERROR == e && output_checksum.type == input_checksum.type)
+	{
+		output_checksum = input_checksum;
+	}
+
+	if (SSBF_NO_ERROR == e)
+	{
+		struct ssbf_data_header data_h = {
+			.full_data_size_uncompressed = input_checksum.size,
+			.max_uncompressed_block_size = max_block_size,
+			.flags = data_header_flags,
+			.inplace_margin = 0,
+			.full_data_checksum = output_checksum.checksum,
+		};
+
+		*actual_output_data_size = ssbf_encode_finish(
+			key_main, key_main_nonce,
+			encrypted ? key_data : NULL,
+			main_header_flags,
+			block_tags ? SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS : 0,
+			hi->meta_h.meta_data_id,
+			hi->meta_payload_data,
+			hi->meta_h.payload_size,
+			&data_h, blocks_offset, blocks_sum_size,
+			output_data_start);
+	}
+
+	if (window)
+	{
+		crypto_wipe(window, window_max_size + scratch_size
+			    + codec_scratch_size);
+		free(window);
+	}
+
+	ssbf_close(&file);
+
+	return e;
+}
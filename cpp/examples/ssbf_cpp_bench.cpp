@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "ssbf.hpp"
+
+#define BENCH_BUFFER_SIZE (16 * 1024 * 1024)
+#define BENCH_ROUNDS 8
+
+static double time_now()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<uint8_t> encode(const std::vector<uint8_t> &data,
+				   size_t block_size,
+				   const ssbf_encode_options &options)
+{
+	uint8_t key_main[32];
+	uint8_t nonce[24];
+	uint8_t key_data[32];
+	uint8_t meta_payload_data[4] = {1, 2, 3, 4};
+	memset(key_main, 0x11, sizeof(key_main));
+	memset(nonce, 0x22, sizeof(nonce));
+	memset(key_data, 0x33, sizeof(key_data));
+
+	std::vector<uint8_t> encoded(2 * data.size() + 65536);
+	size_t encoded_size = 0;
+
+	ssbf_encode_data(key_main, nonce, key_data, 0x1234,
+			 meta_payload_data, sizeof(meta_payload_data),
+			 block_size,
+			 const_cast<uint8_t *>(data.data()), data.size(),
+			 encoded.data(), encoded.size(), &encoded_size,
+			 &options);
+	encoded.resize(encoded_size);
+
+	return encoded;
+}
+
+// MB/s of decode(output) over BENCH_ROUNDS rounds
+template <class Decode>
+static double bench_decode(Decode decode, std::vector<uint8_t> &output)
+{
+	double start = time_now();
+	for (uint32_t r = 0; r < BENCH_ROUNDS; r++)
+	{
+		decode(std::span<uint8_t>(output));
+	}
+
+	return (double) output.size() * BENCH_ROUNDS
+		/ (time_now() - start) / (1024 * 1024);
+}
+
+// Decodes the file with the C decoder, the specialized Decoder and
+// the block range, and checks that all give the data back
+template <class Decoder>
+static bool bench_layout(const char *name, const std::vector<uint8_t> &data,
+			 size_t block_size, const ssbf_encode_options &options)
+{
+	uint8_t key_main[32];
+	memset(key_main, 0x11, sizeof(key_main));
+
+	std::vector<uint8_t> encoded = encode(data, block_size, options);
+	std::vector<uint8_t> output(data.size());
+	bool ok = true;
+
+	try
+	{
+		ssbf_decode_options decode_options = {};
+		decode_options.allow_unencrypted = options.no_encryption;
+
+		ssbf::file f(encoded, ssbf::key(key_main), decode_options);
+
+		if (!Decoder::matches(f.header()))
+		{
+			printf("%-22s layout does not match\n", name);
+			return false;
+		}
+
+		double generic = bench_decode(
+			[&](std::span<uint8_t> out) { f.decode(out); }, output);
+		ok = ok && output == data;
+
+		std::fill(output.begin(), output.end(), 0);
+		double specialized = bench_decode(
+			[&](std::span<uint8_t> out) { Decoder::decode(f, out); },
+			output);
+		ok = ok && output == data;
+
+		size_t offset = 0;
+		for (std::span<uint8_t> block : f.blocks(output))
+		{
+			ok = ok && 0 == memcmp(block.data(), &data[offset],
+					       block.size());
+			offset += block.size();
+		}
+		ok = ok && offset == data.size();
+
+		printf("%-22s %10zu %13.1f %13.1f %7.2fx   %s\n",
+		       name, encoded.size(), generic, specialized,
+		       specialized / generic, ok ? "ok" : "DECODE FAILED");
+	}
+	catch (const ssbf::exception &e)
+	{
+		printf("%-22s %s %i\n", name, e.what(), e.status_code());
+		ok = false;
+	}
+
+	return ok;
+}
+
+int main()
+{
+	std::vector<uint8_t> data(BENCH_BUFFER_SIZE);
+
+	// same data as ssbf_bench: every 16th byte random, the rest
+	// repeats, with a stretch of erased flash
+	uint32_t seed = 1;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (i % 16) ? (uint8_t) (i / 64) : (uint8_t) (seed >> 16);
+	}
+	memset(&data[data.size() / 2], 0xff, data.size() / 8);
+
+	ssbf_cipher_select(NULL);
+
+	printf("%-22s %10s %13s %13s %8s\n", "layout", "size",
+	       "C MB/s", "C++ MB/s", "speedup");
+
+	ssbf_encode_options options = {};
+	bool ok = bench_layout<ssbf::block_decoder<
+		4096,
+		ssbf::codecs<SSBF_CODEC_LZ4>,
+		ssbf::chacha20<false>,
+		ssbf::checksums<SSBF_CHECKSUM_BSD16, SSBF_CHECKSUM_BSD16>>>(
+			"4k lz4 chacha bsd", data, 4096, options);
+
+	options = {};
+	options.block_tags = true;
+	options.block_checksum = SSBF_CHECKSUM_CRC16;
+	options.data_checksum = SSBF_CHECKSUM_CRC32;
+	ok &= bench_layout<ssbf::block_decoder<
+		1024,
+		ssbf::codecs<SSBF_CODEC_LZ4>,
+		ssbf::chacha20<true>,
+		ssbf::checksums<SSBF_CHECKSUM_CRC16, SSBF_CHECKSUM_CRC32>>>(
+			"1k lz4 chacha tags crc", data, 1024, options);
+
+	options = {};
+	options.no_encryption = true;
+	options.codecs = SSBF_ENCODE_CODEC_RLE | SSBF_ENCODE_CODEC_LZ4;
+	options.block_checksum = SSBF_CHECKSUM_CRC16;
+	options.data_checksum = SSBF_CHECKSUM_CRC32;
+	ok &= bench_layout<ssbf::block_decoder<
+		4096,
+		ssbf::codecs<SSBF_CODEC_LZ4, SSBF_CODEC_RLE>,
+		ssbf::no_cipher,
+		ssbf::checksums<SSBF_CHECKSUM_CRC16, SSBF_CHECKSUM_CRC32>>>(
+			"4k lz4+rle plain crc", data, 4096, options);
+
+	options = {};
+	options.no_encryption = true;
+	options.block_alignment = 4096;
+	ok &= bench_layout<ssbf::block_decoder<
+		16384,
+		ssbf::codecs<SSBF_CODEC_LZ4>,
+		ssbf::no_cipher,
+		ssbf::checksums<SSBF_CHECKSUM_BSD16, SSBF_CHECKSUM_BSD16>>>(
+			"16k lz4 plain aligned", data, 16384, options);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,722 @@
+#ifndef SSBF_HPP
+#define SSBF_HPP
+
+// C++20 layer over the C decoder (C/src), header only. ssbf::file
+// owns an opened file, ssbf::block_decoder decodes files of one layout
+// (block size, codecs, cipher, checksums) fixed at compile time, so
+// the flag checks of the C decoder drop out and the buffers and
+// checksum tables are sized and built by the compiler. Files of any
+// other layout still decode with ssbf::file::decode.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include "ssbf.h"
+#include "ssbf_internal.h"
+#include "ssbf_common.h"
+#include "ssbf_cipher.h"
+#include "ssbf_codec.h"
+
+#include "lz4.h"
+}
+
+namespace ssbf {
+
+class exception : public std::runtime_error {
+public:
+	exception(const char *message, ssbf_errors status_code)
+		: std::runtime_error(message), status_code_(status_code)
+	{
+	}
+
+	ssbf_errors status_code() const noexcept
+	{
+		return status_code_;
+	}
+
+private:
+	ssbf_errors status_code_;
+};
+
+inline void check(ssbf_errors e, const char *message)
+{
+	if (SSBF_NO_ERROR != e && SSBF_DECODE_IN_PROGRESS != e)
+	{
+		throw exception(message, e);
+	}
+}
+
+using key = std::span<const uint8_t, 32>;
+
+class block_range;
+
+// Opened file (ssbf_open). Encrypted blocks are decrypted to a scratch
+// buffer the file owns, so the input is never modified. The data key
+// is wiped when the file goes out of scope.
+class file {
+public:
+	file(std::span<uint8_t> input, key key_main,
+	     const ssbf_decode_options &options = {})
+	{
+		open(input, const_cast<uint8_t *>(key_main.data()), options);
+	}
+
+	// files without the crypto extension only
+	explicit file(std::span<uint8_t> input,
+		      const ssbf_decode_options &options = {})
+	{
+		open(input, nullptr, options);
+	}
+
+	~file()
+	{
+		ssbf_close(&file_);
+	}
+
+	// file_ points into itself (meta payload) and to scratch_
+	file(const file &) = delete;
+	file &operator=(const file &) = delete;
+
+	const ssbf_header_info &header() const noexcept
+	{
+		return file_.hi;
+	}
+
+	ssbf_file *get() noexcept
+	{
+		return &file_;
+	}
+
+	uint16_t meta_data_id() const noexcept
+	{
+		return file_.hi.meta_h.meta_data_id;
+	}
+
+	std::span<const uint8_t> meta() const noexcept
+	{
+		return {file_.meta_payload, file_.hi.meta_h.payload_size};
+	}
+
+	size_t data_size() const noexcept
+	{
+		return file_.hi.data_h.full_data_size_uncompressed;
+	}
+
+	size_t max_block_size() const noexcept
+	{
+		return file_.hi.data_h.max_uncompressed_block_size;
+	}
+
+	void verify()
+	{
+		check(ssbf_file_verify(&file_), "verify failed");
+	}
+
+	// output must hold data_size() bytes
+	void decode(std::span<uint8_t> output)
+	{
+		ssbf_decode_checkpoint checkpoint;
+		ssbf_decode_checkpoint_init(&checkpoint);
+
+		check(ssbf_file_decode(&file_, output.data(), output.size(),
+				       &checkpoint, 0),
+		      "decode failed");
+	}
+
+	// Decodes block by block into output, see block_range
+	block_range blocks(std::span<uint8_t> output);
+
+private:
+	void open(std::span<uint8_t> input, uint8_t *key_main,
+		  const ssbf_decode_options &options)
+	{
+		check(ssbf_open(&file_, key_main, input.data(), input.size(),
+				&options),
+		      "open failed");
+
+		// the largest block payload, known from the header
+		if (nullptr == file_.options.scratch
+		    && (file_.hi.mh.flags
+			& SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION))
+		{
+			scratch_.resize(max_block_size() + sizeof(uint16_t));
+			file_.options.scratch = scratch_.data();
+			file_.options.scratch_size = scratch_.size();
+		}
+	}
+
+	ssbf_file file_;
+	std::vector<uint8_t> scratch_;
+};
+
+// Range over the decoded blocks of a file, every element is the span
+// of output a block was decoded to. The data checksum is checked with
+// the last block, a failure throws from the increment.
+class block_range {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = std::span<uint8_t>;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+
+		explicit iterator(block_range *range) : range_(range)
+		{
+			next();
+		}
+
+		std::span<uint8_t> operator*() const noexcept
+		{
+			return block_;
+		}
+
+		iterator &operator++()
+		{
+			next();
+			return *this;
+		}
+
+		void operator++(int)
+		{
+			next();
+		}
+
+		bool operator==(std::default_sentinel_t) const noexcept
+		{
+			return nullptr == range_;
+		}
+
+	private:
+		void next()
+		{
+			block_ = {};
+
+			// a file of no data has one empty block
+			while (range_ && block_.empty())
+			{
+				if (range_->done_)
+				{
+					range_ = nullptr;
+					break;
+				}
+
+				block_ = range_->decode_next();
+			}
+		}
+
+		block_range *range_ = nullptr;
+		std::span<uint8_t> block_;
+	};
+
+	block_range(file &f, std::span<uint8_t> output)
+		: file_(f), output_(output)
+	{
+		ssbf_decode_checkpoint_init(&checkpoint_);
+	}
+
+	// the range can be iterated once
+	iterator begin()
+	{
+		return iterator(this);
+	}
+
+	std::default_sentinel_t end() const noexcept
+	{
+		return {};
+	}
+
+private:
+	std::span<uint8_t> decode_next()
+	{
+		size_t start = checkpoint_.output_offset;
+		ssbf_errors e = ssbf_file_decode(file_.get(), output_.data(),
+						 output_.size(), &checkpoint_,
+						 1);
+		check(e, "decode failed");
+		done_ = (SSBF_NO_ERROR == e);
+
+		return output_.subspan(start,
+				       checkpoint_.output_offset - start);
+	}
+
+	file &file_;
+	std::span<uint8_t> output_;
+	ssbf_decode_checkpoint checkpoint_;
+	bool done_ = false;
+};
+
+inline block_range file::blocks(std::span<uint8_t> output)
+{
+	return block_range(*this, output);
+}
+
+// Checksum policies, same results as ssbf_common.c. The tables are
+// built by the compiler, a byte per step instead of the 4 bit tables
+// the C code keeps small for MCUs.
+template <ssbf_checksum_types Type>
+struct checksum;
+
+template <>
+struct checksum<SSBF_CHECKSUM_BSD16> {
+	static constexpr ssbf_checksum_types type = SSBF_CHECKSUM_BSD16;
+
+	static uint32_t update(uint32_t start, const uint8_t *data,
+			       size_t size) noexcept
+	{
+		uint16_t c = (uint16_t) start;
+
+		for (size_t i = 0; size > i; i++)
+		{
+			c = (uint16_t) ((c >> 1) + ((c & 1) << 15));
+			c = (uint16_t) (c + data[i]);
+		}
+
+		return c;
+	}
+};
+
+template <>
+struct checksum<SSBF_CHECKSUM_CRC16> {
+	static constexpr ssbf_checksum_types type = SSBF_CHECKSUM_CRC16;
+
+	static constexpr std::array<uint16_t, 256> table = [] {
+		std::array<uint16_t, 256> t{};
+		for (uint32_t i = 0; 256 > i; i++)
+		{
+			uint16_t c = (uint16_t) (i << 8);
+			for (int b = 0; 8 > b; b++)
+			{
+				c = (uint16_t) ((c & 0x8000)
+						? (c << 1) ^ 0x1021 : c << 1);
+			}
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	static uint32_t update(uint32_t start, const uint8_t *data,
+			       size_t size) noexcept
+	{
+		uint16_t c = (uint16_t) start;
+
+		for (size_t i = 0; size > i; i++)
+		{
+			c = (uint16_t) ((c << 8) ^ table[(c >> 8) ^ data[i]]);
+		}
+
+		return c;
+	}
+};
+
+template <>
+struct checksum<SSBF_CHECKSUM_CRC32> {
+	static constexpr ssbf_checksum_types type = SSBF_CHECKSUM_CRC32;
+
+	static constexpr std::array<uint32_t, 256> table = [] {
+		std::array<uint32_t, 256> t{};
+		for (uint32_t i = 0; 256 > i; i++)
+		{
+			uint32_t c = i;
+			for (int b = 0; 8 > b; b++)
+			{
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			}
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	static uint32_t update(uint32_t start, const uint8_t *data,
+			       size_t size) noexcept
+	{
+		uint32_t c = ~start;
+
+		for (size_t i = 0; size > i; i++)
+		{
+			c = (c >> 8) ^ table[(c ^ data[i]) & 0xff];
+		}
+
+		return ~c;
+	}
+};
+
+// block payload and full data checksum types of the data header
+template <ssbf_checksum_types Block, ssbf_checksum_types Data>
+struct checksums {
+	using block = checksum<Block>;
+	using data = checksum<Data>;
+
+	static_assert(SSBF_CHECKSUM_CRC32 != Block,
+		      "block checksums are 16 bit");
+
+	static constexpr uint8_t flags = (uint8_t)
+		((Block << SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_SHIFT)
+		 | (Data << SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_SHIFT));
+};
+
+// Codec policy: formats compressed blocks of the file may use. Blocks
+// which did not compress are stored as is with any codec policy,
+// codecs<> is for files made of such blocks only.
+template <ssbf_codec_ids... Ids>
+struct codecs {
+	static constexpr bool allows(uint8_t id) noexcept
+	{
+		return ((Ids == id) || ...);
+	}
+
+	static int32_t decompress(uint8_t id, const uint8_t *input,
+				  size_t input_size, uint8_t *output,
+				  size_t output_size) noexcept
+	{
+		if (!allows(id))
+		{
+			return -1;
+		}
+
+		if constexpr (allows(SSBF_CODEC_LZ4))
+		{
+			if (SSBF_CODEC_LZ4 == id)
+			{
+				return LZ4_decompress_safe(
+					(const char *) input, (char *) output,
+					(int) input_size, (int) output_size);
+			}
+		}
+
+		if constexpr (allows(SSBF_CODEC_RLE))
+		{
+			if (SSBF_CODEC_RLE == id)
+			{
+				static const ssbf_codec *rle =
+					ssbf_codec_by_id(SSBF_CODEC_RLE);
+				return rle->decompress(input, input_size,
+						       output, output_size);
+			}
+		}
+
+		return -1;
+	}
+};
+
+// Cipher policies: files without the crypto extension, or encrypted
+// blocks with or without block tags
+struct no_cipher {
+	static constexpr bool encrypted = false;
+	static constexpr bool tags = false;
+};
+
+template <bool Tags>
+struct chacha20 {
+	static constexpr bool encrypted = true;
+	static constexpr bool tags = Tags;
+};
+
+// Decoder of files with fixed size blocks of BlockSize bytes, packed
+// or aligned, which are not delta encoded. Dedup references are
+// decoded by the C decoder. try_decode returns the same errors as
+// ssbf_file_decode, SSBF_GENERIC_ERROR for a file of another layout
+// (see matches).
+template <size_t BlockSize, class Codecs, class Cipher, class Checksums>
+class block_decoder {
+public:
+	static_assert(0 < BlockSize && UINT16_MAX >= BlockSize,
+		      "max_uncompressed_block_size is 16 bit");
+
+	static bool matches(const ssbf_header_info &hi) noexcept
+	{
+		const uint8_t checksum_flags = hi.data_h.flags
+			& (SSBF_DATA_HEADER_FLAG_BLOCK_CHECKSUM_MASK
+			   | SSBF_DATA_HEADER_FLAG_DATA_CHECKSUM_MASK);
+		const bool encrypted = hi.mh.flags
+			& SSBF_MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION;
+		const bool tags = hi.ch.flags
+			& SSBF_ENCRYPTION_HEADER_FLAG_BLOCK_TAGS;
+
+		return BlockSize == hi.data_h.max_uncompressed_block_size
+			&& !(hi.mh.flags
+			     & SSBF_MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE)
+			&& !(hi.data_h.flags & SSBF_DATA_HEADER_FLAG_DELTA)
+			&& Checksums::flags == checksum_flags
+			&& Cipher::encrypted == encrypted
+			&& Cipher::tags == tags;
+	}
+
+	static void decode(file &f, std::span<uint8_t> output)
+	{
+		check(try_decode(f, output), "decode failed");
+	}
+
+	static ssbf_errors try_decode(file &f,
+				      std::span<uint8_t> output) noexcept
+	{
+		const ssbf_header_info &hi = f.header();
+		const size_t data_size = hi.data_h.full_data_size_uncompressed;
+
+		if (!matches(hi))
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		if (data_size > output.size())
+		{
+			return SSBF_NOT_ENOUGHT_DATA;
+		}
+
+		uint8_t *blocks = f.get()->input_data_start + hi.blocks_offset;
+		uint32_t data_checksum = 0;
+		size_t offset = 0;
+		size_t output_offset = 0;
+
+		// decrypted payload: the block and the tag
+		alignas(64) std::array<uint8_t,
+			Cipher::encrypted ? BlockSize + SSBF_BLOCK_TAG_SIZE : 1>
+			scratch;
+
+		for (uint32_t block_number = 0; ; block_number++)
+		{
+			ssbf_payload_block_header h;
+
+			if (UINT16_MAX < block_number)
+			{
+				return SSBF_GENERIC_ERROR;
+			}
+
+			ssbf_errors r = ssbf_file_block_header(
+				f.get(), offset, (uint16_t) block_number, &h);
+			if (SSBF_NO_ERROR != r)
+			{
+				return r;
+			}
+
+			uint8_t *input = blocks + offset
+				+ sizeof(ssbf_payload_block_header);
+			size_t payload_size = h.compressed_size;
+
+			if (Checksums::block::update(0, input, payload_size)
+			    != h.data_checksum)
+			{
+				return SSBF_CHECKSUM_FAILED;
+			}
+
+			if (output_offset > data_size)
+			{
+				return SSBF_GENERIC_ERROR;
+			}
+
+			size_t block_output_size = data_size - output_offset;
+			if (BlockSize < block_output_size)
+			{
+				block_output_size = BlockSize;
+			}
+
+			uint8_t *out = output.data() + output_offset;
+
+			if (h.flags & BHF_BLOCK_REFERENCE)
+			{
+				size_t size = 0;
+				r = ssbf_file_decode_block(f.get(), offset, &h,
+							   out,
+							   block_output_size,
+							   &size);
+				if (SSBF_NO_ERROR != r)
+				{
+					return r;
+				}
+				if (size != block_output_size)
+				{
+					return SSBF_GENERIC_ERROR;
+				}
+			}
+			else
+			{
+				r = decode_payload(hi, f.get()->options, h,
+						   input, payload_size,
+						   scratch.data(), out,
+						   block_output_size);
+				if (SSBF_NO_ERROR != r)
+				{
+					return r;
+				}
+			}
+
+			data_checksum = Checksums::data::update(
+				data_checksum, out, block_output_size);
+			output_offset += block_output_size;
+
+			if (h.flags & BHF_LAST_BLOCK)
+			{
+				break;
+			}
+
+			r = ssbf_file_skip_block(f.get(), &h, &offset);
+			if (SSBF_NO_ERROR != r)
+			{
+				return r;
+			}
+		}
+
+		if (output_offset != data_size)
+		{
+			return SSBF_NOT_ENOUGHT_DATA;
+		}
+
+		if (data_checksum != hi.data_h.full_data_checksum)
+		{
+			return SSBF_CHECKSUM_FAILED;
+		}
+
+		return SSBF_NO_ERROR;
+	}
+
+private:
+	static ssbf_errors decode_payload(const ssbf_header_info &hi,
+					  const ssbf_decode_options &options,
+					  const ssbf_payload_block_header &h,
+					  uint8_t *payload,
+					  size_t payload_size,
+					  uint8_t *scratch,
+					  uint8_t *output,
+					  size_t output_size) noexcept
+	{
+		if (h.flags & BHF_BLOCK_BASE_COPY)
+		{
+			return SSBF_BASE_DATA_MISMATCH;
+		}
+
+		if constexpr (Cipher::tags)
+		{
+			uint8_t tag[SSBF_BLOCK_TAG_SIZE];
+			uint8_t diff = 0;
+
+			if (SSBF_BLOCK_TAG_SIZE > payload_size)
+			{
+				return SSBF_GENERIC_ERROR;
+			}
+
+			payload_size -= SSBF_BLOCK_TAG_SIZE;
+			ssbf_block_tag(tag, hi.key_data, &h, payload,
+				       payload_size);
+
+			for (size_t i = 0; SSBF_BLOCK_TAG_SIZE > i; i++)
+			{
+				diff |= tag[i] ^ payload[payload_size + i];
+			}
+
+			if (diff)
+			{
+				return SSBF_DECRYPTION_FAILED;
+			}
+		}
+
+		// nothing to write on erased flash
+		if (h.flags & BHF_BLOCK_FILL)
+		{
+			if (1 != payload_size)
+			{
+				return SSBF_GENERIC_ERROR;
+			}
+
+			if (!(options.output_erased
+			      && options.erased_value == payload[0]))
+			{
+				std::memset(output, payload[0], output_size);
+			}
+
+			return SSBF_NO_ERROR;
+		}
+
+		if (h.flags & BHF_BLOCK_ENCRYPTED)
+		{
+			if constexpr (Cipher::encrypted)
+			{
+				uint8_t nonce[24] = {
+					(uint8_t) (h.block_number & 0xff),
+					(uint8_t) (h.block_number >> 8),
+				};
+
+				if (BlockSize < payload_size)
+				{
+					return SSBF_NOT_ENOUGHT_DATA;
+				}
+
+				ssbf_chacha20_x(scratch, payload, payload_size,
+						hi.key_data, nonce, 0);
+				payload = scratch;
+			}
+			else
+			{
+				// there is no data key without the crypto header
+				return SSBF_DECRYPTION_FAILED;
+			}
+		}
+
+		if (h.flags & BHF_BLOCK_COMPRESSED)
+		{
+			uint8_t id = (h.flags & BHF_BLOCK_CODEC_MASK)
+				>> BHF_BLOCK_CODEC_SHIFT;
+
+			if (SSBF_CODEC_LZ4 != id
+			    && !(hi.data_h.flags
+				 & SSBF_DATA_HEADER_FLAG_BLOCK_CODECS))
+			{
+				return SSBF_COMPRESSION_FAILED;
+			}
+
+			int32_t size = Codecs::decompress(id, payload,
+							  payload_size,
+							  output, output_size);
+			if (0 >= size)
+			{
+				return SSBF_COMPRESSION_FAILED;
+			}
+
+			return ((size_t) size == output_size)
+				? SSBF_NO_ERROR : SSBF_GENERIC_ERROR;
+		}
+
+		if (payload_size != output_size)
+		{
+			return SSBF_GENERIC_ERROR;
+		}
+
+		// all blocks but the last one are full
+		if (BlockSize == payload_size)
+		{
+			std::memcpy(output, payload, BlockSize);
+		}
+		else
+		{
+			std::memcpy(output, payload, payload_size);
+		}
+
+		return SSBF_NO_ERROR;
+	}
+};
+
+// Decodes with the first decoder whose layout matches the file, or
+// with the C decoder if none does
+template <class... Decoders>
+void decode_with(file &f, std::span<uint8_t> output)
+{
+	const bool decoded = ((Decoders::matches(f.header())
+			       && (Decoders::decode(f, output), true))
+			      || ...);
+
+	if (!decoded)
+	{
+		f.decode(output);
+	}
+}
+
+} // namespace ssbf
+
+#endif
@@ -1,9 +1,13 @@
+import hashlib
 import os
 import struct
 
 """ To run this code you need to install the following packages
 monocypher: https://pypi.org/project/pymonocypher/
 lz4: https://pypi.org/project/lz4/
+
+This is the reference decoder, it is slow on big files. ssbf_native.py
+decodes and verifies with the C library.
 """
 
 import monocypher
@@ -24,6 +28,27 @@ def bsd_checksum16(data):
     return cs
 
 
+def rle_decompress(data):
+    """ RLE block codec: 0lllllll is followed by l + 1 literal bytes,
+    1lllllll v is l + 3 times byte v, 11111111 lo hi v is a long run """
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        if token < 0x80:
+            out += data[i:i + token + 1]
+            i += token + 1
+        else:
+            n = (token & 0x7f) + 3
+            if token == 0xff:
+                n = data[i] | (data[i + 1] << 8)
+                i += 2
+            out += bytes([data[i]]) * n
+            i += 1
+    return bytes(out)
+
+
 class ssbf_exception(Exception):
     def __init__(self, message, status_code):
         self.message = message
@@ -35,6 +60,9 @@ class ssbf_main_header():
     ssbf_magic_number = 0x19345601
     MAIN_HEADER_FLAG_USE_META_EXTENSION = 1
     MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION = 2
+    MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE = 4
+    MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT = 4
+    MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK = 0xf0
 
     def __init__(self, data):
         self.header_size = 12
@@ -49,6 +77,10 @@ class ssbf_main_header():
     def get_size(self):
         return self.header_size
 
+    def get_block_alignment(self):
+        return 1 << ((self.flags & self.MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK)
+                     >> self.MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_SHIFT)
+
     def decode(self):
         magic_num, self.payload_size, self.full_header_size, \
             self.flags, self.checksum = struct.unpack('<IIHBB', self.raw_data)
@@ -76,10 +108,17 @@ class ssbf_main_header():
         else:
             print("  encryption extension NOT used")
 
+        if (self.flags & self.MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE):
+            print("  variable block size used")
+
+        if (self.flags & self.MAIN_HEADE_FLAG_BLOCK_ALIGNMENT_MASK):
+            print("  blocks aligned to", self.get_block_alignment(), "bytes")
+
 
 class ssbf_encryption():
     FLAG_ENCRYPTION_USED_CHACHA20 = (1 << 3)
     FLAG_ENCRYPTION_USED_HASH_POLY1305 = (1 << 0)
+    FLAG_ENCRYPTION_BLOCK_TAGS = (1 << 6)
     
     nonce_size = 24
 
@@ -128,6 +167,8 @@ class ssbf_encryption():
 
         if (self.flags & self.FLAG_ENCRYPTION_USED_HASH_POLY1305):
             print("  poly1305 used")
+        if (self.flags & self.FLAG_ENCRYPTION_BLOCK_TAGS):
+            print("  blocks end with a poly1305 tag (not checked here)")
         else:
             print("  data integrity NOT used")
         
@@ -194,11 +235,20 @@ class ssbf_meta():
 
 
 class ssbf_data_block():
+    FLAG_DATA_BLOCK_FLAG_FILL = (1 << 5)
+    FLAG_DATA_BLOCK_FLAG_REFERENCE = (1 << 4)
+    FLAG_DATA_BLOCK_FLAG_BASE_COPY = (1 << 3)
     FLAG_DATA_BLOCK_FLAG_ENCRYPTED = (1 << 2)
     FLAG_DATA_BLOCK_FLAG_COMPRESSED = (1 << 1)
     FLAG_DATA_BLOCK_LAST = (1 << 0)
-    def __init__(self, data):
+    DATA_BLOCK_CODEC_SHIFT = 6
+    CODEC_NAMES = ("lz4", "rle", "reserved", "reserved")
+    block_tag_size = 8
+
+    def __init__(self, data, variable_block_size=False, block_tags=False):
         self.header_size = 8
+        self.variable_block_size = variable_block_size
+        self.block_tags = block_tags
 
         if len(data) < self.header_size:
             raise ssbf_exception("Data block header data too short", 1)
@@ -218,19 +268,50 @@ class ssbf_data_block():
             print("Header checksum failed")
             raise ssbf_exception("Header checksum failed", 1)
 
+        # variable size blocks store the block size in front of the payload
+        self.payload_offset = self.header_size
+        if self.variable_block_size:
+            self.block_size, = struct.unpack('<H', data[8:10])
+            self.payload_offset += 2
+
         is_encrypted = self.flags & self.FLAG_DATA_BLOCK_FLAG_ENCRYPTED
         is_compressed = self.flags & self.FLAG_DATA_BLOCK_FLAG_COMPRESSED
 
+        self.codec = self.flags >> self.DATA_BLOCK_CODEC_SHIFT
+
         print("Found block {} with size {}, {}, {}".format(
             self.block_number, self.blocks_payload_size,
             'Encrypted' if is_encrypted else 'Not encrypted',
-            'Compressed' if is_compressed else 'Not compressed'))
+            'Compressed ({})'.format(self.CODEC_NAMES[self.codec])
+            if is_compressed else 'Not compressed'))
+
+        if self.flags & self.FLAG_DATA_BLOCK_FLAG_BASE_COPY:
+            self.base_offset, self.base_size, self.base_checksum = \
+                struct.unpack('<IHH', data[self.payload_offset:self.payload_offset+8])
+            print("  copy of {} bytes from base offset {}".format(
+                self.base_size, self.base_offset))
+
+        if self.flags & self.FLAG_DATA_BLOCK_FLAG_REFERENCE:
+            self.ref_offset, self.ref_size, self.ref_block_number = \
+                struct.unpack('<IHH', data[self.payload_offset:self.payload_offset+8])
+            print("  repeat of block {} ({} bytes)".format(
+                self.ref_block_number, self.ref_size))
+
+        if self.flags & self.FLAG_DATA_BLOCK_FLAG_FILL:
+            self.fill_value = data[self.payload_offset]
+            print("  fill with 0x{:02x}".format(self.fill_value))
 
         
         self.raw_block = data[:self.header_size+self.blocks_payload_size]
 
     def decrypt_and_uncompress(self, key, max_output_data_size):
-        buff = self.raw_block[self.header_size:] #make hard copy
+        if self.flags & self.FLAG_DATA_BLOCK_FLAG_FILL:
+            print("fill block, nothing to decrypt or decompress")
+            return
+
+        buff = self.raw_block[self.payload_offset:] #make hard copy
+        if self.block_tags:
+            buff = buff[:-self.block_tag_size]
 
         if self.raw_block and self.flags & self.FLAG_DATA_BLOCK_FLAG_ENCRYPTED:
 
@@ -238,13 +319,20 @@ class ssbf_data_block():
             nonce[0] =  self.block_number & 0xff
             nonce[1] =  (self.block_number >> 8) & 0xff
 
+            if key is None:
+                print("encrypted block in a file without a data key")
+                return
+
             buff = monocypher.chacha20(key, nonce, buff)
 
             if None == buff:
                 print("decryption failed")
 
         if self.raw_block and self.flags & self.FLAG_DATA_BLOCK_FLAG_COMPRESSED:
-            buff = lz4.block.decompress(buff, uncompressed_size=max_output_data_size)
+            if self.codec == 1:
+                buff = rle_decompress(buff)
+            else:
+                buff = lz4.block.decompress(buff, uncompressed_size=max_output_data_size)
             print("decompressed size: ", len(buff))
 
 
@@ -268,13 +356,20 @@ class ssbf_data():
 
     def decode_header(self):
         self.full_data_size_uncompressed, self.max_uncompressed_block_size, \
-        self.flags, self.reserved, \
+        self.flags, self.inplace_margin, \
         self.full_data_checksum = struct.unpack('<IHBBI', self.raw_header_data)
 
         print("full uncompressed data size: ", self.full_data_size_uncompressed)
         print("max uncompressed block size: ", self.max_uncompressed_block_size)
         print("full data checksum: ", self.full_data_checksum)
-        print("flags: (not supported atm, always default)", self.flags)
+        if self.inplace_margin:
+            print("in place decode margin: ", self.inplace_margin * 64)
+        else:
+            print("in place decode margin: unknown")
+        checksum_names = ("BSD16", "CRC16", "CRC32", "reserved")
+        print("flags: ", self.flags)
+        print("block checksum: ", checksum_names[(self.flags >> 4) & 3])
+        print("full data checksum type: ", checksum_names[(self.flags >> 2) & 3])
 
 
 class ssbf_decoder():
@@ -303,27 +398,66 @@ class ssbf_decoder():
         print("\n/// MAIN HEADER ///")
         self.mh = ssbf_main_header(self.file_data)
 
-        print("\n/// ENCRYPTION HEADER ///")
-        self.ch = ssbf_encryption(self.key, self.file_data, 
-                                  self.mh.get_size())
+        header_plain = None
+        data_key = None
+        self.ch = None
+
+        if self.mh.flags & self.mh.MAIN_HEADE_FLAG_USE_ENCRYPTION_EXTENSION:
+            print("\n/// ENCRYPTION HEADER ///")
+            self.ch = ssbf_encryption(self.key, self.file_data, 
+                                      self.mh.get_size())
+
+            if self.key != None:
+                header_plain = self.ch.decrypted_header
+                data_key = self.ch.encryption_payload[:32]
 
-        if self.key != None:
+            blocks_offset = self.mh.get_size() + self.ch.get_size() \
+                + self.ch.encrypted_header_size + 16
+        else:
+            # no crypto extension, the header is plain and protected
+            # with an unkeyed BLAKE2b hash
+            print("\n/// HEADER HASH ///")
+            header_end = self.mh.full_header_size
+            header_hash = hashlib.blake2b(self.file_data[:header_end],
+                                          digest_size=16).digest()
+            if header_hash != self.file_data[header_end:header_end+16]:
+                print("Header hash mismatch")
+                raise ssbf_exception("header hash mismatch", 1)
+            print("header hash ok (not encrypted)")
+
+            header_plain = self.file_data[self.mh.get_size():header_end]
+            blocks_offset = header_end + 16
+
+        if header_plain != None:
             print("\n/// META HEADER ///")
-            self.meta_h = ssbf_meta(self.ch.decrypted_header)
+            self.meta_h = ssbf_meta(header_plain)
 
             print("\n/// DATA HEADER ///")
             self.ssbf_data = ssbf_data(
-                self.ch.decrypted_header[self.meta_h.get_size():])
+                header_plain[self.meta_h.get_size()
+                             + self.meta_h.payload_size:])
 
 
         print("\n/// BLOCKS ///")
         self.blocks = []
-        payload = self.file_data[self.mh.get_size() + self.ch.get_size()
-                                 + self.ch.encrypted_header_size + 16:]
+
+        # aligned blocks are separated by zero padding
+        alignment = self.mh.get_block_alignment()
+        blocks_offset += -blocks_offset % alignment
+        payload = self.file_data[blocks_offset:]
+        offset = 0
+
+        block_tags = self.ch is not None and \
+            self.ch.flags & self.ch.FLAG_ENCRYPTION_BLOCK_TAGS
 
         while payload:
-            self.blocks.append(ssbf_data_block(payload))
-            payload = payload[self.blocks[-1].get_block_size():]
+            self.blocks.append(ssbf_data_block(
+                payload, self.mh.flags & self.mh.MAIN_HEADE_FLAG_VARIABLE_BLOCK_SIZE,
+                block_tags))
+            block_size = self.blocks[-1].get_block_size()
+            block_size += -(offset + block_size) % alignment
+            offset += block_size
+            payload = payload[block_size:]
 
 
         # check if block numbers are in sequence
@@ -332,12 +466,11 @@ class ssbf_decoder():
                 print("Block number mismatch")
                 return
 
-        if self.key != None:
-            print("Testing decryption/uncompression on block 1, ", 
-                  len(self.ch.encryption_payload))
+        if header_plain != None and self.blocks:
+            print("Testing decryption/uncompression on block 1")
 
             self.blocks[0].decrypt_and_uncompress(
-                self.ch.encryption_payload[:32], 
+                data_key, 
                 self.ssbf_data.max_uncompressed_block_size)
 
         print("Done")
@@ -0,0 +1,362 @@
+import ctypes
+import os
+
+""" Python binding of the C library (libssbf.so), for host tools which
+need to decode, verify or encode big images quickly. Build the library
+with "make libssbf.so" in C/examples, or point SSBF_LIB to it.
+
+The input data is passed to C without copying if it is a bytes object
+or a writable buffer (bytearray, mmap, numpy array...). It is never
+changed: encrypted blocks are decrypted into a scratch buffer.
+
+ssbf_decode.py is the pure Python reference decoder, it only needs the
+monocypher and lz4 packages.
+"""
+
+SSBF_NO_ERROR = 0
+SSBF_DECODE_IN_PROGRESS = 6
+
+# ssbf_encode_options.codecs
+SSBF_ENCODE_CODEC_RLE = 1 << 0
+SSBF_ENCODE_CODEC_LZ4 = 1 << 1
+SSBF_ENCODE_CODEC_LZ4HC = 1 << 2
+
+# must match the library build
+SSBF_META_PAYLOAD_MAX_SIZE = 128
+
+c_uint8_p = ctypes.POINTER(ctypes.c_uint8)
+
+
+class ssbf_main_header(ctypes.Structure):
+    _fields_ = [("ssbf_magic_number", ctypes.c_uint32),
+                ("blocks_sum_size", ctypes.c_uint32),
+                ("hashed_data_size", ctypes.c_uint16),
+                ("flags", ctypes.c_uint8),
+                ("header_checksum", ctypes.c_uint8)]
+
+
+class ssbf_encryption_header(ctypes.Structure):
+    _fields_ = [("nonce", ctypes.c_uint8 * 24),
+                ("encryption_payload_size", ctypes.c_uint16),
+                ("encrypted_header_size", ctypes.c_uint16),
+                ("flags", ctypes.c_uint8),
+                ("header_checksum", ctypes.c_uint8)]
+
+
+class ssbf_meta_header(ctypes.Structure):
+    _fields_ = [("meta_data_id", ctypes.c_uint16),
+                ("payload_size", ctypes.c_uint16)]
+
+
+class ssbf_data_header(ctypes.Structure):
+    _fields_ = [("full_data_size_uncompressed", ctypes.c_uint32),
+                ("max_uncompressed_block_size", ctypes.c_uint16),
+                ("flags", ctypes.c_uint8),
+                ("inplace_margin", ctypes.c_uint8),
+                ("full_data_checksum", ctypes.c_uint32)]
+
+
+class ssbf_header_info(ctypes.Structure):
+    _fields_ = [("mh", ssbf_main_header),
+                ("ch", ssbf_encryption_header),
+                ("meta_h", ssbf_meta_header),
+                ("data_h", ssbf_data_header),
+                ("key_data", ctypes.c_uint8 * 32),
+                ("header_mac", ctypes.c_uint8 * 16),
+                ("meta_payload_data", c_uint8_p),
+                ("blocks_offset", ctypes.c_size_t)]
+
+
+class ssbf_decode_checkpoint(ctypes.Structure):
+    _fields_ = [("file_id", ctypes.c_uint32),
+                ("input_offset", ctypes.c_uint32),
+                ("output_offset", ctypes.c_uint32),
+                ("full_data_checksum", ctypes.c_uint32),
+                ("next_block_number", ctypes.c_uint16),
+                ("flags", ctypes.c_uint8),
+                ("checkpoint_checksum", ctypes.c_uint8)]
+
+
+class ssbf_encode_options(ctypes.Structure):
+    _fields_ = [("base_data_start", c_uint8_p),
+                ("base_data_size", ctypes.c_size_t),
+                ("dedup", ctypes.c_bool),
+                ("cdc_min_block_size", ctypes.c_uint16),
+                ("no_encryption", ctypes.c_bool),
+                ("block_alignment", ctypes.c_uint16),
+                ("block_tags", ctypes.c_bool),
+                ("compression_level", ctypes.c_uint8),
+                ("codecs", ctypes.c_uint8),
+                ("block_checksum", ctypes.c_uint8),
+                ("data_checksum", ctypes.c_uint8),
+                ("fill_blocks", ctypes.c_bool)]
+
+
+class ssbf_decode_options(ctypes.Structure):
+    _fields_ = [("base_data_start", c_uint8_p),
+                ("base_data_size", ctypes.c_size_t),
+                ("scratch", c_uint8_p),
+                ("scratch_size", ctypes.c_size_t),
+                ("allow_unencrypted", ctypes.c_bool),
+                ("output_erased", ctypes.c_bool),
+                ("erased_value", ctypes.c_uint8)]
+
+
+class ssbf_file_t(ctypes.Structure):
+    _fields_ = [("hi", ssbf_header_info),
+                ("meta_payload", ctypes.c_uint8 * SSBF_META_PAYLOAD_MAX_SIZE),
+                ("input_data_start", c_uint8_p),
+                ("input_data_size", ctypes.c_size_t),
+                ("options", ssbf_decode_options),
+                ("file_id", ctypes.c_uint32)]
+
+
+class ssbf_exception(Exception):
+    def __init__(self, message, status_code):
+        self.message = message
+        self.status_code = status_code
+        super().__init__(self.message)
+
+
+def load_library(path=None):
+    if path is None:
+        path = os.environ.get("SSBF_LIB")
+    if path is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                            "..", "..", "C", "examples", "libssbf.so")
+
+    lib = ctypes.CDLL(path)
+
+    lib.ssbf_open.restype = ctypes.c_int
+    lib.ssbf_open.argtypes = [ctypes.POINTER(ssbf_file_t), c_uint8_p,
+                              c_uint8_p, ctypes.c_size_t,
+                              ctypes.POINTER(ssbf_decode_options)]
+    lib.ssbf_close.restype = None
+    lib.ssbf_close.argtypes = [ctypes.POINTER(ssbf_file_t)]
+    lib.ssbf_file_decode.restype = ctypes.c_int
+    lib.ssbf_file_decode.argtypes = [ctypes.POINTER(ssbf_file_t),
+                                     c_uint8_p, ctypes.c_size_t,
+                                     ctypes.POINTER(ssbf_decode_checkpoint),
+                                     ctypes.c_uint32]
+    lib.ssbf_file_verify.restype = ctypes.c_int
+    lib.ssbf_file_verify.argtypes = [ctypes.POINTER(ssbf_file_t)]
+    lib.ssbf_decode_checkpoint_init.restype = None
+    lib.ssbf_decode_checkpoint_init.argtypes = [
+        ctypes.POINTER(ssbf_decode_checkpoint)]
+    lib.ssbf_encode_data.restype = None
+    lib.ssbf_encode_data.argtypes = [c_uint8_p, c_uint8_p, c_uint8_p,
+                                     ctypes.c_uint16, c_uint8_p,
+                                     ctypes.c_uint16, ctypes.c_size_t,
+                                     c_uint8_p, ctypes.c_size_t,
+                                     c_uint8_p, ctypes.c_size_t,
+                                     ctypes.POINTER(ctypes.c_size_t),
+                                     ctypes.POINTER(ssbf_encode_options)]
+    lib.ssbf_explain.restype = ctypes.c_int
+    lib.ssbf_explain.argtypes = [c_uint8_p, ctypes.c_size_t]
+
+    return lib
+
+
+_lib = None
+
+
+def library():
+    global _lib
+    if _lib is None:
+        _lib = load_library()
+    return _lib
+
+
+def _buffer_pointer(data):
+    """ Pointer to the data of a bytes object or a writable buffer,
+    without copying. Read only buffers other than bytes are copied. """
+    if data is None:
+        return None, None
+
+    if isinstance(data, bytes):
+        keep = ctypes.c_char_p(data)
+        return ctypes.cast(keep, c_uint8_p), keep
+
+    view = memoryview(data).cast("B")
+    if view.readonly:
+        keep = (ctypes.c_uint8 * len(view)).from_buffer_copy(view)
+    else:
+        keep = (ctypes.c_uint8 * len(view)).from_buffer(view)
+    return ctypes.cast(keep, c_uint8_p), keep
+
+
+def _key_pointer(key):
+    if key is None:
+        return None, None
+    if len(key) != 32:
+        raise ssbf_exception("key must be 32 bytes", 1)
+    return _buffer_pointer(bytes(key))
+
+
+class ssbf_file():
+    """ Opened ssbf file, the header is authenticated once. data must
+    stay unchanged while the file is open. """
+
+    def __init__(self, data, key=None, allow_unencrypted=False, base=None):
+        self.lib = library()
+        self.data = data
+        self.size = len(memoryview(data).cast("B"))
+        self.data_p, self._keep_data = _buffer_pointer(data)
+        self.base_p, self._keep_base = _buffer_pointer(base)
+        key_p, keep_key = _key_pointer(key)
+
+        # largest block payload, max_uncompressed_block_size + 2
+        self.scratch = (ctypes.c_uint8 * (0x10000 + 2))()
+
+        options = ssbf_decode_options()
+        options.scratch = ctypes.cast(self.scratch, c_uint8_p)
+        options.scratch_size = len(self.scratch)
+        options.allow_unencrypted = allow_unencrypted
+        if base is not None:
+            options.base_data_start = self.base_p
+            options.base_data_size = len(memoryview(base).cast("B"))
+
+        self.file = ssbf_file_t()
+        r = self.lib.ssbf_open(ctypes.byref(self.file), key_p,
+                               self.data_p, self.size,
+                               ctypes.byref(options))
+        del keep_key
+        if SSBF_NO_ERROR != r:
+            raise ssbf_exception("open failed", r)
+        self.is_open = True
+
+    def close(self):
+        if self.is_open:
+            self.lib.ssbf_close(ctypes.byref(self.file))
+            self.is_open = False
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        if getattr(self, "is_open", False):
+            self.close()
+
+    def data_size(self):
+        return self.file.hi.data_h.full_data_size_uncompressed
+
+    def meta(self):
+        meta_h = self.file.hi.meta_h
+        return meta_h.meta_data_id, \
+            bytes(self.file.meta_payload[:meta_h.payload_size])
+
+    def verify(self):
+        """ Checks the block structure and payload checksums, nothing
+        is decrypted or decompressed """
+        r = self.lib.ssbf_file_verify(ctypes.byref(self.file))
+        if SSBF_NO_ERROR != r:
+            raise ssbf_exception("verify failed", r)
+
+    def _output(self, output):
+        if output is None:
+            output = bytearray(self.data_size())
+        view = memoryview(output).cast("B")
+        if view.readonly or len(view) < self.data_size():
+            raise ssbf_exception("output buffer too small or read only", 1)
+        out = (ctypes.c_uint8 * len(view)).from_buffer(view)
+        return output, view, out
+
+    def decode(self, output=None):
+        """ Decodes all data into output (any writable buffer, a new
+        bytearray if None) and checks the full data checksum """
+        output, view, out = self._output(output)
+        checkpoint = ssbf_decode_checkpoint()
+        self.lib.ssbf_decode_checkpoint_init(ctypes.byref(checkpoint))
+        r = self.lib.ssbf_file_decode(ctypes.byref(self.file),
+                                      ctypes.cast(out, c_uint8_p),
+                                      len(view), ctypes.byref(checkpoint), 0)
+        del out, view
+        if SSBF_NO_ERROR != r:
+            raise ssbf_exception("decode failed", r)
+        return output
+
+    def blocks(self, output=None):
+        """ Decodes block by block into output and yields a memoryview
+        of every decoded block. The full data checksum is checked
+        after the last block. """
+        output, view, out = self._output(output)
+        checkpoint = ssbf_decode_checkpoint()
+        self.lib.ssbf_decode_checkpoint_init(ctypes.byref(checkpoint))
+
+        r = SSBF_DECODE_IN_PROGRESS
+        while SSBF_DECODE_IN_PROGRESS == r:
+            start = checkpoint.output_offset
+            r = self.lib.ssbf_file_decode(ctypes.byref(self.file),
+                                          ctypes.cast(out, c_uint8_p),
+                                          len(view),
+                                          ctypes.byref(checkpoint), 1)
+            if r not in (SSBF_NO_ERROR, SSBF_DECODE_IN_PROGRESS):
+                raise ssbf_exception("decode failed", r)
+            if checkpoint.output_offset > start:
+                yield view[start:checkpoint.output_offset]
+
+
+def decode(data, key=None, allow_unencrypted=False, base=None):
+    with ssbf_file(data, key, allow_unencrypted, base) as f:
+        return f.decode()
+
+
+def verify(data, key=None, allow_unencrypted=False):
+    with ssbf_file(data, key, allow_unencrypted) as f:
+        f.verify()
+
+
+def explain(data):
+    """ Prints the headers and blocks of the file (C ssbf_explain) """
+    data_p, keep = _buffer_pointer(data)
+    return library().ssbf_explain(data_p, len(memoryview(data).cast("B")))
+
+
+def encode(data, key_main=None, key_main_nonce=None, key_data=None,
+           meta_data_id=0, meta=b"", max_block_size=4096, **options):
+    """ Encodes data, options are the fields of ssbf_encode_options
+    (dedup, cdc_min_block_size, no_encryption, block_alignment,
+    block_tags, compression_level, codecs, block_checksum,
+    data_checksum, fill_blocks) and base for delta mode """
+    lib = library()
+    size = len(memoryview(data).cast("B"))
+    data_p, keep_data = _buffer_pointer(data)
+    key_main_p, keep_key_main = _key_pointer(key_main)
+    key_data_p, keep_key_data = _key_pointer(key_data)
+    nonce_p, keep_nonce = _buffer_pointer(
+        bytes(key_main_nonce) if key_main_nonce is not None else None)
+    meta_p, keep_meta = _buffer_pointer(bytes(meta) + b"\0")
+
+    if (not options.get("no_encryption")
+            and None in (key_main, key_main_nonce, key_data)):
+        raise ssbf_exception("keys and nonce needed for encryption", 1)
+
+    o = ssbf_encode_options()
+    base = options.pop("base", None)
+    base_p, keep_base = _buffer_pointer(base)
+    if base is not None:
+        o.base_data_start = base_p
+        o.base_data_size = len(memoryview(base).cast("B"))
+    for name, value in options.items():
+        setattr(o, name, value)
+
+    # blocks which don't compress are stored as is, with their header,
+    # size, tag and alignment padding
+    block_size = min(max_block_size, o.cdc_min_block_size or max_block_size)
+    alignment = 1 << (max(o.block_alignment, 1) - 1).bit_length()
+    max_size = size + (size // block_size + 1) * (8 + 2 + 8 + alignment) \
+        + 256 + len(meta) + alignment
+
+    output = bytearray(max_size)
+    out = (ctypes.c_uint8 * max_size).from_buffer(output)
+    actual = ctypes.c_size_t(0)
+
+    lib.ssbf_encode_data(key_main_p, nonce_p, key_data_p,
+                         meta_data_id, meta_p, len(meta), max_block_size,
+                         data_p, size, ctypes.cast(out, c_uint8_p), max_size,
+                         ctypes.byref(actual), ctypes.byref(o))
+    del out
+    return bytes(memoryview(output)[:actual.value])